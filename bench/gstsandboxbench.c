@@ -0,0 +1,523 @@
+/*
+ * Copyright (C) 2012 Igalia S.L.
+*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * Measures what the sandbox costs: encodes reference clips from
+ * videotestsrc/audiotestsrc, then decodes each of them with decodebin2 and
+ * with sandboxeddecodebin into fakesinks that don't sync, and reports decode
+ * fps, time to first frame, CPU time and peak RSS of the player and of the
+ * decoder, and the shared memory used.
+ *
+ * Each decode runs in its own process (this program, re-executed with
+ * --run) so that its peak RSS is its own. That process is a child subreaper:
+ * the decoders sandboxeddecodebin spawns end up as its children, and it
+ * collects their resource usage when they exit.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <glib/gstdio.h>
+#include <gst/gst.h>
+
+/* how long the decoders have to exit once their pipeline is gone */
+#define REAP_TIMEOUT (5 * G_USEC_PER_SEC)
+
+#define FRAMERATE 30
+#define AUDIO_RATE 44100
+
+typedef struct {
+  const gchar *name;
+  gint width;
+  gint height;
+  const gchar *video_encoder;
+  const gchar *audio_encoder;
+  const gchar *muxer;
+  const gchar *extension;
+} Clip;
+
+static const Clip clips[] = {
+  { "theora-320x240", 320, 240, "theoraenc", "vorbisenc", "oggmux", "ogg" },
+  { "theora-1280x720", 1280, 720, "theoraenc", "vorbisenc", "oggmux", "ogg" },
+  { "vp8-640x480", 640, 480, "vp8enc", "vorbisenc", "webmmux", "webm" },
+  { "h264-1920x1080", 1920, 1080, "x264enc", "faac", "mp4mux", "mp4" },
+};
+
+static const gchar *modes[] = { "decodebin2", "sandboxeddecodebin" };
+
+/* what a --run process reports */
+typedef struct {
+  guint frames;
+  gdouble elapsed;
+  gdouble time_to_first_frame;
+  guint64 shm_high_water;
+  gdouble decoder_cpu;
+  glong decoder_max_rss;
+  gdouble player_cpu;
+  glong player_max_rss;
+} Result;
+
+typedef struct {
+  GMainLoop *loop;
+  GstElement *pipeline;
+  guint frames;
+  gint64 start_time;
+  gint64 first_frame_time;
+  gboolean failed;
+} Run;
+
+static gint duration = 10;
+static gchar *clips_dir = NULL;
+static gchar *run_mode = NULL;
+static gchar *run_clip = NULL;
+
+static GOptionEntry entries[] = {
+  { "duration", 'd', 0, G_OPTION_ARG_INT, &duration,
+    "Duration of the reference clips in seconds (default: 10)", "S" },
+  { "clips-dir", 'c', 0, G_OPTION_ARG_FILENAME, &clips_dir,
+    "Where to encode the reference clips (default: bench-clips)", "DIR" },
+  { "run", 0, G_OPTION_FLAG_HIDDEN, G_OPTION_ARG_STRING, &run_mode,
+    NULL, NULL },
+  { "clip", 0, G_OPTION_FLAG_HIDDEN, G_OPTION_ARG_FILENAME, &run_clip,
+    NULL, NULL },
+  { NULL }
+};
+
+static gdouble
+get_cpu_time (const struct rusage *usage)
+{
+  return usage->ru_utime.tv_sec + usage->ru_utime.tv_usec / 1e6
+      + usage->ru_stime.tv_sec + usage->ru_stime.tv_usec / 1e6;
+}
+
+/* Runs a pipeline until EOS or an error */
+static gboolean
+run_pipeline (GstElement *pipeline)
+{
+  GstBus *bus;
+  GstMessage *message;
+  gboolean ret;
+
+  gst_element_set_state (pipeline, GST_STATE_PLAYING);
+  bus = gst_element_get_bus (pipeline);
+  message = gst_bus_timed_pop_filtered (bus, GST_CLOCK_TIME_NONE,
+                                        GST_MESSAGE_EOS | GST_MESSAGE_ERROR);
+  ret = GST_MESSAGE_TYPE (message) == GST_MESSAGE_EOS;
+  if (!ret) {
+    GError *error;
+
+    gst_message_parse_error (message, &error, NULL);
+    fprintf (stderr, "%s\n", error->message);
+    g_error_free (error);
+  }
+  gst_message_unref (message);
+  gst_object_unref (bus);
+  gst_element_set_state (pipeline, GST_STATE_NULL);
+
+  return ret;
+}
+
+static gboolean
+have_elements (const Clip *clip)
+{
+  const gchar *names[] = { clip->video_encoder, clip->audio_encoder,
+                           clip->muxer };
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (names); i++) {
+    GstElementFactory *factory = gst_element_factory_find (names[i]);
+
+    if (!factory)
+      return FALSE;
+    gst_object_unref (factory);
+  }
+
+  return TRUE;
+}
+
+/* Returns the path of the reference clip, encoding it unless it is there
+ * already, or NULL if it can't be */
+static gchar *
+encode_clip (const Clip *clip)
+{
+  GError *error = NULL;
+  GstElement *pipeline;
+  gchar *path, *file_name, *desc;
+  guint n_buffers = duration * FRAMERATE;
+  gboolean ret;
+
+  file_name = g_strdup_printf ("%s-%ds.%s", clip->name, duration,
+                               clip->extension);
+  path = g_build_filename (clips_dir, file_name, NULL);
+  g_free (file_name);
+  if (g_file_test (path, G_FILE_TEST_EXISTS))
+    return path;
+
+  if (!have_elements (clip)) {
+    fprintf (stderr, "Skipping %s: missing %s, %s or %s\n", clip->name,
+             clip->video_encoder, clip->audio_encoder, clip->muxer);
+    g_free (path);
+    return NULL;
+  }
+
+  fprintf (stderr, "Encoding %s\n", path);
+  desc = g_strdup_printf ("videotestsrc num-buffers=%u "
+                          "! video/x-raw-yuv,width=%d,height=%d,"
+                          "framerate=%d/1 ! %s ! %s name=mux "
+                          "! filesink location=\"%s\" "
+                          "audiotestsrc num-buffers=%u samplesperbuffer=%d "
+                          "! audio/x-raw-int,rate=%d,channels=2 "
+                          "! audioconvert ! %s ! mux.",
+                          n_buffers, clip->width, clip->height, FRAMERATE,
+                          clip->video_encoder, clip->muxer, path,
+                          n_buffers, AUDIO_RATE / FRAMERATE, AUDIO_RATE,
+                          clip->audio_encoder);
+  pipeline = gst_parse_launch (desc, &error);
+  g_free (desc);
+  if (!pipeline) {
+    fprintf (stderr, "Could not encode %s: %s\n", clip->name, error->message);
+    g_error_free (error);
+    g_free (path);
+    return NULL;
+  }
+
+  ret = run_pipeline (pipeline);
+  gst_object_unref (pipeline);
+  if (!ret) {
+    g_unlink (path);
+    g_free (path);
+    return NULL;
+  }
+
+  return path;
+}
+
+/* --run side */
+
+static void
+on_handoff (GstElement *sink, GstBuffer *buffer, GstPad *pad, Run *run)
+{
+  if (run->frames++ == 0)
+    run->first_frame_time = g_get_monotonic_time ();
+}
+
+static void
+on_pad_added (GstElement *decoder, GstPad *pad, Run *run)
+{
+  GstElement *sink;
+  GstPad *sinkpad;
+  GstCaps *caps;
+  gboolean video;
+
+  caps = gst_pad_get_caps_reffed (pad);
+  video = !gst_caps_is_empty (caps) && g_str_has_prefix (
+      gst_structure_get_name (gst_caps_get_structure (caps, 0)), "video/");
+  gst_caps_unref (caps);
+
+  sink = gst_element_factory_make ("fakesink", NULL);
+  g_object_set (sink, "sync", FALSE, "async", FALSE, NULL);
+  if (video) {
+    g_object_set (sink, "signal-handoffs", TRUE, NULL);
+    g_signal_connect (sink, "handoff", G_CALLBACK (on_handoff), run);
+  }
+  gst_bin_add (GST_BIN (run->pipeline), sink);
+  gst_element_sync_state_with_parent (sink);
+
+  sinkpad = gst_element_get_static_pad (sink, "sink");
+  gst_pad_link (pad, sinkpad);
+  gst_object_unref (sinkpad);
+}
+
+static gboolean
+add_shm_high_water (GQuark field, const GValue *value, guint64 *total)
+{
+  const GstStructure *stream;
+  guint64 high_water;
+
+  if (G_VALUE_TYPE (value) != GST_TYPE_STRUCTURE)
+    return TRUE;
+
+  stream = gst_value_get_structure (value);
+  if (gst_structure_get_uint64 (stream, "shm-high-water", &high_water))
+    *total += high_water;
+
+  return TRUE;
+}
+
+static gboolean
+on_bus_message (GstBus *bus, GstMessage *message, Run *run)
+{
+  switch (GST_MESSAGE_TYPE (message)) {
+  case GST_MESSAGE_ERROR:
+  {
+    GError *error;
+
+    gst_message_parse_error (message, &error, NULL);
+    fprintf (stderr, "%s\n", error->message);
+    g_error_free (error);
+    run->failed = TRUE;
+    g_main_loop_quit (run->loop);
+    break;
+  }
+  case GST_MESSAGE_EOS:
+    g_main_loop_quit (run->loop);
+    break;
+  default:
+    break;
+  }
+
+  return TRUE;
+}
+
+/* Collects the resource usage of the decoders, which are our children now
+ * that we are a subreaper */
+static void
+reap_decoders (Result *result)
+{
+  gint64 deadline = g_get_monotonic_time () + REAP_TIMEOUT;
+
+  for (;;) {
+    struct rusage usage;
+    gint status;
+    pid_t pid;
+
+    pid = wait4 (-1, &status, WNOHANG, &usage);
+    if (pid > 0) {
+      result->decoder_cpu += get_cpu_time (&usage);
+      result->decoder_max_rss = MAX (result->decoder_max_rss,
+                                     usage.ru_maxrss);
+      continue;
+    }
+    if (pid < 0 || g_get_monotonic_time () > deadline)
+      break;
+    g_usleep (10000);
+  }
+}
+
+static gint
+run_decode (const gchar *mode, const gchar *clip)
+{
+  GError *error = NULL;
+  GstElement *decoder;
+  GstBus *bus;
+  struct rusage usage;
+  Result result;
+  Run run;
+  gchar *desc;
+
+  memset (&result, 0, sizeof (result));
+  memset (&run, 0, sizeof (run));
+
+  prctl (PR_SET_CHILD_SUBREAPER, 1);
+
+  desc = g_strdup_printf ("filesrc location=\"%s\" ! %s name=decoder", clip,
+                          mode);
+  run.pipeline = gst_parse_launch (desc, &error);
+  g_free (desc);
+  if (!run.pipeline) {
+    fprintf (stderr, "Could not create pipeline: %s\n", error->message);
+    g_error_free (error);
+    return EXIT_FAILURE;
+  }
+
+  decoder = gst_bin_get_by_name (GST_BIN (run.pipeline), "decoder");
+  g_signal_connect (decoder, "pad-added", G_CALLBACK (on_pad_added), &run);
+
+  run.loop = g_main_loop_new (NULL, FALSE);
+  bus = gst_element_get_bus (run.pipeline);
+  gst_bus_add_watch (bus, (GstBusFunc) on_bus_message, &run);
+  gst_object_unref (bus);
+
+  run.start_time = g_get_monotonic_time ();
+  gst_element_set_state (run.pipeline, GST_STATE_PLAYING);
+  g_main_loop_run (run.loop);
+
+  result.frames = run.frames;
+  result.elapsed = (g_get_monotonic_time () - run.start_time) / 1e6;
+  if (run.frames > 0)
+    result.time_to_first_frame =
+        (run.first_frame_time - run.start_time) / 1e6;
+
+  if (g_object_class_find_property (G_OBJECT_GET_CLASS (decoder), "stats")) {
+    GstStructure *stats;
+
+    g_object_get (decoder, "stats", &stats, NULL);
+    gst_structure_foreach (stats, (GstStructureForeachFunc) add_shm_high_water,
+                           &result.shm_high_water);
+    gst_structure_free (stats);
+  }
+
+  gst_object_unref (decoder);
+  gst_element_set_state (run.pipeline, GST_STATE_NULL);
+  gst_object_unref (run.pipeline);
+  g_main_loop_unref (run.loop);
+
+  /* our own usage alone, the decoders are counted apart */
+  getrusage (RUSAGE_SELF, &usage);
+  result.player_cpu = get_cpu_time (&usage);
+  result.player_max_rss = usage.ru_maxrss;
+
+  reap_decoders (&result);
+
+  printf ("%u %f %f %" G_GUINT64_FORMAT " %f %ld %f %ld\n", result.frames,
+          result.elapsed, result.time_to_first_frame, result.shm_high_water,
+          result.decoder_cpu, result.decoder_max_rss, result.player_cpu,
+          result.player_max_rss);
+
+  return run.failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* main process side */
+
+/* Runs a decode in a new process and measures it */
+static gboolean
+measure_decode (const gchar *mode, const gchar *clip, Result *result)
+{
+  gchar *argv[] = { "/proc/self/exe", "--run", (gchar *) mode,
+                    "--clip", (gchar *) clip, NULL };
+  gchar output[256];
+  gint fds[2], status;
+  gssize size, total = 0;
+  pid_t pid;
+
+  if (pipe (fds) == -1)
+    return FALSE;
+
+  pid = fork ();
+  if (pid == -1) {
+    close (fds[0]);
+    close (fds[1]);
+    return FALSE;
+  }
+  if (pid == 0) {
+    dup2 (fds[1], STDOUT_FILENO);
+    execv (argv[0], argv);
+    _exit (EXIT_FAILURE);
+  }
+
+  close (fds[1]);
+  while (total < (gssize) sizeof (output) - 1
+         && (size = read (fds[0], output + total,
+                          sizeof (output) - 1 - total)) != 0) {
+    if (size < 0 && errno == EINTR)
+      continue;
+    if (size < 0)
+      break;
+    total += size;
+  }
+  output[total] = '\0';
+  close (fds[0]);
+
+  /* being a subreaper, it reports its own usage: ours of it would include
+   * the decoders */
+  while (waitpid (pid, &status, 0) == -1 && errno == EINTR);
+  if (!WIFEXITED (status) || WEXITSTATUS (status) != EXIT_SUCCESS)
+    return FALSE;
+
+  memset (result, 0, sizeof (*result));
+  if (sscanf (output, "%u %lf %lf %" G_GUINT64_FORMAT " %lf %ld %lf %ld",
+              &result->frames, &result->elapsed,
+              &result->time_to_first_frame, &result->shm_high_water,
+              &result->decoder_cpu, &result->decoder_max_rss,
+              &result->player_cpu, &result->player_max_rss) != 8)
+    return FALSE;
+
+  return TRUE;
+}
+
+static void
+print_result (const gchar *clip, const gchar *mode, const Result *result)
+{
+  printf ("%-16s %-18s %8.1f %9.1f %8.2f %8.2f %8ld %8ld %8.1f\n",
+          clip, mode,
+          result->elapsed > 0 ? result->frames / result->elapsed : 0.0,
+          result->time_to_first_frame * 1000,
+          result->player_cpu, result->decoder_cpu,
+          result->player_max_rss / 1024, result->decoder_max_rss / 1024,
+          result->shm_high_water / (1024.0 * 1024.0));
+}
+
+int
+main (int argc, char **argv)
+{
+  GOptionContext *context;
+  GError *error = NULL;
+  gboolean failed = FALSE;
+  guint i, j;
+
+  context = g_option_context_new ("- compare sandboxeddecodebin with "
+                                  "decodebin2");
+  g_option_context_add_main_entries (context, entries, NULL);
+  g_option_context_add_group (context, gst_init_get_option_group ());
+  if (!g_option_context_parse (context, &argc, &argv, &error)) {
+    fprintf (stderr, "%s\n", error->message);
+    return EXIT_FAILURE;
+  }
+  g_option_context_free (context);
+
+  if (run_mode && run_clip)
+    return run_decode (run_mode, run_clip);
+
+  if (duration <= 0) {
+    fprintf (stderr, "Invalid duration %d\n", duration);
+    return EXIT_FAILURE;
+  }
+  if (!clips_dir)
+    clips_dir = g_strdup ("bench-clips");
+  if (g_mkdir_with_parents (clips_dir, 0755) == -1) {
+    fprintf (stderr, "Could not create %s: %s\n", clips_dir,
+             g_strerror (errno));
+    return EXIT_FAILURE;
+  }
+
+  printf ("%-16s %-18s %8s %9s %8s %8s %8s %8s %8s\n", "clip", "decoder",
+          "fps", "ttff(ms)", "cpu(s)", "dec cpu", "rss(MB)", "dec rss",
+          "shm(MB)");
+  for (i = 0; i < G_N_ELEMENTS (clips); i++) {
+    gchar *path = encode_clip (&clips[i]);
+
+    if (!path)
+      continue;
+
+    for (j = 0; j < G_N_ELEMENTS (modes); j++) {
+      Result result;
+
+      if (measure_decode (modes[j], path, &result)) {
+        print_result (clips[i].name, modes[j], &result);
+      } else {
+        fprintf (stderr, "Decoding %s with %s failed\n", path, modes[j]);
+        failed = TRUE;
+      }
+    }
+    g_free (path);
+  }
+
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
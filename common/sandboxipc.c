@@ -0,0 +1,754 @@
+/*
+ * Copyright (C) 2012 Igalia S.L.
+*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/* Wire protocol between the sandboxed decoder and sandboxeddecodebin.
+ *
+ * Each message is a SandboxMessageHeader followed by its payload, sent as a
+ * single packet on a SOCK_SEQPACKET socket. File descriptors (shm areas,
+ * other channels) travel alongside as SCM_RIGHTS. Keep in mind that the
+ * parent must not trust anything coming from the decoder: every payload is
+ * size checked before use.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "sandboxipc.h"
+
+struct _SandboxChannel {
+  gint refcount;
+  gint fd;
+  /* serialises writers, buffers can be released from any thread */
+  GMutex lock;
+};
+
+/* Creates a pair of connected sockets suitable for a channel, both of them
+ * close-on-exec */
+gboolean
+sandbox_ipc_socketpair (gint fds[2])
+{
+  return socketpair (AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) == 0;
+}
+
+/* A GSpawnChildSetupFunc making the fd in user_data available as
+ * SANDBOX_IPC_CONTROL_FD to the program about to be executed */
+void
+sandbox_ipc_setup_control_fd (gpointer user_data)
+{
+  gint fd = GPOINTER_TO_INT (user_data);
+
+  /* dup2() leaves the new fd open across exec, but does nothing if it is
+   * already the right one */
+  if (fd == SANDBOX_IPC_CONTROL_FD)
+    fcntl (fd, F_SETFD, 0);
+  else
+    dup2 (fd, SANDBOX_IPC_CONTROL_FD);
+}
+
+/* Takes ownership of fd */
+SandboxChannel *
+sandbox_channel_new (gint fd)
+{
+  SandboxChannel *channel;
+
+  g_return_val_if_fail (fd >= 0, NULL);
+
+  channel = g_slice_new (SandboxChannel);
+  channel->refcount = 1;
+  channel->fd = fd;
+  g_mutex_init (&channel->lock);
+
+  return channel;
+}
+
+SandboxChannel *
+sandbox_channel_ref (SandboxChannel *channel)
+{
+  g_atomic_int_inc (&channel->refcount);
+  return channel;
+}
+
+void
+sandbox_channel_unref (SandboxChannel *channel)
+{
+  if (!g_atomic_int_dec_and_test (&channel->refcount))
+    return;
+
+  close (channel->fd);
+  g_mutex_clear (&channel->lock);
+  g_slice_free (SandboxChannel, channel);
+}
+
+gint
+sandbox_channel_get_fd (SandboxChannel *channel)
+{
+  return channel->fd;
+}
+
+gboolean
+sandbox_channel_send (SandboxChannel *channel,
+                      guint32 type,
+                      gconstpointer payload,
+                      gsize size,
+                      const gint *fds,
+                      guint n_fds)
+{
+  SandboxMessageHeader header;
+  struct iovec iov[2];
+  struct msghdr msg;
+  gchar control[CMSG_SPACE (sizeof (gint) * SANDBOX_IPC_MAX_FDS)];
+  ssize_t sent;
+
+  g_return_val_if_fail (size <= SANDBOX_IPC_MAX_PAYLOAD_SIZE, FALSE);
+  g_return_val_if_fail (n_fds <= SANDBOX_IPC_MAX_FDS, FALSE);
+
+  header.type = type;
+  header.size = size;
+
+  iov[0].iov_base = &header;
+  iov[0].iov_len = sizeof (header);
+  iov[1].iov_base = (gpointer) payload;
+  iov[1].iov_len = size;
+
+  memset (&msg, 0, sizeof (msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = size ? 2 : 1;
+
+  if (n_fds) {
+    struct cmsghdr *cmsg;
+
+    memset (control, 0, sizeof (control));
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE (sizeof (gint) * n_fds);
+    cmsg = CMSG_FIRSTHDR (&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN (sizeof (gint) * n_fds);
+    memcpy (CMSG_DATA (cmsg), fds, sizeof (gint) * n_fds);
+  }
+
+  g_mutex_lock (&channel->lock);
+  do {
+    sent = sendmsg (channel->fd, &msg, MSG_NOSIGNAL);
+  } while (sent == -1 && errno == EINTR);
+  g_mutex_unlock (&channel->lock);
+
+  return sent == (ssize_t) (sizeof (header) + size);
+}
+
+/* Blocks until a message is available: callers that need to be interruptible
+ * should poll the fd first. */
+SandboxChannelResult
+sandbox_channel_receive (SandboxChannel *channel,
+                         SandboxMessage *message)
+{
+  SandboxMessageHeader header;
+  struct iovec iov[2];
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+  gchar control[CMSG_SPACE (sizeof (gint) * SANDBOX_IPC_MAX_FDS)];
+  ssize_t received;
+
+  iov[0].iov_base = &header;
+  iov[0].iov_len = sizeof (header);
+  iov[1].iov_base = message->payload;
+  iov[1].iov_len = sizeof (message->payload);
+
+  memset (&msg, 0, sizeof (msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = 2;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof (control);
+
+  do {
+    received = recvmsg (channel->fd, &msg, MSG_CMSG_CLOEXEC);
+  } while (received == -1 && errno == EINTR);
+
+  if (received == 0)
+    return SANDBOX_CHANNEL_CLOSED;
+  if (received == -1)
+    return SANDBOX_CHANNEL_ERROR;
+
+  message->n_fds = 0;
+  for (cmsg = CMSG_FIRSTHDR (&msg); cmsg; cmsg = CMSG_NXTHDR (&msg, cmsg)) {
+    guint i, n;
+
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+      continue;
+
+    n = (cmsg->cmsg_len - CMSG_LEN (0)) / sizeof (gint);
+    for (i = 0; i < n; i++) {
+      gint fd;
+
+      memcpy (&fd, CMSG_DATA (cmsg) + i * sizeof (gint), sizeof (gint));
+      if (message->n_fds < SANDBOX_IPC_MAX_FDS)
+        message->fds[message->n_fds++] = fd;
+      else
+        close (fd);
+    }
+  }
+
+  if ((msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))
+      || received < (ssize_t) sizeof (header)
+      || header.size != received - sizeof (header)) {
+    sandbox_message_close_fds (message);
+    errno = EPROTO;
+    return SANDBOX_CHANNEL_ERROR;
+  }
+
+  message->type = header.type;
+  message->size = header.size;
+
+  return SANDBOX_CHANNEL_OK;
+}
+
+gboolean
+sandbox_channel_send_caps (SandboxChannel *channel, GstCaps *caps)
+{
+  gchar *caps_string;
+  gboolean ret;
+
+  caps_string = gst_caps_to_string (caps);
+  if (strlen (caps_string) + 1 > SANDBOX_IPC_MAX_PAYLOAD_SIZE) {
+    GST_WARNING ("Caps too big to be sent");
+    g_free (caps_string);
+    return FALSE;
+  }
+  ret = sandbox_channel_send (channel, SANDBOX_MESSAGE_CAPS,
+                              caps_string, strlen (caps_string) + 1,
+                              NULL, 0);
+  g_free (caps_string);
+
+  return ret;
+}
+
+/* The events sandbox_message_parse_event() rebuilds, the others are not
+ * worth sending */
+gboolean
+sandbox_event_is_forwarded (GstEvent *event)
+{
+  switch (GST_EVENT_TYPE (event)) {
+  case GST_EVENT_FLUSH_START:
+  case GST_EVENT_FLUSH_STOP:
+  case GST_EVENT_EOS:
+  case GST_EVENT_NEWSEGMENT:
+  case GST_EVENT_TAG:
+  case GST_EVENT_SEEK:
+  case GST_EVENT_QOS:
+  case GST_EVENT_CUSTOM_DOWNSTREAM:
+  case GST_EVENT_CUSTOM_DOWNSTREAM_OOB:
+  case GST_EVENT_CUSTOM_BOTH:
+  case GST_EVENT_CUSTOM_BOTH_OOB:
+    return TRUE;
+  default:
+    return FALSE;
+  }
+}
+
+gboolean
+sandbox_channel_send_event (SandboxChannel *channel, GstEvent *event)
+{
+  SandboxEventMessage *header;
+  const GstStructure *structure;
+  gchar *structure_string = NULL;
+  gsize string_size, size;
+  guint8 *payload;
+  gboolean ret;
+
+  structure = gst_event_get_structure (event);
+  if (structure)
+    structure_string = gst_structure_to_string (structure);
+  string_size = structure_string ? strlen (structure_string) + 1 : 1;
+  size = sizeof (SandboxEventMessage) + string_size;
+
+  if (size > SANDBOX_IPC_MAX_PAYLOAD_SIZE) {
+    GST_WARNING ("%s event too big to be forwarded",
+                 GST_EVENT_TYPE_NAME (event));
+    g_free (structure_string);
+    return FALSE;
+  }
+
+  payload = g_malloc0 (size);
+  header = (SandboxEventMessage *) payload;
+  header->type = GST_EVENT_TYPE (event);
+  header->seqnum = gst_event_get_seqnum (event);
+  if (structure_string)
+    memcpy (payload + sizeof (SandboxEventMessage), structure_string,
+            string_size);
+
+  ret = sandbox_channel_send (channel, SANDBOX_MESSAGE_EVENT,
+                              payload, size, NULL, 0);
+  g_free (payload);
+  g_free (structure_string);
+
+  return ret;
+}
+
+/* The queries that make sense on the other side. Others, like the URI, would
+ * tell the decoder more than it needs to know. */
+gboolean
+sandbox_query_is_forwarded (GstQuery *query)
+{
+  switch (GST_QUERY_TYPE (query)) {
+  case GST_QUERY_POSITION:
+  case GST_QUERY_DURATION:
+  case GST_QUERY_LATENCY:
+  case GST_QUERY_SEEKING:
+  case GST_QUERY_CONVERT:
+    return TRUE;
+  default:
+    return FALSE;
+  }
+}
+
+/* Sends a QUERY, or with type QUERY_RESULT the answer to one. The type in
+ * the header is the one of the query. */
+gboolean
+sandbox_channel_send_query (SandboxChannel *channel,
+                            guint32 type,
+                            GstQuery *query,
+                            const SandboxQueryMessage *header)
+{
+  SandboxQueryMessage *query_header;
+  gchar *structure_string;
+  gsize string_size, size;
+  guint8 *payload;
+  gboolean ret;
+
+  structure_string = gst_structure_to_string (gst_query_get_structure (query));
+  string_size = strlen (structure_string) + 1;
+  size = sizeof (SandboxQueryMessage) + string_size;
+
+  if (size > SANDBOX_IPC_MAX_PAYLOAD_SIZE) {
+    GST_WARNING ("%s query too big to be forwarded",
+                 GST_QUERY_TYPE_NAME (query));
+    g_free (structure_string);
+    return FALSE;
+  }
+
+  payload = g_malloc0 (size);
+  query_header = (SandboxQueryMessage *) payload;
+  *query_header = *header;
+  query_header->type = GST_QUERY_TYPE (query);
+  memcpy (payload + sizeof (SandboxQueryMessage), structure_string,
+          string_size);
+
+  ret = sandbox_channel_send (channel, type, payload, size, NULL, 0);
+  g_free (payload);
+  g_free (structure_string);
+
+  return ret;
+}
+
+/* Returns the payload if it has exactly the expected size, NULL otherwise */
+gconstpointer
+sandbox_message_get_payload (SandboxMessage *message, gsize size)
+{
+  if (message->size != size)
+    return NULL;
+
+  return message->payload;
+}
+
+/* Returns the NUL-terminated string at offset in the payload, or NULL if
+ * there isn't one */
+const gchar *
+sandbox_message_get_string (SandboxMessage *message, gsize offset)
+{
+  if (message->size <= offset
+      || message->payload[message->size - 1] != '\0')
+    return NULL;
+
+  return (const gchar *) message->payload + offset;
+}
+
+/* Returns the first fd attached to the message, which the caller then owns,
+ * or -1 */
+gint
+sandbox_message_steal_fd (SandboxMessage *message)
+{
+  gint fd;
+
+  if (message->n_fds == 0)
+    return -1;
+
+  fd = message->fds[0];
+  message->n_fds--;
+  memmove (message->fds, message->fds + 1, message->n_fds * sizeof (gint));
+
+  return fd;
+}
+
+void
+sandbox_message_close_fds (SandboxMessage *message)
+{
+  guint i;
+
+  for (i = 0; i < message->n_fds; i++)
+    close (message->fds[i]);
+  message->n_fds = 0;
+}
+
+GstCaps *
+sandbox_message_parse_caps (SandboxMessage *message)
+{
+  const gchar *caps_string;
+
+  caps_string = sandbox_message_get_string (message, 0);
+  if (!caps_string)
+    return NULL;
+
+  return gst_caps_from_string (caps_string);
+}
+
+static GstEvent *
+parse_new_segment (GstStructure *structure)
+{
+  gboolean update;
+  gdouble rate, applied_rate;
+  gint format;
+  gint64 start, stop, position;
+
+  if (!gst_structure_get_boolean (structure, "update", &update)
+      || !gst_structure_get_double (structure, "rate", &rate)
+      || !gst_structure_get_double (structure, "applied-rate", &applied_rate)
+      || !gst_structure_get_enum (structure, "format", GST_TYPE_FORMAT, &format)
+      || !gst_structure_get_int64 (structure, "start", &start)
+      || !gst_structure_get_int64 (structure, "stop", &stop)
+      || !gst_structure_get_int64 (structure, "position", &position)
+      || rate == 0.0 || applied_rate == 0.0)
+    return NULL;
+
+  return gst_event_new_new_segment_full (update, rate, applied_rate, format,
+                                         start, stop, position);
+}
+
+static GstEvent *
+parse_seek (GstStructure *structure)
+{
+  const GValue *flags;
+  gdouble rate;
+  gint format, cur_type, stop_type;
+  gint64 cur, stop;
+
+  flags = gst_structure_get_value (structure, "flags");
+  if (!flags || !G_VALUE_HOLDS (flags, GST_TYPE_SEEK_FLAGS)
+      || !gst_structure_get_double (structure, "rate", &rate)
+      || !gst_structure_get_enum (structure, "format", GST_TYPE_FORMAT, &format)
+      || !gst_structure_get_enum (structure, "cur_type", GST_TYPE_SEEK_TYPE,
+                                  &cur_type)
+      || !gst_structure_get_int64 (structure, "cur", &cur)
+      || !gst_structure_get_enum (structure, "stop_type", GST_TYPE_SEEK_TYPE,
+                                  &stop_type)
+      || !gst_structure_get_int64 (structure, "stop", &stop)
+      || rate == 0.0)
+    return NULL;
+
+  return gst_event_new_seek (rate, format, g_value_get_flags (flags),
+                             cur_type, cur, stop_type, stop);
+}
+
+static GstEvent *
+parse_qos (GstStructure *structure)
+{
+  gdouble proportion;
+  gint64 diff;
+  guint64 timestamp;
+#if GST_CHECK_VERSION (0, 10, 33)
+  gint type;
+#endif
+
+  if (!gst_structure_get_double (structure, "proportion", &proportion)
+      || !gst_structure_get_int64 (structure, "diff", &diff)
+      || !gst_structure_get_uint64 (structure, "timestamp", &timestamp))
+    return NULL;
+
+#if GST_CHECK_VERSION (0, 10, 33)
+  if (gst_structure_get_enum (structure, "type", GST_TYPE_QOS_TYPE, &type))
+    return gst_event_new_qos_full (type, proportion, diff, timestamp);
+#endif
+
+  return gst_event_new_qos (proportion, diff, timestamp);
+}
+
+/* Rebuilds an event sent with sandbox_channel_send_event(). Returns NULL if
+ * the message doesn't make sense, or is of a type we don't forward: the
+ * events a decoder sends go downstream in the parent, where elements parse
+ * them expecting the fields their constructor sets. */
+GstEvent *
+sandbox_message_parse_event (SandboxMessage *message)
+{
+  const SandboxEventMessage *header;
+  const gchar *structure_string;
+  GstStructure *structure = NULL;
+  GstEvent *event = NULL;
+
+  if (message->size < sizeof (SandboxEventMessage))
+    return NULL;
+
+  header = (const SandboxEventMessage *) message->payload;
+  structure_string =
+      sandbox_message_get_string (message, sizeof (SandboxEventMessage));
+  if (!structure_string)
+    return NULL;
+
+  if (*structure_string) {
+    structure = gst_structure_from_string (structure_string, NULL);
+    if (!structure)
+      return NULL;
+  }
+
+  switch (header->type) {
+  case GST_EVENT_FLUSH_START:
+    event = gst_event_new_flush_start ();
+    break;
+  case GST_EVENT_FLUSH_STOP:
+    event = gst_event_new_flush_stop ();
+    break;
+  case GST_EVENT_EOS:
+    event = gst_event_new_eos ();
+    break;
+  case GST_EVENT_NEWSEGMENT:
+    if (structure)
+      event = parse_new_segment (structure);
+    break;
+  case GST_EVENT_TAG:
+    if (structure && gst_is_tag_list (structure)) {
+      event = gst_event_new_tag ((GstTagList *) structure);
+      structure = NULL;
+    }
+    break;
+  case GST_EVENT_SEEK:
+    if (structure)
+      event = parse_seek (structure);
+    break;
+  case GST_EVENT_QOS:
+    if (structure)
+      event = parse_qos (structure);
+    break;
+  case GST_EVENT_CUSTOM_DOWNSTREAM:
+  case GST_EVENT_CUSTOM_DOWNSTREAM_OOB:
+  case GST_EVENT_CUSTOM_BOTH:
+  case GST_EVENT_CUSTOM_BOTH_OOB:
+    /* custom events carry everything in their structure */
+    if (structure) {
+      event = gst_event_new_custom (header->type, structure);
+      structure = NULL;
+    }
+    break;
+  default:
+    GST_WARNING ("Not forwarding event of type %u", header->type);
+    break;
+  }
+
+  if (structure)
+    gst_structure_free (structure);
+  if (event)
+    gst_event_set_seqnum (event, header->seqnum);
+
+  return event;
+}
+
+/* Returns the header of a QUERY or QUERY_RESULT, or NULL if the message is
+ * too short for one */
+const SandboxQueryMessage *
+sandbox_message_get_query_header (SandboxMessage *message)
+{
+  if (message->size < sizeof (SandboxQueryMessage))
+    return NULL;
+
+  return (const SandboxQueryMessage *) message->payload;
+}
+
+static GstStructure *
+parse_query_structure (SandboxMessage *message)
+{
+  const gchar *structure_string;
+
+  if (!sandbox_message_get_query_header (message))
+    return NULL;
+
+  structure_string =
+      sandbox_message_get_string (message, sizeof (SandboxQueryMessage));
+  if (!structure_string)
+    return NULL;
+
+  return gst_structure_from_string (structure_string, NULL);
+}
+
+/* Rebuilds a query sent with sandbox_channel_send_query(), with the
+ * constructor of its type so that it has all the fields parsing it expects.
+ * Returns NULL if the message doesn't make sense or the query isn't one we
+ * forward. */
+GstQuery *
+sandbox_message_parse_query (SandboxMessage *message)
+{
+  GstStructure *structure;
+  GstQuery *query = NULL;
+  gint format, dest_format;
+  gint64 value;
+
+  structure = parse_query_structure (message);
+  if (!structure)
+    return NULL;
+
+  switch (sandbox_message_get_query_header (message)->type) {
+  case GST_QUERY_POSITION:
+    if (gst_structure_get_enum (structure, "format", GST_TYPE_FORMAT,
+                                &format))
+      query = gst_query_new_position (format);
+    break;
+  case GST_QUERY_DURATION:
+    if (gst_structure_get_enum (structure, "format", GST_TYPE_FORMAT,
+                                &format))
+      query = gst_query_new_duration (format);
+    break;
+  case GST_QUERY_SEEKING:
+    if (gst_structure_get_enum (structure, "format", GST_TYPE_FORMAT,
+                                &format))
+      query = gst_query_new_seeking (format);
+    break;
+  case GST_QUERY_LATENCY:
+    query = gst_query_new_latency ();
+    break;
+  case GST_QUERY_CONVERT:
+    if (gst_structure_get_enum (structure, "src_format", GST_TYPE_FORMAT,
+                                &format)
+        && gst_structure_get_int64 (structure, "src_value", &value)
+        && gst_structure_get_enum (structure, "dest_format", GST_TYPE_FORMAT,
+                                   &dest_format))
+      query = gst_query_new_convert (format, value, dest_format);
+    break;
+  default:
+    break;
+  }
+  gst_structure_free (structure);
+
+  return query;
+}
+
+/* Only the fields the query already has, with the same type */
+static gboolean
+merge_query_field (GQuark field, const GValue *value, GstStructure *into)
+{
+  const GValue *existing = gst_structure_id_get_value (into, field);
+
+  if (existing && G_VALUE_TYPE (existing) == G_VALUE_TYPE (value))
+    gst_structure_id_set_value (into, field, value);
+
+  return TRUE;
+}
+
+/* Fills query in with the answer in a QUERY_RESULT. Returns whether it was
+ * answered. */
+gboolean
+sandbox_message_parse_query_result (SandboxMessage *message, GstQuery *query)
+{
+  const SandboxQueryMessage *header;
+  GstStructure *structure;
+  gboolean answered;
+
+  structure = parse_query_structure (message);
+  if (!structure)
+    return FALSE;
+
+  header = sandbox_message_get_query_header (message);
+  answered = header->answered && header->type == GST_QUERY_TYPE (query);
+  if (answered)
+    gst_structure_foreach (structure,
+                           (GstStructureForeachFunc) merge_query_field,
+                           gst_query_get_structure (query));
+  gst_structure_free (structure);
+
+  return answered;
+}
+
+gboolean
+sandbox_channel_send_preamble (SandboxChannel *channel,
+                               const gchar *plugins,
+                               const SandboxPreamble *settings)
+{
+  gsize string_size, size;
+  guint8 *payload;
+  gboolean ret;
+
+  string_size = strlen (plugins) + 1;
+  size = sizeof (SandboxPreamble) + string_size;
+  if (size > SANDBOX_IPC_MAX_PAYLOAD_SIZE)
+    return FALSE;
+
+  payload = g_malloc0 (size);
+  memcpy (payload, settings, sizeof (SandboxPreamble));
+  memcpy (payload + sizeof (SandboxPreamble), plugins, string_size);
+
+  ret = sandbox_channel_send (channel, SANDBOX_MESSAGE_PREAMBLE,
+                              payload, size, NULL, 0);
+  g_free (payload);
+
+  return ret;
+}
+
+/* Returns the list of plugins of a preamble and fills settings, or NULL if
+ * the message isn't one */
+gchar *
+sandbox_message_parse_preamble (SandboxMessage *message,
+                                SandboxPreamble *settings)
+{
+  const gchar *plugins;
+
+  if (message->type != SANDBOX_MESSAGE_PREAMBLE
+      || message->size < sizeof (SandboxPreamble))
+    return NULL;
+
+  plugins = sandbox_message_get_string (message, sizeof (SandboxPreamble));
+  if (!plugins)
+    return NULL;
+
+  memcpy (settings, message->payload, sizeof (SandboxPreamble));
+
+  return g_strdup (plugins);
+}
+
+/* the field names of the phases in the startup-profile message */
+const gchar *
+sandbox_startup_phase_get_name (SandboxStartupPhase phase)
+{
+  static const gchar *names[SANDBOX_N_PHASES] = {
+    "decoder-started",
+    "gst-initialized",
+    "pipeline-created",
+    "pipeline-ready",
+    "preamble-received",
+    "plugins-loaded",
+    "sandboxed",
+    "playing",
+    "first-buffer"
+  };
+
+  g_return_val_if_fail (phase < SANDBOX_N_PHASES, NULL);
+
+  return names[phase];
+}
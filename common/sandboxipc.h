@@ -0,0 +1,406 @@
+/*
+ * Copyright (C) 2012 Igalia S.L.
+*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __SANDBOX_IPC_H__
+#define __SANDBOX_IPC_H__
+
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+
+/* Messages are exchanged on SOCK_SEQPACKET unix sockets, so each of them is
+ * received in one go, along with the file descriptors attached to it. */
+#define SANDBOX_IPC_MAX_PAYLOAD_SIZE 65536
+#define SANDBOX_IPC_MAX_FDS 4
+
+/* where a spawned decoder (or zygote) finds its control channel */
+#define SANDBOX_IPC_CONTROL_FD 3
+
+/* how decoders are confined: chrooted by the setuid sandboxme helper, or
+ * confining themselves with namespaces and a seccomp filter. The names are
+ * those of gst-decoder --sandbox. */
+typedef enum {
+  SANDBOX_BACKEND_SETUID,
+  SANDBOX_BACKEND_NAMESPACES
+} SandboxBackend;
+
+/* the scheduling policy of the decoding threads, SCHED_OTHER, SCHED_BATCH
+ * or SCHED_IDLE */
+typedef enum {
+  SANDBOX_SCHEDULING_NORMAL,
+  SANDBOX_SCHEDULING_BATCH,
+  SANDBOX_SCHEDULING_IDLE
+} SandboxScheduling;
+
+/* what backs the shared memory areas of the decoder: normal pages,
+ * transparent huge pages, or explicit ones from the hugetlbfs pool */
+typedef enum {
+  SANDBOX_HUGE_PAGES_NONE,
+  SANDBOX_HUGE_PAGES_TRANSPARENT,
+  SANDBOX_HUGE_PAGES_EXPLICIT
+} SandboxHugePages;
+
+/* the CPUs a decoder can be pinned to, in the preamble */
+#define SANDBOX_MAX_CPUS 1024
+
+typedef enum {
+  /* stream channels, decoder -> parent */
+  SANDBOX_MESSAGE_AREA = 1,
+  SANDBOX_MESSAGE_CAPS,
+  SANDBOX_MESSAGE_EVENT,
+  SANDBOX_MESSAGE_BUFFER,
+  SANDBOX_MESSAGE_BUFFER_BATCH,
+  SANDBOX_MESSAGE_SHM_WAIT,
+
+  /* stream channels, parent -> decoder. EVENT too, but only for seeks and
+   * QoS, and CAPS for what downstream of the parent accepts */
+  SANDBOX_MESSAGE_RELEASE = 64,
+
+  /* control channel, decoder -> parent */
+  SANDBOX_MESSAGE_READY = 128,
+  SANDBOX_MESSAGE_STREAM_ADDED,
+  SANDBOX_MESSAGE_NO_MORE_STREAMS,
+  SANDBOX_MESSAGE_STARTUP_PROFILE,
+  SANDBOX_MESSAGE_DONE,
+  SANDBOX_MESSAGE_QUERY_RESULT,
+
+  /* control channel, parent -> decoder */
+  SANDBOX_MESSAGE_QUERY = 144,
+
+  /* thumbnail channel, gst-thumbnailer -> its worker */
+  SANDBOX_MESSAGE_THUMBNAIL_JOB = 160,
+
+  /* thumbnail channel, worker -> gst-thumbnailer. READY too, once the
+   * worker is sandboxed */
+  SANDBOX_MESSAGE_THUMBNAIL = 176,
+  SANDBOX_MESSAGE_THUMBNAIL_JOB_DONE,
+
+  /* control channel, parent -> zygote */
+  SANDBOX_MESSAGE_SPAWN = 192,
+
+  /* input channel, parent -> decoder. QUERY_RESULT too, for the queries
+   * below */
+  SANDBOX_MESSAGE_PREAMBLE = 224,
+  SANDBOX_MESSAGE_INPUT_INFO,
+  SANDBOX_MESSAGE_DATA,
+
+  /* input channel, decoder -> parent. QUERY too, for upstream of the
+   * parent */
+  SANDBOX_MESSAGE_QUERY_INPUT_INFO = 240,
+  SANDBOX_MESSAGE_READ
+} SandboxMessageType;
+
+typedef enum {
+  SANDBOX_CHANNEL_OK,
+  SANDBOX_CHANNEL_CLOSED,
+  SANDBOX_CHANNEL_ERROR
+} SandboxChannelResult;
+
+typedef struct {
+  guint32 type;
+  guint32 size;
+} SandboxMessageHeader;
+
+/* SANDBOX_MESSAGE_AREA, comes with the fd of the area. The buffers that
+ * follow are in this area, until the next one. flags are the ShmAreaFlags it
+ * was created with, for the parent to map it the same way. */
+typedef struct {
+  guint64 size;
+  guint32 id;
+  guint32 flags;
+} SandboxAreaMessage;
+
+/* SANDBOX_MESSAGE_BUFFER */
+typedef struct {
+  guint64 offset;        /* of the data in the shm area */
+  guint64 size;
+  guint64 timestamp;
+  guint64 duration;
+  guint64 buffer_offset;
+  guint64 buffer_offset_end;
+  /* g_get_monotonic_time() when the sink got the buffer, in ns */
+  guint64 render_time;
+  guint32 flags;
+} SandboxBufferMessage;
+
+/* SANDBOX_MESSAGE_BUFFER_BATCH, followed by n_buffers SandboxBufferMessage:
+ * consecutive buffers packed in the block at offset, released all at once
+ * with that offset. The offsets of the buffers are relative to the block. */
+typedef struct {
+  guint64 offset;
+  guint32 n_buffers;
+} SandboxBatchMessage;
+
+#define SANDBOX_BATCH_MAX_BUFFERS \
+    ((SANDBOX_IPC_MAX_PAYLOAD_SIZE - sizeof (SandboxBatchMessage)) \
+     / sizeof (SandboxBufferMessage))
+
+/* SANDBOX_MESSAGE_SHM_WAIT, sent after the sink had to wait for the parent
+ * to release memory */
+typedef struct {
+  /* since the sink started, in ns */
+  guint64 total_wait_time;
+} SandboxShmWaitMessage;
+
+/* SANDBOX_MESSAGE_RELEASE, the parent is done with the data at offset in
+ * area id */
+typedef struct {
+  guint64 offset;
+  guint32 area;
+} SandboxReleaseMessage;
+
+/* SANDBOX_MESSAGE_STREAM_ADDED: the decoder exposed a new decoded stream,
+ * comes with the parent end of its stream channel */
+typedef enum {
+  SANDBOX_STREAM_VIDEO,
+  SANDBOX_STREAM_AUDIO
+} SandboxStreamKind;
+
+typedef struct {
+  guint32 kind;
+  /* how queries for the stream refer to it */
+  guint32 id;
+} SandboxStreamMessage;
+
+/* SANDBOX_MESSAGE_STARTUP_PROFILE, sent once the decoder handed its first
+ * buffer over: when it went through each phase of its startup, as
+ * g_get_monotonic_time() in ns, 0 for the phases it skipped (a decoder forked
+ * by the zygote doesn't initialise GStreamer or enter the sandbox) */
+typedef enum {
+  SANDBOX_PHASE_STARTED,
+  SANDBOX_PHASE_GST_INITIALIZED,
+  SANDBOX_PHASE_PIPELINE_CREATED,
+  SANDBOX_PHASE_PIPELINE_READY,
+  SANDBOX_PHASE_PREAMBLE_RECEIVED,
+  SANDBOX_PHASE_PLUGINS_LOADED,
+  SANDBOX_PHASE_SANDBOXED,
+  SANDBOX_PHASE_PLAYING,
+  SANDBOX_PHASE_FIRST_BUFFER,
+  SANDBOX_N_PHASES
+} SandboxStartupPhase;
+
+typedef struct {
+  guint64 times[SANDBOX_N_PHASES];
+} SandboxStartupProfileMessage;
+
+/* SANDBOX_MESSAGE_READY: the decoder pipeline is up and waits for its input.
+ *
+ * SANDBOX_MESSAGE_NO_MORE_STREAMS: all the streams have been announced.
+ *
+ * SANDBOX_MESSAGE_DONE: the decoder is quitting of its own accord, after EOS
+ * or an error. Its control channel closing without it means it crashed.
+ *
+ * SANDBOX_MESSAGE_SPAWN: asks the zygote for a decoder, comes with the
+ * decoder end of its control channel and of its input channel. */
+
+/* SANDBOX_MESSAGE_QUERY, followed by the serialised query structure. On the
+ * control channel, a query from downstream of the parent for the stream
+ * with that id, which the decoder runs upstream of its sink. On the input
+ * channel, a query from the decoder, which the parent runs upstream of its
+ * input.
+ *
+ * SANDBOX_MESSAGE_QUERY_RESULT: the same header, with answered set if the
+ * query was, followed by the structure of the answer */
+typedef struct {
+  guint32 type;
+  guint32 id;
+  guint32 stream;
+  guint32 answered;
+} SandboxQueryMessage;
+
+/* SANDBOX_MESSAGE_EVENT, followed by the serialised event structure (or an
+ * empty string). Downstream events from the decoder, seeks from the parent */
+typedef struct {
+  guint32 type;
+  guint32 seqnum;
+} SandboxEventMessage;
+
+typedef enum {
+  SANDBOX_THUMBNAIL_RAW,
+  SANDBOX_THUMBNAIL_PNG
+} SandboxThumbnailFormat;
+
+#define SANDBOX_THUMBNAIL_MAX_TIMES 1024
+
+/* SANDBOX_MESSAGE_THUMBNAIL_JOB, comes with the fd of the file and is
+ * followed by n_times timestamps (guint64, in ns): the worker grabs the
+ * keyframe closest to each, or count evenly spaced ones if there are none.
+ * Frames are scaled to width x height, with 0 for either to keep the aspect
+ * ratio, 0 for both to keep the size. The worker gives up on the file after
+ * timeout s, 0 for never. */
+typedef struct {
+  guint32 id;
+  guint32 format;
+  guint32 width;
+  guint32 height;
+  guint32 count;
+  guint32 timeout;
+  guint32 n_times;
+  guint32 padding;
+} SandboxThumbnailJobMessage;
+
+/* SANDBOX_MESSAGE_THUMBNAIL, comes with a shm area of size bytes holding
+ * the frame: height rows of stride bytes of packed RGB when raw, a PNG
+ * file otherwise */
+typedef struct {
+  guint64 timestamp;
+  guint64 size;
+  guint32 job;
+  guint32 index;
+  guint32 width;
+  guint32 height;
+  guint32 stride;
+  guint32 padding;
+} SandboxThumbnailMessage;
+
+/* SANDBOX_MESSAGE_THUMBNAIL_JOB_DONE, once all the thumbnails of a job were
+ * sent. success is FALSE if the file could not be decoded at all. */
+typedef struct {
+  guint32 job;
+  guint32 success;
+} SandboxThumbnailJobDoneMessage;
+
+/* SANDBOX_MESSAGE_PREAMBLE, the first message on the input channel,
+ * followed by the comma separated names of the plugins the decoder should
+ * load. max_shm_size caps the shared memory all the streams of the decoder
+ * may use, 0 for no limit. Raw audio buffers are sent in batches of up to
+ * audio_batch_duration, 0 to send each of them. Each stream may have at most
+ * max_buffers_in_flight buffers and max_bytes_in_flight bytes the parent has
+ * not released yet, 0 for no limit.
+ *
+ * The threads decoding the session run on the CPUs set in cpu_set (one bit
+ * each, none to leave the affinity alone), at the given nice level (0 to
+ * leave it alone) and scheduling policy. Decoders that can use several
+ * threads use at most max_threads, 0 to let them choose.
+ *
+ * huge_pages is a SandboxHugePages for the shared memory areas, which are
+ * faulted in when created if prefault_shm is set.
+ *
+ * With demux_only set, no decoder is plugged: the streams are handed over
+ * parsed but still compressed. */
+/* for feeders that cannot tell, the decoder loads all it has */
+#define SANDBOX_PREAMBLE_ALL_PLUGINS "*"
+
+typedef struct {
+  guint64 max_shm_size;
+  guint64 audio_batch_duration;
+  guint64 max_bytes_in_flight;
+  guint32 max_buffers_in_flight;
+  guint32 max_threads;
+  gint32 nice;
+  guint32 scheduling;
+  guint32 huge_pages;
+  guint32 prefault_shm;
+  guint32 demux_only;
+  guint64 cpu_set[SANDBOX_MAX_CPUS / 64];
+} SandboxPreamble;
+
+/* SANDBOX_MESSAGE_INPUT_INFO, the answer to SANDBOX_MESSAGE_QUERY_INPUT_INFO
+ * (which has no payload). Only seekable input can be read at random. */
+#define SANDBOX_INPUT_SIZE_UNKNOWN G_MAXUINT64
+
+typedef struct {
+  guint64 size;
+  guint32 seekable;
+} SandboxInputInfoMessage;
+
+/* SANDBOX_MESSAGE_READ, asks for size bytes of input at offset */
+typedef struct {
+  guint64 offset;
+  guint32 size;
+  guint32 seqnum;
+} SandboxReadMessage;
+
+/* SANDBOX_MESSAGE_DATA, followed by data. The answer to a read can take
+ * several messages, the last one is flagged. An empty last one means the
+ * end of the input. */
+#define SANDBOX_DATA_LAST (1 << 0)
+#define SANDBOX_DATA_ERROR (1 << 1)
+
+typedef struct {
+  guint32 seqnum;
+  guint32 flags;
+} SandboxDataMessage;
+
+#define SANDBOX_DATA_CHUNK_SIZE \
+    (SANDBOX_IPC_MAX_PAYLOAD_SIZE - sizeof (SandboxDataMessage))
+
+typedef struct {
+  guint32 type;
+  guint32 size;
+  gint fds[SANDBOX_IPC_MAX_FDS];
+  guint n_fds;
+  guint8 payload[SANDBOX_IPC_MAX_PAYLOAD_SIZE];
+} SandboxMessage;
+
+typedef struct _SandboxChannel SandboxChannel;
+
+gboolean sandbox_ipc_socketpair (gint fds[2]);
+void sandbox_ipc_setup_control_fd (gpointer user_data);
+
+SandboxChannel *sandbox_channel_new (gint fd);
+SandboxChannel *sandbox_channel_ref (SandboxChannel *channel);
+void sandbox_channel_unref (SandboxChannel *channel);
+gint sandbox_channel_get_fd (SandboxChannel *channel);
+
+gboolean sandbox_channel_send (SandboxChannel *channel,
+                               guint32 type,
+                               gconstpointer payload,
+                               gsize size,
+                               const gint *fds,
+                               guint n_fds);
+SandboxChannelResult sandbox_channel_receive (SandboxChannel *channel,
+                                              SandboxMessage *message);
+
+gboolean sandbox_channel_send_caps (SandboxChannel *channel, GstCaps *caps);
+gboolean sandbox_event_is_forwarded (GstEvent *event);
+gboolean sandbox_channel_send_event (SandboxChannel *channel,
+                                     GstEvent *event);
+
+gboolean sandbox_query_is_forwarded (GstQuery *query);
+gboolean sandbox_channel_send_query (SandboxChannel *channel,
+                                     guint32 type,
+                                     GstQuery *query,
+                                     const SandboxQueryMessage *header);
+
+gconstpointer sandbox_message_get_payload (SandboxMessage *message,
+                                           gsize size);
+const gchar *sandbox_message_get_string (SandboxMessage *message,
+                                         gsize offset);
+gint sandbox_message_steal_fd (SandboxMessage *message);
+void sandbox_message_close_fds (SandboxMessage *message);
+GstCaps *sandbox_message_parse_caps (SandboxMessage *message);
+GstEvent *sandbox_message_parse_event (SandboxMessage *message);
+const SandboxQueryMessage *
+sandbox_message_get_query_header (SandboxMessage *message);
+GstQuery *sandbox_message_parse_query (SandboxMessage *message);
+gboolean sandbox_message_parse_query_result (SandboxMessage *message,
+                                             GstQuery *query);
+
+gboolean sandbox_channel_send_preamble (SandboxChannel *channel,
+                                        const gchar *plugins,
+                                        const SandboxPreamble *settings);
+gchar *sandbox_message_parse_preamble (SandboxMessage *message,
+                                       SandboxPreamble *settings);
+
+const gchar *sandbox_startup_phase_get_name (SandboxStartupPhase phase);
+
+G_END_DECLS
+
+#endif /* __SANDBOX_IPC_H__ */
@@ -0,0 +1,485 @@
+/*
+ * Copyright (C) 2012 Igalia S.L.
+*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/* Shared memory areas holding the decoded buffers.
+ *
+ * The areas are anonymous: they only exist as a file descriptor that is
+ * passed to the other process, so there is nothing to unlink in /dev/shm
+ * once everyone is done with them. The decoder side carves blocks out of an
+ * area with a simple first-fit allocator, the parent side only maps it.
+ *
+ * Areas for big raw video run into the hundreds of MB. Faulting them in 4 KiB
+ * at a time as the first frames are written shows at the start of playback,
+ * and their TLB misses in steady state; hence the huge page and prefault
+ * options. Explicit huge pages make the file size and the mappings a
+ * multiple of the huge page size, which fstat() gives as the block size.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "shmarea.h"
+
+/* blocks start on a cache line so that decoders can use aligned writes */
+#define SHM_AREA_ALIGNMENT 64
+
+struct _ShmBlock {
+  ShmArea *area;
+  gsize offset;
+  gsize size;
+  gint refcount;
+};
+
+struct _ShmArea {
+  gint refcount;
+  gint fd;
+  guint8 *data;
+  gsize size;
+  /* size rounded up to the pages of the file */
+  gsize map_size;
+  ShmAreaFlags flags;
+
+  GMutex lock;
+  GList *blocks;        /* allocated blocks, sorted by offset */
+  gsize used;
+
+  ShmAreaReleaseFunc release_func;
+  gpointer release_data;
+};
+
+static gint
+create_anonymous_fd (ShmAreaFlags flags)
+{
+  gint fd;
+#ifdef HAVE_MEMFD_CREATE
+  guint mfd_flags = MFD_CLOEXEC | MFD_ALLOW_SEALING;
+
+#ifdef MFD_HUGETLB
+  if (flags & SHM_AREA_HUGE_PAGES)
+    mfd_flags |= MFD_HUGETLB;
+#else
+  if (flags & SHM_AREA_HUGE_PAGES) {
+    errno = ENOSYS;
+    return -1;
+  }
+#endif
+  fd = memfd_create ("sandboxed-decodebin", mfd_flags);
+  if (fd != -1 || errno != ENOSYS || (flags & SHM_AREA_HUGE_PAGES))
+    return fd;
+#else
+  if (flags & SHM_AREA_HUGE_PAGES) {
+    errno = ENOSYS;
+    return -1;
+  }
+#endif
+  {
+    gchar name[64];
+    guint attempts;
+
+    for (attempts = 0; attempts < 16; attempts++) {
+      g_snprintf (name, sizeof (name), "/sandboxed-decodebin-%d-%u",
+                  getpid (), g_random_int ());
+      fd = shm_open (name, O_RDWR | O_CREAT | O_EXCL, 0600);
+      if (fd != -1) {
+        /* only the fd matters from now on */
+        shm_unlink (name);
+        break;
+      }
+      if (errno != EEXIST)
+        break;
+    }
+  }
+
+  return fd;
+}
+
+/* What the pages of fd are a multiple of: the huge page size on
+ * hugetlbfs */
+static gsize
+get_page_size (gint fd)
+{
+  gsize page_size = sysconf (_SC_PAGESIZE);
+  struct stat st;
+
+  /* sanity checked, fd may come from the other side */
+  if (fstat (fd, &st) == 0 && st.st_blksize > (blksize_t) page_size
+      && st.st_blksize <= (1 << 30) && !(st.st_blksize & (st.st_blksize - 1)))
+    page_size = st.st_blksize;
+
+  return page_size;
+}
+
+/* Touches every page of the mapping so that they are all there before the
+ * first buffer is written. The pages only get allocated once, so on the
+ * side receiving the area this only fills its page tables. */
+static void
+prefault (guint8 *data, gsize size, gsize page_size)
+{
+  gsize offset;
+
+#ifdef MADV_POPULATE_WRITE
+  if (madvise (data, size, MADV_POPULATE_WRITE) == 0)
+    return;
+#endif
+
+  for (offset = 0; offset < size; offset += page_size)
+    (void) ((volatile guint8 *) data)[offset];
+}
+
+static ShmArea *
+shm_area_new_internal (gint fd, gsize size, ShmAreaFlags flags)
+{
+  ShmArea *area;
+  guint8 *data;
+  gsize page_size, map_size;
+
+  page_size = get_page_size (fd);
+  map_size = (size + page_size - 1) & ~(page_size - 1);
+  data = mmap (NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (data == MAP_FAILED)
+    return NULL;
+
+#ifdef MADV_HUGEPAGE
+  /* has to come before the pages are faulted in */
+  if (flags & SHM_AREA_TRANSPARENT_HUGE_PAGES)
+    madvise (data, map_size, MADV_HUGEPAGE);
+#endif
+  if (flags & SHM_AREA_PREFAULT)
+    prefault (data, size, page_size);
+
+  area = g_slice_new0 (ShmArea);
+  area->refcount = 1;
+  area->fd = fd;
+  area->data = data;
+  area->size = size;
+  area->map_size = map_size;
+  area->flags = flags;
+  g_mutex_init (&area->lock);
+
+  return area;
+}
+
+static ShmArea *
+create_area (gsize size, ShmAreaFlags flags)
+{
+  ShmArea *area;
+  gsize page_size;
+  gint fd, errsv;
+
+  fd = create_anonymous_fd (flags);
+  if (fd == -1)
+    return NULL;
+
+  page_size = get_page_size (fd);
+  if (ftruncate (fd, (size + page_size - 1) & ~(page_size - 1)) == -1)
+    goto failed;
+
+#ifdef F_ADD_SEALS
+  /* whoever maps this area must not be able to make the other side SIGBUS
+   * by shrinking it */
+  fcntl (fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL);
+#endif
+
+  area = shm_area_new_internal (fd, size, flags);
+  if (!area)
+    goto failed;
+
+  return area;
+
+failed:
+  errsv = errno;
+  close (fd);
+  errno = errsv;
+  return NULL;
+}
+
+/* Creates a new area of the given size, returns NULL and sets errno on
+ * failure */
+ShmArea *
+shm_area_new (gsize size, ShmAreaFlags flags)
+{
+  ShmArea *area = NULL;
+
+  /* mapping fails when there are not enough huge pages reserved */
+  if (flags & SHM_AREA_HUGE_PAGES) {
+    area = create_area (size, flags);
+    flags &= ~SHM_AREA_HUGE_PAGES;
+  }
+  if (!area)
+    area = create_area (size, flags);
+
+  return area;
+}
+
+/* Maps an area received from another process, taking ownership of fd. The
+ * size is checked against the real one since the sender is not trusted.
+ * Only the flags about the mapping apply. */
+ShmArea *
+shm_area_new_from_fd (gint fd, gsize size, ShmAreaFlags flags)
+{
+  ShmArea *area;
+  struct stat st;
+  gint errsv;
+
+  if (size == 0 || fstat (fd, &st) == -1)
+    goto failed;
+
+  if (!S_ISREG (st.st_mode) || (guint64) st.st_size < size) {
+    errno = EINVAL;
+    goto failed;
+  }
+
+#ifdef F_GET_SEALS
+  {
+    gint seals = fcntl (fd, F_GET_SEALS);
+    /* an area that can still shrink could make us SIGBUS at will. With
+     * memfd_create() around, the sender has no reason to send an area that
+     * can't be sealed, such as a file of /dev/shm. */
+#ifdef HAVE_MEMFD_CREATE
+    if (seals == -1 || !(seals & F_SEAL_SHRINK)) {
+#else
+    if (seals != -1 && !(seals & F_SEAL_SHRINK)) {
+#endif
+      errno = EPERM;
+      goto failed;
+    }
+  }
+#endif
+
+  area = shm_area_new_internal (fd, size, flags & ~SHM_AREA_HUGE_PAGES);
+  if (!area)
+    goto failed;
+
+  return area;
+
+failed:
+  errsv = errno;
+  close (fd);
+  errno = errsv;
+  return NULL;
+}
+
+ShmArea *
+shm_area_ref (ShmArea *area)
+{
+  g_atomic_int_inc (&area->refcount);
+  return area;
+}
+
+void
+shm_area_unref (ShmArea *area)
+{
+  if (!g_atomic_int_dec_and_test (&area->refcount))
+    return;
+
+  /* blocks hold a reference on their area, so none can be left here */
+  g_assert (area->blocks == NULL);
+
+  munmap (area->data, area->map_size);
+  close (area->fd);
+  g_mutex_clear (&area->lock);
+  g_slice_free (ShmArea, area);
+}
+
+gint
+shm_area_get_fd (ShmArea *area)
+{
+  return area->fd;
+}
+
+guint8 *
+shm_area_get_data (ShmArea *area)
+{
+  return area->data;
+}
+
+gsize
+shm_area_get_size (ShmArea *area)
+{
+  return area->size;
+}
+
+/* Also tells whether an area asked for with SHM_AREA_HUGE_PAGES got them */
+ShmAreaFlags
+shm_area_get_flags (ShmArea *area)
+{
+  return area->flags;
+}
+
+/* Returns how many bytes are currently allocated in blocks */
+gsize
+shm_area_get_used (ShmArea *area)
+{
+  gsize used;
+
+  g_mutex_lock (&area->lock);
+  used = area->used;
+  g_mutex_unlock (&area->lock);
+
+  return used;
+}
+
+gboolean
+shm_area_contains (ShmArea *area, gconstpointer data, gsize size)
+{
+  const guint8 *ptr = data;
+
+  return ptr >= area->data && size <= area->size
+      && (gsize) (ptr - area->data) <= area->size - size;
+}
+
+void
+shm_area_set_release_func (ShmArea *area,
+                           ShmAreaReleaseFunc func,
+                           gpointer user_data)
+{
+  g_mutex_lock (&area->lock);
+  area->release_func = func;
+  area->release_data = user_data;
+  g_mutex_unlock (&area->lock);
+}
+
+/* Returns a new block of at least size bytes with a refcount of 1, or NULL
+ * if there is no room left in the area */
+ShmBlock *
+shm_area_alloc_block (ShmArea *area, gsize size)
+{
+  ShmBlock *block = NULL;
+  GList *elem;
+  gsize offset = 0;
+
+  if (size == 0)
+    size = 1;
+  size = (size + SHM_AREA_ALIGNMENT - 1) & ~(gsize) (SHM_AREA_ALIGNMENT - 1);
+  if (size > area->size)
+    return NULL;
+
+  g_mutex_lock (&area->lock);
+
+  for (elem = area->blocks; elem; elem = elem->next) {
+    ShmBlock *next = elem->data;
+
+    if (next->offset - offset >= size)
+      break;
+    offset = next->offset + next->size;
+  }
+
+  if (area->size - offset >= size) {
+    block = g_slice_new (ShmBlock);
+    block->area = shm_area_ref (area);
+    block->offset = offset;
+    block->size = size;
+    block->refcount = 1;
+
+    if (elem)
+      area->blocks = g_list_insert_before (area->blocks, elem, block);
+    else
+      area->blocks = g_list_append (area->blocks, block);
+    area->used += size;
+  }
+
+  g_mutex_unlock (&area->lock);
+
+  return block;
+}
+
+/* Returns a new reference to the block containing offset, or NULL */
+ShmBlock *
+shm_area_find_block (ShmArea *area, gsize offset)
+{
+  ShmBlock *block = NULL;
+  GList *elem;
+
+  g_mutex_lock (&area->lock);
+  for (elem = area->blocks; elem; elem = elem->next) {
+    ShmBlock *candidate = elem->data;
+
+    if (candidate->offset > offset)
+      break;
+    if (offset < candidate->offset + candidate->size) {
+      block = candidate;
+      block->refcount++;
+      break;
+    }
+  }
+  g_mutex_unlock (&area->lock);
+
+  return block;
+}
+
+ShmBlock *
+shm_block_ref (ShmBlock *block)
+{
+  g_mutex_lock (&block->area->lock);
+  block->refcount++;
+  g_mutex_unlock (&block->area->lock);
+
+  return block;
+}
+
+void
+shm_block_unref (ShmBlock *block)
+{
+  ShmArea *area = block->area;
+  ShmAreaReleaseFunc release_func;
+  gpointer release_data;
+
+  g_mutex_lock (&area->lock);
+  if (--block->refcount > 0) {
+    g_mutex_unlock (&area->lock);
+    return;
+  }
+  area->blocks = g_list_remove (area->blocks, block);
+  area->used -= block->size;
+  release_func = area->release_func;
+  release_data = area->release_data;
+  g_mutex_unlock (&area->lock);
+
+  g_slice_free (ShmBlock, block);
+
+  if (release_func)
+    release_func (area, release_data);
+  shm_area_unref (area);
+}
+
+gsize
+shm_block_get_offset (ShmBlock *block)
+{
+  return block->offset;
+}
+
+gsize
+shm_block_get_size (ShmBlock *block)
+{
+  return block->size;
+}
+
+guint8 *
+shm_block_get_data (ShmBlock *block)
+{
+  return block->area->data + block->offset;
+}
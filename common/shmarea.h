@@ -0,0 +1,73 @@
+/*
+ * Copyright (C) 2012 Igalia S.L.
+*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __SHM_AREA_H__
+#define __SHM_AREA_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _ShmArea ShmArea;
+typedef struct _ShmBlock ShmBlock;
+
+/* SHM_AREA_HUGE_PAGES: back the area with explicit huge pages (hugetlbfs),
+ * falling back to normal ones if there are not enough reserved.
+ * SHM_AREA_TRANSPARENT_HUGE_PAGES: ask for transparent huge pages, which
+ * shmem only uses if /sys/kernel/mm/transparent_hugepage/shmem_enabled
+ * allows it.
+ * SHM_AREA_PREFAULT: fault the whole mapping in right away rather than page
+ * by page as it is first written or read. */
+typedef enum {
+  SHM_AREA_HUGE_PAGES = (1 << 0),
+  SHM_AREA_TRANSPARENT_HUGE_PAGES = (1 << 1),
+  SHM_AREA_PREFAULT = (1 << 2)
+} ShmAreaFlags;
+
+/* Called without any lock held each time a block goes back to the free
+ * space of an area */
+typedef void (*ShmAreaReleaseFunc) (ShmArea *area, gpointer user_data);
+
+ShmArea *shm_area_new (gsize size, ShmAreaFlags flags);
+ShmArea *shm_area_new_from_fd (gint fd, gsize size, ShmAreaFlags flags);
+ShmArea *shm_area_ref (ShmArea *area);
+void shm_area_unref (ShmArea *area);
+
+gint shm_area_get_fd (ShmArea *area);
+guint8 *shm_area_get_data (ShmArea *area);
+gsize shm_area_get_size (ShmArea *area);
+ShmAreaFlags shm_area_get_flags (ShmArea *area);
+gsize shm_area_get_used (ShmArea *area);
+gboolean shm_area_contains (ShmArea *area, gconstpointer data, gsize size);
+void shm_area_set_release_func (ShmArea *area,
+                                ShmAreaReleaseFunc func,
+                                gpointer user_data);
+
+ShmBlock *shm_area_alloc_block (ShmArea *area, gsize size);
+ShmBlock *shm_area_find_block (ShmArea *area, gsize offset);
+
+ShmBlock *shm_block_ref (ShmBlock *block);
+void shm_block_unref (ShmBlock *block);
+gsize shm_block_get_offset (ShmBlock *block);
+gsize shm_block_get_size (ShmBlock *block);
+guint8 *shm_block_get_data (ShmBlock *block);
+
+G_END_DECLS
+
+#endif /* __SHM_AREA_H__ */
@@ -23,13 +23,17 @@
  * DOCME
  */
 
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
 #include <gst/gst.h>
-#include <gio/gio.h>
-#include <glib/gstdio.h>
-
-#include <sys/mman.h>
+#include <glib-unix.h>
 
 #include "gstsandboxeddecodebin.h"
+#include "gstsandboxsrc.h"
+#include "gstsandboxinputsink.h"
+#include "gstsandboxzygote.h"
+#include "sandboxipc.h"
 #include "../config.h"
 
 GST_DEBUG_CATEGORY_STATIC (gst_debug_sandboxed_decodebin);
@@ -42,32 +46,184 @@ G_DEFINE_TYPE (GstSandboxedDecodebin, gst_sandboxed_decodebin, GST_TYPE_BIN);
 
 #define DECODER_PATH "gst-decoder"
 
-#define AUDIO_SOCKET 0
-#define VIDEO_SOCKET 1
-#define LAST_SOCKET 1
+/* how long we give a decoder to get ready, in ms */
+#define DECODER_READY_TIMEOUT 10000
+
+/* how long we give a decoder to answer a query, in us */
+#define QUERY_TIMEOUT G_USEC_PER_SEC
+
+#define DEFAULT_ZYGOTE FALSE
+#define DEFAULT_ZYGOTE_POOL_SIZE 0
+#define DEFAULT_ZYGOTE_PREWARM 1
+#define DEFAULT_ZYGOTE_SESSIONS 1
+#define DEFAULT_MAX_SHM_SIZE 0
+#define DEFAULT_AUDIO_BATCH_DURATION 0
+#define DEFAULT_MAX_BUFFERS_IN_FLIGHT 0
+#define DEFAULT_MAX_BYTES_IN_FLIGHT 0
+#define DEFAULT_MAX_THREADS 0
+#define DEFAULT_CPU_SET NULL
+#define DEFAULT_NICE 0
+#define DEFAULT_SCHEDULING SANDBOX_SCHEDULING_NORMAL
+#define DEFAULT_HUGE_PAGES SANDBOX_HUGE_PAGES_NONE
+#define DEFAULT_PREFAULT_SHM FALSE
+#define DEFAULT_SHM_BUDGET 0
+#define DEFAULT_SPARE_DECODER FALSE
+#define DEFAULT_MAX_RECOVERIES 3
+#define DEFAULT_DEMUX_ONLY FALSE
+#define DEFAULT_STATS_INTERVAL 0
+#define DEFAULT_SANDBOX SANDBOX_BACKEND_SETUID
+
+enum {
+  PROP_0,
+  PROP_ZYGOTE,
+  PROP_ZYGOTE_POOL_SIZE,
+  PROP_ZYGOTE_PREWARM,
+  PROP_ZYGOTE_SESSIONS,
+  PROP_MAX_SHM_SIZE,
+  PROP_AUDIO_BATCH_DURATION,
+  PROP_STATS,
+  PROP_STATS_INTERVAL,
+  PROP_SANDBOX,
+  PROP_MAX_BUFFERS_IN_FLIGHT,
+  PROP_MAX_BYTES_IN_FLIGHT,
+  PROP_MAX_THREADS,
+  PROP_CPU_SET,
+  PROP_NICE,
+  PROP_SCHEDULING,
+  PROP_HUGE_PAGES,
+  PROP_PREFAULT_SHM,
+  PROP_SHM_BUDGET,
+  PROP_SPARE_DECODER,
+  PROP_MAX_RECOVERIES,
+  PROP_DEMUX_ONLY
+};
+
+static GstStaticPadTemplate sink_template = GST_STATIC_PAD_TEMPLATE ("sink",
+    GST_PAD_SINK,
+    GST_PAD_ALWAYS,
+    GST_STATIC_CAPS_ANY);
+
+/* raw, unless demux-only */
+static GstStaticPadTemplate video_template = GST_STATIC_PAD_TEMPLATE ("video_%d",
+    GST_PAD_SRC,
+    GST_PAD_SOMETIMES,
+    GST_STATIC_CAPS_ANY);
+
+static GstStaticPadTemplate audio_template = GST_STATIC_PAD_TEMPLATE ("audio_%d",
+    GST_PAD_SRC,
+    GST_PAD_SOMETIMES,
+    GST_STATIC_CAPS_ANY);
+
+/* A decoded stream the decoder announced */
+typedef struct {
+  GstElement *src;
+  GstPad *pad;
+  /* the source dups it when it starts */
+  gint fd;
+  /* the index-th stream of its kind, which is how the streams of a spare
+   * decoder taking over are matched with ours */
+  SandboxStreamKind kind;
+  guint index;
+  gboolean resumed;
+  /* what the decoder calls it in queries */
+  guint32 id;
+  /* answers of the decoder that don't change until the next segment,
+   * GST_FORMAT_UNDEFINED when we have none */
+  GstFormat duration_format;
+  gint64 duration;
+  GstFormat seeking_format;
+  gboolean seekable;
+  gint64 seek_start;
+  gint64 seek_end;
+} DecodedStream;
+
+/* A query forwarded to the decoder, waiting for its answer */
+typedef struct {
+  guint32 id;
+  GstQuery *query;
+  gboolean done;
+  gboolean answered;
+} PendingQuery;
 
 struct _GstSandboxedDecodebinPrivate {
-  GstElement *fdsink;
-  GstElement *audiosrc;
-  GstElement *audiodepay;
-  GstElement *videosrc;
-  GstElement *videodepay;
+  GstElement *typefind;
+  GstElement *inputsink;
 
   GstPad *sink_pad;
-  GstPad *video_src_pad;
-  GstPad *audio_src_pad;
-
-  int subprocess_stdin;
-  gchar *shm_video_socket_path;
-  gchar *shm_audio_socket_path;
-  gchar *audio_shm_area_name;
-  gchar *video_shm_area_name;
-
-  GFileMonitor *audio_monitor;
-  GFileMonitor *video_monitor;
-  GCancellable *monitor_cancellable;
-  gboolean subprocess_ready;
-  gint uninitialised_socket_paths;
+
+  /* our end of the input channel, served by inputsink */
+  gint input_sink_fd;
+  /* the decoder's end of the input channel, until the decoder is ready */
+  gint input_fd;
+
+  SandboxBackend sandbox;
+  gboolean zygote;
+  guint zygote_pool_size;
+  guint zygote_prewarm;
+  guint zygote_sessions;
+  guint64 max_shm_size;
+  guint64 audio_batch_duration;
+  guint max_buffers_in_flight;
+  guint64 max_bytes_in_flight;
+  guint max_threads;
+  gchar *cpu_set;
+  gint nice;
+  SandboxScheduling scheduling;
+  SandboxHugePages huge_pages;
+  gboolean prefault_shm;
+  /* what we took from the budget of the process for our decoder */
+  guint64 shm_grant;
+  gboolean spare_decoder;
+  guint max_recoveries;
+  gboolean demux_only;
+
+  /* posts the stats on the bus every stats_interval ms */
+  guint stats_interval;
+  GstClockID stats_id;
+
+  /* our side of the startup profile, as g_get_monotonic_time() in ns */
+  GstClockTime start_time;
+  GstClockTime spawned_time;
+  GstClockTime ready_time;
+  GstClockTime typefound_time;
+
+  /* the decoder tells us on its control channel when it is ready, then
+   * hands over a stream channel for every stream it decodes */
+  SandboxChannel *control;
+
+  /* a decoder waiting for its preamble, to take over if ours crashes, and
+   * both ends of its input channel */
+  SandboxChannel *spare;
+  gint spare_input_fd;
+  gint spare_input_sink_fd;
+
+  /* waits for the decoder, GstPoll so that we can interrupt it */
+  GThread *decoder_thread;
+  GstPoll *poll;
+
+  /* only touched by the decoder thread until it is joined */
+  guint n_video;
+  guint n_audio;
+  /* a spare decoder took over and is announcing its streams, which resume
+   * from resume_position */
+  gboolean recovering;
+  guint recoveries;
+  GstClockTime resume_position;
+  gboolean resume_seek_sent;
+
+  /* protects the fields below */
+  GMutex lock;
+  GList *streams;
+  gboolean streams_complete;
+  /* we returned ASYNC from READY_TO_PAUSED, waiting for the streams */
+  gboolean async_pending;
+  /* what we sent the decoder before its input, again for a spare one */
+  gchar *plugins;
+  SandboxPreamble settings;
+  /* PendingQuery, answered from the decoder thread */
+  GList *queries;
+  guint32 query_id;
+  GCond query_cond;
 };
 
 static GstStateChangeReturn
@@ -76,107 +232,1618 @@ gst_sandboxed_decodebin_change_state (GstElement *element,
 
 static GstBinClass *parent_class;
 
+/* The shared memory the decoders of all the instances of the process may
+ * use together, 0 for no limit. Each decoder is granted its max-shm-size
+ * out of it when it starts, or DEFAULT_SHM_GRANT if it has none, and gives
+ * it back when it stops. */
+G_LOCK_DEFINE_STATIC (shm_budget);
+static guint64 shm_budget = DEFAULT_SHM_BUDGET;
+static guint64 shm_granted = 0;
+#define DEFAULT_SHM_GRANT (128 * 1024 * 1024)
+
 /* internal helpers */
 
-/* Returns the fd to write in the subprocess stdin or -1 on error */
-static gint
-start_decoder (gchar *audio_socket_path,
-               gchar *video_socket_path,
-               GError **error)
+static void
+return_shm_grant (GstSandboxedDecodebin *self)
+{
+  G_LOCK (shm_budget);
+  shm_granted -= self->priv->shm_grant;
+  self->priv->shm_grant = 0;
+  G_UNLOCK (shm_budget);
+}
+
+/* Returns the max_shm_size of our decoder, which is 0 for no limit, or
+ * FALSE if the budget of the process is exhausted */
+static gboolean
+grant_shm (GstSandboxedDecodebin *self, guint64 *max_shm_size)
+{
+  GstSandboxedDecodebinPrivate *priv = self->priv;
+  guint64 grant = priv->max_shm_size;
+  gboolean ret = TRUE;
+
+  /* in case typefind ran again */
+  return_shm_grant (self);
+
+  G_LOCK (shm_budget);
+  if (shm_budget > 0) {
+    guint64 left = shm_budget > shm_granted ? shm_budget - shm_granted : 0;
+
+    grant = MIN (grant ? grant : DEFAULT_SHM_GRANT, left);
+    shm_granted += grant;
+    priv->shm_grant = grant;
+    ret = grant > 0;
+  }
+  G_UNLOCK (shm_budget);
+
+  *max_shm_size = grant;
+
+  return ret;
+}
+
+
+/* the decoder uses the same clock in its startup profile */
+static GstClockTime
+get_monotonic_time (void)
 {
-  gint subprocess_stdin;
+  return g_get_monotonic_time () * GST_USECOND;
+}
+
+GType
+gst_sandbox_backend_get_type (void)
+{
+  static GType type = 0;
+  static const GEnumValue values[] = {
+    { SANDBOX_BACKEND_SETUID,
+      "Chrooted by the setuid sandboxme helper", "setuid" },
+    { SANDBOX_BACKEND_NAMESPACES,
+      "Unprivileged namespaces and a seccomp filter", "namespaces" },
+    { 0, NULL, NULL }
+  };
+
+  if (g_once_init_enter (&type))
+    g_once_init_leave (&type, g_enum_register_static ("GstSandboxBackend",
+                                                      values));
+
+  return type;
+}
+
+GType
+gst_sandbox_scheduling_get_type (void)
+{
+  static GType type = 0;
+  static const GEnumValue values[] = {
+    { SANDBOX_SCHEDULING_NORMAL, "Default policy (SCHED_OTHER)", "normal" },
+    { SANDBOX_SCHEDULING_BATCH,
+      "Throughput over latency (SCHED_BATCH)", "batch" },
+    { SANDBOX_SCHEDULING_IDLE,
+      "Only when nothing else runs (SCHED_IDLE)", "idle" },
+    { 0, NULL, NULL }
+  };
+
+  if (g_once_init_enter (&type))
+    g_once_init_leave (&type, g_enum_register_static ("GstSandboxScheduling",
+                                                      values));
+
+  return type;
+}
+
+GType
+gst_sandbox_huge_pages_get_type (void)
+{
+  static GType type = 0;
+  static const GEnumValue values[] = {
+    { SANDBOX_HUGE_PAGES_NONE, "Normal pages", "none" },
+    { SANDBOX_HUGE_PAGES_TRANSPARENT,
+      "Transparent huge pages, if shmem_enabled allows", "transparent" },
+    { SANDBOX_HUGE_PAGES_EXPLICIT,
+      "Reserved huge pages, normal ones when they run out", "explicit" },
+    { 0, NULL, NULL }
+  };
+
+  if (g_once_init_enter (&type))
+    g_once_init_leave (&type, g_enum_register_static ("GstSandboxHugePages",
+                                                      values));
+
+  return type;
+}
+
+typedef struct {
+  gint control_fd;
+  gint input_fd;
+} DecoderFds;
+
+static void
+decoder_child_setup (gpointer user_data)
+{
+  DecoderFds *fds = user_data;
+
+  dup2 (fds->input_fd, STDIN_FILENO);
+  sandbox_ipc_setup_control_fd (GINT_TO_POINTER (fds->control_fd));
+}
+
+/* Spawns a decoder in the sandbox, with its control channel as
+ * SANDBOX_IPC_CONTROL_FD and input_fd as stdin. With the namespaces
+ * backend, the decoder is started directly and confines itself. Returns the
+ * control channel, or NULL on error. */
+static SandboxChannel *
+spawn_decoder (GstSandboxedDecodebin *self, gint input_fd)
+{
+  GError *error = NULL;
+  DecoderFds fds;
+  gint control[2];
+  gboolean spawned;
   char **env;
-  char *args[] = {
+  char *setuid_args[] = {
     SANDBOXME_PATH,
     "-P",
     "-u1",
     "--",
     DECODER_PATH,
-    video_socket_path,
-    audio_socket_path,
+    "--control-fd=" G_STRINGIFY (SANDBOX_IPC_CONTROL_FD),
     NULL
   };
+  char *namespaces_args[] = {
+    DECODER_PATH,
+    "--sandbox=namespaces",
+    "--control-fd=" G_STRINGIFY (SANDBOX_IPC_CONTROL_FD),
+    NULL
+  };
+  char **args = self->priv->sandbox == SANDBOX_BACKEND_NAMESPACES ?
+      namespaces_args : setuid_args;
 
-  env = g_get_environ ();
-  if (!g_spawn_async_with_pipes (NULL, /* working_directory */
-                                args,
-                                env,
-                                0, /* flags */
-                                NULL, /* child_setup */
-                                NULL, /* user_data */
-                                NULL, /* child pid */
-                                &subprocess_stdin,
-                                NULL, /* standard_output */
-                                NULL, /* standard_error */
-                                error)) {
-    subprocess_stdin = -1;
+  if (!sandbox_ipc_socketpair (control)) {
+    GST_WARNING_OBJECT (self, "Could not create control channel: %m");
+    return NULL;
   }
+
+  fds.control_fd = control[1];
+  fds.input_fd = input_fd;
+
+  env = g_get_environ ();
+  spawned = g_spawn_async (NULL, /* working_directory */
+                           args,
+                           env,
+                           /* gst-decoder is looked up like sandboxme does */
+                           G_SPAWN_SEARCH_PATH,
+                           decoder_child_setup,
+                           &fds,
+                           NULL, /* child pid */
+                           &error);
   g_strfreev (env);
+  close (control[1]);
+
+  if (!spawned) {
+    GST_WARNING_OBJECT (self, "Could not spawn subprocess: %s",
+                        error->message);
+    g_error_free (error);
+    close (control[0]);
+    return NULL;
+  }
+
+  return sandbox_channel_new (control[0]);
+}
+
+/* Asks the zygote for a decoder, which only costs a fork as opposed to
+ * spawn_decoder(). Returns the control channel, or NULL on error. */
+static SandboxChannel *
+request_decoder_from_zygote (GstSandboxedDecodebin *self, gint input_fd)
+{
+  GstSandboxedDecodebinPrivate *priv = self->priv;
+  GError *error = NULL;
+  gint control[2];
+
+  if (!sandbox_ipc_socketpair (control)) {
+    GST_WARNING_OBJECT (self, "Could not create control channel: %m");
+    return NULL;
+  }
+
+  if (!gst_sandbox_zygote_spawn_decoder (priv->sandbox,
+                                         priv->zygote_pool_size,
+                                         priv->zygote_prewarm,
+                                         priv->zygote_sessions,
+                                         control[1], input_fd, &error)) {
+    GST_WARNING_OBJECT (self, "Could not get a decoder from the zygote: %s",
+                        error->message);
+    g_error_free (error);
+    close (control[0]);
+    close (control[1]);
+    return NULL;
+  }
+  close (control[1]);
+
+  return sandbox_channel_new (control[0]);
+}
+
+typedef enum {
+  DECODER_READY,
+  DECODER_GONE,
+  DECODER_FAILED
+} DecoderStatus;
+
+/* Waits up to timeout for a message on the control channel. Timing out and
+ * being flushed count as errors. */
+static SandboxChannelResult
+receive_control_message (GstSandboxedDecodebin *self,
+                         SandboxChannel *channel,
+                         GstClockTime timeout,
+                         SandboxMessage *message)
+{
+  GstSandboxedDecodebinPrivate *priv = self->priv;
+  GstPollFD pollfd = GST_POLL_FD_INIT;
+  gint ret;
+
+  pollfd.fd = sandbox_channel_get_fd (channel);
+  gst_poll_add_fd (priv->poll, &pollfd);
+  gst_poll_fd_ctl_read (priv->poll, &pollfd, TRUE);
+  do {
+    ret = gst_poll_wait (priv->poll, timeout);
+  } while (ret == -1 && errno == EINTR);
+  gst_poll_remove_fd (priv->poll, &pollfd);
+
+  if (ret == 0) {
+    GST_WARNING_OBJECT (self, "Decoder did not answer in time");
+    return SANDBOX_CHANNEL_ERROR;
+  }
+  if (ret < 0) {
+    /* we are shutting down */
+    return SANDBOX_CHANNEL_ERROR;
+  }
+
+  return sandbox_channel_receive (channel, message);
+}
+
+/* Waits for the decoder to tell us it is ready on the control channel. It
+ * closes the channel instead when the zygote refused it. */
+static DecoderStatus
+wait_for_decoder (GstSandboxedDecodebin *self, SandboxChannel *channel)
+{
+  SandboxMessage *message;
+  DecoderStatus status = DECODER_FAILED;
+
+  message = g_new (SandboxMessage, 1);
+  switch (receive_control_message (self, channel,
+                                   DECODER_READY_TIMEOUT * GST_MSECOND,
+                                   message)) {
+  case SANDBOX_CHANNEL_OK:
+    break;
+  case SANDBOX_CHANNEL_CLOSED:
+    GST_DEBUG_OBJECT (self, "Decoder went away before getting ready");
+    status = DECODER_GONE;
+    goto done;
+  default:
+    goto done;
+  }
+
+  if (message->type != SANDBOX_MESSAGE_READY) {
+    GST_WARNING_OBJECT (self, "Unexpected message %u from the decoder",
+                        message->type);
+    goto done;
+  }
+
+  status = DECODER_READY;
+  self->priv->ready_time = get_monotonic_time ();
 
-  return subprocess_stdin;
+done:
+  sandbox_message_close_fds (message);
+  g_free (message);
+
+  return status;
+}
+
+/* Waits for the decoder of control to get ready, falling back to spawning
+ * one ourselves on input_fd if the zygote refused it. Returns the control
+ * channel of the ready decoder, or NULL. */
+static SandboxChannel *
+get_ready_decoder (GstSandboxedDecodebin *self,
+                   SandboxChannel *control,
+                   gint input_fd,
+                   GstClockTime *spawned_time)
+{
+  DecoderStatus status;
+
+  status = wait_for_decoder (self, control);
+  if (status == DECODER_GONE && self->priv->zygote) {
+    GST_DEBUG_OBJECT (self, "Zygote refused, spawning a decoder");
+    sandbox_channel_unref (control);
+    control = spawn_decoder (self, input_fd);
+    if (spawned_time)
+      *spawned_time = get_monotonic_time ();
+    if (!control)
+      return NULL;
+    status = wait_for_decoder (self, control);
+  }
+
+  if (status != DECODER_READY) {
+    sandbox_channel_unref (control);
+    return NULL;
+  }
+
+  return control;
 }
 
+/* Posts the startup-profile message: when we and the decoder went through
+ * each phase of the startup, in ns since we started the decoder */
 static void
-subprocess_ready (GstSandboxedDecodebin *self)
+post_startup_profile (GstSandboxedDecodebin *self, SandboxMessage *message)
 {
-  self->priv->subprocess_ready = TRUE;
-  GST_DEBUG_OBJECT (self, "subprocess looks ready");
+  GstSandboxedDecodebinPrivate *priv = self->priv;
+  const SandboxStartupProfileMessage *profile;
+  GstStructure *structure;
+  guint i;
+
+  profile = sandbox_message_get_payload (message, sizeof (*profile));
+  if (!profile) {
+    GST_WARNING_OBJECT (self, "Invalid startup profile from the decoder");
+    return;
+  }
+
+  structure = gst_structure_new ("startup-profile",
+      "decoder-spawned", G_TYPE_UINT64, priv->spawned_time - priv->start_time,
+      "decoder-ready", G_TYPE_UINT64, priv->ready_time - priv->start_time,
+      "typefound", G_TYPE_UINT64, priv->typefound_time - priv->start_time,
+      NULL);
+  for (i = 0; i < SANDBOX_N_PHASES; i++) {
+    /* the decoder skipped it, or its clock is off */
+    if (profile->times[i] < priv->start_time)
+      continue;
+    gst_structure_set (structure, sandbox_startup_phase_get_name (i),
+                       G_TYPE_UINT64, profile->times[i] - priv->start_time,
+                       NULL);
+  }
+
+  GST_DEBUG_OBJECT (self, "Startup profile: %" GST_PTR_FORMAT, structure);
+  gst_element_post_message (GST_ELEMENT (self),
+      gst_message_new_element (GST_OBJECT (self), structure));
 }
 
+static void
+do_async_start (GstSandboxedDecodebin *self)
+{
+  GstMessage *message;
+
+  message = gst_message_new_async_start (GST_OBJECT_CAST (self), FALSE);
+  parent_class->handle_message (GST_BIN_CAST (self), message);
+}
 
 static void
-on_file_changed (GFileMonitor     *monitor,
-                 GFile            *file,
-                 GFile            *other_file,
-                 GFileMonitorEvent event_type,
-                 GstSandboxedDecodebin *self)
+do_async_done (GstSandboxedDecodebin *self)
 {
-  if (event_type == G_FILE_MONITOR_EVENT_CREATED
-      && g_atomic_int_dec_and_test (&self->priv->uninitialised_socket_paths)) {
-    g_cancellable_cancel (self->priv->monitor_cancellable);
-    subprocess_ready (self);
+  GstMessage *message;
+
+  message = gst_message_new_async_done (GST_OBJECT_CAST (self));
+  parent_class->handle_message (GST_BIN_CAST (self), message);
+}
+
+/* The stream exposed on pad, or whose source pad is. Call with the lock. */
+static DecodedStream *
+find_stream (GstSandboxedDecodebin *self, GstPad *pad)
+{
+  GList *elem;
+
+  for (elem = self->priv->streams; elem; elem = elem->next) {
+    DecodedStream *stream = elem->data;
+
+    if (stream->pad == pad
+        || GST_OBJECT_PARENT (pad) == GST_OBJECT (stream->src))
+      return stream;
   }
+
+  return NULL;
 }
 
-/* FIXME: reference the monitors in self->priv so that we can clean them up later */
+/* A new segment, after a seek or once a spare decoder took over, may come
+ * with another duration */
+static gboolean
+on_stream_event (GstPad *pad, GstEvent *event, GstSandboxedDecodebin *self)
+{
+  DecodedStream *stream;
+  gboolean update;
+
+  if (GST_EVENT_TYPE (event) != GST_EVENT_NEWSEGMENT)
+    return TRUE;
+  gst_event_parse_new_segment (event, &update, NULL, NULL, NULL, NULL, NULL);
+  if (update)
+    return TRUE;
+
+  g_mutex_lock (&self->priv->lock);
+  stream = find_stream (self, pad);
+  if (stream) {
+    stream->duration_format = GST_FORMAT_UNDEFINED;
+    stream->seeking_format = GST_FORMAT_UNDEFINED;
+  }
+  g_mutex_unlock (&self->priv->lock);
+
+  return TRUE;
+}
+
+/* Has the decoder run the query upstream of the sink of the stream, and
+ * waits for the answer for QUERY_TIMEOUT at most */
+static gboolean
+forward_query (GstSandboxedDecodebin *self, guint32 stream_id, GstQuery *query)
+{
+  GstSandboxedDecodebinPrivate *priv = self->priv;
+  SandboxQueryMessage header;
+  SandboxChannel *control;
+  PendingQuery pending;
+  gint64 deadline;
+  gboolean sent = FALSE;
+
+  g_mutex_lock (&priv->lock);
+  control = priv->control ? sandbox_channel_ref (priv->control) : NULL;
+  pending.id = ++priv->query_id;
+  pending.query = query;
+  pending.done = FALSE;
+  pending.answered = FALSE;
+  priv->queries = g_list_prepend (priv->queries, &pending);
+  g_mutex_unlock (&priv->lock);
+
+  header.id = pending.id;
+  header.stream = stream_id;
+  header.answered = FALSE;
+  if (control) {
+    sent = sandbox_channel_send_query (control, SANDBOX_MESSAGE_QUERY, query,
+                                       &header);
+    sandbox_channel_unref (control);
+  }
+
+  deadline = g_get_monotonic_time () + QUERY_TIMEOUT;
+  g_mutex_lock (&priv->lock);
+  while (sent && !pending.done)
+    if (!g_cond_wait_until (&priv->query_cond, &priv->lock, deadline))
+      break;
+  priv->queries = g_list_remove (priv->queries, &pending);
+  g_mutex_unlock (&priv->lock);
+
+  GST_LOG_OBJECT (self, "Decoder %s the %s query",
+                  pending.answered ? "answered" : "did not answer",
+                  GST_QUERY_TYPE_NAME (query));
+
+  return pending.answered;
+}
+
+/* Fills in the query waiting for the QUERY_RESULT the decoder sent */
+static void
+complete_query (GstSandboxedDecodebin *self, SandboxMessage *message)
+{
+  GstSandboxedDecodebinPrivate *priv = self->priv;
+  const SandboxQueryMessage *header;
+  GList *elem;
+
+  header = sandbox_message_get_query_header (message);
+  if (!header) {
+    GST_WARNING_OBJECT (self, "Invalid query result");
+    return;
+  }
+
+  /* it may have timed out */
+  g_mutex_lock (&priv->lock);
+  for (elem = priv->queries; elem; elem = elem->next) {
+    PendingQuery *pending = elem->data;
+
+    if (pending->id == header->id && !pending->done) {
+      pending->answered = sandbox_message_parse_query_result (message,
+                                                              pending->query);
+      pending->done = TRUE;
+      g_cond_broadcast (&priv->query_cond);
+      break;
+    }
+  }
+  g_mutex_unlock (&priv->lock);
+}
+
+/* The decoder went away, the queries it didn't answer won't be */
+static void
+fail_queries (GstSandboxedDecodebin *self)
+{
+  GstSandboxedDecodebinPrivate *priv = self->priv;
+  GList *elem;
+
+  g_mutex_lock (&priv->lock);
+  for (elem = priv->queries; elem; elem = elem->next)
+    ((PendingQuery *) elem->data)->done = TRUE;
+  g_cond_broadcast (&priv->query_cond);
+  g_mutex_unlock (&priv->lock);
+}
+
+/* Answers the query from what the decoder told us about the stream before,
+ * if it doesn't change. Call with the lock. */
+static gboolean
+answer_from_cache (DecodedStream *stream, GstQuery *query)
+{
+  GstFormat format;
+
+  switch (GST_QUERY_TYPE (query)) {
+  case GST_QUERY_DURATION:
+    gst_query_parse_duration (query, &format, NULL);
+    if (format == GST_FORMAT_UNDEFINED || format != stream->duration_format)
+      return FALSE;
+    gst_query_set_duration (query, format, stream->duration);
+    return TRUE;
+  case GST_QUERY_SEEKING:
+    gst_query_parse_seeking (query, &format, NULL, NULL, NULL);
+    if (format == GST_FORMAT_UNDEFINED || format != stream->seeking_format)
+      return FALSE;
+    gst_query_set_seeking (query, format, stream->seekable,
+                           stream->seek_start, stream->seek_end);
+    return TRUE;
+  default:
+    return FALSE;
+  }
+}
+
+/* Keeps the answer to a duration or seeking query. An unknown duration may
+ * not be for long, so it isn't. Call with the lock. */
+static void
+cache_answer (DecodedStream *stream, GstQuery *query)
+{
+  GstFormat format;
+  gint64 duration;
+
+  switch (GST_QUERY_TYPE (query)) {
+  case GST_QUERY_DURATION:
+    gst_query_parse_duration (query, &format, &duration);
+    if (duration >= 0) {
+      stream->duration_format = format;
+      stream->duration = duration;
+    }
+    break;
+  case GST_QUERY_SEEKING:
+    gst_query_parse_seeking (query, &stream->seeking_format,
+                             &stream->seekable, &stream->seek_start,
+                             &stream->seek_end);
+    break;
+  default:
+    break;
+  }
+}
+
+/* Queries on our source pads go to the decoder, where the demuxer and
+ * decoders can answer them, unless we know the answer already */
+static gboolean
+query_stream (GstSandboxedDecodebin *self, GstPad *pad, GstQuery *query)
+{
+  GstSandboxedDecodebinPrivate *priv = self->priv;
+  DecodedStream *stream;
+  guint32 id;
+
+  if (!sandbox_query_is_forwarded (query))
+    return FALSE;
+
+  g_mutex_lock (&priv->lock);
+  stream = find_stream (self, pad);
+  if (!stream) {
+    g_mutex_unlock (&priv->lock);
+    return FALSE;
+  }
+  if (answer_from_cache (stream, query)) {
+    g_mutex_unlock (&priv->lock);
+    GST_LOG_OBJECT (self, "Answered the %s query from the cache",
+                    GST_QUERY_TYPE_NAME (query));
+    return TRUE;
+  }
+  id = stream->id;
+  g_mutex_unlock (&priv->lock);
+
+  if (!forward_query (self, id, query))
+    return FALSE;
+
+  /* the stream may be gone, or be another decoder's by now */
+  g_mutex_lock (&priv->lock);
+  stream = find_stream (self, pad);
+  if (stream && stream->id == id)
+    cache_answer (stream, query);
+  g_mutex_unlock (&priv->lock);
+
+  return TRUE;
+}
+
+static gboolean
+gst_sandboxed_decodebin_src_query (GstPad *pad, GstQuery *query)
+{
+  GstObject *parent;
+  GstPad *target;
+  gboolean ret = FALSE;
+
+  parent = gst_pad_get_parent (pad);
+  if (!parent)
+    return FALSE;
+
+  /* what the source knows itself, otherwise */
+  if (!query_stream (GST_SANDBOXED_DECODEBIN (parent), pad, query)) {
+    target = gst_ghost_pad_get_target (GST_GHOST_PAD (pad));
+    if (target) {
+      ret = gst_pad_query (target, query);
+      gst_object_unref (target);
+    }
+  } else {
+    ret = TRUE;
+  }
+  gst_object_unref (parent);
+
+  return ret;
+}
+
+/* Hands a stream of the spare decoder that took over to the source of the
+ * same stream of the one that crashed */
 static void
-monitor_subprocess_creation (GstSandboxedDecodebin *self)
+resume_stream (GstSandboxedDecodebin *self,
+               SandboxStreamKind kind,
+               guint index,
+               guint32 id,
+               gint fd)
 {
-  GFile *audio_file, *video_file;
+  GstSandboxedDecodebinPrivate *priv = self->priv;
+  DecodedStream *stream = NULL;
+  GList *elem;
+
+  g_mutex_lock (&priv->lock);
+  for (elem = priv->streams; elem; elem = elem->next) {
+    DecodedStream *candidate = elem->data;
 
-  GST_DEBUG_OBJECT (self, "Putting monitors on %s and %s",
-                    self->priv->shm_audio_socket_path,
-                    self->priv->shm_video_socket_path);
+    if (candidate->kind == kind && candidate->index == index) {
+      stream = candidate;
+      break;
+    }
+  }
+  g_mutex_unlock (&priv->lock);
+
+  if (!stream || stream->resumed) {
+    GST_WARNING_OBJECT (self, "The new decoder has a stream the crashed one "
+                        "didn't have, ignoring it");
+    close (fd);
+    return;
+  }
+
+  GST_DEBUG_OBJECT (self, "Resuming stream %s", GST_PAD_NAME (stream->pad));
+  gst_sandbox_src_resume (GST_SANDBOX_SRC (stream->src), fd,
+                          priv->resume_position, !priv->resume_seek_sent);
+  priv->resume_seek_sent = TRUE;
+  close (stream->fd);
+  stream->fd = fd;
+  g_mutex_lock (&priv->lock);
+  stream->resumed = TRUE;
+  stream->id = id;
+  stream->duration_format = GST_FORMAT_UNDEFINED;
+  stream->seeking_format = GST_FORMAT_UNDEFINED;
+  g_mutex_unlock (&priv->lock);
+}
 
-  self->priv->monitor_cancellable = g_cancellable_new ();
+/* Exposes a stream the decoder announced, as a sometimes pad backed by a
+ * sandboxsrc reading from the stream channel that came with it */
+static void
+add_stream (GstSandboxedDecodebin *self, SandboxMessage *message)
+{
+  GstSandboxedDecodebinPrivate *priv = self->priv;
+  const SandboxStreamMessage *stream_message;
+  GstPadTemplate *templ;
+  DecodedStream *stream;
+  GstPad *srcpad;
+  gchar *name;
+  guint index;
+  gint fd;
+
+  stream_message = sandbox_message_get_payload (message,
+                                                sizeof (*stream_message));
+  fd = sandbox_message_steal_fd (message);
+  if (!stream_message || fd == -1) {
+    GST_WARNING_OBJECT (self, "Invalid stream announcement");
+    if (fd != -1)
+      close (fd);
+    return;
+  }
+
+  switch (stream_message->kind) {
+  case SANDBOX_STREAM_VIDEO:
+    index = priv->n_video++;
+    break;
+  case SANDBOX_STREAM_AUDIO:
+    index = priv->n_audio++;
+    break;
+  default:
+    GST_WARNING_OBJECT (self, "Unknown stream kind %u", stream_message->kind);
+    close (fd);
+    return;
+  }
+
+  if (priv->recovering) {
+    resume_stream (self, stream_message->kind, index, stream_message->id,
+                   fd);
+    return;
+  }
+
+  if (stream_message->kind == SANDBOX_STREAM_VIDEO) {
+    templ = gst_static_pad_template_get (&video_template);
+    name = g_strdup_printf ("video_%u", index);
+  } else {
+    templ = gst_static_pad_template_get (&audio_template);
+    name = g_strdup_printf ("audio_%u", index);
+  }
 
-  audio_file = g_file_new_for_path (self->priv->shm_audio_socket_path);
-  self->priv->audio_monitor =
-      g_file_monitor_file (audio_file, G_FILE_MONITOR_NONE,
-                           self->priv->monitor_cancellable, NULL);
+  GST_DEBUG_OBJECT (self, "Decoder added stream %s", name);
+
+  stream = g_slice_new (DecodedStream);
+  stream->fd = fd;
+  stream->kind = stream_message->kind;
+  stream->index = index;
+  stream->resumed = FALSE;
+  stream->id = stream_message->id;
+  stream->duration_format = GST_FORMAT_UNDEFINED;
+  stream->seeking_format = GST_FORMAT_UNDEFINED;
+  stream->src = g_object_new (GST_SANDBOX_SRC_TYPE, "fd", fd,
+                              "resumable", priv->spare_decoder, NULL);
+  gst_bin_add (GST_BIN (self), stream->src);
+
+  srcpad = gst_element_get_static_pad (stream->src, "src");
+  gst_pad_add_event_probe (srcpad, G_CALLBACK (on_stream_event), self);
+  stream->pad = gst_ghost_pad_new_from_template (name, srcpad, templ);
+  gst_pad_set_query_function (stream->pad, gst_sandboxed_decodebin_src_query);
+  gst_object_unref (srcpad);
+  gst_object_unref (templ);
+  g_free (name);
+
+  g_mutex_lock (&priv->lock);
+  priv->streams = g_list_append (priv->streams, stream);
+  g_mutex_unlock (&priv->lock);
+
+  /* expose the pad before any data flows, so that it can be linked */
+  gst_pad_set_active (stream->pad, TRUE);
+  gst_element_add_pad (GST_ELEMENT (self), stream->pad);
+  gst_element_sync_state_with_parent (stream->src);
+}
 
-  video_file = g_file_new_for_path (self->priv->shm_video_socket_path);
-  self->priv->video_monitor =
-      g_file_monitor_file (video_file, G_FILE_MONITOR_NONE,
-                           self->priv->monitor_cancellable, NULL);
-  g_signal_connect (self->priv->audio_monitor, "changed",
-                    G_CALLBACK (on_file_changed), self);
-  g_signal_connect (self->priv->video_monitor, "changed",
-                    G_CALLBACK (on_file_changed), self);
+static void
+remove_streams (GstSandboxedDecodebin *self)
+{
+  GstSandboxedDecodebinPrivate *priv = self->priv;
+  GList *streams, *elem;
+
+  g_mutex_lock (&priv->lock);
+  streams = priv->streams;
+  priv->streams = NULL;
+  g_mutex_unlock (&priv->lock);
+
+  for (elem = streams; elem; elem = elem->next) {
+    DecodedStream *stream = elem->data;
+
+    gst_element_set_state (stream->src, GST_STATE_NULL);
+    gst_element_remove_pad (GST_ELEMENT (self), stream->pad);
+    gst_bin_remove (GST_BIN (self), stream->src);
+    close (stream->fd);
+    g_slice_free (DecodedStream, stream);
+  }
+  g_list_free (streams);
+  priv->n_video = 0;
+  priv->n_audio = 0;
+}
 
-  if (g_file_query_exists (audio_file, self->priv->monitor_cancellable)
-      || g_file_query_exists (video_file, self->priv->monitor_cancellable)) {
-    GST_WARNING_OBJECT (self,
-        "Some of the files we are monitoring for creation already exist!");
+/* The stats of the input, and those of each stream under the name of its
+ * pad, see sandboxsrc */
+static GstStructure *
+get_stats (GstSandboxedDecodebin *self)
+{
+  GstSandboxedDecodebinPrivate *priv = self->priv;
+  GstStructure *stats;
+  guint64 input_bytes;
+  GList *elem;
+
+  g_object_get (priv->inputsink, "bytes-served", &input_bytes, NULL);
+  stats = gst_structure_new ("sandboxeddecodebin-stats",
+                             "input-bytes", G_TYPE_UINT64, input_bytes,
+                             NULL);
+
+  g_mutex_lock (&priv->lock);
+  for (elem = priv->streams; elem; elem = elem->next) {
+    DecodedStream *stream = elem->data;
+    GstStructure *stream_stats;
+
+    g_object_get (stream->src, "stats", &stream_stats, NULL);
+    gst_structure_set (stats, GST_PAD_NAME (stream->pad),
+                       GST_TYPE_STRUCTURE, stream_stats, NULL);
+    gst_structure_free (stream_stats);
   }
+  g_mutex_unlock (&priv->lock);
+
+  return stats;
+}
+
+static gboolean
+on_stats_timeout (GstClock *clock,
+                  GstClockTime time,
+                  GstClockID id,
+                  GstSandboxedDecodebin *self)
+{
+  gst_element_post_message (GST_ELEMENT (self),
+      gst_message_new_element (GST_OBJECT (self), get_stats (self)));
 
-  g_object_unref (audio_file);
-  g_object_unref (video_file);
+  return TRUE;
 }
 
+static void
+start_stats (GstSandboxedDecodebin *self)
+{
+  GstSandboxedDecodebinPrivate *priv = self->priv;
+  GstClockTime interval = priv->stats_interval * GST_MSECOND;
+  GstClock *clock;
+
+  if (interval == 0)
+    return;
+
+  clock = gst_system_clock_obtain ();
+  priv->stats_id = gst_clock_new_periodic_id (clock,
+      gst_clock_get_time (clock) + interval, interval);
+  gst_object_unref (clock);
+  gst_clock_id_wait_async (priv->stats_id,
+                           (GstClockCallback) on_stats_timeout, self);
+}
+
+static void
+stop_stats (GstSandboxedDecodebin *self)
+{
+  GstSandboxedDecodebinPrivate *priv = self->priv;
+
+  if (!priv->stats_id)
+    return;
+
+  gst_clock_id_unschedule (priv->stats_id);
+  gst_clock_id_unref (priv->stats_id);
+  priv->stats_id = NULL;
+}
+
+/* The sources of the streams error out once the decoder goes away, as no
+ * other one will take over. Only those no spare decoder picked up unless
+ * all. */
+static void
+give_up_streams (GstSandboxedDecodebin *self, gboolean all)
+{
+  GstSandboxedDecodebinPrivate *priv = self->priv;
+  GList *elem;
+
+  g_mutex_lock (&priv->lock);
+  for (elem = priv->streams; elem; elem = elem->next) {
+    DecodedStream *stream = elem->data;
+
+    if (all || !stream->resumed)
+      gst_sandbox_src_give_up (GST_SANDBOX_SRC (stream->src));
+  }
+  g_mutex_unlock (&priv->lock);
+}
+
+static void
+on_no_more_streams (GstSandboxedDecodebin *self)
+{
+  GstSandboxedDecodebinPrivate *priv = self->priv;
+  gboolean async_pending;
+
+  if (priv->recovering) {
+    GST_DEBUG_OBJECT (self, "All streams resumed");
+    /* those the new decoder doesn't have won't come back */
+    give_up_streams (self, FALSE);
+    priv->recovering = FALSE;
+    return;
+  }
+
+  GST_DEBUG_OBJECT (self, "All streams exposed");
+  gst_element_no_more_pads (GST_ELEMENT (self));
+
+  g_mutex_lock (&priv->lock);
+  priv->streams_complete = TRUE;
+  async_pending = priv->async_pending;
+  priv->async_pending = FALSE;
+  g_mutex_unlock (&priv->lock);
+
+  if (async_pending)
+    do_async_done (self);
+}
+
+/* Follows the streams the decoder announces, until it goes away or we shut
+ * down. Returns whether it crashed after exposing its streams. */
+static gboolean
+handle_control_messages (GstSandboxedDecodebin *self)
+{
+  GstSandboxedDecodebinPrivate *priv = self->priv;
+  SandboxMessage *message;
+  SandboxChannelResult result;
+  gboolean done = FALSE;
+
+  message = g_new (SandboxMessage, 1);
+  while ((result = receive_control_message (self, priv->control,
+                                            GST_CLOCK_TIME_NONE,
+                                            message)) == SANDBOX_CHANNEL_OK) {
+    switch (message->type) {
+    case SANDBOX_MESSAGE_STREAM_ADDED:
+      add_stream (self, message);
+      break;
+    case SANDBOX_MESSAGE_NO_MORE_STREAMS:
+      on_no_more_streams (self);
+      break;
+    case SANDBOX_MESSAGE_STARTUP_PROFILE:
+      /* a spare decoder started long after us */
+      if (priv->recoveries == 0)
+        post_startup_profile (self, message);
+      break;
+    case SANDBOX_MESSAGE_DONE:
+      GST_DEBUG_OBJECT (self, "Decoder is done");
+      done = TRUE;
+      break;
+    case SANDBOX_MESSAGE_QUERY_RESULT:
+      complete_query (self, message);
+      break;
+    default:
+      GST_WARNING_OBJECT (self, "Unexpected message %u from the decoder",
+                          message->type);
+      break;
+    }
+    sandbox_message_close_fds (message);
+  }
+  g_free (message);
+  fail_queries (self);
+
+  if (result != SANDBOX_CHANNEL_CLOSED || done)
+    return FALSE;
+
+  g_mutex_lock (&priv->lock);
+  if (!priv->streams_complete) {
+    g_mutex_unlock (&priv->lock);
+    GST_ELEMENT_ERROR (self, STREAM, DECODE,
+                       ("The sandboxed decoder exited before exposing its "
+                        "streams"), (NULL));
+    return FALSE;
+  }
+  g_mutex_unlock (&priv->lock);
+
+  return TRUE;
+}
+
+/* Gets a spare decoder going, which waits for its preamble until the one we
+ * use crashes, see recover() */
+static void
+start_spare (GstSandboxedDecodebin *self)
+{
+  GstSandboxedDecodebinPrivate *priv = self->priv;
+  gint input[2];
+
+  if (!sandbox_ipc_socketpair (input)) {
+    GST_WARNING_OBJECT (self, "Could not create input channel: %m");
+    return;
+  }
+  priv->spare_input_fd = input[0];
+  priv->spare_input_sink_fd = input[1];
+
+  /* the sessions of a zygote decoder may share its process, and crash with
+   * it */
+  if (priv->zygote && priv->zygote_sessions <= 1)
+    priv->spare = request_decoder_from_zygote (self, priv->spare_input_fd);
+  if (!priv->spare)
+    priv->spare = spawn_decoder (self, priv->spare_input_fd);
+  if (!priv->spare) {
+    GST_WARNING_OBJECT (self, "Could not start a spare decoder");
+    close (priv->spare_input_fd);
+    close (priv->spare_input_sink_fd);
+    priv->spare_input_fd = -1;
+    priv->spare_input_sink_fd = -1;
+  }
+}
+
+static void
+drop_spare (GstSandboxedDecodebin *self)
+{
+  GstSandboxedDecodebinPrivate *priv = self->priv;
+
+  /* it quits when its control channel goes away, like ours */
+  if (priv->spare) {
+    sandbox_channel_unref (priv->spare);
+    priv->spare = NULL;
+  }
+  if (priv->spare_input_fd != -1) {
+    close (priv->spare_input_fd);
+    priv->spare_input_fd = -1;
+  }
+  if (priv->spare_input_sink_fd != -1) {
+    close (priv->spare_input_sink_fd);
+    priv->spare_input_sink_fd = -1;
+  }
+}
+
+/* Sends the plugins and settings to the decoder on the other end of the
+ * input channel we serve on fd */
+static gboolean
+send_preamble (GstSandboxedDecodebin *self, gint fd)
+{
+  GstSandboxedDecodebinPrivate *priv = self->priv;
+  SandboxChannel *input;
+  gboolean ret;
+
+  input = sandbox_channel_new (dup (fd));
+  g_mutex_lock (&priv->lock);
+  ret = sandbox_channel_send_preamble (input, priv->plugins, &priv->settings);
+  if (!ret)
+    GST_WARNING_OBJECT (self, "Could not send the plugin list: %m");
+  g_mutex_unlock (&priv->lock);
+  sandbox_channel_unref (input);
+
+  return ret;
+}
+
+/* Where the streams stopped, the earliest end of what they pushed */
+static GstClockTime
+get_resume_position (GstSandboxedDecodebin *self)
+{
+  GstSandboxedDecodebinPrivate *priv = self->priv;
+  GstClockTime position = GST_CLOCK_TIME_NONE;
+  GList *elem;
+
+  g_mutex_lock (&priv->lock);
+  for (elem = priv->streams; elem; elem = elem->next) {
+    DecodedStream *stream = elem->data;
+    guint64 stream_position;
+
+    g_object_get (stream->src, "position", &stream_position, NULL);
+    if (GST_CLOCK_TIME_IS_VALID (stream_position)
+        && (!GST_CLOCK_TIME_IS_VALID (position) || stream_position < position))
+      position = stream_position;
+  }
+  g_mutex_unlock (&priv->lock);
+
+  return position;
+}
+
+/* Swaps the decoder that crashed for the spare one, which reads the same
+ * input from the start and hands its streams to our sources, which have it
+ * seek to where they stopped. Returns FALSE if it can't. */
+static gboolean
+recover (GstSandboxedDecodebin *self)
+{
+  GstSandboxedDecodebinPrivate *priv = self->priv;
+  SandboxChannel *control;
+  gboolean pull_mode;
+  GList *elem;
+
+  if (!priv->spare) {
+    GST_WARNING_OBJECT (self, "Decoder crashed, no spare one to take over");
+    return FALSE;
+  }
+  if (priv->recoveries >= priv->max_recoveries) {
+    GST_WARNING_OBJECT (self, "Decoder crashed %u times, giving up",
+                        priv->recoveries + 1);
+    return FALSE;
+  }
+  /* the spare decoder can't skip what upstream already pushed */
+  g_object_get (priv->inputsink, "pull-mode", &pull_mode, NULL);
+  if (!pull_mode) {
+    GST_WARNING_OBJECT (self, "Decoder crashed, its input can't be read "
+                        "again");
+    return FALSE;
+  }
+
+  control = get_ready_decoder (self, priv->spare, priv->spare_input_fd,
+                               NULL);
+  priv->spare = NULL;
+  /* queries go to the new decoder from now on */
+  g_mutex_lock (&priv->lock);
+  sandbox_channel_unref (priv->control);
+  priv->control = control;
+  g_mutex_unlock (&priv->lock);
+  if (!priv->control) {
+    GST_WARNING_OBJECT (self, "Spare decoder did not get ready");
+    drop_spare (self);
+    return FALSE;
+  }
+  close (priv->spare_input_fd);
+  priv->spare_input_fd = -1;
+
+  if (!send_preamble (self, priv->spare_input_sink_fd)) {
+    drop_spare (self);
+    return FALSE;
+  }
+
+  /* inputsink serves the new decoder from now on */
+  g_mutex_lock (&priv->lock);
+  if (priv->input_sink_fd != -1)
+    close (priv->input_sink_fd);
+  priv->input_sink_fd = priv->spare_input_sink_fd;
+  priv->spare_input_sink_fd = -1;
+  g_mutex_unlock (&priv->lock);
+  g_object_set (priv->inputsink, "fd", priv->input_sink_fd, NULL);
+
+  priv->recoveries++;
+  priv->recovering = TRUE;
+  priv->resume_position = get_resume_position (self);
+  priv->resume_seek_sent = FALSE;
+  priv->n_video = 0;
+  priv->n_audio = 0;
+  g_mutex_lock (&priv->lock);
+  for (elem = priv->streams; elem; elem = elem->next) {
+    DecodedStream *stream = elem->data;
+
+    stream->resumed = FALSE;
+    /* none, until the new decoder announces it */
+    stream->id = G_MAXUINT32;
+    stream->duration_format = GST_FORMAT_UNDEFINED;
+    stream->seeking_format = GST_FORMAT_UNDEFINED;
+  }
+  g_mutex_unlock (&priv->lock);
+
+  GST_ELEMENT_WARNING (self, STREAM, DECODE,
+                       ("The sandboxed decoder crashed, a spare one took "
+                        "over"),
+                       ("Resuming at %" GST_TIME_FORMAT ", recovery %u of "
+                        "%u", GST_TIME_ARGS (priv->resume_position),
+                        priv->recoveries, priv->max_recoveries));
+
+  /* for the next crash */
+  start_spare (self);
+
+  return TRUE;
+}
+
+/* Waits for the decoder to get ready without blocking the application,
+ * falling back to spawning one ourselves if the zygote refuses, then exposes
+ * its streams. If it crashes once they are exposed, a spare decoder takes
+ * over if we have one, see recover(). */
+static gpointer
+decoder_thread (GstSandboxedDecodebin *self)
+{
+  GstSandboxedDecodebinPrivate *priv = self->priv;
+  SandboxChannel *control;
+
+  control = get_ready_decoder (self, priv->control, priv->input_fd,
+                               &priv->spawned_time);
+  g_mutex_lock (&priv->lock);
+  priv->control = control;
+  g_mutex_unlock (&priv->lock);
+  if (!priv->control) {
+    GST_ELEMENT_ERROR (self, CORE, STATE_CHANGE,
+                       ("Could not start the sandboxed decoder"), (NULL));
+    return NULL;
+  }
+
+  /* the decoder has its own copy now */
+  close (priv->input_fd);
+  priv->input_fd = -1;
+
+  GST_DEBUG_OBJECT (self, "Decoder is ready");
+  if (priv->spare_decoder)
+    start_spare (self);
+
+  while (handle_control_messages (self) && recover (self))
+    ;
+  give_up_streams (self, TRUE);
+
+  return NULL;
+}
+
+/* Gets a decoder going, but doesn't wait for it to be ready */
+static gboolean
+start_decoder (GstSandboxedDecodebin *self)
+{
+  GstSandboxedDecodebinPrivate *priv = self->priv;
+  gint input[2];
+
+  if (!sandbox_ipc_socketpair (input)) {
+    GST_WARNING_OBJECT (self, "Could not create input channel: %m");
+    return FALSE;
+  }
+
+  /* we keep the decoder's end until it is ready, in case we have to give it
+   * to another one */
+  priv->input_fd = input[0];
+  priv->input_sink_fd = input[1];
+
+  priv->start_time = get_monotonic_time ();
+  priv->spawned_time = priv->ready_time = priv->typefound_time =
+      priv->start_time;
+  priv->control = NULL;
+  if (priv->zygote)
+    priv->control = request_decoder_from_zygote (self, priv->input_fd);
+  if (!priv->control)
+    priv->control = spawn_decoder (self, priv->input_fd);
+  if (!priv->control) {
+    close (priv->input_fd);
+    close (priv->input_sink_fd);
+    priv->input_fd = -1;
+    priv->input_sink_fd = -1;
+    return FALSE;
+  }
+  priv->spawned_time = get_monotonic_time ();
+
+  g_object_set (priv->inputsink, "fd", priv->input_sink_fd, NULL);
+
+  priv->streams_complete = FALSE;
+  priv->async_pending = FALSE;
+  priv->recovering = FALSE;
+  priv->recoveries = 0;
+  priv->poll = gst_poll_new (TRUE);
+  priv->decoder_thread = g_thread_new ("sandboxeddecodebin",
+                                       (GThreadFunc) decoder_thread, self);
+  start_stats (self);
+
+  return TRUE;
+}
+
+static void
+stop_decoder (GstSandboxedDecodebin *self)
+{
+  GstSandboxedDecodebinPrivate *priv = self->priv;
+
+  stop_stats (self);
+
+  if (priv->decoder_thread) {
+    gst_poll_set_flushing (priv->poll, TRUE);
+    g_thread_join (priv->decoder_thread);
+    priv->decoder_thread = NULL;
+    gst_poll_free (priv->poll);
+    priv->poll = NULL;
+  }
+
+  remove_streams (self);
+  drop_spare (self);
+  return_shm_grant (self);
+  g_free (priv->plugins);
+  priv->plugins = NULL;
+
+  if (priv->input_fd != -1) {
+    close (priv->input_fd);
+    priv->input_fd = -1;
+  }
+
+  if (!priv->control)
+    return;
+
+  /* the decoder quits when its control channel goes away */
+  g_mutex_lock (&priv->lock);
+  sandbox_channel_unref (priv->control);
+  priv->control = NULL;
+  g_mutex_unlock (&priv->lock);
+}
+
+/* Adds to plugins the names of the plugins of the demuxers, parsers and
+ * decoders decodebin2 could plug for caps, and of those it could plug after
+ * them, following their source pad templates. Decoders are left out when
+ * demux_only. */
+static void
+collect_plugins_for_caps (GstCaps *caps,
+                          gboolean demux_only,
+                          GHashTable *plugins)
+{
+  GList *decodable, *matching, *elem;
+  GHashTable *seen;
+  GQueue pending = G_QUEUE_INIT;
+  GstCaps *current;
+  gboolean any_output = FALSE;
+
+  decodable = gst_element_factory_list_get_elements (
+      GST_ELEMENT_FACTORY_TYPE_DECODABLE, GST_RANK_MARGINAL);
+  if (demux_only) {
+    GList *next;
+
+    for (elem = decodable; elem; elem = next) {
+      next = elem->next;
+      if (gst_element_factory_list_is_type (elem->data,
+                                            GST_ELEMENT_FACTORY_TYPE_DECODER)) {
+        gst_object_unref (elem->data);
+        decodable = g_list_delete_link (decodable, elem);
+      }
+    }
+  }
+  seen = g_hash_table_new (NULL, NULL);
+
+  g_queue_push_tail (&pending, gst_caps_ref (caps));
+  while ((current = g_queue_pop_head (&pending))) {
+    matching = gst_element_factory_list_filter (decodable, current,
+                                                GST_PAD_SINK, FALSE);
+    gst_caps_unref (current);
+
+    for (elem = matching; elem; elem = elem->next) {
+      GstElementFactory *factory = elem->data;
+      const GList *templates;
+
+      if (g_hash_table_contains (seen, factory))
+        continue;
+      g_hash_table_add (seen, factory);
+      g_hash_table_add (plugins,
+                        g_strdup (GST_PLUGIN_FEATURE (factory)->plugin_name));
+
+      templates = gst_element_factory_get_static_pad_templates (factory);
+      for (; templates; templates = templates->next) {
+        GstStaticPadTemplate *templ = templates->data;
+        GstCaps *templ_caps;
+
+        if (templ->direction != GST_PAD_SRC)
+          continue;
+
+        templ_caps = gst_static_caps_get (&templ->static_caps);
+        if (gst_caps_is_any (templ_caps)) {
+          any_output = TRUE;
+          gst_caps_unref (templ_caps);
+        } else {
+          g_queue_push_tail (&pending, templ_caps);
+        }
+      }
+    }
+    gst_plugin_feature_list_free (matching);
+  }
+
+  /* we cannot tell what comes out of some element, have the decoder load
+   * everything decodebin2 could plug */
+  if (any_output) {
+    for (elem = decodable; elem; elem = elem->next)
+      g_hash_table_add (plugins,
+          g_strdup (GST_PLUGIN_FEATURE (elem->data)->plugin_name));
+  }
+
+  g_hash_table_destroy (seen);
+  gst_plugin_feature_list_free (decodable);
+}
+
+static gchar *
+get_required_plugins (GstCaps *caps, gboolean demux_only)
+{
+  GHashTable *plugins;
+  GHashTableIter iter;
+  GString *list;
+  gpointer name;
+
+  plugins = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  collect_plugins_for_caps (caps, demux_only, plugins);
+
+  list = g_string_new (NULL);
+  g_hash_table_iter_init (&iter, plugins);
+  while (g_hash_table_iter_next (&iter, &name, NULL)) {
+    if (list->len > 0)
+      g_string_append_c (list, ',');
+    g_string_append (list, name);
+  }
+  g_hash_table_destroy (plugins);
+
+  return g_string_free (list, FALSE);
+}
+
+/* Fills cpu_set from a list of CPUs and ranges like "0-3,8". Returns FALSE
+ * if it doesn't parse. */
+static gboolean
+parse_cpu_set (const gchar *string, guint64 *cpu_set)
+{
+  gchar **ranges, **range;
+  gboolean ret = TRUE;
+
+  memset (cpu_set, 0, sizeof (guint64) * SANDBOX_MAX_CPUS / 64);
+  ranges = g_strsplit (string, ",", -1);
+  for (range = ranges; *range && ret; range++) {
+    gchar *end;
+    guint64 first, last, cpu;
+
+    first = g_ascii_strtoull (*range, &end, 10);
+    last = first;
+    if (end == *range)
+      ret = FALSE;
+    else if (*end == '-')
+      last = g_ascii_strtoull (end + 1, &end, 10);
+    if (*end != '\0' || last < first || last >= SANDBOX_MAX_CPUS)
+      ret = FALSE;
+
+    for (cpu = first; ret && cpu <= last; cpu++)
+      cpu_set[cpu / 64] |= G_GUINT64_CONSTANT (1) << (cpu % 64);
+  }
+  g_strfreev (ranges);
+
+  return ret;
+}
+
+/* Called before typefind lets any data through to the decoder, which is
+ * waiting to know which plugins to load before entering its chroot. Once it
+ * knows, it can start reading, so this is when inputsink starts serving. */
+static void
+on_have_type (GstElement *typefind,
+              guint probability,
+              GstCaps *caps,
+              GstSandboxedDecodebin *self)
+{
+  GstSandboxedDecodebinPrivate *priv = self->priv;
+  SandboxPreamble settings;
+  gchar *plugins;
+
+  priv->typefound_time = get_monotonic_time ();
+  if (!grant_shm (self, &settings.max_shm_size)) {
+    GST_ELEMENT_ERROR (self, RESOURCE, NO_SPACE_LEFT,
+                       ("Shared memory budget exhausted"),
+                       ("All of the %" G_GUINT64_FORMAT " bytes of "
+                        "shm-budget are used by other decoders",
+                        shm_budget));
+    return;
+  }
+
+  plugins = get_required_plugins (caps, priv->demux_only);
+  GST_DEBUG_OBJECT (self, "Stream is %" GST_PTR_FORMAT ", decoder needs %s",
+                    caps, plugins);
+
+  settings.audio_batch_duration = priv->audio_batch_duration;
+  settings.max_buffers_in_flight = priv->max_buffers_in_flight;
+  settings.max_bytes_in_flight = priv->max_bytes_in_flight;
+  settings.max_threads = priv->max_threads;
+  settings.nice = priv->nice;
+  settings.scheduling = priv->scheduling;
+  settings.huge_pages = priv->huge_pages;
+  settings.prefault_shm = priv->prefault_shm;
+  settings.demux_only = priv->demux_only;
+  if (!priv->cpu_set || !parse_cpu_set (priv->cpu_set, settings.cpu_set)) {
+    if (priv->cpu_set)
+      GST_WARNING_OBJECT (self, "Ignoring invalid cpu-set %s", priv->cpu_set);
+    memset (settings.cpu_set, 0, sizeof (settings.cpu_set));
+  }
+
+  /* kept for a spare decoder, see recover() */
+  g_mutex_lock (&priv->lock);
+  g_free (priv->plugins);
+  priv->plugins = plugins;
+  priv->settings = settings;
+  g_mutex_unlock (&priv->lock);
+  send_preamble (self, priv->input_sink_fd);
+
+  /* like decodebin2 does with its own typefind, activating inputsink from
+   * here lets typefind run in pull mode when upstream can */
+  gst_element_set_state (priv->inputsink, GST_STATE_PAUSED);
+}
 
 /* GObject vmethod implementations */
 
+static void
+gst_sandboxed_decodebin_set_property (GObject *object,
+                                      guint prop_id,
+                                      const GValue *value,
+                                      GParamSpec *pspec)
+{
+  GstSandboxedDecodebinPrivate *priv = GST_SANDBOXED_DECODEBIN (object)->priv;
+
+  switch (prop_id) {
+  case PROP_ZYGOTE:
+    priv->zygote = g_value_get_boolean (value);
+    break;
+  case PROP_ZYGOTE_POOL_SIZE:
+    priv->zygote_pool_size = g_value_get_uint (value);
+    break;
+  case PROP_ZYGOTE_PREWARM:
+    priv->zygote_prewarm = g_value_get_uint (value);
+    break;
+  case PROP_ZYGOTE_SESSIONS:
+    priv->zygote_sessions = g_value_get_uint (value);
+    break;
+  case PROP_MAX_SHM_SIZE:
+    priv->max_shm_size = g_value_get_uint64 (value);
+    break;
+  case PROP_AUDIO_BATCH_DURATION:
+    priv->audio_batch_duration = g_value_get_uint64 (value);
+    break;
+  case PROP_STATS_INTERVAL:
+    priv->stats_interval = g_value_get_uint (value);
+    break;
+  case PROP_SANDBOX:
+    priv->sandbox = g_value_get_enum (value);
+    break;
+  case PROP_MAX_BUFFERS_IN_FLIGHT:
+    priv->max_buffers_in_flight = g_value_get_uint (value);
+    break;
+  case PROP_MAX_BYTES_IN_FLIGHT:
+    priv->max_bytes_in_flight = g_value_get_uint64 (value);
+    break;
+  case PROP_MAX_THREADS:
+    priv->max_threads = g_value_get_uint (value);
+    break;
+  case PROP_CPU_SET:
+    g_free (priv->cpu_set);
+    priv->cpu_set = g_value_dup_string (value);
+    break;
+  case PROP_NICE:
+    priv->nice = g_value_get_int (value);
+    break;
+  case PROP_SCHEDULING:
+    priv->scheduling = g_value_get_enum (value);
+    break;
+  case PROP_HUGE_PAGES:
+    priv->huge_pages = g_value_get_enum (value);
+    break;
+  case PROP_PREFAULT_SHM:
+    priv->prefault_shm = g_value_get_boolean (value);
+    break;
+  case PROP_SHM_BUDGET:
+    G_LOCK (shm_budget);
+    shm_budget = g_value_get_uint64 (value);
+    G_UNLOCK (shm_budget);
+    break;
+  case PROP_SPARE_DECODER:
+    priv->spare_decoder = g_value_get_boolean (value);
+    break;
+  case PROP_MAX_RECOVERIES:
+    priv->max_recoveries = g_value_get_uint (value);
+    break;
+  case PROP_DEMUX_ONLY:
+    priv->demux_only = g_value_get_boolean (value);
+    break;
+  default:
+    G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+    break;
+  }
+}
+
+static void
+gst_sandboxed_decodebin_get_property (GObject *object,
+                                      guint prop_id,
+                                      GValue *value,
+                                      GParamSpec *pspec)
+{
+  GstSandboxedDecodebinPrivate *priv = GST_SANDBOXED_DECODEBIN (object)->priv;
+
+  switch (prop_id) {
+  case PROP_ZYGOTE:
+    g_value_set_boolean (value, priv->zygote);
+    break;
+  case PROP_ZYGOTE_POOL_SIZE:
+    g_value_set_uint (value, priv->zygote_pool_size);
+    break;
+  case PROP_ZYGOTE_PREWARM:
+    g_value_set_uint (value, priv->zygote_prewarm);
+    break;
+  case PROP_ZYGOTE_SESSIONS:
+    g_value_set_uint (value, priv->zygote_sessions);
+    break;
+  case PROP_MAX_SHM_SIZE:
+    g_value_set_uint64 (value, priv->max_shm_size);
+    break;
+  case PROP_AUDIO_BATCH_DURATION:
+    g_value_set_uint64 (value, priv->audio_batch_duration);
+    break;
+  case PROP_STATS:
+    g_value_take_boxed (value, get_stats (GST_SANDBOXED_DECODEBIN (object)));
+    break;
+  case PROP_STATS_INTERVAL:
+    g_value_set_uint (value, priv->stats_interval);
+    break;
+  case PROP_SANDBOX:
+    g_value_set_enum (value, priv->sandbox);
+    break;
+  case PROP_MAX_BUFFERS_IN_FLIGHT:
+    g_value_set_uint (value, priv->max_buffers_in_flight);
+    break;
+  case PROP_MAX_BYTES_IN_FLIGHT:
+    g_value_set_uint64 (value, priv->max_bytes_in_flight);
+    break;
+  case PROP_MAX_THREADS:
+    g_value_set_uint (value, priv->max_threads);
+    break;
+  case PROP_CPU_SET:
+    g_value_set_string (value, priv->cpu_set);
+    break;
+  case PROP_NICE:
+    g_value_set_int (value, priv->nice);
+    break;
+  case PROP_SCHEDULING:
+    g_value_set_enum (value, priv->scheduling);
+    break;
+  case PROP_HUGE_PAGES:
+    g_value_set_enum (value, priv->huge_pages);
+    break;
+  case PROP_PREFAULT_SHM:
+    g_value_set_boolean (value, priv->prefault_shm);
+    break;
+  case PROP_SHM_BUDGET:
+    G_LOCK (shm_budget);
+    g_value_set_uint64 (value, shm_budget);
+    G_UNLOCK (shm_budget);
+    break;
+  case PROP_SPARE_DECODER:
+    g_value_set_boolean (value, priv->spare_decoder);
+    break;
+  case PROP_MAX_RECOVERIES:
+    g_value_set_uint (value, priv->max_recoveries);
+    break;
+  case PROP_DEMUX_ONLY:
+    g_value_set_boolean (value, priv->demux_only);
+    break;
+  default:
+    G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+    break;
+  }
+}
+
 static void
 gst_sandboxed_decodebin_dispose (GstSandboxedDecodebin *self)
 {
@@ -185,6 +1852,11 @@ gst_sandboxed_decodebin_dispose (GstSandboxedDecodebin *self)
 static void
 gst_sandboxed_decodebin_finalize (GstSandboxedDecodebin *self)
 {
+  g_mutex_clear (&self->priv->lock);
+  g_cond_clear (&self->priv->query_cond);
+  g_free (self->priv->cpu_set);
+
+  G_OBJECT_CLASS (parent_class)->finalize (G_OBJECT (self));
 }
 
 static void
@@ -192,56 +1864,64 @@ gst_sandboxed_decodebin_init (GstSandboxedDecodebin *self)
 {
   GstSandboxedDecodebinPrivate *priv;
   //GError *error = NULL;
-  GstPad *fdsinkpad,
-         *gdpaudiosrcpad,
-         *gdpvideosrcpad;
+  GstPad *typefindpad;
 
   self->priv = priv = GST_SANDBOXED_DECODEBIN_GET_PRIVATE (self);
 
-  priv->subprocess_stdin = -1;
-
-  priv->shm_video_socket_path = g_strdup (tmpnam (NULL));
-  priv->shm_audio_socket_path = g_strdup (tmpnam (NULL));
-  priv->subprocess_ready = FALSE;
-  priv->uninitialised_socket_paths = 2;
-  monitor_subprocess_creation (self);
-
-  priv->fdsink = gst_element_factory_make ("fdsink", "fdsink0");
-  g_object_set (priv->fdsink,
-                "async", FALSE,
-                NULL);
-  priv->audiosrc = gst_element_factory_make ("shmsrc", "audiosrc");
-  g_object_set (priv->audiosrc,
-                "socket-path", priv->shm_audio_socket_path, NULL);
-  priv->videosrc = gst_element_factory_make ("shmsrc", "videosrc");
-  g_object_set (priv->videosrc,
-                "socket-path", priv->shm_video_socket_path, NULL);
-
-  priv->audiodepay = gst_element_factory_make ("gdpdepay", "audiodepay");
-  priv->videodepay = gst_element_factory_make ("gdpdepay", "videodepay");
-
-  gst_bin_add_many (GST_BIN (self),
-                    priv->fdsink, priv->audiosrc, priv->videosrc,
-                    priv->audiodepay, priv->videodepay,
-                    NULL);
-  gst_element_link (priv->audiosrc, priv->audiodepay);
-  gst_element_link (priv->videosrc, priv->videodepay);
-
-  fdsinkpad = gst_element_get_static_pad (priv->fdsink, "sink");
-  priv->sink_pad = gst_ghost_pad_new ("sink", fdsinkpad);
-  g_object_unref (fdsinkpad);
+  priv->input_sink_fd = -1;
+  priv->sandbox = DEFAULT_SANDBOX;
+  priv->zygote = DEFAULT_ZYGOTE;
+  priv->zygote_pool_size = DEFAULT_ZYGOTE_POOL_SIZE;
+  priv->zygote_prewarm = DEFAULT_ZYGOTE_PREWARM;
+  priv->zygote_sessions = DEFAULT_ZYGOTE_SESSIONS;
+  priv->max_shm_size = DEFAULT_MAX_SHM_SIZE;
+  priv->audio_batch_duration = DEFAULT_AUDIO_BATCH_DURATION;
+  priv->max_buffers_in_flight = DEFAULT_MAX_BUFFERS_IN_FLIGHT;
+  priv->max_bytes_in_flight = DEFAULT_MAX_BYTES_IN_FLIGHT;
+  priv->max_threads = DEFAULT_MAX_THREADS;
+  priv->cpu_set = DEFAULT_CPU_SET;
+  priv->nice = DEFAULT_NICE;
+  priv->scheduling = DEFAULT_SCHEDULING;
+  priv->huge_pages = DEFAULT_HUGE_PAGES;
+  priv->prefault_shm = DEFAULT_PREFAULT_SHM;
+  priv->stats_interval = DEFAULT_STATS_INTERVAL;
+  priv->stats_id = NULL;
+  priv->input_fd = -1;
+  priv->control = NULL;
+  priv->spare_decoder = DEFAULT_SPARE_DECODER;
+  priv->max_recoveries = DEFAULT_MAX_RECOVERIES;
+  priv->demux_only = DEFAULT_DEMUX_ONLY;
+  priv->spare = NULL;
+  priv->spare_input_fd = -1;
+  priv->spare_input_sink_fd = -1;
+  priv->plugins = NULL;
+  priv->streams = NULL;
+  priv->n_video = 0;
+  priv->n_audio = 0;
+  priv->decoder_thread = NULL;
+  priv->poll = NULL;
+  g_mutex_init (&priv->lock);
+  g_cond_init (&priv->query_cond);
+
+  /* the decoder only loads the plugins it needs for what we find here */
+  priv->typefind = gst_element_factory_make ("typefind", "typefind0");
+  g_signal_connect (priv->typefind, "have-type",
+                    G_CALLBACK (on_have_type), self);
+
+  /* serves the reads of the decoder. It only starts once the type is
+   * known, see on_have_type() */
+  priv->inputsink = g_object_new (GST_SANDBOX_INPUT_SINK_TYPE, NULL);
+  gst_element_set_locked_state (priv->inputsink, TRUE);
+  /* the decoded buffers come through shared memory, straight from the
+   * decoders in the subprocess, see add_stream() */
+
+  gst_bin_add_many (GST_BIN (self), priv->typefind, priv->inputsink, NULL);
+  gst_element_link (priv->typefind, priv->inputsink);
+
+  typefindpad = gst_element_get_static_pad (priv->typefind, "sink");
+  priv->sink_pad = gst_ghost_pad_new ("sink", typefindpad);
+  g_object_unref (typefindpad);
   gst_element_add_pad (GST_ELEMENT (self), priv->sink_pad);
-
-  gdpaudiosrcpad = gst_element_get_static_pad (priv->audiodepay, "src");
-  priv->audio_src_pad = gst_ghost_pad_new ("audiosrc", gdpaudiosrcpad);
-  g_object_unref (gdpaudiosrcpad);
-  gst_element_add_pad (GST_ELEMENT (self), priv->audio_src_pad);
-
-  gdpvideosrcpad = gst_element_get_static_pad (priv->videodepay, "src");
-  priv->video_src_pad = gst_ghost_pad_new ("videosrc", gdpvideosrcpad);
-  g_object_unref (gdpvideosrcpad);
-  gst_element_add_pad (GST_ELEMENT (self), priv->video_src_pad);
-
 }
 
 static void
@@ -258,29 +1938,174 @@ gst_sandboxed_decodebin_class_init (GstSandboxedDecodebinClass *self_class)
   g_type_class_add_private (self_class, sizeof (GstSandboxedDecodebinPrivate));
   object_class->dispose = (void (*) (GObject *object)) gst_sandboxed_decodebin_dispose;
   object_class->finalize = (void (*) (GObject *object)) gst_sandboxed_decodebin_finalize;
+  object_class->set_property = gst_sandboxed_decodebin_set_property;
+  object_class->get_property = gst_sandboxed_decodebin_get_property;
+
+  g_object_class_install_property (object_class, PROP_ZYGOTE,
+      g_param_spec_boolean ("zygote", "Zygote",
+                            "Fork the decoder from a zygote that already "
+                            "loaded the plugins and entered the sandbox",
+                            DEFAULT_ZYGOTE,
+                            G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (object_class, PROP_ZYGOTE_POOL_SIZE,
+      g_param_spec_uint ("zygote-pool-size", "Zygote pool size",
+                         "Maximum number of decoders the zygote keeps alive, "
+                         "0 for no limit. Only used when the zygote is "
+                         "started, it is shared by the whole process",
+                         0, G_MAXUINT, DEFAULT_ZYGOTE_POOL_SIZE,
+                         G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (object_class, PROP_ZYGOTE_PREWARM,
+      g_param_spec_uint ("zygote-prewarm", "Zygote prewarm",
+                         "Number of decoders the zygote forks in advance. "
+                         "Only used when the zygote is started",
+                         0, G_MAXUINT, DEFAULT_ZYGOTE_PREWARM,
+                         G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (object_class, PROP_ZYGOTE_SESSIONS,
+      g_param_spec_uint ("zygote-sessions", "Zygote sessions",
+                         "Number of streams each decoder forked by the "
+                         "zygote decodes, each in its own pipeline. Above 1, "
+                         "streams share a process, only for media of "
+                         "trusted origin. Only used when the zygote is "
+                         "started",
+                         1, G_MAXUINT, DEFAULT_ZYGOTE_SESSIONS,
+                         G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (object_class, PROP_MAX_SHM_SIZE,
+      g_param_spec_uint64 ("max-shm-size", "Maximum shm size",
+                           "Maximum shared memory the decoder may use for "
+                           "all its streams together, in bytes, 0 for no "
+                           "limit. Read when the stream type is found",
+                           0, G_MAXUINT64, DEFAULT_MAX_SHM_SIZE,
+                           G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (object_class, PROP_AUDIO_BATCH_DURATION,
+      g_param_spec_uint64 ("audio-batch-duration", "Audio batch duration",
+                           "Raw audio is handed over in batches of up to "
+                           "this duration, in ns, 0 to hand over each "
+                           "buffer. Read when the stream type is found",
+                           0, G_MAXUINT64, DEFAULT_AUDIO_BATCH_DURATION,
+                           G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (object_class, PROP_STATS,
+      g_param_spec_boxed ("stats", "Stats",
+                          "Input bytes sent to the decoder, and transport "
+                          "statistics of each stream under its pad name",
+                          GST_TYPE_STRUCTURE,
+                          G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (object_class, PROP_STATS_INTERVAL,
+      g_param_spec_uint ("stats-interval", "Stats interval",
+                         "Interval in ms at which the stats are posted as an "
+                         "element message, 0 to disable. Read when the "
+                         "decoder starts",
+                         0, G_MAXUINT, DEFAULT_STATS_INTERVAL,
+                         G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (object_class, PROP_SANDBOX,
+      g_param_spec_enum ("sandbox", "Sandbox",
+                         "How the decoder is confined: the setuid helper "
+                         "needs no kernel support but costs an extra "
+                         "process, namespaces need unprivileged user "
+                         "namespaces and seccomp",
+                         GST_TYPE_SANDBOX_BACKEND, DEFAULT_SANDBOX,
+                         G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (object_class, PROP_MAX_BUFFERS_IN_FLIGHT,
+      g_param_spec_uint ("max-buffers-in-flight", "Max buffers in flight",
+                         "Buffers of each stream we may hold before the "
+                         "decoder waits for us to release some, 0 for no "
+                         "limit. Read when the stream type is found",
+                         0, G_MAXUINT, DEFAULT_MAX_BUFFERS_IN_FLIGHT,
+                         G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (object_class, PROP_MAX_BYTES_IN_FLIGHT,
+      g_param_spec_uint64 ("max-bytes-in-flight", "Max bytes in flight",
+                           "Bytes of each stream we may hold before the "
+                           "decoder waits for us to release some, 0 for no "
+                           "limit. Read when the stream type is found",
+                           0, G_MAXUINT64, DEFAULT_MAX_BYTES_IN_FLIGHT,
+                           G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (object_class, PROP_MAX_THREADS,
+      g_param_spec_uint ("max-threads", "Max threads",
+                         "Threads each decoder may use, for those that can "
+                         "use several, 0 to let them choose. Read when the "
+                         "stream type is found",
+                         0, G_MAXUINT, DEFAULT_MAX_THREADS,
+                         G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (object_class, PROP_CPU_SET,
+      g_param_spec_string ("cpu-set", "CPU set",
+                           "CPUs the decoding threads run on, like "
+                           "\"0-3,8\", NULL for all those we may use. Read "
+                           "when the stream type is found",
+                           DEFAULT_CPU_SET,
+                           G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (object_class, PROP_NICE,
+      g_param_spec_int ("nice", "Nice",
+                        "Nice level of the decoding threads, 0 to keep "
+                        "ours. Only raising it works without privileges. "
+                        "Read when the stream type is found",
+                        -20, 19, DEFAULT_NICE,
+                        G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (object_class, PROP_SCHEDULING,
+      g_param_spec_enum ("scheduling", "Scheduling",
+                         "Scheduling policy of the decoding threads, batch "
+                         "or idle to keep background decoding out of the "
+                         "way of playback. Read when the stream type is "
+                         "found",
+                         GST_TYPE_SANDBOX_SCHEDULING, DEFAULT_SCHEDULING,
+                         G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (object_class, PROP_HUGE_PAGES,
+      g_param_spec_enum ("huge-pages", "Huge pages",
+                         "What backs the shared memory areas of the decoder, "
+                         "huge pages mean fewer page faults and TLB misses "
+                         "with big frames. Read when the stream type is "
+                         "found",
+                         GST_TYPE_SANDBOX_HUGE_PAGES, DEFAULT_HUGE_PAGES,
+                         G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (object_class, PROP_PREFAULT_SHM,
+      g_param_spec_boolean ("prefault-shm", "Prefault shm",
+                            "Fault the shared memory areas in on both sides "
+                            "as they are created, instead of page by page "
+                            "with the first buffers. Read when the stream "
+                            "type is found",
+                            DEFAULT_PREFAULT_SHM,
+                            G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (object_class, PROP_SHM_BUDGET,
+      g_param_spec_uint64 ("shm-budget", "Shm budget",
+                           "Shared memory the decoders of all the instances "
+                           "of the process may use together, in bytes, 0 "
+                           "for no limit. Shared by all the instances, the "
+                           "last value set on any of them applies",
+                           0, G_MAXUINT64, DEFAULT_SHM_BUDGET,
+                           G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (object_class, PROP_SPARE_DECODER,
+      g_param_spec_boolean ("spare-decoder", "Spare decoder",
+                            "Keep a started decoder aside, which takes over "
+                            "where the decoder stopped if it crashes. Only "
+                            "when upstream can work in pull mode",
+                            DEFAULT_SPARE_DECODER,
+                            G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (object_class, PROP_MAX_RECOVERIES,
+      g_param_spec_uint ("max-recoveries", "Max recoveries",
+                         "How many crashes a spare decoder takes over from, "
+                         "after which a crash is an error",
+                         0, G_MAXUINT, DEFAULT_MAX_RECOVERIES,
+                         G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (object_class, PROP_DEMUX_ONLY,
+      g_param_spec_boolean ("demux-only", "Demux only",
+                            "Only demux and parse in the sandbox: the pads "
+                            "carry the compressed streams. Read when the "
+                            "stream type is found",
+                            DEFAULT_DEMUX_ONLY,
+                            G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  gst_element_class_add_pad_template (element_class,
+      gst_static_pad_template_get (&sink_template));
+  gst_element_class_add_pad_template (element_class,
+      gst_static_pad_template_get (&video_template));
+  gst_element_class_add_pad_template (element_class,
+      gst_static_pad_template_get (&audio_template));
 
   element_class->change_state = gst_sandboxed_decodebin_change_state;
 }
 
-#if 0
-static gboolean
-do_async_done (gpointer user_data) {
-  GstBin *bin = GST_BIN (user_data);
-  GstMessage *message;
-
-  fprintf (stderr, "do_async_done\n");
-  message = gst_message_new_async_done (GST_OBJECT_CAST (bin));
-  parent_class->handle_message (bin, message);
-
-  return FALSE;
-}
-#endif
-
 GstStateChangeReturn
 gst_sandboxed_decodebin_change_state (GstElement *element,
                                       GstStateChange state_change)
 {
-  GError *error = NULL;
   GstSandboxedDecodebinPrivate *priv;
   GstSandboxedDecodebin *self = GST_SANDBOXED_DECODEBIN (element);
   GstStateChangeReturn ret = GST_STATE_CHANGE_SUCCESS;
@@ -289,51 +2114,31 @@ gst_sandboxed_decodebin_change_state (GstElement *element,
 
   switch (state_change) {
   case GST_STATE_CHANGE_NULL_TO_READY:
-    /* TODO: set up file monitoring */
-    /* spawn subprocess */
-    priv->subprocess_stdin = start_decoder (priv->shm_audio_socket_path,
-                                            priv->shm_video_socket_path,
-                                            &error);
-    if (priv->subprocess_stdin == -1) {
-      GST_WARNING_OBJECT (element,
-                          "Could not spawn subprocess: %s", error->message);
+    /* the decoder gets ready in the background, see decoder_thread() */
+    if (!start_decoder (self)) {
+      GST_WARNING_OBJECT (element, "Could not start the decoder");
       ret = GST_STATE_CHANGE_FAILURE;
     }
-
-    /* set the right fd to fdsink */
-    g_object_set (priv->fdsink, "fd", priv->subprocess_stdin, NULL);
-    GST_DEBUG_OBJECT (element, "Waiting for shm sockets to be available\n");
-    while (!self->priv->subprocess_ready) {
-      /* does that count as acceptable code? The alternatives are another
-       * thread to monitor file creation or sleep() */
-      g_main_context_iteration (NULL, TRUE);
-    }
-    GST_DEBUG_OBJECT (element, "Done waiting\n");
-
     break;
   case GST_STATE_CHANGE_READY_TO_PAUSED:
     GST_DEBUG_OBJECT (element, "Going to PAUSED");
+    g_mutex_lock (&priv->lock);
+    if (!priv->streams_complete) {
+      /* like decodebin2, we preroll once all our pads are exposed */
+      GST_DEBUG_OBJECT (element, "Streams not exposed yet, going async");
+      priv->async_pending = TRUE;
+      do_async_start (self);
+      ret = GST_STATE_CHANGE_ASYNC;
+    }
+    g_mutex_unlock (&priv->lock);
     break;
-#if 0
-  case GST_STATE_CHANGE_READY_TO_PAUSED:
-    /* TODO: check subprocess is ready with the help of file monitoring, if
-     * not, do the change asynchronously */
-      {
-        GstMessage *message;
-        ret = GST_STATE_CHANGE_ASYNC;
-
-        message = gst_message_new_async_start (GST_OBJECT_CAST (element), FALSE);
-        parent_class->handle_message (GST_BIN (element), message);
-
-        /* Yeah, this is a hack */
-        g_timeout_add (2000, do_async_done, self);
-      }
-
-    break;
-#endif
   case GST_STATE_CHANGE_PAUSED_TO_PLAYING:
     GST_DEBUG_OBJECT (element, "Going to PLAYING");
     break;
+  case GST_STATE_CHANGE_PAUSED_TO_READY:
+    /* stop serving the decoder before typefind deactivates */
+    gst_element_set_state (priv->inputsink, GST_STATE_READY);
+    break;
   default:
     break;
   }
@@ -343,55 +2148,37 @@ gst_sandboxed_decodebin_change_state (GstElement *element,
     if (bret == GST_STATE_CHANGE_FAILURE) {
       GST_WARNING_OBJECT (element, "parent change_state failed!");
       ret = bret;
+    } else if (ret == GST_STATE_CHANGE_SUCCESS) {
+      ret = bret;
     }
   }
 
+  if (ret == GST_STATE_CHANGE_FAILURE
+      || state_change == GST_STATE_CHANGE_PAUSED_TO_READY) {
+    /* nobody is waiting for the decoder any more */
+    g_mutex_lock (&priv->lock);
+    if (priv->async_pending) {
+      priv->async_pending = FALSE;
+      do_async_done (self);
+    }
+    g_mutex_unlock (&priv->lock);
+  }
+
   if (ret != GST_STATE_CHANGE_FAILURE) {
-    GstStateChangeReturn fdret;
-    gint fd;
     switch (state_change) {
-    case GST_STATE_CHANGE_READY_TO_PAUSED:
-      GST_DEBUG_OBJECT (element, "Trying to set fdsink to PLAYING");
-      fdret = gst_element_set_state (priv->fdsink, GST_STATE_PLAYING);
-      GST_DEBUG_OBJECT (element, "Returned: %s",
-                        gst_element_state_change_return_get_name (fdret));
-      break;
-    case GST_STATE_CHANGE_PAUSED_TO_PLAYING:
-      g_object_get (priv->audiosrc,
-                    "shm-area-name", &priv->audio_shm_area_name, NULL);
-      g_object_get (priv->videosrc,
-                    "shm-area-name", &priv->video_shm_area_name, NULL);
-      GST_DEBUG_OBJECT (element, "Name of audio/video shm areas: "
-                        "\"%s\" and \"%s\"\n",
-                        priv->audio_shm_area_name,
-                        priv->video_shm_area_name);
-      break;
     case GST_STATE_CHANGE_READY_TO_NULL:
-      /* Closing the fd sounds like a polite thing to do now*/
-      g_object_get (priv->fdsink, "fd", &fd, NULL);
-      close (fd);
+      gst_element_set_state (priv->inputsink, GST_STATE_NULL);
+      /* the decoder sees the end of its input channel */
+      g_mutex_lock (&priv->lock);
+      if (priv->input_sink_fd != -1) {
+        close (priv->input_sink_fd);
+        priv->input_sink_fd = -1;
+      }
+      g_mutex_unlock (&priv->lock);
 
-      /* Unlinking the stuff the decoder could not unlink because it doesn't
-       * have the necessary privileges */
-      GST_DEBUG_OBJECT (element, "Trying to unlink %s and %s",
-                        priv->shm_video_socket_path,
-                        priv->shm_audio_socket_path);
-      if (-1 == g_unlink (priv->shm_video_socket_path))
-        GST_WARNING_OBJECT (element, "Could not unlink %s: %m", priv->shm_video_socket_path);
-      if (-1 == g_unlink (priv->shm_audio_socket_path))
-        GST_WARNING_OBJECT (element, "Could not unlink %s: %m", priv->shm_audio_socket_path);
-
-      GST_DEBUG_OBJECT (element,
-                        "Trying to unlink audio/video shm areas: \"%s\" and \"%s\"\n",
-                        priv->audio_shm_area_name,
-                        priv->video_shm_area_name);
-      if (-1 == shm_unlink (priv->audio_shm_area_name))
-        GST_WARNING_OBJECT (element, "Could not unlink shm area %s: %m",
-                            priv->audio_shm_area_name);
-      if (-1 == shm_unlink (priv->video_shm_area_name))
-        GST_WARNING_OBJECT (element, "Could not unlink shm area %s: %m",
-                            priv->video_shm_area_name);
-      /* FIXME: where do we free all these strings? */
+      /* The shm areas are anonymous, they go away with their last mapping,
+       * and nothing of ours lives on the filesystem */
+      stop_decoder (self);
       break;
     default:
       break;
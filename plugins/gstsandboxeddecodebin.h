@@ -48,6 +48,15 @@ struct _GstSandboxedDecodeBinClass {
 
 GType gst_sandboxed_decodebin_get_type (void);
 
+#define GST_TYPE_SANDBOX_BACKEND (gst_sandbox_backend_get_type ())
+GType gst_sandbox_backend_get_type (void);
+
+#define GST_TYPE_SANDBOX_SCHEDULING (gst_sandbox_scheduling_get_type ())
+GType gst_sandbox_scheduling_get_type (void);
+
+#define GST_TYPE_SANDBOX_HUGE_PAGES (gst_sandbox_huge_pages_get_type ())
+GType gst_sandbox_huge_pages_get_type (void);
+
 G_END_DECLS
 
 #endif /* __GST_SANDBOXEDDECODEBIN_H__ */
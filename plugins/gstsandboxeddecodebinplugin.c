@@ -47,12 +47,18 @@
 
 #include <gst/gst.h>
 #include "gstsandboxeddecodebin.h"
+#include "gstsandboxsrc.h"
+#include "gstsandboxinputsink.h"
 
 static gboolean
 plugin_init (GstPlugin * plugin)
 {
   gst_element_register (plugin, "sandboxeddecodebin", GST_RANK_NONE,
       GST_SANDBOXED_DECODEBIN_TYPE);
+  gst_element_register (plugin, "sandboxsrc", GST_RANK_NONE,
+      GST_SANDBOX_SRC_TYPE);
+  gst_element_register (plugin, "sandboxinputsink", GST_RANK_NONE,
+      GST_SANDBOX_INPUT_SINK_TYPE);
 
   return TRUE;
 }
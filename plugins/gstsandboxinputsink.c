@@ -0,0 +1,655 @@
+/*
+ * Copyright (C) 2012 Igalia S.L.
+*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/**
+ * SECTION:element-sandboxinputsink
+ *
+ * Serves the input of the sandboxed decoder, whose sandboxinputsrc asks for
+ * ranges of bytes. When upstream can work in pull mode, reads are served
+ * straight from it at any offset, which lets demuxers in the sandbox find
+ * their index and seek. Otherwise, upstream pushes into a bounded queue and
+ * only reads going forward can be served.
+ *
+ * Setting the fd while serving moves the server to the new socket, which is
+ * how a spare decoder takes over from one that crashed. Only a decoder in
+ * pull mode can start over with it.
+ *
+ * Duration, position, seeking, latency and conversion queries of the decoder
+ * are run upstream of us.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <gst/base/gstadapter.h>
+
+#include "gstsandboxinputsink.h"
+#include "sandboxipc.h"
+
+GST_DEBUG_CATEGORY_STATIC (gst_debug_sandbox_input_sink);
+#define GST_CAT_DEFAULT gst_debug_sandbox_input_sink
+
+G_DEFINE_TYPE (GstSandboxInputSink, gst_sandbox_input_sink, GST_TYPE_ELEMENT);
+
+#define GST_SANDBOX_INPUT_SINK_GET_PRIVATE(o)\
+    (G_TYPE_INSTANCE_GET_PRIVATE ((o), GST_SANDBOX_INPUT_SINK_TYPE, GstSandboxInputSinkPrivate))
+
+/* how much pushed input we keep for the decoder to read */
+#define MAX_QUEUED_INPUT (1024 * 1024)
+
+enum {
+  PROP_0,
+  PROP_FD,
+  PROP_BYTES_SERVED,
+  PROP_PULL_MODE
+};
+
+static GstStaticPadTemplate sink_template = GST_STATIC_PAD_TEMPLATE ("sink",
+    GST_PAD_SINK,
+    GST_PAD_ALWAYS,
+    GST_STATIC_CAPS_ANY);
+
+struct _GstSandboxInputSinkPrivate {
+  gint fd;
+
+  GstPad *sinkpad;
+  gboolean pull_mode;
+
+  /* serves the reads of the decoder, GstPoll so that we can interrupt it.
+   * server_lock serialises starting and stopping it */
+  GMutex server_lock;
+  SandboxChannel *channel;
+  GstPoll *poll;
+  GThread *server;
+
+  /* protects the fields below, the push mode queue */
+  GMutex lock;
+  GCond cond;
+  GstAdapter *adapter;
+  /* offset in the input of the data in the adapter */
+  guint64 adapter_offset;
+  gboolean eos;
+  gboolean flushing;
+  gboolean stopping;
+  /* what the decoder got from us */
+  guint64 bytes_served;
+};
+
+/* internal helpers */
+
+/* Sends size bytes of data in as many messages as needed, the last one with
+ * flags and SANDBOX_DATA_LAST */
+static gboolean
+send_data (GstSandboxInputSink *self,
+           guint32 seqnum,
+           const guint8 *data,
+           gsize size,
+           guint32 flags)
+{
+  SandboxDataMessage *header;
+  guint8 *payload;
+  gboolean ret;
+
+  payload = g_malloc (SANDBOX_IPC_MAX_PAYLOAD_SIZE);
+  header = (SandboxDataMessage *) payload;
+  do {
+    gsize chunk = MIN (size, SANDBOX_DATA_CHUNK_SIZE);
+
+    header->seqnum = seqnum;
+    header->flags = chunk == size ? flags | SANDBOX_DATA_LAST : 0;
+    if (chunk > 0)
+      memcpy (payload + sizeof (SandboxDataMessage), data, chunk);
+    ret = sandbox_channel_send (self->priv->channel, SANDBOX_MESSAGE_DATA,
+                                payload, sizeof (SandboxDataMessage) + chunk,
+                                NULL, 0);
+    data += chunk;
+    size -= chunk;
+    if (ret) {
+      g_mutex_lock (&self->priv->lock);
+      self->priv->bytes_served += chunk;
+      g_mutex_unlock (&self->priv->lock);
+    }
+  } while (ret && size > 0);
+  g_free (payload);
+
+  return ret;
+}
+
+static void
+send_input_info (GstSandboxInputSink *self)
+{
+  GstSandboxInputSinkPrivate *priv = self->priv;
+  SandboxInputInfoMessage info;
+  GstFormat format = GST_FORMAT_BYTES;
+  gint64 duration;
+
+  info.size = SANDBOX_INPUT_SIZE_UNKNOWN;
+  if (gst_pad_query_peer_duration (priv->sinkpad, &format, &duration)
+      && format == GST_FORMAT_BYTES && duration >= 0)
+    info.size = duration;
+  info.seekable = priv->pull_mode;
+
+  if (!sandbox_channel_send (priv->channel, SANDBOX_MESSAGE_INPUT_INFO,
+                             &info, sizeof (info), NULL, 0))
+    GST_DEBUG_OBJECT (self, "Could not send the input info: %m");
+}
+
+/* Serves a read from what upstream pushed. Only reads going forward can be
+ * served, the data before them is dropped. */
+static GstFlowReturn
+read_queued (GstSandboxInputSink *self,
+             guint64 offset,
+             guint size,
+             GstBuffer **buffer)
+{
+  GstSandboxInputSinkPrivate *priv = self->priv;
+  GstFlowReturn ret;
+
+  g_mutex_lock (&priv->lock);
+  if (offset < priv->adapter_offset) {
+    g_mutex_unlock (&priv->lock);
+    GST_WARNING_OBJECT (self, "Decoder wants to go back to %" G_GUINT64_FORMAT
+                        " but upstream can't seek", offset);
+    return GST_FLOW_ERROR;
+  }
+
+  for (;;) {
+    guint available = gst_adapter_available (priv->adapter);
+    guint64 skip = offset - priv->adapter_offset;
+
+    if (priv->stopping) {
+      ret = GST_FLOW_WRONG_STATE;
+      break;
+    }
+
+    if (skip > 0 && available > 0) {
+      guint flushed = MIN (skip, available);
+
+      gst_adapter_flush (priv->adapter, flushed);
+      priv->adapter_offset += flushed;
+      g_cond_broadcast (&priv->cond);
+      continue;
+    }
+
+    if (skip == 0 && (available >= size || (priv->eos && available > 0))) {
+      guint taken = MIN (size, available);
+
+      *buffer = gst_adapter_take_buffer (priv->adapter, taken);
+      priv->adapter_offset += taken;
+      g_cond_broadcast (&priv->cond);
+      ret = GST_FLOW_OK;
+      break;
+    }
+
+    if (priv->eos) {
+      ret = GST_FLOW_UNEXPECTED;
+      break;
+    }
+
+    g_cond_wait (&priv->cond, &priv->lock);
+  }
+  g_mutex_unlock (&priv->lock);
+
+  return ret;
+}
+
+static void
+handle_read (GstSandboxInputSink *self, SandboxMessage *message)
+{
+  GstSandboxInputSinkPrivate *priv = self->priv;
+  const SandboxReadMessage *request;
+  GstBuffer *buffer = NULL;
+  GstFlowReturn ret;
+  gboolean sent;
+  guint size;
+
+  request = sandbox_message_get_payload (message, sizeof (*request));
+  if (!request || request->size == 0) {
+    GST_WARNING_OBJECT (self, "Invalid read request");
+    return;
+  }
+
+  /* the decoder takes short reads, don't let it have us pull or wait for
+   * more than we ever queue */
+  size = MIN (request->size, MAX_QUEUED_INPUT);
+  GST_LOG_OBJECT (self, "Decoder reads %u bytes at %" G_GUINT64_FORMAT,
+                  size, request->offset);
+
+  if (priv->pull_mode)
+    ret = gst_pad_pull_range (priv->sinkpad, request->offset, size, &buffer);
+  else
+    ret = read_queued (self, request->offset, size, &buffer);
+
+  switch (ret) {
+  case GST_FLOW_OK:
+    sent = send_data (self, request->seqnum, GST_BUFFER_DATA (buffer),
+                      MIN (GST_BUFFER_SIZE (buffer), size), 0);
+    gst_buffer_unref (buffer);
+    break;
+  case GST_FLOW_UNEXPECTED:
+    sent = send_data (self, request->seqnum, NULL, 0, 0);
+    break;
+  default:
+    GST_DEBUG_OBJECT (self, "Could not read: %s", gst_flow_get_name (ret));
+    sent = send_data (self, request->seqnum, NULL, 0, SANDBOX_DATA_ERROR);
+    break;
+  }
+
+  if (!sent)
+    GST_DEBUG_OBJECT (self, "Could not answer the decoder: %m");
+}
+
+/* Runs a query of the decoder upstream of us. The decoder only gets what
+ * sandbox_message_parse_query() lets through. */
+static void
+handle_query (GstSandboxInputSink *self, SandboxMessage *message)
+{
+  SandboxQueryMessage result;
+  GstQuery *query;
+
+  query = sandbox_message_parse_query (message);
+  if (!query) {
+    GST_WARNING_OBJECT (self, "Invalid query");
+    return;
+  }
+
+  result = *sandbox_message_get_query_header (message);
+  result.answered = gst_pad_peer_query (self->priv->sinkpad, query);
+  GST_LOG_OBJECT (self, "Decoder queries %s: %s", GST_QUERY_TYPE_NAME (query),
+                  result.answered ? "answered" : "not answered");
+
+  if (!sandbox_channel_send_query (self->priv->channel,
+                                   SANDBOX_MESSAGE_QUERY_RESULT, query,
+                                   &result))
+    GST_DEBUG_OBJECT (self, "Could not answer the decoder: %m");
+  gst_query_unref (query);
+}
+
+static gpointer
+server_thread (GstSandboxInputSink *self)
+{
+  GstSandboxInputSinkPrivate *priv = self->priv;
+  SandboxMessage *message;
+  GstPollFD pollfd = GST_POLL_FD_INIT;
+
+  pollfd.fd = sandbox_channel_get_fd (priv->channel);
+  gst_poll_add_fd (priv->poll, &pollfd);
+  gst_poll_fd_ctl_read (priv->poll, &pollfd, TRUE);
+
+  message = g_new (SandboxMessage, 1);
+  for (;;) {
+    if (gst_poll_wait (priv->poll, GST_CLOCK_TIME_NONE) < 0) {
+      if (errno == EINTR || errno == EAGAIN)
+        continue;
+      /* we are stopping */
+      break;
+    }
+
+    if (sandbox_channel_receive (priv->channel, message) != SANDBOX_CHANNEL_OK) {
+      GST_DEBUG_OBJECT (self, "Decoder went away");
+      break;
+    }
+
+    switch (message->type) {
+    case SANDBOX_MESSAGE_QUERY_INPUT_INFO:
+      send_input_info (self);
+      break;
+    case SANDBOX_MESSAGE_READ:
+      handle_read (self, message);
+      break;
+    case SANDBOX_MESSAGE_QUERY:
+      handle_query (self, message);
+      break;
+    default:
+      GST_WARNING_OBJECT (self, "Unexpected message type %u", message->type);
+      break;
+    }
+    sandbox_message_close_fds (message);
+  }
+  gst_poll_remove_fd (priv->poll, &pollfd);
+  g_free (message);
+
+  return NULL;
+}
+
+static gboolean
+start_server (GstSandboxInputSink *self, gboolean pull_mode)
+{
+  GstSandboxInputSinkPrivate *priv = self->priv;
+  gint fd;
+
+  if (priv->fd == -1) {
+    GST_ELEMENT_ERROR (self, RESOURCE, NOT_FOUND, ("No fd set"), (NULL));
+    return FALSE;
+  }
+
+  fd = dup (priv->fd);
+  if (fd == -1) {
+    GST_ELEMENT_ERROR (self, RESOURCE, OPEN_WRITE, (NULL),
+                       ("Could not dup fd %d: %s", priv->fd,
+                        g_strerror (errno)));
+    return FALSE;
+  }
+
+  GST_DEBUG_OBJECT (self, "Serving the input in %s mode",
+                    pull_mode ? "pull" : "push");
+
+  priv->pull_mode = pull_mode;
+  priv->channel = sandbox_channel_new (fd);
+  priv->adapter_offset = 0;
+  priv->eos = FALSE;
+  priv->flushing = FALSE;
+  priv->stopping = FALSE;
+  priv->bytes_served = 0;
+  priv->poll = gst_poll_new (TRUE);
+  priv->server = g_thread_new ("sandboxinputsink-server",
+                               (GThreadFunc) server_thread, self);
+
+  return TRUE;
+}
+
+static void
+stop_server (GstSandboxInputSink *self)
+{
+  GstSandboxInputSinkPrivate *priv = self->priv;
+
+  if (!priv->server)
+    return;
+
+  g_mutex_lock (&priv->lock);
+  priv->stopping = TRUE;
+  g_cond_broadcast (&priv->cond);
+  g_mutex_unlock (&priv->lock);
+
+  gst_poll_set_flushing (priv->poll, TRUE);
+  g_thread_join (priv->server);
+  priv->server = NULL;
+  gst_poll_free (priv->poll);
+  priv->poll = NULL;
+
+  sandbox_channel_unref (priv->channel);
+  priv->channel = NULL;
+  gst_adapter_clear (priv->adapter);
+}
+
+/* Serves the reads on the new fd instead, if we are serving */
+static void
+restart_server (GstSandboxInputSink *self)
+{
+  GstSandboxInputSinkPrivate *priv = self->priv;
+  guint64 bytes_served;
+
+  if (!priv->server)
+    return;
+
+  GST_DEBUG_OBJECT (self, "Moving to fd %d", priv->fd);
+  g_mutex_lock (&priv->lock);
+  bytes_served = priv->bytes_served;
+  g_mutex_unlock (&priv->lock);
+
+  stop_server (self);
+  if (!start_server (self, priv->pull_mode))
+    return;
+
+  g_mutex_lock (&priv->lock);
+  priv->bytes_served = bytes_served;
+  g_mutex_unlock (&priv->lock);
+}
+
+/* pad functions */
+
+static gboolean
+gst_sandbox_input_sink_activate (GstPad *pad)
+{
+  if (gst_pad_check_pull_range (pad))
+    return gst_pad_activate_pull (pad, TRUE);
+
+  return gst_pad_activate_push (pad, TRUE);
+}
+
+static gboolean
+activate_server (GstSandboxInputSink *self,
+                 gboolean pull_mode,
+                 gboolean active)
+{
+  GstSandboxInputSinkPrivate *priv = self->priv;
+  gboolean ret = TRUE;
+
+  g_mutex_lock (&priv->server_lock);
+  if (active)
+    ret = start_server (self, pull_mode);
+  else
+    stop_server (self);
+  g_mutex_unlock (&priv->server_lock);
+
+  return ret;
+}
+
+static gboolean
+gst_sandbox_input_sink_activate_pull (GstPad *pad, gboolean active)
+{
+  GstSandboxInputSink *self = GST_SANDBOX_INPUT_SINK (GST_PAD_PARENT (pad));
+
+  return activate_server (self, TRUE, active);
+}
+
+static gboolean
+gst_sandbox_input_sink_activate_push (GstPad *pad, gboolean active)
+{
+  GstSandboxInputSink *self = GST_SANDBOX_INPUT_SINK (GST_PAD_PARENT (pad));
+
+  return activate_server (self, FALSE, active);
+}
+
+static GstFlowReturn
+gst_sandbox_input_sink_chain (GstPad *pad, GstBuffer *buffer)
+{
+  GstSandboxInputSink *self = GST_SANDBOX_INPUT_SINK (GST_PAD_PARENT (pad));
+  GstSandboxInputSinkPrivate *priv = self->priv;
+  GstFlowReturn ret = GST_FLOW_OK;
+
+  g_mutex_lock (&priv->lock);
+  /* the decoder reads at its own pace */
+  while (gst_adapter_available (priv->adapter) >= MAX_QUEUED_INPUT
+         && !priv->flushing && !priv->stopping)
+    g_cond_wait (&priv->cond, &priv->lock);
+
+  if (priv->flushing || priv->stopping) {
+    gst_buffer_unref (buffer);
+    ret = GST_FLOW_WRONG_STATE;
+  } else {
+    gst_adapter_push (priv->adapter, buffer);
+    g_cond_broadcast (&priv->cond);
+  }
+  g_mutex_unlock (&priv->lock);
+
+  return ret;
+}
+
+static gboolean
+gst_sandbox_input_sink_event (GstPad *pad, GstEvent *event)
+{
+  GstSandboxInputSink *self = GST_SANDBOX_INPUT_SINK (GST_PAD_PARENT (pad));
+  GstSandboxInputSinkPrivate *priv = self->priv;
+
+  g_mutex_lock (&priv->lock);
+  switch (GST_EVENT_TYPE (event)) {
+  case GST_EVENT_EOS:
+    priv->eos = TRUE;
+    break;
+  case GST_EVENT_FLUSH_START:
+    priv->flushing = TRUE;
+    break;
+  case GST_EVENT_FLUSH_STOP:
+    priv->flushing = FALSE;
+    priv->eos = FALSE;
+    gst_adapter_clear (priv->adapter);
+    break;
+  case GST_EVENT_NEWSEGMENT:
+  {
+    GstFormat format;
+    gint64 start;
+
+    gst_event_parse_new_segment (event, NULL, NULL, &format, &start, NULL,
+                                 NULL);
+    if (format == GST_FORMAT_BYTES && start >= 0
+        && gst_adapter_available (priv->adapter) == 0)
+      priv->adapter_offset = start;
+    break;
+  }
+  default:
+    break;
+  }
+  g_cond_broadcast (&priv->cond);
+  g_mutex_unlock (&priv->lock);
+
+  gst_event_unref (event);
+
+  return TRUE;
+}
+
+/* GObject vmethod implementations */
+
+static void
+gst_sandbox_input_sink_set_property (GObject *object,
+                                     guint prop_id,
+                                     const GValue *value,
+                                     GParamSpec *pspec)
+{
+  GstSandboxInputSink *self = GST_SANDBOX_INPUT_SINK (object);
+  GstSandboxInputSinkPrivate *priv = self->priv;
+
+  switch (prop_id) {
+  case PROP_FD:
+    g_mutex_lock (&priv->server_lock);
+    priv->fd = g_value_get_int (value);
+    restart_server (self);
+    g_mutex_unlock (&priv->server_lock);
+    break;
+  default:
+    G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+    break;
+  }
+}
+
+static void
+gst_sandbox_input_sink_get_property (GObject *object,
+                                     guint prop_id,
+                                     GValue *value,
+                                     GParamSpec *pspec)
+{
+  GstSandboxInputSinkPrivate *priv = GST_SANDBOX_INPUT_SINK (object)->priv;
+
+  switch (prop_id) {
+  case PROP_FD:
+    g_value_set_int (value, priv->fd);
+    break;
+  case PROP_BYTES_SERVED:
+    g_mutex_lock (&priv->lock);
+    g_value_set_uint64 (value, priv->bytes_served);
+    g_mutex_unlock (&priv->lock);
+    break;
+  case PROP_PULL_MODE:
+    g_mutex_lock (&priv->server_lock);
+    g_value_set_boolean (value, priv->server && priv->pull_mode);
+    g_mutex_unlock (&priv->server_lock);
+    break;
+  default:
+    G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+    break;
+  }
+}
+
+static void
+gst_sandbox_input_sink_finalize (GstSandboxInputSink *self)
+{
+  g_object_unref (self->priv->adapter);
+  g_mutex_clear (&self->priv->lock);
+  g_mutex_clear (&self->priv->server_lock);
+  g_cond_clear (&self->priv->cond);
+
+  G_OBJECT_CLASS (gst_sandbox_input_sink_parent_class)->finalize (G_OBJECT (self));
+}
+
+static void
+gst_sandbox_input_sink_init (GstSandboxInputSink *self)
+{
+  GstSandboxInputSinkPrivate *priv;
+
+  self->priv = priv = GST_SANDBOX_INPUT_SINK_GET_PRIVATE (self);
+
+  priv->fd = -1;
+  priv->adapter = gst_adapter_new ();
+  g_mutex_init (&priv->lock);
+  g_mutex_init (&priv->server_lock);
+  g_cond_init (&priv->cond);
+
+  priv->sinkpad = gst_pad_new_from_static_template (&sink_template, "sink");
+  gst_pad_set_activate_function (priv->sinkpad,
+      GST_DEBUG_FUNCPTR (gst_sandbox_input_sink_activate));
+  gst_pad_set_activatepull_function (priv->sinkpad,
+      GST_DEBUG_FUNCPTR (gst_sandbox_input_sink_activate_pull));
+  gst_pad_set_activatepush_function (priv->sinkpad,
+      GST_DEBUG_FUNCPTR (gst_sandbox_input_sink_activate_push));
+  gst_pad_set_chain_function (priv->sinkpad,
+      GST_DEBUG_FUNCPTR (gst_sandbox_input_sink_chain));
+  gst_pad_set_event_function (priv->sinkpad,
+      GST_DEBUG_FUNCPTR (gst_sandbox_input_sink_event));
+  gst_element_add_pad (GST_ELEMENT (self), priv->sinkpad);
+}
+
+static void
+gst_sandbox_input_sink_class_init (GstSandboxInputSinkClass *self_class)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (self_class);
+  GstElementClass *element_class = GST_ELEMENT_CLASS (self_class);
+
+  GST_DEBUG_CATEGORY_INIT (gst_debug_sandbox_input_sink, "sandboxinputsink", 0,
+      "serves the input of the sandboxed decoder");
+
+  g_type_class_add_private (self_class, sizeof (GstSandboxInputSinkPrivate));
+  object_class->set_property = gst_sandbox_input_sink_set_property;
+  object_class->get_property = gst_sandbox_input_sink_get_property;
+  object_class->finalize = (void (*) (GObject *object)) gst_sandbox_input_sink_finalize;
+
+  g_object_class_install_property (object_class, PROP_FD,
+      g_param_spec_int ("fd", "fd",
+                        "Socket connected to the decoder's sandboxinputsrc",
+                        -1, G_MAXINT, -1,
+                        G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (object_class, PROP_BYTES_SERVED,
+      g_param_spec_uint64 ("bytes-served", "Bytes served",
+                           "Input bytes sent to the decoder",
+                           0, G_MAXUINT64, 0,
+                           G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (object_class, PROP_PULL_MODE,
+      g_param_spec_boolean ("pull-mode", "Pull mode",
+                            "Whether the decoder's reads are served straight "
+                            "from upstream, at any offset",
+                            FALSE,
+                            G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+  gst_element_class_add_pad_template (element_class,
+      gst_static_pad_template_get (&sink_template));
+  gst_element_class_set_details_simple (element_class,
+      "Sandbox input sink", "Sink",
+      "Serves the reads of the sandboxed decoder from upstream",
+      "Guillaume Emont <guijemont@igalia.com>");
+}
@@ -0,0 +1,53 @@
+/*
+ * Copyright (C) 2012 Igalia S.L.
+*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __GST_SANDBOX_INPUT_SINK_H__
+#define __GST_SANDBOX_INPUT_SINK_H__
+
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+
+#define GST_SANDBOX_INPUT_SINK_TYPE (gst_sandbox_input_sink_get_type ())
+#define GST_SANDBOX_INPUT_SINK(obj) (G_TYPE_CHECK_INSTANCE_CAST ((obj), GST_SANDBOX_INPUT_SINK_TYPE, GstSandboxInputSink))
+#define GST_SANDBOX_INPUT_SINK_CLASS(klass) (G_TYPE_CHECK_CLASS_CAST ((klass), GST_SANDBOX_INPUT_SINK_TYPE, GstSandboxInputSinkClass))
+#define IS_GST_SANDBOX_INPUT_SINK(obj) (G_TYPE_CHECK_INSTANCE_TYPE ((obj), GST_SANDBOX_INPUT_SINK_TYPE))
+#define IS_GST_SANDBOX_INPUT_SINK_CLASS(klass) (G_TYPE_CHECK_CLASS_TYPE ((klass), GST_SANDBOX_INPUT_SINK_TYPE))
+#define GST_SANDBOX_INPUT_SINK_GET_CLASS(obj) (G_TYPE_INSTANCE_GET_CLASS ((obj), GST_SANDBOX_INPUT_SINK_TYPE, GstSandboxInputSinkClass))
+
+typedef struct _GstSandboxInputSink GstSandboxInputSink;
+typedef struct _GstSandboxInputSinkClass GstSandboxInputSinkClass;
+
+typedef struct _GstSandboxInputSinkPrivate GstSandboxInputSinkPrivate;
+
+struct _GstSandboxInputSink {
+  GstElement parent;
+
+  GstSandboxInputSinkPrivate *priv;
+};
+
+struct _GstSandboxInputSinkClass {
+  GstElementClass parent;
+};
+
+GType gst_sandbox_input_sink_get_type (void);
+
+G_END_DECLS
+
+#endif /* __GST_SANDBOX_INPUT_SINK_H__ */
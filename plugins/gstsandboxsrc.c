@@ -0,0 +1,1081 @@
+/*
+ * Copyright (C) 2012 Igalia S.L.
+*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/**
+ * SECTION:element-sandboxsrc
+ *
+ * Receiving end of the sandboxsink running in the decoder subprocess. The
+ * buffers we push wrap the shared memory the decoder wrote into, without
+ * any copy; the memory is handed back to the decoder when they are freed.
+ *
+ * Everything the decoder tells us is checked: it is the process we are
+ * protecting ourselves from.
+ *
+ * The stats property tells what went through since the element started: the
+ * buffers and bytes received, the shared memory we hold (now and at most),
+ * the time the decoder spent waiting for us to release some, and how long
+ * buffers took from the decoder's sink to us.
+ *
+ * Seeks and QoS events from downstream go to the decoder, so that it skips
+ * frames our sinks would only drop. So do the caps downstream accepts, each
+ * time the decoder announces new caps: the decoder converts and scales to
+ * those before the buffers go through shared memory.
+ *
+ * When resumable, the decoder going away without sending EOS is not an
+ * error: the source waits for sandboxeddecodebin to hand it the channel of
+ * a spare decoder, see gst_sandbox_src_resume(), and has it seek to where
+ * the crashed one stopped.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "gstsandboxsrc.h"
+#include "sandboxipc.h"
+#include "shmarea.h"
+
+GST_DEBUG_CATEGORY_STATIC (gst_debug_sandbox_src);
+#define GST_CAT_DEFAULT gst_debug_sandbox_src
+
+G_DEFINE_TYPE (GstSandboxSrc, gst_sandbox_src, GST_TYPE_PUSH_SRC);
+
+#define GST_SANDBOX_SRC_GET_PRIVATE(o)\
+    (G_TYPE_INSTANCE_GET_PRIVATE ((o), GST_SANDBOX_SRC_TYPE, GstSandboxSrcPrivate))
+
+/* the only flags that make sense for the buffers we get */
+#define ALLOWED_BUFFER_FLAGS (GST_BUFFER_FLAG_DISCONT | GST_BUFFER_FLAG_IN_CAPS \
+    | GST_BUFFER_FLAG_GAP | GST_BUFFER_FLAG_DELTA_UNIT)
+
+enum {
+  PROP_0,
+  PROP_FD,
+  PROP_STATS,
+  PROP_RESUMABLE,
+  PROP_POSITION
+};
+
+static GstStaticPadTemplate src_template = GST_STATIC_PAD_TEMPLATE ("src",
+    GST_PAD_SRC,
+    GST_PAD_ALWAYS,
+    GST_STATIC_CAPS_ANY);
+
+struct _GstSandboxSrcPrivate {
+  gint fd;
+  gboolean resumable;
+
+  SandboxChannel *channel;
+  ShmArea *area;
+  guint32 area_id;
+  GstCaps *caps;
+  /* the last caps of downstream we told the decoder about */
+  GstCaps *downstream_caps;
+
+  GstPoll *poll;
+  GstPollFD pollfd;
+  SandboxMessage *message;
+  /* the buffers of a batch we haven't pushed yet */
+  GQueue pending;
+
+  /* the seek basesrc is performing, forwarded in do_seek() */
+  gboolean seek_pending;
+  GstSeekFlags seek_flags;
+  guint32 seek_seqnum;
+  /* after a flushing seek, what the decoder sent before its FLUSH_STOP */
+  gboolean discarding;
+
+  /* protects the stats, buffers are released from any thread */
+  GMutex stats_lock;
+  guint64 buffers;
+  guint64 bytes;
+  guint64 shm_used;
+  guint64 shm_high_water;
+  guint64 shm_wait_time;
+  guint64 latency_total;
+  guint64 latency_max;
+  /* the end of the last buffer we pushed, in the decoder's stream time */
+  GstClockTime position;
+
+  /* protects the fields below, how a spare decoder takes over */
+  GMutex resume_lock;
+  GCond resume_cond;
+  gint resume_fd;
+  GstClockTime resume_position;
+  gboolean resume_seek;
+  gboolean given_up;
+  gboolean unlocked;
+};
+
+/* Attached to each buffer we push, gives the memory back to the decoder */
+typedef struct {
+  GstSandboxSrc *src;
+  SandboxChannel *channel;
+  ShmArea *area;
+  guint32 area_id;
+  guint64 offset;
+  guint64 size;
+} BufferRelease;
+
+/* internal helpers */
+
+static void
+buffer_release (BufferRelease *release)
+{
+  SandboxReleaseMessage message;
+
+  message.offset = release->offset;
+  message.area = release->area_id;
+  if (!sandbox_channel_send (release->channel, SANDBOX_MESSAGE_RELEASE,
+                             &message, sizeof (message), NULL, 0))
+    GST_DEBUG ("Could not release offset %" G_GUINT64_FORMAT
+               ", decoder gone?", release->offset);
+
+  g_mutex_lock (&release->src->priv->stats_lock);
+  release->src->priv->shm_used -= release->size;
+  g_mutex_unlock (&release->src->priv->stats_lock);
+
+  gst_object_unref (release->src);
+  sandbox_channel_unref (release->channel);
+  shm_area_unref (release->area);
+  g_slice_free (BufferRelease, release);
+}
+
+/* Gives a buffer we won't push straight back to the decoder */
+static void
+release_offset (GstSandboxSrc *self, guint64 offset)
+{
+  SandboxReleaseMessage message;
+
+  message.offset = offset;
+  message.area = self->priv->area_id;
+  if (!sandbox_channel_send (self->priv->channel, SANDBOX_MESSAGE_RELEASE,
+                             &message, sizeof (message), NULL, 0))
+    GST_DEBUG_OBJECT (self, "Could not release offset %" G_GUINT64_FORMAT
+                      ", decoder gone?", offset);
+}
+
+/* Whether size bytes at offset are in the current area */
+static gboolean
+is_valid_range (GstSandboxSrc *self, guint64 offset, guint64 size)
+{
+  ShmArea *area = self->priv->area;
+
+  return area && size > 0 && size <= shm_area_get_size (area)
+      && offset <= shm_area_get_size (area) - size;
+}
+
+/* A buffer of the data at offset in the current area, which is released
+ * when the buffer goes away */
+static GstBuffer *
+wrap_shm (GstSandboxSrc *self, guint64 offset, guint64 size)
+{
+  GstSandboxSrcPrivate *priv = self->priv;
+  BufferRelease *release;
+  GstBuffer *buf;
+
+  release = g_slice_new (BufferRelease);
+  release->src = gst_object_ref (self);
+  release->channel = sandbox_channel_ref (priv->channel);
+  release->area = shm_area_ref (priv->area);
+  release->area_id = priv->area_id;
+  release->offset = offset;
+  release->size = size;
+
+  g_mutex_lock (&priv->stats_lock);
+  priv->shm_used += size;
+  priv->shm_high_water = MAX (priv->shm_high_water, priv->shm_used);
+  g_mutex_unlock (&priv->stats_lock);
+
+  buf = gst_buffer_new ();
+  GST_BUFFER_DATA (buf) = shm_area_get_data (priv->area) + offset;
+  GST_BUFFER_SIZE (buf) = size;
+  GST_BUFFER_MALLOCDATA (buf) = (guint8 *) release;
+  GST_BUFFER_FREE_FUNC (buf) = (GFreeFunc) buffer_release;
+
+  return buf;
+}
+
+static void
+set_buffer_metadata (GstSandboxSrc *self,
+                     GstBuffer *buf,
+                     const SandboxBufferMessage *buffer_message)
+{
+  GstSandboxSrcPrivate *priv = self->priv;
+  guint64 now = g_get_monotonic_time () * GST_USECOND;
+  guint64 latency;
+
+  latency = now > buffer_message->render_time
+      ? now - buffer_message->render_time : 0;
+  g_mutex_lock (&priv->stats_lock);
+  priv->buffers++;
+  priv->bytes += buffer_message->size;
+  priv->latency_total += latency;
+  priv->latency_max = MAX (priv->latency_max, latency);
+  g_mutex_unlock (&priv->stats_lock);
+
+  GST_BUFFER_TIMESTAMP (buf) = buffer_message->timestamp;
+  GST_BUFFER_DURATION (buf) = buffer_message->duration;
+  GST_BUFFER_OFFSET (buf) = buffer_message->buffer_offset;
+  GST_BUFFER_OFFSET_END (buf) = buffer_message->buffer_offset_end;
+  GST_BUFFER_FLAG_SET (buf, buffer_message->flags & ALLOWED_BUFFER_FLAGS);
+  if (self->priv->caps)
+    gst_buffer_set_caps (buf, self->priv->caps);
+}
+
+static GstFlowReturn
+handle_shm_wait (GstSandboxSrc *self, SandboxMessage *message)
+{
+  const SandboxShmWaitMessage *wait;
+
+  wait = sandbox_message_get_payload (message, sizeof (*wait));
+  if (!wait) {
+    GST_ELEMENT_ERROR (self, STREAM, DECODE, (NULL),
+                       ("Invalid wait message from the decoder"));
+    return GST_FLOW_ERROR;
+  }
+
+  GST_LOG_OBJECT (self, "Decoder waited %" GST_TIME_FORMAT " for shm so far",
+                  GST_TIME_ARGS (wait->total_wait_time));
+  g_mutex_lock (&self->priv->stats_lock);
+  self->priv->shm_wait_time = wait->total_wait_time;
+  g_mutex_unlock (&self->priv->stats_lock);
+
+  return GST_FLOW_OK;
+}
+
+static GstStructure *
+get_stats (GstSandboxSrc *self)
+{
+  GstSandboxSrcPrivate *priv = self->priv;
+  GstStructure *stats;
+
+  g_mutex_lock (&priv->stats_lock);
+  stats = gst_structure_new ("sandbox-stream-stats",
+      "buffers", G_TYPE_UINT64, priv->buffers,
+      "bytes", G_TYPE_UINT64, priv->bytes,
+      "shm-used", G_TYPE_UINT64, priv->shm_used,
+      "shm-high-water", G_TYPE_UINT64, priv->shm_high_water,
+      "shm-wait-time", G_TYPE_UINT64, priv->shm_wait_time,
+      "latency-average", G_TYPE_UINT64,
+          priv->buffers ? priv->latency_total / priv->buffers : 0,
+      "latency-max", G_TYPE_UINT64, priv->latency_max,
+      NULL);
+  g_mutex_unlock (&priv->stats_lock);
+
+  return stats;
+}
+
+static void
+drop_pending (GstSandboxSrc *self)
+{
+  GstBuffer *buf;
+
+  while ((buf = g_queue_pop_head (&self->priv->pending)))
+    gst_buffer_unref (buf);
+}
+
+static GstFlowReturn
+handle_area (GstSandboxSrc *self, SandboxMessage *message)
+{
+  GstSandboxSrcPrivate *priv = self->priv;
+  const SandboxAreaMessage *area_message;
+  ShmArea *area;
+  gint fd;
+
+  area_message = sandbox_message_get_payload (message, sizeof (*area_message));
+  fd = sandbox_message_steal_fd (message);
+  if (!area_message || fd == -1 || area_message->size > G_MAXSIZE)
+    goto invalid;
+
+  area = shm_area_new_from_fd (fd, area_message->size,
+                               area_message->flags
+                               & (SHM_AREA_TRANSPARENT_HUGE_PAGES
+                                  | SHM_AREA_PREFAULT));
+  if (!area) {
+    GST_ELEMENT_ERROR (self, RESOURCE, OPEN_READ,
+                       ("Could not map the decoder's shm area"),
+                       ("%s", g_strerror (errno)));
+    return GST_FLOW_ERROR;
+  }
+  GST_DEBUG_OBJECT (self, "Mapped shm area %u of %" G_GUINT64_FORMAT " bytes",
+                    area_message->id, area_message->size);
+
+  /* buffers from the previous one keep it alive */
+  if (priv->area)
+    shm_area_unref (priv->area);
+  priv->area = area;
+  priv->area_id = area_message->id;
+
+  return GST_FLOW_OK;
+
+invalid:
+  if (fd != -1)
+    close (fd);
+  GST_ELEMENT_ERROR (self, STREAM, DECODE, (NULL),
+                     ("Invalid area message from the decoder"));
+  return GST_FLOW_ERROR;
+}
+
+/* Tells the decoder what downstream accepts if it changed, so that it
+ * converts to it rather than sending what downstream would convert anyway */
+static void
+send_downstream_caps (GstSandboxSrc *self)
+{
+  GstSandboxSrcPrivate *priv = self->priv;
+  GstCaps *caps;
+
+  caps = gst_pad_peer_get_caps_reffed (GST_BASE_SRC_PAD (self));
+  if (!caps)
+    return;
+
+  /* nothing the decoder could do with those */
+  if (gst_caps_is_any (caps) || gst_caps_is_empty (caps)
+      || (priv->downstream_caps
+          && gst_caps_is_equal (caps, priv->downstream_caps))) {
+    gst_caps_unref (caps);
+    return;
+  }
+
+  GST_DEBUG_OBJECT (self, "Downstream accepts %" GST_PTR_FORMAT, caps);
+  if (sandbox_channel_send_caps (priv->channel, caps))
+    gst_caps_replace (&priv->downstream_caps, caps);
+  else
+    GST_DEBUG_OBJECT (self, "Could not send downstream caps: %m");
+  gst_caps_unref (caps);
+}
+
+static GstFlowReturn
+handle_caps (GstSandboxSrc *self, SandboxMessage *message)
+{
+  GstCaps *caps;
+
+  caps = sandbox_message_parse_caps (message);
+  if (!caps || !gst_caps_is_fixed (caps)) {
+    if (caps)
+      gst_caps_unref (caps);
+    GST_ELEMENT_ERROR (self, STREAM, DECODE, (NULL),
+                       ("Invalid caps from the decoder"));
+    return GST_FLOW_ERROR;
+  }
+
+  GST_DEBUG_OBJECT (self, "New caps: %" GST_PTR_FORMAT, caps);
+  gst_caps_replace (&self->priv->caps, caps);
+  gst_caps_unref (caps);
+
+  send_downstream_caps (self);
+
+  return GST_FLOW_OK;
+}
+
+static GstFlowReturn
+handle_event (GstSandboxSrc *self, SandboxMessage *message)
+{
+  GstEvent *event;
+
+  event = sandbox_message_parse_event (message);
+  if (!event || !GST_EVENT_IS_DOWNSTREAM (event)) {
+    if (event)
+      gst_event_unref (event);
+    GST_ELEMENT_ERROR (self, STREAM, DECODE, (NULL),
+                       ("Invalid event from the decoder"));
+    return GST_FLOW_ERROR;
+  }
+
+  GST_DEBUG_OBJECT (self, "Got %s event", GST_EVENT_TYPE_NAME (event));
+
+  if (self->priv->discarding) {
+    if (GST_EVENT_TYPE (event) == GST_EVENT_FLUSH_STOP) {
+      GST_DEBUG_OBJECT (self, "Decoder flushed, done discarding");
+      self->priv->discarding = FALSE;
+    }
+    gst_event_unref (event);
+    return GST_FLOW_OK;
+  }
+
+  switch (GST_EVENT_TYPE (event)) {
+  case GST_EVENT_EOS:
+    /* basesrc sends EOS downstream for us */
+    gst_event_unref (event);
+    return GST_FLOW_UNEXPECTED;
+  case GST_EVENT_FLUSH_START:
+  case GST_EVENT_FLUSH_STOP:
+    /* flushing on our side is basesrc's business */
+    gst_event_unref (event);
+    break;
+  default:
+    gst_pad_push_event (GST_BASE_SRC_PAD (self), event);
+    break;
+  }
+
+  return GST_FLOW_OK;
+}
+
+static GstFlowReturn
+handle_buffer (GstSandboxSrc *self,
+               SandboxMessage *message,
+               GstBuffer **buffer)
+{
+  const SandboxBufferMessage *buffer_message;
+  GstBuffer *buf;
+
+  buffer_message = sandbox_message_get_payload (message,
+                                                sizeof (*buffer_message));
+  if (!buffer_message
+      || !is_valid_range (self, buffer_message->offset, buffer_message->size)) {
+    GST_ELEMENT_ERROR (self, STREAM, DECODE, (NULL),
+                       ("Invalid buffer from the decoder"));
+    return GST_FLOW_ERROR;
+  }
+
+  if (self->priv->discarding) {
+    GST_LOG_OBJECT (self, "Discarding buffer from before the seek");
+    release_offset (self, buffer_message->offset);
+    return GST_FLOW_OK;
+  }
+
+  buf = wrap_shm (self, buffer_message->offset, buffer_message->size);
+  set_buffer_metadata (self, buf, buffer_message);
+
+  *buffer = buf;
+
+  return GST_FLOW_OK;
+}
+
+/* Splits a batch back into its buffers, which all keep the block alive, and
+ * queues them to be pushed */
+static GstFlowReturn
+handle_batch (GstSandboxSrc *self, SandboxMessage *message)
+{
+  GstSandboxSrcPrivate *priv = self->priv;
+  const SandboxBatchMessage *batch;
+  const SandboxBufferMessage *buffers;
+  GstBuffer *block;
+  guint64 size = 0;
+  guint i;
+
+  /* the buffers follow, so the payload is bigger than the header */
+  if (message->size < sizeof (*batch))
+    goto invalid;
+  batch = (const SandboxBatchMessage *) message->payload;
+  if (batch->n_buffers == 0
+      || batch->n_buffers > SANDBOX_BATCH_MAX_BUFFERS
+      || message->size < sizeof (*batch)
+                         + batch->n_buffers * sizeof (SandboxBufferMessage))
+    goto invalid;
+
+  buffers = (const SandboxBufferMessage *) (message->payload + sizeof (*batch));
+  for (i = 0; i < batch->n_buffers; i++) {
+    if (buffers[i].size == 0 || buffers[i].size > G_MAXUINT
+        || buffers[i].offset > G_MAXUINT - buffers[i].size)
+      goto invalid;
+    size = MAX (size, buffers[i].offset + buffers[i].size);
+  }
+  if (!is_valid_range (self, batch->offset, size))
+    goto invalid;
+
+  if (priv->discarding) {
+    GST_LOG_OBJECT (self, "Discarding batch from before the seek");
+    release_offset (self, batch->offset);
+    return GST_FLOW_OK;
+  }
+
+  GST_LOG_OBJECT (self, "Got batch of %u buffers", batch->n_buffers);
+  block = wrap_shm (self, batch->offset, size);
+  for (i = 0; i < batch->n_buffers; i++) {
+    GstBuffer *buf;
+
+    buf = gst_buffer_create_sub (block, buffers[i].offset, buffers[i].size);
+    set_buffer_metadata (self, buf, &buffers[i]);
+    g_queue_push_tail (&priv->pending, buf);
+  }
+  gst_buffer_unref (block);
+
+  return GST_FLOW_OK;
+
+invalid:
+  GST_ELEMENT_ERROR (self, STREAM, DECODE, (NULL),
+                     ("Invalid batch from the decoder"));
+  return GST_FLOW_ERROR;
+}
+
+/* Moves to the stream channel of the decoder that took over, and has it
+ * seek to position unless another source of ours does. Either way, what
+ * comes before the flush of that seek is stale. */
+static void
+switch_channel (GstSandboxSrc *self,
+                gint fd,
+                GstClockTime position,
+                gboolean seek)
+{
+  GstSandboxSrcPrivate *priv = self->priv;
+  SandboxChannel *channel;
+
+  GST_DEBUG_OBJECT (self, "New decoder, resuming at %" GST_TIME_FORMAT,
+                    GST_TIME_ARGS (position));
+
+  gst_poll_remove_fd (priv->poll, &priv->pollfd);
+  gst_poll_fd_init (&priv->pollfd);
+  priv->pollfd.fd = fd;
+  gst_poll_add_fd (priv->poll, &priv->pollfd);
+  gst_poll_fd_ctl_read (priv->poll, &priv->pollfd, TRUE);
+
+  GST_OBJECT_LOCK (self);
+  channel = priv->channel;
+  priv->channel = sandbox_channel_new (fd);
+  GST_OBJECT_UNLOCK (self);
+  sandbox_channel_unref (channel);
+
+  /* buffers still downstream keep the old areas alive */
+  drop_pending (self);
+  if (priv->area) {
+    shm_area_unref (priv->area);
+    priv->area = NULL;
+  }
+  gst_caps_replace (&priv->downstream_caps, NULL);
+  priv->discarding = FALSE;
+
+  if (!GST_CLOCK_TIME_IS_VALID (position))
+    return;
+
+  if (seek) {
+    GstEvent *event;
+
+    event = gst_event_new_seek (1.0, GST_FORMAT_TIME,
+                                GST_SEEK_FLAG_FLUSH | GST_SEEK_FLAG_ACCURATE,
+                                GST_SEEK_TYPE_SET, position,
+                                GST_SEEK_TYPE_NONE, -1);
+    if (!sandbox_channel_send_event (priv->channel, event)) {
+      GST_WARNING_OBJECT (self, "Could not resume at %" GST_TIME_FORMAT ": %m",
+                          GST_TIME_ARGS (position));
+      gst_event_unref (event);
+      return;
+    }
+    gst_event_unref (event);
+  }
+  priv->discarding = TRUE;
+}
+
+/* Waits for gst_sandbox_src_resume() after the decoder went away */
+static GstFlowReturn
+wait_for_resume (GstSandboxSrc *self)
+{
+  GstSandboxSrcPrivate *priv = self->priv;
+  GstClockTime position;
+  gboolean seek;
+  gint fd;
+
+  GST_DEBUG_OBJECT (self, "Decoder went away, waiting for another one");
+
+  g_mutex_lock (&priv->resume_lock);
+  while (priv->resume_fd == -1 && !priv->given_up && !priv->unlocked)
+    g_cond_wait (&priv->resume_cond, &priv->resume_lock);
+  if (priv->unlocked) {
+    g_mutex_unlock (&priv->resume_lock);
+    return GST_FLOW_WRONG_STATE;
+  }
+  fd = priv->resume_fd;
+  position = priv->resume_position;
+  seek = priv->resume_seek;
+  priv->resume_fd = -1;
+  g_mutex_unlock (&priv->resume_lock);
+
+  if (fd == -1) {
+    GST_ELEMENT_ERROR (self, STREAM, DECODE,
+                       ("The decoder went away"), (NULL));
+    return GST_FLOW_ERROR;
+  }
+
+  switch_channel (self, fd, position, seek);
+
+  return GST_FLOW_OK;
+}
+
+/* GstBaseSrc vmethod implementations */
+
+static gboolean
+gst_sandbox_src_start (GstBaseSrc *base_src)
+{
+  GstSandboxSrc *self = GST_SANDBOX_SRC (base_src);
+  GstSandboxSrcPrivate *priv = self->priv;
+  gint fd;
+
+  if (priv->fd == -1) {
+    GST_ELEMENT_ERROR (self, RESOURCE, NOT_FOUND, ("No fd set"), (NULL));
+    return FALSE;
+  }
+
+  fd = dup (priv->fd);
+  if (fd == -1) {
+    GST_ELEMENT_ERROR (self, RESOURCE, OPEN_READ, (NULL),
+                       ("Could not dup fd %d: %s", priv->fd,
+                        g_strerror (errno)));
+    return FALSE;
+  }
+
+  GST_OBJECT_LOCK (self);
+  priv->channel = sandbox_channel_new (fd);
+  GST_OBJECT_UNLOCK (self);
+  priv->message = g_new (SandboxMessage, 1);
+  priv->poll = gst_poll_new (TRUE);
+  gst_poll_fd_init (&priv->pollfd);
+  priv->pollfd.fd = fd;
+  priv->seek_pending = FALSE;
+  priv->discarding = FALSE;
+
+  g_mutex_lock (&priv->resume_lock);
+  priv->given_up = FALSE;
+  g_mutex_unlock (&priv->resume_lock);
+
+  g_mutex_lock (&priv->stats_lock);
+  priv->buffers = 0;
+  priv->bytes = 0;
+  priv->shm_high_water = priv->shm_used;
+  priv->shm_wait_time = 0;
+  priv->latency_total = 0;
+  priv->latency_max = 0;
+  priv->position = GST_CLOCK_TIME_NONE;
+  g_mutex_unlock (&priv->stats_lock);
+  gst_poll_add_fd (priv->poll, &priv->pollfd);
+  gst_poll_fd_ctl_read (priv->poll, &priv->pollfd, TRUE);
+
+  return TRUE;
+}
+
+static gboolean
+gst_sandbox_src_stop (GstBaseSrc *base_src)
+{
+  GstSandboxSrcPrivate *priv = GST_SANDBOX_SRC (base_src)->priv;
+
+  gst_poll_free (priv->poll);
+  priv->poll = NULL;
+  g_free (priv->message);
+  priv->message = NULL;
+
+  /* buffers still downstream hold their own references */
+  drop_pending (GST_SANDBOX_SRC (base_src));
+  GST_OBJECT_LOCK (base_src);
+  sandbox_channel_unref (priv->channel);
+  priv->channel = NULL;
+  GST_OBJECT_UNLOCK (base_src);
+  if (priv->area) {
+    shm_area_unref (priv->area);
+    priv->area = NULL;
+  }
+  gst_caps_replace (&priv->caps, NULL);
+  gst_caps_replace (&priv->downstream_caps, NULL);
+
+  g_mutex_lock (&priv->resume_lock);
+  if (priv->resume_fd != -1) {
+    close (priv->resume_fd);
+    priv->resume_fd = -1;
+  }
+  g_mutex_unlock (&priv->resume_lock);
+
+  return TRUE;
+}
+
+static gboolean
+gst_sandbox_src_unlock (GstBaseSrc *base_src)
+{
+  GstSandboxSrcPrivate *priv = GST_SANDBOX_SRC (base_src)->priv;
+
+  gst_poll_set_flushing (priv->poll, TRUE);
+  g_mutex_lock (&priv->resume_lock);
+  priv->unlocked = TRUE;
+  g_cond_broadcast (&priv->resume_cond);
+  g_mutex_unlock (&priv->resume_lock);
+
+  return TRUE;
+}
+
+static gboolean
+gst_sandbox_src_unlock_stop (GstBaseSrc *base_src)
+{
+  GstSandboxSrcPrivate *priv = GST_SANDBOX_SRC (base_src)->priv;
+
+  gst_poll_set_flushing (priv->poll, FALSE);
+  g_mutex_lock (&priv->resume_lock);
+  priv->unlocked = FALSE;
+  g_mutex_unlock (&priv->resume_lock);
+
+  return TRUE;
+}
+
+static gboolean
+gst_sandbox_src_is_seekable (GstBaseSrc *base_src)
+{
+  /* the decoder finds out whether its input can do it */
+  return TRUE;
+}
+
+/* QoS events come from the streaming threads of our sinks, which may run
+ * while we stop */
+static gboolean
+forward_qos (GstSandboxSrc *self, GstEvent *event)
+{
+  GstSandboxSrcPrivate *priv = self->priv;
+  SandboxChannel *channel = NULL;
+  gboolean ret;
+
+  GST_OBJECT_LOCK (self);
+  if (priv->channel)
+    channel = sandbox_channel_ref (priv->channel);
+  GST_OBJECT_UNLOCK (self);
+  if (!channel)
+    return FALSE;
+
+  GST_LOG_OBJECT (self, "Forwarding %" GST_PTR_FORMAT, event);
+  ret = sandbox_channel_send_event (channel, event);
+  if (!ret)
+    GST_DEBUG_OBJECT (self, "Could not forward QoS: %m");
+  sandbox_channel_unref (channel);
+
+  return ret;
+}
+
+static gboolean
+gst_sandbox_src_event (GstBaseSrc *base_src, GstEvent *event)
+{
+  GstSandboxSrcPrivate *priv = GST_SANDBOX_SRC (base_src)->priv;
+
+  /* the decoder is the one that can do something about it */
+  if (GST_EVENT_TYPE (event) == GST_EVENT_QOS)
+    return forward_qos (GST_SANDBOX_SRC (base_src), event);
+
+  if (GST_EVENT_TYPE (event) == GST_EVENT_SEEK) {
+    /* basesrc keeps the segment but not the flags, we need them in
+     * do_seek() */
+    gst_event_parse_seek (event, NULL, NULL, &priv->seek_flags, NULL, NULL,
+                          NULL, NULL);
+    priv->seek_seqnum = gst_event_get_seqnum (event);
+    priv->seek_pending = TRUE;
+  }
+
+  return GST_BASE_SRC_CLASS (gst_sandbox_src_parent_class)->event (base_src, event);
+}
+
+/* Called by basesrc with the streaming thread stopped, and also once when
+ * starting, which the decoder doesn't need to hear about */
+static gboolean
+gst_sandbox_src_do_seek (GstBaseSrc *base_src, GstSegment *segment)
+{
+  GstSandboxSrc *self = GST_SANDBOX_SRC (base_src);
+  GstSandboxSrcPrivate *priv = self->priv;
+  GstEvent *seek;
+  gboolean ret;
+
+  if (!priv->seek_pending)
+    return TRUE;
+  priv->seek_pending = FALSE;
+
+  GST_DEBUG_OBJECT (self, "Forwarding seek to %" GST_TIME_FORMAT,
+                    GST_TIME_ARGS (segment->start));
+
+  seek = gst_event_new_seek (segment->rate, segment->format, priv->seek_flags,
+                             GST_SEEK_TYPE_SET, segment->start,
+                             segment->stop == -1 ? GST_SEEK_TYPE_NONE
+                                                 : GST_SEEK_TYPE_SET,
+                             segment->stop);
+  gst_event_set_seqnum (seek, priv->seek_seqnum);
+  ret = sandbox_channel_send_event (priv->channel, seek);
+  gst_event_unref (seek);
+
+  if (!ret) {
+    GST_WARNING_OBJECT (self, "Could not forward seek: %m");
+    return FALSE;
+  }
+
+  /* what the decoder sent until it handles the seek is stale */
+  if (priv->seek_flags & GST_SEEK_FLAG_FLUSH) {
+    drop_pending (self);
+    priv->discarding = TRUE;
+  }
+
+  return TRUE;
+}
+
+static GstFlowReturn
+gst_sandbox_src_create (GstPushSrc *push_src, GstBuffer **buffer)
+{
+  GstSandboxSrc *self = GST_SANDBOX_SRC (push_src);
+  GstSandboxSrcPrivate *priv = self->priv;
+  GstFlowReturn ret = GST_FLOW_OK;
+
+  *buffer = NULL;
+
+  while (ret == GST_FLOW_OK && !*buffer) {
+    if (!g_queue_is_empty (&priv->pending)) {
+      *buffer = g_queue_pop_head (&priv->pending);
+      break;
+    }
+
+    if (gst_poll_wait (priv->poll, GST_CLOCK_TIME_NONE) < 0) {
+      if (errno == EBUSY)
+        return GST_FLOW_WRONG_STATE;
+      if (errno == EINTR || errno == EAGAIN)
+        continue;
+      GST_ELEMENT_ERROR (self, RESOURCE, READ, (NULL),
+                         ("poll failed: %s", g_strerror (errno)));
+      return GST_FLOW_ERROR;
+    }
+
+    switch (sandbox_channel_receive (priv->channel, priv->message)) {
+    case SANDBOX_CHANNEL_OK:
+      break;
+    case SANDBOX_CHANNEL_CLOSED:
+      if (priv->resumable) {
+        ret = wait_for_resume (self);
+        continue;
+      }
+      GST_ELEMENT_ERROR (self, STREAM, DECODE,
+                         ("The decoder went away"), (NULL));
+      return GST_FLOW_ERROR;
+    default:
+      GST_ELEMENT_ERROR (self, RESOURCE, READ, (NULL),
+                         ("Could not read from the decoder: %s",
+                          g_strerror (errno)));
+      return GST_FLOW_ERROR;
+    }
+
+    switch (priv->message->type) {
+    case SANDBOX_MESSAGE_AREA:
+      ret = handle_area (self, priv->message);
+      break;
+    case SANDBOX_MESSAGE_CAPS:
+      ret = handle_caps (self, priv->message);
+      break;
+    case SANDBOX_MESSAGE_EVENT:
+      ret = handle_event (self, priv->message);
+      break;
+    case SANDBOX_MESSAGE_BUFFER:
+      ret = handle_buffer (self, priv->message, buffer);
+      break;
+    case SANDBOX_MESSAGE_BUFFER_BATCH:
+      ret = handle_batch (self, priv->message);
+      break;
+    case SANDBOX_MESSAGE_SHM_WAIT:
+      ret = handle_shm_wait (self, priv->message);
+      break;
+    default:
+      GST_WARNING_OBJECT (self, "Unexpected message type %u",
+                          priv->message->type);
+      break;
+    }
+    sandbox_message_close_fds (priv->message);
+  }
+
+  if (*buffer && GST_BUFFER_TIMESTAMP_IS_VALID (*buffer)) {
+    g_mutex_lock (&priv->stats_lock);
+    priv->position = GST_BUFFER_TIMESTAMP (*buffer);
+    if (GST_BUFFER_DURATION_IS_VALID (*buffer))
+      priv->position += GST_BUFFER_DURATION (*buffer);
+    g_mutex_unlock (&priv->stats_lock);
+  }
+
+  return ret;
+}
+
+/**
+ * gst_sandbox_src_resume:
+ * @src: a resumable #GstSandboxSrc
+ * @fd: the stream channel of the decoder taking over, which is dup'ed
+ * @position: where to resume, or GST_CLOCK_TIME_NONE to start over
+ * @seek: whether this source asks the decoder to seek to @position. Only
+ *   one of the sources of a decoder should.
+ *
+ * Hands the source the channel of a decoder taking over from the one that
+ * went away. It picks it up once it notices, from its streaming thread.
+ */
+void
+gst_sandbox_src_resume (GstSandboxSrc *src,
+                        gint fd,
+                        GstClockTime position,
+                        gboolean seek)
+{
+  GstSandboxSrcPrivate *priv = src->priv;
+  gint new_fd;
+
+  new_fd = dup (fd);
+  if (new_fd == -1) {
+    GST_WARNING_OBJECT (src, "Could not dup fd %d: %m", fd);
+    gst_sandbox_src_give_up (src);
+    return;
+  }
+
+  g_mutex_lock (&priv->resume_lock);
+  if (priv->resume_fd != -1)
+    close (priv->resume_fd);
+  priv->resume_fd = new_fd;
+  priv->resume_position = position;
+  priv->resume_seek = seek;
+  g_cond_broadcast (&priv->resume_cond);
+  g_mutex_unlock (&priv->resume_lock);
+}
+
+/**
+ * gst_sandbox_src_give_up:
+ * @src: a resumable #GstSandboxSrc
+ *
+ * No decoder will take over: the source errors out as if it weren't
+ * resumable, now or once it notices the decoder went away.
+ */
+void
+gst_sandbox_src_give_up (GstSandboxSrc *src)
+{
+  GstSandboxSrcPrivate *priv = src->priv;
+
+  g_mutex_lock (&priv->resume_lock);
+  priv->given_up = TRUE;
+  g_cond_broadcast (&priv->resume_cond);
+  g_mutex_unlock (&priv->resume_lock);
+}
+
+/* GObject vmethod implementations */
+
+static void
+gst_sandbox_src_set_property (GObject *object,
+                              guint prop_id,
+                              const GValue *value,
+                              GParamSpec *pspec)
+{
+  GstSandboxSrcPrivate *priv = GST_SANDBOX_SRC (object)->priv;
+
+  switch (prop_id) {
+  case PROP_FD:
+    priv->fd = g_value_get_int (value);
+    break;
+  case PROP_RESUMABLE:
+    priv->resumable = g_value_get_boolean (value);
+    break;
+  default:
+    G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+    break;
+  }
+}
+
+static void
+gst_sandbox_src_get_property (GObject *object,
+                              guint prop_id,
+                              GValue *value,
+                              GParamSpec *pspec)
+{
+  GstSandboxSrcPrivate *priv = GST_SANDBOX_SRC (object)->priv;
+
+  switch (prop_id) {
+  case PROP_FD:
+    g_value_set_int (value, priv->fd);
+    break;
+  case PROP_STATS:
+    g_value_take_boxed (value, get_stats (GST_SANDBOX_SRC (object)));
+    break;
+  case PROP_RESUMABLE:
+    g_value_set_boolean (value, priv->resumable);
+    break;
+  case PROP_POSITION:
+    g_mutex_lock (&priv->stats_lock);
+    g_value_set_uint64 (value, priv->position);
+    g_mutex_unlock (&priv->stats_lock);
+    break;
+  default:
+    G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+    break;
+  }
+}
+
+static void
+gst_sandbox_src_finalize (GstSandboxSrc *self)
+{
+  g_mutex_clear (&self->priv->stats_lock);
+  g_mutex_clear (&self->priv->resume_lock);
+  g_cond_clear (&self->priv->resume_cond);
+
+  G_OBJECT_CLASS (gst_sandbox_src_parent_class)->finalize (G_OBJECT (self));
+}
+
+static void
+gst_sandbox_src_init (GstSandboxSrc *self)
+{
+  self->priv = GST_SANDBOX_SRC_GET_PRIVATE (self);
+  self->priv->fd = -1;
+  self->priv->resume_fd = -1;
+  self->priv->position = GST_CLOCK_TIME_NONE;
+  g_queue_init (&self->priv->pending);
+  g_mutex_init (&self->priv->stats_lock);
+  g_mutex_init (&self->priv->resume_lock);
+  g_cond_init (&self->priv->resume_cond);
+
+  gst_base_src_set_format (GST_BASE_SRC (self), GST_FORMAT_TIME);
+}
+
+static void
+gst_sandbox_src_class_init (GstSandboxSrcClass *self_class)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (self_class);
+  GstElementClass *element_class = GST_ELEMENT_CLASS (self_class);
+  GstBaseSrcClass *base_src_class = GST_BASE_SRC_CLASS (self_class);
+  GstPushSrcClass *push_src_class = GST_PUSH_SRC_CLASS (self_class);
+
+  GST_DEBUG_CATEGORY_INIT (gst_debug_sandbox_src, "sandboxsrc", 0,
+      "source of sandboxeddecodebin");
+
+  g_type_class_add_private (self_class, sizeof (GstSandboxSrcPrivate));
+  object_class->set_property = gst_sandbox_src_set_property;
+  object_class->get_property = gst_sandbox_src_get_property;
+  object_class->finalize = (void (*) (GObject *object)) gst_sandbox_src_finalize;
+
+  g_object_class_install_property (object_class, PROP_FD,
+      g_param_spec_int ("fd", "fd",
+                        "Socket connected to the decoder's sandboxsink",
+                        -1, G_MAXINT, -1,
+                        G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (object_class, PROP_STATS,
+      g_param_spec_boxed ("stats", "Stats",
+                          "Transport statistics since the element started",
+                          GST_TYPE_STRUCTURE,
+                          G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (object_class, PROP_RESUMABLE,
+      g_param_spec_boolean ("resumable", "Resumable",
+                            "Wait for another decoder to take over when the "
+                            "decoder goes away before EOS, see "
+                            "gst_sandbox_src_resume()",
+                            FALSE,
+                            G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (object_class, PROP_POSITION,
+      g_param_spec_uint64 ("position", "Position",
+                           "End of the last buffer pushed, in the stream "
+                           "time of the decoder",
+                           0, G_MAXUINT64, GST_CLOCK_TIME_NONE,
+                           G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+  gst_element_class_add_pad_template (element_class,
+      gst_static_pad_template_get (&src_template));
+  gst_element_class_set_details_simple (element_class,
+      "Sandbox source", "Source",
+      "Pushes the buffers decoded in the sandbox without copying them",
+      "Guillaume Emont <guijemont@igalia.com>");
+
+  base_src_class->start = gst_sandbox_src_start;
+  base_src_class->stop = gst_sandbox_src_stop;
+  base_src_class->unlock = gst_sandbox_src_unlock;
+  base_src_class->unlock_stop = gst_sandbox_src_unlock_stop;
+  base_src_class->is_seekable = gst_sandbox_src_is_seekable;
+  base_src_class->event = gst_sandbox_src_event;
+  base_src_class->do_seek = gst_sandbox_src_do_seek;
+  push_src_class->create = gst_sandbox_src_create;
+}
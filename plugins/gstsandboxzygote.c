@@ -0,0 +1,179 @@
+/*
+ * Copyright (C) 2012 Igalia S.L.
+*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+
+/* One decoder zygote per sandbox backend is shared by all the
+ * sandboxeddecodebin instances of the process. It is started, with the pool
+ * size and prewarm count of the first element that needs it, the first time
+ * a decoder is requested, and again if it went away in the meantime. */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <unistd.h>
+
+#include "gstsandboxzygote.h"
+#include "sandboxipc.h"
+
+GST_DEBUG_CATEGORY_STATIC (gst_debug_sandbox_zygote);
+#define GST_CAT_DEFAULT gst_debug_sandbox_zygote
+
+#define DECODER_PATH "gst-decoder"
+
+G_LOCK_DEFINE_STATIC (zygote);
+/* indexed by SandboxBackend */
+static SandboxChannel *zygote_channels[2] = { NULL, NULL };
+
+static SandboxChannel *
+start_zygote (SandboxBackend backend,
+              guint pool_size,
+              guint prewarm,
+              guint sessions,
+              GError **error)
+{
+  gint fds[2];
+  gchar *pool_size_arg, *prewarm_arg, *sessions_arg;
+  gchar **env;
+  gboolean spawned;
+  gchar *setuid_args[] = {
+    SANDBOXME_PATH,
+    "-P",
+    "-u1",
+    "--",
+    DECODER_PATH,
+    "--zygote",
+    "--control-fd=" G_STRINGIFY (SANDBOX_IPC_CONTROL_FD),
+    NULL, /* pool size */
+    NULL, /* prewarm */
+    NULL, /* sessions */
+    NULL
+  };
+  gchar *namespaces_args[] = {
+    DECODER_PATH,
+    "--sandbox=namespaces",
+    "--zygote",
+    "--control-fd=" G_STRINGIFY (SANDBOX_IPC_CONTROL_FD),
+    NULL, /* pool size */
+    NULL, /* prewarm */
+    NULL, /* sessions */
+    NULL
+  };
+  gchar **args;
+  guint n_args;
+
+  GST_DEBUG_CATEGORY_INIT (gst_debug_sandbox_zygote, "sandboxzygote", 0,
+      "sandboxed decoder zygote");
+
+  if (!sandbox_ipc_socketpair (fds)) {
+    g_set_error (error, G_SPAWN_ERROR, G_SPAWN_ERROR_FAILED,
+                 "Could not create the zygote channel: %s",
+                 g_strerror (errno));
+    return NULL;
+  }
+
+  if (backend == SANDBOX_BACKEND_NAMESPACES) {
+    args = namespaces_args;
+    n_args = G_N_ELEMENTS (namespaces_args);
+  } else {
+    args = setuid_args;
+    n_args = G_N_ELEMENTS (setuid_args);
+  }
+  args[n_args - 4] = pool_size_arg =
+      g_strdup_printf ("--pool-size=%u", pool_size);
+  args[n_args - 3] = prewarm_arg = g_strdup_printf ("--prewarm=%u", prewarm);
+  args[n_args - 2] = sessions_arg = g_strdup_printf ("--sessions=%u",
+                                                     sessions);
+
+  GST_DEBUG ("Starting zygote, sandbox %d, pool size %u, prewarm %u, "
+             "sessions %u", backend, pool_size, prewarm, sessions);
+
+  env = g_get_environ ();
+  spawned = g_spawn_async (NULL, /* working_directory */
+                           args,
+                           env,
+                           /* gst-decoder is looked up like sandboxme does */
+                           G_SPAWN_SEARCH_PATH,
+                           sandbox_ipc_setup_control_fd,
+                           GINT_TO_POINTER (fds[1]),
+                           NULL, /* child pid */
+                           error);
+  g_strfreev (env);
+  g_free (pool_size_arg);
+  g_free (prewarm_arg);
+  g_free (sessions_arg);
+  close (fds[1]);
+
+  if (!spawned) {
+    close (fds[0]);
+    return NULL;
+  }
+
+  return sandbox_channel_new (fds[0]);
+}
+
+/* Asks the zygote for a decoder that will talk to us on control_fd and read
+ * its input from input_fd, starting the zygote if needed. The fds are not
+ * taken. Whether we actually get a decoder is only known once it says READY
+ * on the control channel, or closes it when the zygote refused the request.
+ */
+gboolean
+gst_sandbox_zygote_spawn_decoder (SandboxBackend backend,
+                                  guint pool_size,
+                                  guint prewarm,
+                                  guint sessions,
+                                  gint control_fd,
+                                  gint input_fd,
+                                  GError **error)
+{
+  SandboxChannel **zygote_channel = &zygote_channels[backend];
+  gint fds[2];
+  gboolean ret = FALSE;
+  gint attempt;
+
+  fds[0] = control_fd;
+  fds[1] = input_fd;
+
+  G_LOCK (zygote);
+  /* a failed send means the zygote died, we start a new one once */
+  for (attempt = 0; attempt < 2 && !ret; attempt++) {
+    if (!*zygote_channel) {
+      *zygote_channel = start_zygote (backend, pool_size, prewarm,
+                                      sessions, error);
+      if (!*zygote_channel)
+        break;
+    }
+
+    ret = sandbox_channel_send (*zygote_channel, SANDBOX_MESSAGE_SPAWN, NULL,
+                                0, fds, 2);
+    if (!ret) {
+      GST_WARNING ("Lost the zygote: %s", g_strerror (errno));
+      sandbox_channel_unref (*zygote_channel);
+      *zygote_channel = NULL;
+    }
+  }
+  G_UNLOCK (zygote);
+
+  if (!ret && error && !*error)
+    g_set_error (error, G_SPAWN_ERROR, G_SPAWN_ERROR_FAILED,
+                 "Could not reach the zygote");
+
+  return ret;
+}
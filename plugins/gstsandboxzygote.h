@@ -0,0 +1,40 @@
+/*
+ * Copyright (C) 2012 Igalia S.L.
+*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+
+#ifndef __GST_SANDBOX_ZYGOTE_H__
+#define __GST_SANDBOX_ZYGOTE_H__
+
+#include <gst/gst.h>
+
+#include "sandboxipc.h"
+
+G_BEGIN_DECLS
+
+gboolean gst_sandbox_zygote_spawn_decoder (SandboxBackend backend,
+                                           guint pool_size,
+                                           guint prewarm,
+                                           guint sessions,
+                                           gint control_fd,
+                                           gint input_fd,
+                                           GError **error);
+
+G_END_DECLS
+
+#endif /* __GST_SANDBOX_ZYGOTE_H__ */
@@ -1,7 +1,9 @@
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
 #include <glib-unix.h>
 #include <gst/gst.h>
+#include "common/sandboxipc.h"
 
 #define DECODER_PATH "./decoder"
 #define SANDBOXME_PATH "../setuid-sandbox/sandboxme"
@@ -10,8 +12,7 @@ struct SafePlayer {
   GMainLoop *loop;
   int subprocess_stdin;
   const gchar *media_uri;
-  gchar *shm_video_socket_path;
-  gchar *shm_audio_socket_path;
+  SandboxChannel *control;
   GstElement *source_pipeline;
   GstElement *sink_pipeline;
   char **environment;
@@ -23,10 +24,7 @@ safe_player_init (struct SafePlayer *player, const gchar *media_uri, char **envp
   player->loop = g_main_loop_new (g_main_context_default (), FALSE);
   player->subprocess_stdin = -1;
   player->media_uri = media_uri;
-  /* FIXME: this is insecure in a way, ideally we should have the name decided
-   * securely by shmsink in the decoder process, and communicated back to us */
-  player->shm_video_socket_path = g_strdup (tmpnam (NULL));
-  player->shm_audio_socket_path = g_strdup (tmpnam (NULL));
+  player->control = NULL;
   player->source_pipeline = NULL;
   player->sink_pipeline = NULL;
   player->environment = envp;
@@ -41,8 +39,7 @@ exec_decoder (struct SafePlayer *player)
     "-u1",
     "--",
     DECODER_PATH,
-    player->shm_video_socket_path,
-    player->shm_audio_socket_path,
+    "--control-fd=" G_STRINGIFY (SANDBOX_IPC_CONTROL_FD),
     NULL
   };
   int ret;
@@ -52,18 +49,24 @@ exec_decoder (struct SafePlayer *player)
   exit (EXIT_FAILURE);
 }
 
-/* Return an fd in which you can write to the stdin of the decoder (or -1 on
+/* Return our end of the input channel, the stdin of the decoder (or -1 on
  * error) */
 static int
 start_decoder (struct SafePlayer *safe_player)
 {
   int pipe_fd[2] = {-1, -1};
+  int control[2] = {-1, -1};
   int pid;
   int ret = -1;
 
-  if (pipe (pipe_fd)) {
+  if (!sandbox_ipc_socketpair (control)) {
+    fprintf (stderr, "Could not create control channel of decoder: %m\n");
+    goto clean;
+  }
+
+  if (!sandbox_ipc_socketpair (pipe_fd)) {
     fprintf (stderr,
-             "Could not create pipe to communicate with decoder subprocess: %m\n");
+             "Could not create input channel of decoder subprocess: %m\n");
     goto clean;
   }
 
@@ -77,13 +80,21 @@ start_decoder (struct SafePlayer *safe_player)
       exit (EXIT_FAILURE);
     }
     close (pipe_fd[0]);
+    sandbox_ipc_setup_control_fd (GINT_TO_POINTER (control[1]));
     exec_decoder (safe_player);
   } else { /* parent: controller */
+    close (pipe_fd[0]);
+    close (control[1]);
+    safe_player->control = sandbox_channel_new (control[0]);
     ret = pipe_fd[1];
     goto beach;
   }
 
 clean:
+  if (control[0] != -1)
+    close (control[0]);
+  if (control[1] != -1)
+    close (control[1]);
   if (pipe_fd[0] != -1)
     close (pipe_fd[0]);
   if (pipe_fd[1] != -1)
@@ -99,7 +110,7 @@ init_source_pipeline (struct SafePlayer *player)
   gchar * pipeline_desc;
   GError *error = NULL;
 
-  pipeline_desc = g_strdup_printf ("giosrc location=%s ! fdsink fd=%d",
+  pipeline_desc = g_strdup_printf ("giosrc location=%s ! sandboxinputsink fd=%d",
                                    player->media_uri,
                                    player->subprocess_stdin);
   player->source_pipeline = gst_parse_launch (pipeline_desc, &error);
@@ -119,27 +130,91 @@ init_source_pipeline (struct SafePlayer *player)
 static gboolean
 init_sink_pipeline (struct SafePlayer *player)
 {
-  gchar * pipeline_desc;
+  /* the streams get added as the decoder announces them */
+  player->sink_pipeline = gst_pipeline_new ("sinks");
+  gst_element_set_state (player->sink_pipeline, GST_STATE_PLAYING);
+
+  return FALSE;
+}
+
+static void
+add_stream (struct SafePlayer *player, SandboxMessage *message)
+{
+  const SandboxStreamMessage *stream;
+  GstElement *bin;
   GError *error = NULL;
+  gchar *bin_desc;
+  int fd;
+
+  stream = sandbox_message_get_payload (message, sizeof (*stream));
+  fd = sandbox_message_steal_fd (message);
+  if (!stream || fd == -1) {
+    fprintf (stderr, "Invalid stream announcement\n");
+    return;
+  }
 
-  pipeline_desc =
-      g_strdup_printf ("shmsrc socket-path=%s ! gdpdepay ! queue ! autovideosink "
-                       "shmsrc socket-path=%s ! gdpdepay ! queue ! autoaudiosink",
-                       player->shm_video_socket_path,
-                       player->shm_audio_socket_path);
+  /* the fd is not closed, the source dups it whenever it starts */
+  bin_desc = g_strdup_printf ("sandboxsrc fd=%d ! queue ! %s", fd,
+                              stream->kind == SANDBOX_STREAM_VIDEO ?
+                              "autovideosink" : "autoaudiosink");
+  bin = gst_parse_bin_from_description (bin_desc, FALSE, &error);
+  g_free (bin_desc);
+
+  if (!bin) {
+    fprintf (stderr, "Could not create stream sink: %s\n", error->message);
+    g_error_free (error);
+    close (fd);
+    return;
+  }
 
-  player->sink_pipeline = gst_parse_launch (pipeline_desc, &error);
-  g_free (pipeline_desc);
+  gst_bin_add (GST_BIN (player->sink_pipeline), bin);
+  gst_element_sync_state_with_parent (bin);
+}
 
-  if (!player->sink_pipeline) {
-    fprintf (stderr, "Could not create sink pipeline: %s\n", error->message);
-    /* Don't know what to do; let's commit suicide */
-    g_assert_not_reached ();
+/* The decoder tells us on its control channel when it is ready, then hands
+ * us the socket of a sandboxsink for each stream it decodes */
+static gboolean
+on_control_message (GIOChannel *source,
+                    GIOCondition condition,
+                    struct SafePlayer *player)
+{
+  SandboxMessage *message = g_new (SandboxMessage, 1);
+
+  if (sandbox_channel_receive (player->control, message) != SANDBOX_CHANNEL_OK) {
+    g_free (message);
+    if (!player->sink_pipeline) {
+      fprintf (stderr, "Decoder did not get ready\n");
+      /* Don't know what to do; let's commit suicide */
+      g_assert_not_reached ();
+    }
+    return FALSE;
   }
 
-  gst_element_set_state (player->sink_pipeline, GST_STATE_PLAYING);
+  switch (message->type) {
+  case SANDBOX_MESSAGE_READY:
+    init_sink_pipeline (player);
+    break;
+  case SANDBOX_MESSAGE_STREAM_ADDED:
+    add_stream (player, message);
+    break;
+  default:
+    break;
+  }
+  sandbox_message_close_fds (message);
+  g_free (message);
 
-  return FALSE;
+  return TRUE;
+}
+
+static void
+wait_for_decoder (struct SafePlayer *player)
+{
+  GIOChannel *io_channel;
+
+  io_channel = g_io_channel_unix_new (sandbox_channel_get_fd (player->control));
+  g_io_add_watch (io_channel, G_IO_IN | G_IO_HUP | G_IO_ERR,
+                  (GIOFunc) on_control_message, player);
+  g_io_channel_unref (io_channel);
 }
 
 /* signal handler */
@@ -169,10 +244,8 @@ set_up_signals (struct SafePlayer *player)
 TODO:
  - ensure we transfer the environment -> or maybe not, we can't reasonably get
  LD_LIBRARY_PATH through
- - create source pipeline using player->subprocess_stdin for fdsink, make it go to
- PLAYING
- - once the decoder has created the shmsinks, create the sink pipelines, make
- it go to PLAYING (need to get stdout of decoder)
+ - create source pipeline using player->subprocess_stdin for sandboxinputsink,
+ make it go to PLAYING
  - find a way to clean up everything at EOF/when CTRL-C'ing safeplayer.
  */
 
@@ -180,6 +253,8 @@ int
 main (int argc, char **argv, char **envp)
 {
   struct SafePlayer player;
+  SandboxChannel *input;
+  SandboxPreamble settings;
 
   if (argc != 2) {
     g_print ("Syntax: %s media_url\n", argv[0]);
@@ -194,11 +269,16 @@ main (int argc, char **argv, char **envp)
 
   player.subprocess_stdin = start_decoder (&player);
   g_assert (player.subprocess_stdin != -1);
+  /* we don't typefind, let the decoder load everything */
+  memset (&settings, 0, sizeof (settings));
+  input = sandbox_channel_new (dup (player.subprocess_stdin));
+  if (!sandbox_channel_send_preamble (input, SANDBOX_PREAMBLE_ALL_PLUGINS,
+                                      &settings))
+    g_assert_not_reached ();
+  sandbox_channel_unref (input);
 
   g_idle_add ((GSourceFunc)init_source_pipeline, &player);
-  g_timeout_add (2000, /* HACK: we wait a bit for the decoder subprocess to set
-                          up the shm stuff */
-                 (GSourceFunc)init_sink_pipeline, &player);
+  wait_for_decoder (&player);
 
   g_main_loop_run (player.loop);
 
@@ -0,0 +1,221 @@
+/*
+ * Copyright (C) 2012 Igalia S.L.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * Plays the decoder's part on the stream channel of a sandboxsrc: sends it
+ * an area, caps, a batch of buffers and EOS, and checks that the buffers
+ * come out of it as they went in.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <gst/gst.h>
+
+#include "sandboxipc.h"
+#include "shmarea.h"
+
+#define AREA_SIZE 4096
+#define N_BUFFERS 3
+#define BUFFER_SIZE 100
+
+static GList *received = NULL;
+
+static void
+on_handoff (GstElement *sink, GstBuffer *buffer, GstPad *pad, gpointer data)
+{
+  received = g_list_append (received, gst_buffer_ref (buffer));
+}
+
+static gboolean
+send_batch (SandboxChannel *channel)
+{
+  SandboxBatchMessage *batch;
+  SandboxBufferMessage *buffers;
+  gsize size;
+  guint8 *payload;
+  gboolean ret;
+  guint i;
+
+  size = sizeof (SandboxBatchMessage)
+      + N_BUFFERS * sizeof (SandboxBufferMessage);
+  payload = g_malloc0 (size);
+  batch = (SandboxBatchMessage *) payload;
+  batch->offset = 0;
+  batch->n_buffers = N_BUFFERS;
+  buffers = (SandboxBufferMessage *) (payload + sizeof (SandboxBatchMessage));
+  for (i = 0; i < N_BUFFERS; i++) {
+    buffers[i].offset = i * BUFFER_SIZE;
+    buffers[i].size = BUFFER_SIZE;
+    buffers[i].timestamp = i * 10 * GST_MSECOND;
+    buffers[i].duration = 10 * GST_MSECOND;
+    buffers[i].buffer_offset = GST_BUFFER_OFFSET_NONE;
+    buffers[i].buffer_offset_end = GST_BUFFER_OFFSET_NONE;
+  }
+
+  ret = sandbox_channel_send (channel, SANDBOX_MESSAGE_BUFFER_BATCH,
+                              payload, size, NULL, 0);
+  g_free (payload);
+
+  return ret;
+}
+
+/* What the decoder sends for a stream of batched audio */
+static gboolean
+send_stream (SandboxChannel *channel)
+{
+  SandboxAreaMessage area_message;
+  GstCaps *caps;
+  GstEvent *eos;
+  ShmArea *area;
+  gint fd;
+  guint i;
+  gboolean ret;
+
+  area = shm_area_new (AREA_SIZE, 0);
+  if (!area)
+    return FALSE;
+  for (i = 0; i < N_BUFFERS; i++)
+    memset (shm_area_get_data (area) + i * BUFFER_SIZE, i + 1, BUFFER_SIZE);
+
+  area_message.size = AREA_SIZE;
+  area_message.id = 1;
+  area_message.flags = 0;
+  fd = shm_area_get_fd (area);
+  caps = gst_caps_from_string ("audio/x-raw-int,rate=44100,channels=2,"
+                               "width=16,depth=16,signed=true,"
+                               "endianness=1234");
+  eos = gst_event_new_eos ();
+
+  ret = sandbox_channel_send (channel, SANDBOX_MESSAGE_AREA,
+                              &area_message, sizeof (area_message), &fd, 1)
+      && sandbox_channel_send_caps (channel, caps)
+      && send_batch (channel)
+      && sandbox_channel_send_event (channel, eos);
+
+  gst_event_unref (eos);
+  gst_caps_unref (caps);
+  shm_area_unref (area);
+
+  return ret;
+}
+
+static gboolean
+check_buffers (void)
+{
+  GList *elem;
+  guint i = 0;
+
+  if (g_list_length (received) != N_BUFFERS) {
+    fprintf (stderr, "Got %u buffers instead of %u\n",
+             g_list_length (received), N_BUFFERS);
+    return FALSE;
+  }
+
+  for (elem = received; elem; elem = elem->next, i++) {
+    GstBuffer *buffer = elem->data;
+
+    if (GST_BUFFER_SIZE (buffer) != BUFFER_SIZE
+        || GST_BUFFER_DATA (buffer)[0] != i + 1
+        || GST_BUFFER_DATA (buffer)[BUFFER_SIZE - 1] != i + 1
+        || GST_BUFFER_TIMESTAMP (buffer) != i * 10 * GST_MSECOND
+        || GST_BUFFER_DURATION (buffer) != 10 * GST_MSECOND) {
+      fprintf (stderr, "Buffer %u doesn't match what was sent\n", i);
+      return FALSE;
+    }
+  }
+
+  return TRUE;
+}
+
+int
+main (int argc, char **argv)
+{
+  GstElement *pipeline, *src, *sink;
+  SandboxChannel *channel;
+  GstMessage *message;
+  GstBus *bus;
+  gboolean ok;
+  gint fds[2];
+
+  gst_init (&argc, &argv);
+
+  if (!sandbox_ipc_socketpair (fds)) {
+    fprintf (stderr, "Could not create the stream channel\n");
+    return EXIT_FAILURE;
+  }
+
+  pipeline = gst_pipeline_new (NULL);
+  src = gst_element_factory_make ("sandboxsrc", NULL);
+  sink = gst_element_factory_make ("fakesink", NULL);
+  if (!src || !sink) {
+    fprintf (stderr, "Could not create sandboxsrc, check GST_PLUGIN_PATH\n");
+    return EXIT_FAILURE;
+  }
+  /* the source dups it when it starts */
+  g_object_set (src, "fd", fds[0], NULL);
+  g_object_set (sink, "sync", FALSE, "signal-handoffs", TRUE, NULL);
+  g_signal_connect (sink, "handoff", G_CALLBACK (on_handoff), NULL);
+  gst_bin_add_many (GST_BIN (pipeline), src, sink, NULL);
+  gst_element_link (src, sink);
+
+  /* all of it fits in the socket buffer, the source reads it once
+   * started */
+  channel = sandbox_channel_new (fds[1]);
+  if (!send_stream (channel)) {
+    fprintf (stderr, "Could not send the stream: %m\n");
+    return EXIT_FAILURE;
+  }
+
+  gst_element_set_state (pipeline, GST_STATE_PLAYING);
+  bus = gst_element_get_bus (pipeline);
+  message = gst_bus_timed_pop_filtered (bus, 10 * GST_SECOND,
+                                        GST_MESSAGE_EOS | GST_MESSAGE_ERROR);
+  ok = message && GST_MESSAGE_TYPE (message) == GST_MESSAGE_EOS;
+  if (!message) {
+    fprintf (stderr, "Timed out\n");
+  } else if (!ok) {
+    GError *error;
+    gchar *debug;
+
+    gst_message_parse_error (message, &error, &debug);
+    fprintf (stderr, "%s (%s)\n", error->message, debug);
+    g_error_free (error);
+    g_free (debug);
+  }
+  if (message)
+    gst_message_unref (message);
+  gst_object_unref (bus);
+  gst_element_set_state (pipeline, GST_STATE_NULL);
+
+  ok = ok && check_buffers ();
+
+  g_list_foreach (received, (GFunc) gst_buffer_unref, NULL);
+  g_list_free (received);
+  gst_object_unref (pipeline);
+  sandbox_channel_unref (channel);
+  close (fds[0]);
+
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
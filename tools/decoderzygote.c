@@ -0,0 +1,316 @@
+/*
+ * Copyright (C) 2012 Igalia S.L.
+*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/* The zygote is a gst-decoder that has initialised GStreamer, loaded all the
+ * plugins and entered the sandbox, and from then on only forks. Each child is
+ * a decoder that just has to build its pipeline once it gets its control
+ * channel and its input, so that a new stream no longer pays for the exec of
+ * sandboxme and gst-decoder, gst_init() and the plugin loading.
+ *
+ * We keep a few children forked in advance (prewarm), and never have more than
+ * pool_size of them alive at the same time (0 means no limit). Requests
+ * beyond that are refused by closing the channel, and the parent falls back
+ * to spawning a decoder the usual way.
+ *
+ * A child can also host several sessions, each with its own pipeline: with
+ * sessions above 1, a child keeps getting new ones until it had that many,
+ * and children that already host some get the new ones first. This saves a
+ * process per stream at the cost of streams sharing one, which is only wise
+ * for media of trusted origin.
+ *
+ * No GMainLoop runs in the zygote and we stick to poll(), so that there is no
+ * other thread around when we fork.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "decoderzygote.h"
+#include "sandboxipc.h"
+
+/* how often we reap children when nothing happens, in ms */
+#define REAP_INTERVAL 1000
+
+typedef struct {
+  pid_t pid;
+  /* our end of the socket the child waits for sessions on, NULL once it got
+   * all it can host */
+  SandboxChannel *link;
+  guint n_sessions;
+} ZygoteChild;
+
+static GList *children = NULL;
+/* children that have no session yet */
+static guint n_idle = 0;
+/* how many sessions each child hosts over its life */
+static guint max_sessions = 1;
+
+static void
+free_child (ZygoteChild *child)
+{
+  if (child->link)
+    sandbox_channel_unref (child->link);
+  g_slice_free (ZygoteChild, child);
+}
+
+static void
+forget_children (void)
+{
+  g_list_free_full (children, (GDestroyNotify) free_child);
+  children = NULL;
+  n_idle = 0;
+}
+
+static void
+reap_children (void)
+{
+  pid_t pid;
+  GList *elem;
+
+  while ((pid = waitpid (-1, NULL, WNOHANG)) > 0) {
+    for (elem = children; elem; elem = elem->next) {
+      ZygoteChild *child = elem->data;
+
+      if (child->pid != pid)
+        continue;
+
+      if (child->n_sessions == 0)
+        n_idle--;
+      children = g_list_delete_link (children, elem);
+      free_child (child);
+      break;
+    }
+  }
+}
+
+static gboolean
+room_for_child (guint pool_size)
+{
+  return pool_size == 0 || g_list_length (children) < pool_size;
+}
+
+/* Run in a freshly forked child: blocks until the zygote hands us a session */
+static gboolean
+wait_for_session (SandboxChannel *link, gint *control_fd, gint *input_fd)
+{
+  SandboxMessage *message;
+  gboolean ret = FALSE;
+
+  message = g_new (SandboxMessage, 1);
+
+  if (sandbox_channel_receive (link, message) == SANDBOX_CHANNEL_OK
+      && message->type == SANDBOX_MESSAGE_SPAWN
+      && message->n_fds == 2) {
+    *control_fd = sandbox_message_steal_fd (message);
+    *input_fd = sandbox_message_steal_fd (message);
+    ret = TRUE;
+  }
+
+  sandbox_message_close_fds (message);
+  g_free (message);
+
+  return ret;
+}
+
+/* Returns the pid of the new child in the zygote, -1 on error, and 0 in the
+ * child once it has been given a session. The child gets the fd it receives
+ * its next sessions on in link_fd, -1 if it hosts only one. */
+static pid_t
+fork_child (gint *control_fd, gint *input_fd, gint *link_fd)
+{
+  SandboxChannel *session_link;
+  ZygoteChild *child;
+  gint link[2];
+  pid_t pid;
+
+  if (!sandbox_ipc_socketpair (link))
+    return -1;
+
+  pid = fork ();
+  if (pid == -1) {
+    close (link[0]);
+    close (link[1]);
+    return -1;
+  }
+
+  if (pid == 0) {
+    close (link[0]);
+    /* our siblings are none of our business */
+    forget_children ();
+    session_link = sandbox_channel_new (link[1]);
+    if (!wait_for_session (session_link, control_fd, input_fd))
+      _exit (EXIT_SUCCESS);
+    *link_fd = max_sessions > 1 ? dup (link[1]) : -1;
+    sandbox_channel_unref (session_link);
+    return 0;
+  }
+
+  close (link[1]);
+  child = g_slice_new (ZygoteChild);
+  child->pid = pid;
+  child->link = sandbox_channel_new (link[0]);
+  child->n_sessions = 0;
+  children = g_list_append (children, child);
+  n_idle++;
+
+  return pid;
+}
+
+/* Children already hosting sessions come first, so that they fill up
+ * before we use the idle ones */
+static ZygoteChild *
+get_child_with_room (void)
+{
+  ZygoteChild *idle = NULL;
+  GList *elem;
+
+  for (elem = children; elem; elem = elem->next) {
+    ZygoteChild *child = elem->data;
+
+    if (!child->link)
+      continue;
+    if (child->n_sessions > 0)
+      return child;
+    if (!idle)
+      idle = child;
+  }
+
+  return idle;
+}
+
+/* Forwards the fds of a spawn request to a child that can host one more
+ * session */
+static gboolean
+hand_session (ZygoteChild *child, SandboxMessage *message)
+{
+  gboolean ret;
+
+  ret = sandbox_channel_send (child->link, SANDBOX_MESSAGE_SPAWN, NULL, 0,
+                              message->fds, message->n_fds);
+
+  if (child->n_sessions++ == 0)
+    n_idle--;
+  if (!ret || child->n_sessions == max_sessions) {
+    /* the child quits once its sessions are over and the link is gone */
+    sandbox_channel_unref (child->link);
+    child->link = NULL;
+  }
+
+  return ret;
+}
+
+/* Runs the zygote until the parent goes away, in which case FALSE is
+ * returned. Also returns, with TRUE, in each forked child, which then has to
+ * run a decoder with the given control channel and input, and when sessions
+ * is more than 1, take up to sessions - 1 more over link_fd. */
+gboolean
+decoder_zygote_run (gint parent_fd,
+                    guint pool_size,
+                    guint prewarm,
+                    guint sessions,
+                    gint *control_fd,
+                    gint *input_fd,
+                    gint *link_fd)
+{
+  SandboxChannel *parent;
+  SandboxMessage *message;
+  struct pollfd pfd;
+  pid_t pid;
+
+  parent = sandbox_channel_new (parent_fd);
+  message = g_new (SandboxMessage, 1);
+  max_sessions = MAX (sessions, 1);
+
+  fprintf (stderr, "zygote: up, pool size %u, prewarm %u, sessions %u\n",
+           pool_size, prewarm, max_sessions);
+
+  for (;;) {
+    ZygoteChild *child;
+    gint ret;
+
+    reap_children ();
+    while (n_idle < prewarm && room_for_child (pool_size)) {
+      pid = fork_child (control_fd, input_fd, link_fd);
+      if (pid == 0)
+        goto forked;
+      if (pid == -1) {
+        fprintf (stderr, "zygote: could not fork: %m\n");
+        break;
+      }
+    }
+
+    pfd.fd = parent_fd;
+    pfd.events = POLLIN;
+    ret = poll (&pfd, 1, REAP_INTERVAL);
+    if (ret == -1 && errno != EINTR)
+      break;
+    if (ret <= 0)
+      continue;
+
+    if (sandbox_channel_receive (parent, message) != SANDBOX_CHANNEL_OK)
+      break;
+
+    if (message->type != SANDBOX_MESSAGE_SPAWN || message->n_fds != 2) {
+      fprintf (stderr, "zygote: invalid request\n");
+      sandbox_message_close_fds (message);
+      continue;
+    }
+
+    reap_children ();
+    while (!(child = get_child_with_room ()) && room_for_child (pool_size)) {
+      pid = fork_child (control_fd, input_fd, link_fd);
+      if (pid == 0)
+        goto forked;
+      if (pid == -1)
+        break;
+    }
+
+    /* refusing means closing the fds, the parent will notice */
+    if (!child)
+      fprintf (stderr, "zygote: no decoder available, refusing request\n");
+    else if (!hand_session (child, message))
+      fprintf (stderr, "zygote: could not hand session to %d\n", child->pid);
+
+    sandbox_message_close_fds (message);
+  }
+
+  fprintf (stderr, "zygote: parent went away, quitting\n");
+  g_free (message);
+  sandbox_channel_unref (parent);
+  forget_children ();
+
+  return FALSE;
+
+forked:
+  /* the fds of a request we forked for belong to our sibling-to-be */
+  sandbox_message_close_fds (message);
+  g_free (message);
+  sandbox_channel_unref (parent);
+
+  return TRUE;
+}
@@ -0,0 +1,445 @@
+/*
+ * Copyright (C) 2012 Igalia S.L.
+*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * Decodes a list of files with sandboxeddecodebin, keeping a number of them
+ * (one per CPU by default) decoding at the same time, and reports the
+ * throughput of each and the files per second of the whole batch.
+ *
+ * Each file gets its own pipeline and its own decoder. The decoders are
+ * forked by the zygote of sandboxeddecodebin, which keeps as many of them
+ * prewarmed as there are parallel jobs: starting one costs a fork rather
+ * than an exec and the loading of all the plugins. With --trusted, each
+ * decoder process decodes up to --sessions files, see zygote-sessions.
+ *
+ * Decoded streams go to fakesinks, or to files in --output-dir.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <glib/gstdio.h>
+#include <gst/gst.h>
+
+typedef struct {
+  guint64 buffers;
+  guint64 bytes;
+  gboolean video;
+} Stream;
+
+typedef struct {
+  guint index;
+  gchar *path;
+  GstElement *pipeline;
+  /* Stream *, added from the streaming threads */
+  GMutex lock;
+  GList *streams;
+  guint64 input_size;
+  gint64 start_time;
+  gboolean failed;
+} Job;
+
+typedef struct {
+  GMainLoop *loop;
+  GQueue pending;
+  guint running;
+  guint done;
+  guint failed;
+} Batch;
+
+static gint jobs = 0;
+static gchar *job_list = NULL;
+static gchar *output_dir = NULL;
+static gboolean trusted = FALSE;
+static gint sessions = 4;
+static gchar *sandbox = NULL;
+
+static GOptionEntry entries[] = {
+  { "jobs", 'j', 0, G_OPTION_ARG_INT, &jobs,
+    "Files decoded at the same time (default: one per CPU)", "N" },
+  { "job-list", 'l', 0, G_OPTION_ARG_FILENAME, &job_list,
+    "File listing the files to decode, one per line, - for stdin", "FILE" },
+  { "output-dir", 'o', 0, G_OPTION_ARG_FILENAME, &output_dir,
+    "Write the decoded streams there instead of discarding them", "DIR" },
+  { "trusted", 0, 0, G_OPTION_ARG_NONE, &trusted,
+    "Let files share decoder processes: only for media of trusted origin",
+    NULL },
+  { "sessions", 0, 0, G_OPTION_ARG_INT, &sessions,
+    "Files a decoder process decodes with --trusted (default: 4)", "N" },
+  { "sandbox", 0, 0, G_OPTION_ARG_STRING, &sandbox,
+    "setuid (the default) or namespaces, see sandboxeddecodebin", "BACKEND" },
+  { NULL }
+};
+
+static void start_jobs (Batch *batch);
+
+static Job *
+job_new (guint index, const gchar *path)
+{
+  Job *job = g_new0 (Job, 1);
+
+  job->index = index;
+  job->path = g_strdup (path);
+  g_mutex_init (&job->lock);
+
+  return job;
+}
+
+static void
+job_free (Job *job)
+{
+  g_list_foreach (job->streams, (GFunc) g_free, NULL);
+  g_list_free (job->streams);
+  g_mutex_clear (&job->lock);
+  g_free (job->path);
+  g_free (job);
+}
+
+static gboolean
+on_buffer (GstPad *pad, GstBuffer *buffer, Stream *stream)
+{
+  stream->buffers++;
+  stream->bytes += GST_BUFFER_SIZE (buffer);
+
+  return TRUE;
+}
+
+static GstElement *
+make_sink (Job *job, GstPad *pad)
+{
+  GstElement *sink;
+  gchar *base, *pad_name, *name, *location;
+
+  if (!output_dir) {
+    sink = gst_element_factory_make ("fakesink", NULL);
+    g_object_set (sink, "sync", FALSE, "async", FALSE, NULL);
+    return sink;
+  }
+
+  base = g_path_get_basename (job->path);
+  pad_name = gst_pad_get_name (pad);
+  name = g_strdup_printf ("%u-%s-%s.raw", job->index, base, pad_name);
+  location = g_build_filename (output_dir, name, NULL);
+  sink = gst_element_factory_make ("filesink", NULL);
+  g_object_set (sink, "location", location, "async", FALSE, NULL);
+  g_free (location);
+  g_free (name);
+  g_free (pad_name);
+  g_free (base);
+
+  return sink;
+}
+
+static void
+on_pad_added (GstElement *decoder, GstPad *pad, Job *job)
+{
+  GstElement *sink;
+  GstPad *sinkpad;
+  GstCaps *caps;
+  Stream *stream;
+
+  stream = g_new0 (Stream, 1);
+  caps = gst_pad_get_caps_reffed (pad);
+  stream->video = !gst_caps_is_empty (caps) && !gst_caps_is_any (caps)
+      && g_str_has_prefix (gst_structure_get_name (
+             gst_caps_get_structure (caps, 0)), "video/");
+  gst_caps_unref (caps);
+
+  g_mutex_lock (&job->lock);
+  job->streams = g_list_prepend (job->streams, stream);
+  g_mutex_unlock (&job->lock);
+  /* one streaming thread per pad, the counts are read once it is gone */
+  gst_pad_add_buffer_probe (pad, G_CALLBACK (on_buffer), stream);
+
+  sink = make_sink (job, pad);
+  gst_bin_add (GST_BIN (job->pipeline), sink);
+  gst_element_sync_state_with_parent (sink);
+
+  sinkpad = gst_element_get_static_pad (sink, "sink");
+  if (!GST_PAD_LINK_SUCCESSFUL (gst_pad_link (pad, sinkpad)))
+    fprintf (stderr, "%s: could not link %s\n", job->path,
+             GST_PAD_NAME (pad));
+  gst_object_unref (sinkpad);
+}
+
+static void
+print_job (Job *job)
+{
+  gdouble elapsed;
+  guint64 frames = 0, bytes = 0;
+  GList *l;
+
+  elapsed = (g_get_monotonic_time () - job->start_time) / 1e6;
+  for (l = job->streams; l; l = l->next) {
+    Stream *stream = l->data;
+
+    if (stream->video)
+      frames += stream->buffers;
+    bytes += stream->bytes;
+  }
+
+  printf ("%-40s %-6s %8.2f %10" G_GUINT64_FORMAT " %8.1f %8.1f %8.1f\n",
+          job->path, job->failed ? "failed" : "ok", elapsed, frames,
+          elapsed > 0 ? frames / elapsed : 0.0,
+          elapsed > 0 ? job->input_size / elapsed / (1024.0 * 1024.0) : 0.0,
+          elapsed > 0 ? bytes / elapsed / (1024.0 * 1024.0) : 0.0);
+  fflush (stdout);
+}
+
+static void
+finish_job (Batch *batch, Job *job)
+{
+  /* joins the streaming threads */
+  gst_element_set_state (job->pipeline, GST_STATE_NULL);
+  print_job (job);
+  gst_object_unref (job->pipeline);
+
+  batch->running--;
+  batch->done++;
+  if (job->failed)
+    batch->failed++;
+  job_free (job);
+
+  start_jobs (batch);
+  if (!batch->running)
+    g_main_loop_quit (batch->loop);
+}
+
+static gboolean
+on_bus_message (GstBus *bus, GstMessage *message, Batch *batch)
+{
+  Job *job = g_object_get_data (G_OBJECT (bus), "batch-job");
+
+  switch (GST_MESSAGE_TYPE (message)) {
+  case GST_MESSAGE_ERROR:
+  {
+    GError *error;
+
+    gst_message_parse_error (message, &error, NULL);
+    fprintf (stderr, "%s: %s\n", job->path, error->message);
+    g_error_free (error);
+    job->failed = TRUE;
+    finish_job (batch, job);
+    /* the pipeline is gone, and so is its bus */
+    return FALSE;
+  }
+  case GST_MESSAGE_EOS:
+    finish_job (batch, job);
+    return FALSE;
+  default:
+    break;
+  }
+
+  return TRUE;
+}
+
+static gboolean
+start_job (Batch *batch, Job *job)
+{
+  GstElement *src, *decoder;
+  GstMessage *message;
+  GstBus *bus;
+  struct stat st;
+  guint watch;
+
+  if (g_stat (job->path, &st) == -1) {
+    fprintf (stderr, "Could not stat %s: %m\n", job->path);
+    return FALSE;
+  }
+  job->input_size = st.st_size;
+
+  src = gst_element_factory_make ("filesrc", NULL);
+  decoder = gst_element_factory_make ("sandboxeddecodebin", NULL);
+  if (!src || !decoder) {
+    fprintf (stderr, "Could not create filesrc or sandboxeddecodebin\n");
+    if (src)
+      gst_object_unref (src);
+    if (decoder)
+      gst_object_unref (decoder);
+    return FALSE;
+  }
+  g_object_set (src, "location", job->path, NULL);
+
+  /* every decoder is forked by the zygote, which keeps one ready for each
+   * job that may start next */
+  g_object_set (decoder, "zygote", TRUE, "zygote-prewarm", (guint) jobs,
+                "zygote-sessions", trusted ? (guint) sessions : 1, NULL);
+  if (sandbox)
+    gst_util_set_object_arg (G_OBJECT (decoder), "sandbox", sandbox);
+  g_signal_connect (decoder, "pad-added", G_CALLBACK (on_pad_added), job);
+
+  job->pipeline = gst_pipeline_new (NULL);
+  gst_bin_add_many (GST_BIN (job->pipeline), src, decoder, NULL);
+  gst_element_link (src, decoder);
+
+  bus = gst_element_get_bus (job->pipeline);
+  g_object_set_data (G_OBJECT (bus), "batch-job", job);
+  watch = gst_bus_add_watch (bus, (GstBusFunc) on_bus_message, batch);
+
+  job->start_time = g_get_monotonic_time ();
+  if (gst_element_set_state (job->pipeline, GST_STATE_PLAYING)
+      == GST_STATE_CHANGE_FAILURE) {
+    /* not every failure posts an error, so the job can't be left to the
+     * bus watch */
+    g_source_remove (watch);
+    message = gst_bus_pop_filtered (bus, GST_MESSAGE_ERROR);
+    if (message) {
+      GError *error;
+
+      gst_message_parse_error (message, &error, NULL);
+      fprintf (stderr, "%s: %s\n", job->path, error->message);
+      g_error_free (error);
+      gst_message_unref (message);
+    } else {
+      fprintf (stderr, "%s: could not start decoding\n", job->path);
+    }
+    gst_object_unref (bus);
+    gst_element_set_state (job->pipeline, GST_STATE_NULL);
+    gst_object_unref (job->pipeline);
+    job->pipeline = NULL;
+    return FALSE;
+  }
+  gst_object_unref (bus);
+
+  return TRUE;
+}
+
+/* Starts pending jobs until jobs of them are running */
+static void
+start_jobs (Batch *batch)
+{
+  while (batch->running < (guint) jobs && !g_queue_is_empty (&batch->pending)) {
+    Job *job = g_queue_pop_head (&batch->pending);
+
+    if (start_job (batch, job)) {
+      batch->running++;
+    } else {
+      job->failed = TRUE;
+      print_job (job);
+      batch->done++;
+      batch->failed++;
+      job_free (job);
+    }
+  }
+}
+
+static gboolean
+read_job_list (const gchar *path, GQueue *pending)
+{
+  GError *error = NULL;
+  gchar *contents, **lines, **line;
+
+  if (!strcmp (path, "-")) {
+    GIOChannel *in = g_io_channel_unix_new (STDIN_FILENO);
+    GIOStatus status;
+
+    status = g_io_channel_read_to_end (in, &contents, NULL, &error);
+    g_io_channel_unref (in);
+    if (status != G_IO_STATUS_NORMAL) {
+      fprintf (stderr, "Could not read the job list: %s\n", error->message);
+      g_error_free (error);
+      return FALSE;
+    }
+  } else if (!g_file_get_contents (path, &contents, NULL, &error)) {
+    fprintf (stderr, "%s\n", error->message);
+    g_error_free (error);
+    return FALSE;
+  }
+
+  /* one file per line, # starts a comment */
+  lines = g_strsplit (contents, "\n", -1);
+  for (line = lines; *line; line++) {
+    g_strstrip (*line);
+    if (**line && **line != '#')
+      g_queue_push_tail (pending,
+                         job_new (g_queue_get_length (pending), *line));
+  }
+  g_strfreev (lines);
+  g_free (contents);
+
+  return TRUE;
+}
+
+int
+main (int argc, char **argv)
+{
+  GOptionContext *context;
+  GError *error = NULL;
+  Batch batch;
+  gint64 start_time;
+  gdouble elapsed;
+  gint i;
+
+  context = g_option_context_new ("[FILE...]");
+  g_option_context_set_summary (context,
+      "Decodes files in parallel, each in its own sandboxed decoder.");
+  g_option_context_add_main_entries (context, entries, NULL);
+  g_option_context_add_group (context, gst_init_get_option_group ());
+  if (!g_option_context_parse (context, &argc, &argv, &error)) {
+    fprintf (stderr, "%s\n", error->message);
+    return EXIT_FAILURE;
+  }
+  g_option_context_free (context);
+
+  if (jobs <= 0)
+    jobs = MAX (sysconf (_SC_NPROCESSORS_ONLN), 1);
+  if (sessions <= 0) {
+    fprintf (stderr, "Invalid --sessions %d\n", sessions);
+    return EXIT_FAILURE;
+  }
+  if (output_dir && g_mkdir_with_parents (output_dir, 0755) == -1) {
+    fprintf (stderr, "Could not create %s: %m\n", output_dir);
+    return EXIT_FAILURE;
+  }
+
+  memset (&batch, 0, sizeof (batch));
+  g_queue_init (&batch.pending);
+  if (job_list && !read_job_list (job_list, &batch.pending))
+    return EXIT_FAILURE;
+  for (i = 1; i < argc; i++)
+    g_queue_push_tail (&batch.pending,
+                       job_new (g_queue_get_length (&batch.pending), argv[i]));
+  if (g_queue_is_empty (&batch.pending)) {
+    fprintf (stderr, "Syntax: %s [--jobs=N] [--job-list=FILE] [--output-dir=DIR] [--trusted [--sessions=N]] [--sandbox=setuid|namespaces] [FILE...]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  printf ("%-40s %-6s %8s %10s %8s %8s %8s\n", "file", "status", "time(s)",
+          "frames", "fps", "in MB/s", "out MB/s");
+
+  batch.loop = g_main_loop_new (NULL, FALSE);
+  start_time = g_get_monotonic_time ();
+  start_jobs (&batch);
+  if (batch.running)
+    g_main_loop_run (batch.loop);
+  elapsed = (g_get_monotonic_time () - start_time) / 1e6;
+  g_main_loop_unref (batch.loop);
+
+  printf ("%u files (%u failed) in %.2f s with %d jobs: %.2f files/s\n",
+          batch.done, batch.failed, elapsed, jobs,
+          elapsed > 0 ? batch.done / elapsed : 0.0);
+
+  return batch.failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
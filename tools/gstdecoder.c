@@ -1,47 +1,355 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <sched.h>
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
 #include <gst/gst.h>
 #include <glib-unix.h>
 #include "libsandbox.h"
+#include "nssandbox.h"
+#include "gstsandboxsink.h"
+#include "gstsandboxinputsrc.h"
+#include "decoderzygote.h"
+#include "sandboxipc.h"
 
+/* A decoding session: a pipeline and the channels to the sandboxeddecodebin
+ * it works for. A decoder forked by the zygote may host several. */
 struct PipelineInfo {
-  const gchar *video_shm;
-  const gchar *audio_shm;
-  GstElement *videosink;
-  GstElement *audiosink;
+  GstElement *pipeline;
+  guint bus_watch;
+  /* the control channel to the parent */
+  SandboxChannel *control;
+  guint control_watch;
+  gint input_fd;
+  /* TRUE when we were forked by a zygote that already loaded the plugins and
+   * chrooted */
+  gboolean sandboxed;
   gint connections;
+  /* from the preamble, for the sinks of audio streams */
+  guint64 audio_batch_duration;
+  /* from the preamble, the credit of each sink */
+  guint max_buffers_in_flight;
+  guint64 max_bytes_in_flight;
+  /* from the preamble, for the decoders and the streaming threads */
+  guint max_threads;
+  gint nice;
+  SandboxScheduling scheduling;
+  guint64 cpu_set[SANDBOX_MAX_CPUS / 64];
+  /* from the preamble, how the sinks create their shm areas */
+  SandboxHugePages huge_pages;
+  gboolean prefault_shm;
+  /* from the preamble, stop decodebin2 before the decoders */
+  gboolean demux_only;
+  gboolean got_preamble;
+  guint64 max_shm_size;
+  /* when we went through each phase of our startup, for the parent */
+  SandboxStartupProfileMessage startup_profile;
+  gint first_buffer_seen;
+  /* the sinks of the streams we announced, their index being the id of the
+   * stream, for the queries of the parent. Added from the streaming
+   * threads. */
+  GMutex sinks_lock;
+  GPtrArray *sinks;
+  guint preamble_watch;
+  guint profile_id;
+  guint quit_id;
 };
 
-GstElement *pipeline;
-GstBus *bus;
 GMainLoop *loop;
+/* all our sessions */
+GList *pipelines;
+/* where the zygote hands us more sessions, if we can host more */
+SandboxChannel *session_link;
+guint session_link_watch;
+
+/* Plugins we always load on top of the ones the parent asks for: what
+ * decodebin2 needs to do its job, and what converts the decoded streams to
+ * what the parent wants */
+#define FALLBACK_PLUGINS "coreelements,playback,typefindfunctions," \
+    "ffmpegcolorspace,videoscale,audioconvert,audioresample"
+
+/* Between the queue and the sink of each stream. Passthrough until the
+ * parent tells us what it accepts. */
+#define VIDEO_CONVERTER "ffmpegcolorspace ! videoscale ! capsfilter name=filter"
+#define AUDIO_CONVERTER "audioconvert ! audioresample ! capsfilter name=filter"
+
+/* references to the plugins we loaded, until we know which ones we use */
+GList *loaded_plugins;
+
+/* the phases of the startup of the process, which the first session went
+ * through too unless the zygote forked us */
+static SandboxStartupProfileMessage process_profile;
+
+/* how we confine ourselves once the plugins are loaded */
+static SandboxBackend sandbox_backend = SANDBOX_BACKEND_SETUID;
+
+static void on_pipeline_ready (struct PipelineInfo *pipeline_info);
+static void drop_unused_plugins (GstElement *pipeline);
+static gboolean shut_down (gpointer data);
+
+static void
+mark_phase (SandboxStartupProfileMessage *profile, SandboxStartupPhase phase)
+{
+  profile->times[phase] = g_get_monotonic_time () * GST_USECOND;
+}
+
+static gboolean
+parse_sandbox_option (const gchar *name,
+                      const gchar *value,
+                      gpointer data,
+                      GError **error)
+{
+  if (!strcmp (value, "setuid")) {
+    sandbox_backend = SANDBOX_BACKEND_SETUID;
+  } else if (!strcmp (value, "namespaces")) {
+    /* only possible while we are the only thread, that is before the
+     * GStreamer option group calls gst_init() once all options are parsed */
+    if (!ns_sandbox_enter_namespaces ()) {
+      g_set_error (error, G_OPTION_ERROR, G_OPTION_ERROR_FAILED,
+                   "Could not enter new namespaces");
+      return FALSE;
+    }
+    sandbox_backend = SANDBOX_BACKEND_NAMESPACES;
+  } else {
+    g_set_error (error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+                 "Unknown sandbox %s", value);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+/* Nothing can be loaded or opened from here on */
+static void
+enter_sandbox (void)
+{
+  if (sandbox_backend == SANDBOX_BACKEND_NAMESPACES) {
+    if (!ns_sandbox_lock_down ())
+      exit (EXIT_FAILURE);
+  } else {
+    chrootme ();
+  }
+}
+
+/* After enter_sandbox(), in the process that decodes: the filter keeps the
+ * pid of the process installing it, so a zygote leaves it to its children */
+static void
+confine_signals (void)
+{
+  if (sandbox_backend == SANDBOX_BACKEND_NAMESPACES
+      && !ns_sandbox_confine_signals ())
+    exit (EXIT_FAILURE);
+}
+
+static gboolean
+send_startup_profile (struct PipelineInfo *pipeline_info)
+{
+  pipeline_info->profile_id = 0;
+  if (!sandbox_channel_send (pipeline_info->control,
+                             SANDBOX_MESSAGE_STARTUP_PROFILE,
+                             &pipeline_info->startup_profile,
+                             sizeof (pipeline_info->startup_profile),
+                             NULL, 0))
+    fprintf (stderr, "Could not send the startup profile to the parent\n");
+
+  return FALSE;
+}
+
+/* The first buffer of any stream ends the startup */
+static gboolean
+on_first_buffer (GstPad *pad,
+                 GstBuffer *buffer,
+                 struct PipelineInfo *pipeline_info)
+{
+  if (g_atomic_int_compare_and_exchange (&pipeline_info->first_buffer_seen,
+                                         FALSE, TRUE)) {
+    mark_phase (&pipeline_info->startup_profile, SANDBOX_PHASE_FIRST_BUFFER);
+    pipeline_info->profile_id =
+        g_idle_add ((GSourceFunc) send_startup_profile, pipeline_info);
+  }
+  gst_pad_remove_buffer_probe (pad, GPOINTER_TO_UINT (
+      g_object_get_data (G_OBJECT (pad), "first-buffer-probe")));
+
+  return TRUE;
+}
+
+/* The sinks of all our sessions share the budget of the process: the sum of
+ * what their parents allow, no limit if one of them sets none */
+static void
+update_shm_limit (void)
+{
+  guint64 limit = 0;
+  GList *elem;
+
+  for (elem = pipelines; elem; elem = elem->next) {
+    struct PipelineInfo *pipeline_info = elem->data;
+
+    if (!pipeline_info->got_preamble)
+      continue;
+    if (pipeline_info->max_shm_size == 0) {
+      limit = 0;
+      break;
+    }
+    limit += pipeline_info->max_shm_size;
+  }
+
+  gst_sandbox_sink_set_shm_limit (limit);
+}
+
+/* Tears a session down, and quits once the last one is over and no more can
+ * come */
+static void
+end_pipeline (struct PipelineInfo *pipeline_info)
+{
+  gst_element_set_state (pipeline_info->pipeline, GST_STATE_NULL);
+  gst_object_unref (pipeline_info->pipeline);
+
+  g_source_remove (pipeline_info->bus_watch);
+  g_source_remove (pipeline_info->control_watch);
+  if (pipeline_info->preamble_watch)
+    g_source_remove (pipeline_info->preamble_watch);
+  if (pipeline_info->profile_id)
+    g_source_remove (pipeline_info->profile_id);
+  if (pipeline_info->quit_id)
+    g_source_remove (pipeline_info->quit_id);
+  /* so that the parent doesn't take it for a crash, it may be gone already */
+  sandbox_channel_send (pipeline_info->control, SANDBOX_MESSAGE_DONE,
+                        NULL, 0, NULL, 0);
+  sandbox_channel_unref (pipeline_info->control);
+  /* stdin is only ours when we are not a decoder forked by the zygote */
+  if (pipeline_info->sandboxed)
+    close (pipeline_info->input_fd);
+
+  g_ptr_array_free (pipeline_info->sinks, TRUE);
+  g_mutex_clear (&pipeline_info->sinks_lock);
+
+  pipelines = g_list_remove (pipelines, pipeline_info);
+  g_slice_free (struct PipelineInfo, pipeline_info);
+  update_shm_limit ();
+
+  if (!pipelines && !session_link)
+    g_main_loop_quit (loop);
+}
+
+/* Called from each streaming thread of the session as it starts. The
+ * decoders' own threads are created from those and inherit it all. All of
+ * it goes through pid 0, the calling thread, the only one the namespaces
+ * sandbox lets us touch. */
+static void
+apply_thread_settings (struct PipelineInfo *pipeline_info)
+{
+  cpu_set_t cpus;
+  gboolean pinned = FALSE;
+  guint i;
+
+  CPU_ZERO (&cpus);
+  for (i = 0; i < SANDBOX_MAX_CPUS && i < CPU_SETSIZE; i++) {
+    if (pipeline_info->cpu_set[i / 64]
+        & (G_GUINT64_CONSTANT (1) << (i % 64))) {
+      CPU_SET (i, &cpus);
+      pinned = TRUE;
+    }
+  }
+  if (pinned && sched_setaffinity (0, sizeof (cpus), &cpus) == -1)
+    fprintf (stderr, "Could not set the CPU affinity: %m\n");
+
+  if (pipeline_info->scheduling != SANDBOX_SCHEDULING_NORMAL) {
+    struct sched_param param = { 0 };
+    int policy = pipeline_info->scheduling == SANDBOX_SCHEDULING_BATCH
+        ? SCHED_BATCH : SCHED_IDLE;
+
+    if (sched_setscheduler (0, policy, &param) == -1)
+      fprintf (stderr, "Could not set the scheduling policy: %m\n");
+  }
+
+  /* per thread on Linux. Going below the nice level we inherited takes
+   * privileges we don't have. */
+  if (pipeline_info->nice
+      && setpriority (PRIO_PROCESS, 0, pipeline_info->nice) == -1)
+    fprintf (stderr, "Could not set the nice level: %m\n");
+}
 
-static void on_pipeline_ready (void);
+static GstBusSyncReply
+on_sync_message (GstBus *bus,
+                 GstMessage *message,
+                 struct PipelineInfo *pipeline_info)
+{
+  GstStreamStatusType type;
+
+  if (message->type == GST_MESSAGE_STREAM_STATUS) {
+    gst_message_parse_stream_status (message, &type, NULL);
+    if (type == GST_STREAM_STATUS_TYPE_ENTER)
+      apply_thread_settings (pipeline_info);
+  }
+
+  return GST_BUS_PASS;
+}
+
+/* decodebin2 plugs everything in itself. Decoders have no standard thread
+ * option, these are the ones of ffmpeg and libvpx. */
+static void
+on_element_added (GstBin *decodebin,
+                  GstElement *element,
+                  struct PipelineInfo *pipeline_info)
+{
+  static const gchar *thread_properties[] = { "max-threads", "threads" };
+  GParamSpec *pspec = NULL;
+  guint i;
+
+  if (!pipeline_info->max_threads)
+    return;
 
-#define SHM_SIZE 100000000
+  for (i = 0; i < G_N_ELEMENTS (thread_properties) && !pspec; i++)
+    pspec = g_object_class_find_property (G_OBJECT_GET_CLASS (element),
+                                          thread_properties[i]);
+  if (!pspec || !(pspec->flags & G_PARAM_WRITABLE))
+    return;
+
+  if (G_IS_PARAM_SPEC_INT (pspec))
+    g_object_set (element, pspec->name,
+                  (gint) MIN (pipeline_info->max_threads, G_MAXINT), NULL);
+  else if (G_IS_PARAM_SPEC_UINT (pspec))
+    g_object_set (element, pspec->name, pipeline_info->max_threads, NULL);
+  else
+    return;
+
+  fprintf (stderr, "%s uses at most %u threads\n", GST_ELEMENT_NAME (element),
+           pipeline_info->max_threads);
+}
 
 static gboolean
 on_message (GstBus *bus,
             GstMessage *message,
-            gpointer data)
+            struct PipelineInfo *pipeline_info)
 {
   switch (message->type) {
   case GST_MESSAGE_STATE_CHANGED:
-    if (message->src == (GstObject *)pipeline) {
-      GstState new_state;
+    if (message->src == (GstObject *)pipeline_info->pipeline) {
+      GstState old_state, new_state;
       gst_message_parse_state_changed (message,
-                                       NULL, /* oldstate */
+                                       &old_state,
                                        &new_state,
                                        NULL /* pending */);
-      if (new_state == GST_STATE_READY)
-        on_pipeline_ready ();
+      /* only on the way up, not when shutting down */
+      if (new_state == GST_STATE_READY && old_state == GST_STATE_NULL)
+        on_pipeline_ready (pipeline_info);
+      if (new_state == GST_STATE_PAUSED && old_state == GST_STATE_READY)
+        drop_unused_plugins (pipeline_info->pipeline);
+      if (new_state == GST_STATE_PLAYING && old_state == GST_STATE_PAUSED)
+        mark_phase (&pipeline_info->startup_profile, SANDBOX_PHASE_PLAYING);
       if (new_state == GST_STATE_NULL)
         fprintf (stderr, "decoder: pipeline set to NULL state\n");
     }
     break;
   case GST_MESSAGE_EOS:
-    if (message->src == (GstObject *)pipeline) {
+    if (message->src == (GstObject *)pipeline_info->pipeline) {
       fprintf (stderr, "Got EOS, quitting\n");
-      g_main_loop_quit (loop);
+      end_pipeline (pipeline_info);
+      return FALSE;
     }
   default:
     break;
@@ -70,55 +378,464 @@ load_all_plugins (void)
   }
 }
 
+/* Loads the plugins from a comma separated list of names, those we don't
+ * have are skipped, decodebin2 will tell if they were really needed */
+static void
+load_plugins (const gchar *names)
+{
+  GstRegistry *registry = gst_registry_get_default ();
+  gchar **plugin_names, **name;
+
+  plugin_names = g_strsplit (names, ",", -1);
+  for (name = plugin_names; *name; name++) {
+    GstPlugin *plugin, *loaded;
+
+    if (**name == '\0')
+      continue;
+
+    plugin = gst_registry_find_plugin (registry, *name);
+    if (!plugin) {
+      fprintf (stderr, "No plugin named %s\n", *name);
+      continue;
+    }
+
+    loaded = gst_plugin_load (plugin);
+    gst_object_unref (plugin);
+    if (loaded)
+      loaded_plugins = g_list_prepend (loaded_plugins, loaded);
+  }
+  g_strfreev (plugin_names);
+}
+
+static void
+add_plugin_name (GstElement *element, GHashTable *used)
+{
+  GstElementFactory *factory = gst_element_get_factory (element);
+
+  if (factory && GST_PLUGIN_FEATURE (factory)->plugin_name)
+    g_hash_table_add (used, g_strdup (GST_PLUGIN_FEATURE (factory)->plugin_name));
+}
+
+/* Once prerolled, decodebin2 plugged everything it needs: forget about the
+ * plugins none of our elements come from. GStreamer never unloads modules,
+ * but this lets go of the plugin objects. */
+static void
+drop_unused_plugins (GstElement *pipeline)
+{
+  GHashTable *used;
+  GstIterator *iter;
+  GList *elem, *next;
+  gpointer item;
+  gboolean done = FALSE;
+
+  if (!loaded_plugins)
+    return;
+
+  used = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  iter = gst_bin_iterate_recurse (GST_BIN (pipeline));
+  while (!done) {
+    switch (gst_iterator_next (iter, &item)) {
+    case GST_ITERATOR_OK:
+      add_plugin_name (GST_ELEMENT (item), used);
+      gst_object_unref (item);
+      break;
+    case GST_ITERATOR_RESYNC:
+      g_hash_table_remove_all (used);
+      gst_iterator_resync (iter);
+      break;
+    default:
+      done = TRUE;
+      break;
+    }
+  }
+  gst_iterator_free (iter);
+
+  for (elem = loaded_plugins; elem; elem = next) {
+    GstPlugin *plugin = elem->data;
+
+    next = elem->next;
+    if (!g_hash_table_contains (used, gst_plugin_get_name (plugin))) {
+      gst_object_unref (plugin);
+      loaded_plugins = g_list_delete_link (loaded_plugins, elem);
+    }
+  }
+
+  g_hash_table_destroy (used);
+}
+
+/* The parent typefinds the stream and tells us which plugins we need in the
+ * first message of our input channel. As nothing can be loaded once
+ * chrooted, this has to happen before. It also tells how much shared memory
+ * our sinks may use. */
+static gboolean
+load_required_plugins (struct PipelineInfo *pipeline_info)
+{
+  SandboxChannel *input;
+  SandboxMessage *message;
+  SandboxPreamble settings;
+  gchar *plugins = NULL;
+
+  message = g_new (SandboxMessage, 1);
+  input = sandbox_channel_new (dup (pipeline_info->input_fd));
+  if (sandbox_channel_receive (input, message) == SANDBOX_CHANNEL_OK) {
+    mark_phase (&pipeline_info->startup_profile,
+                SANDBOX_PHASE_PREAMBLE_RECEIVED);
+    plugins = sandbox_message_parse_preamble (message, &settings);
+    sandbox_message_close_fds (message);
+  }
+  sandbox_channel_unref (input);
+  g_free (message);
+  if (!plugins)
+    return FALSE;
+
+  pipeline_info->got_preamble = TRUE;
+  pipeline_info->max_shm_size = settings.max_shm_size;
+  pipeline_info->audio_batch_duration = settings.audio_batch_duration;
+  pipeline_info->max_buffers_in_flight = settings.max_buffers_in_flight;
+  pipeline_info->max_bytes_in_flight = settings.max_bytes_in_flight;
+  pipeline_info->max_threads = settings.max_threads;
+  pipeline_info->nice = settings.nice;
+  pipeline_info->scheduling = settings.scheduling <= SANDBOX_SCHEDULING_IDLE
+      ? settings.scheduling : SANDBOX_SCHEDULING_NORMAL;
+  memcpy (pipeline_info->cpu_set, settings.cpu_set,
+          sizeof (pipeline_info->cpu_set));
+  pipeline_info->huge_pages = settings.huge_pages;
+  pipeline_info->prefault_shm = settings.prefault_shm != 0;
+  pipeline_info->demux_only = settings.demux_only != 0;
+  update_shm_limit ();
+
+  if (pipeline_info->sandboxed) {
+    /* the zygote loaded all of them already */
+  } else if (!strcmp (plugins, SANDBOX_PREAMBLE_ALL_PLUGINS)) {
+    fprintf (stderr, "Loading all plugins\n");
+    load_all_plugins ();
+  } else {
+    fprintf (stderr, "Loading plugins %s\n", plugins);
+    load_plugins (FALLBACK_PLUGINS);
+    load_plugins (plugins);
+  }
+  g_free (plugins);
+  mark_phase (&pipeline_info->startup_profile, SANDBOX_PHASE_PLUGINS_LOADED);
+
+  return TRUE;
+}
+
 static void
-on_client_connected (GstElement *shmsink,
+on_client_connected (GstElement *sandboxsink,
                      gint arg0,
                      struct PipelineInfo *pipeline_info)
 {
   g_atomic_int_inc (&pipeline_info->connections);
 }
 
+static gboolean
+quit_pipeline (struct PipelineInfo *pipeline_info)
+{
+  pipeline_info->quit_id = 0;
+  end_pipeline (pipeline_info);
+
+  return FALSE;
+}
+
+/* For when the session can't be ended right away, from a streaming thread or
+ * from one of its own callbacks */
+static void
+quit_soon (struct PipelineInfo *pipeline_info)
+{
+  if (!pipeline_info->quit_id)
+    pipeline_info->quit_id = g_idle_add ((GSourceFunc) quit_pipeline,
+                                         pipeline_info);
+}
+
 static void
-on_client_disconnected (GstElement *shmsink,
+on_client_disconnected (GstElement *sandboxsink,
                      gint arg0,
                      struct PipelineInfo *pipeline_info)
 {
   if (g_atomic_int_dec_and_test (&pipeline_info->connections)) {
     fprintf (stderr, "No more connections, quitting!\n");
-    gst_element_set_state (pipeline, GST_STATE_NULL);
-    g_object_unref (pipeline);
-    g_main_loop_quit (loop);
+    /* we are in the sink's thread, which wouldn't like to be stopped from
+     * here */
+    quit_soon (pipeline_info);
+  }
+}
+
+/* The return values of decodebin2's autoplug-select, from gstplay-enum.h,
+ * which isn't installed */
+typedef enum {
+  AUTOPLUG_SELECT_TRY,
+  AUTOPLUG_SELECT_EXPOSE,
+  AUTOPLUG_SELECT_SKIP
+} AutoplugSelectResult;
+
+/* In demux-only mode, the pads decoders would be plugged on are exposed
+ * instead, with the caps of the parser before them if any */
+static AutoplugSelectResult
+on_autoplug_select (GstElement *decodebin,
+                    GstPad *pad,
+                    GstCaps *caps,
+                    GstElementFactory *factory,
+                    struct PipelineInfo *pipeline_info)
+{
+  if (pipeline_info->demux_only
+      && gst_element_factory_list_is_type (factory,
+                                           GST_ELEMENT_FACTORY_TYPE_DECODER))
+    return AUTOPLUG_SELECT_EXPOSE;
+
+  return AUTOPLUG_SELECT_TRY;
+}
+
+/* Raw streams only, unless demux_only */
+static gboolean
+get_stream_kind (GstPad *pad, gboolean demux_only, SandboxStreamKind *kind)
+{
+  GstCaps *caps;
+  const gchar *name;
+  gboolean ret = TRUE;
+
+  caps = gst_pad_get_caps_reffed (pad);
+  if (gst_caps_is_empty (caps) || gst_caps_is_any (caps)) {
+    gst_caps_unref (caps);
+    return FALSE;
+  }
+
+  name = gst_structure_get_name (gst_caps_get_structure (caps, 0));
+  if (g_str_has_prefix (name, demux_only ? "video/" : "video/x-raw-"))
+    *kind = SANDBOX_STREAM_VIDEO;
+  else if (g_str_has_prefix (name, demux_only ? "audio/" : "audio/x-raw-"))
+    *kind = SANDBOX_STREAM_AUDIO;
+  else
+    ret = FALSE;
+  gst_caps_unref (caps);
+
+  return ret;
+}
+
+/* Plugs something at the end of a decodebin2 pad, and syncs it with the
+ * pipeline. convert may be NULL. */
+static gboolean
+plug_stream_end (GstElement *pipeline,
+                 GstPad *pad,
+                 GstElement *queue,
+                 GstElement *convert,
+                 GstElement *sink)
+{
+  GstPad *sinkpad;
+  gboolean ret;
+
+  gst_bin_add_many (GST_BIN (pipeline), queue, sink, NULL);
+  if (convert) {
+    gst_bin_add (GST_BIN (pipeline), convert);
+    if (!gst_element_link_many (queue, convert, sink, NULL))
+      return FALSE;
+  } else if (!gst_element_link (queue, sink)) {
+    return FALSE;
   }
+
+  sinkpad = gst_element_get_static_pad (queue, "sink");
+  ret = GST_PAD_LINK_SUCCESSFUL (gst_pad_link (pad, sinkpad));
+  gst_object_unref (sinkpad);
+  if (!ret)
+    return FALSE;
+
+  gst_element_sync_state_with_parent (sink);
+  if (convert)
+    gst_element_sync_state_with_parent (convert);
+  gst_element_sync_state_with_parent (queue);
+
+  return TRUE;
 }
 
+/* Streams we can't hand over still need somewhere to go, or decodebin2's
+ * upstream would stop on not-linked */
 static void
-monitor_shmsink_connections (struct PipelineInfo *pipeline_info)
+discard_stream (GstElement *pipeline, GstPad *pad)
 {
-  g_signal_connect (pipeline_info->videosink, "client-connected",
-                    G_CALLBACK (on_client_connected), pipeline_info);
-  g_signal_connect (pipeline_info->videosink, "client-disconnected",
-                    G_CALLBACK (on_client_disconnected), pipeline_info);
-  g_signal_connect (pipeline_info->audiosink, "client-connected",
+  GstElement *queue = gst_element_factory_make ("queue", NULL);
+  GstElement *sink = gst_element_factory_make ("fakesink", NULL);
+
+  g_object_set (sink, "sync", FALSE, "async", FALSE, NULL);
+  if (!plug_stream_end (pipeline, pad, queue, NULL, sink))
+    fprintf (stderr, "Could not discard stream\n");
+}
+
+/* The parent tells the sink of a stream what its downstream accepts. We
+ * keep the raw formats of the stream's kind, minus what our converter can't
+ * change, and have it convert to those, which costs less than sending
+ * full-size frames the parent would scale down anyway. */
+static void
+on_downstream_caps (GstElement *sandboxsink,
+                    GstCaps *caps,
+                    GstElement *capsfilter)
+{
+  SandboxStreamKind kind;
+  GstCaps *filter;
+  guint i;
+
+  kind = GPOINTER_TO_INT (g_object_get_data (G_OBJECT (capsfilter),
+                                             "stream-kind"));
+  filter = gst_caps_new_empty ();
+  for (i = 0; i < gst_caps_get_size (caps); i++) {
+    GstStructure *structure = gst_caps_get_structure (caps, i);
+    const gchar *name = gst_structure_get_name (structure);
+
+    if (kind == SANDBOX_STREAM_VIDEO
+        && g_str_has_prefix (name, "video/x-raw-")) {
+      structure = gst_structure_copy (structure);
+      /* we don't drop or duplicate frames */
+      gst_structure_remove_field (structure, "framerate");
+      gst_caps_append_structure (filter, structure);
+    } else if (kind == SANDBOX_STREAM_AUDIO
+               && g_str_has_prefix (name, "audio/x-raw-")) {
+      gst_caps_append_structure (filter, gst_structure_copy (structure));
+    }
+  }
+
+  if (gst_caps_is_empty (filter)) {
+    fprintf (stderr, "Ignoring downstream caps without raw formats\n");
+  } else {
+    /* capsfilter has upstream renegotiate if the current caps don't fit */
+    g_object_set (capsfilter, "caps", filter, NULL);
+  }
+  gst_caps_unref (filter);
+}
+
+/* Returns a bin converting streams of that kind, whose capsfilter follows
+ * the downstream-caps of sink, or NULL if we lack the elements */
+static GstElement *
+make_converter (SandboxStreamKind kind, GstElement *sink)
+{
+  GstElement *convert, *capsfilter;
+  GError *error = NULL;
+
+  convert = gst_parse_bin_from_description (kind == SANDBOX_STREAM_VIDEO
+                                            ? VIDEO_CONVERTER
+                                            : AUDIO_CONVERTER,
+                                            TRUE, &error);
+  /* even what it could build would be missing something */
+  if (error) {
+    fprintf (stderr, "Could not create converter, sending streams as "
+             "decoded: %s\n", error->message);
+    g_error_free (error);
+    if (convert)
+      gst_object_unref (convert);
+    return NULL;
+  }
+
+  capsfilter = gst_bin_get_by_name (GST_BIN (convert), "filter");
+  g_object_set_data (G_OBJECT (capsfilter), "stream-kind",
+                     GINT_TO_POINTER (kind));
+  g_signal_connect_data (sink, "downstream-caps",
+                         G_CALLBACK (on_downstream_caps), capsfilter,
+                         (GClosureNotify) gst_object_unref, 0);
+
+  return convert;
+}
+
+/* Every decoded stream gets its own sink and channel, whose other end goes
+ * to the parent in a STREAM_ADDED message */
+static void
+on_pad_added (GstElement *decodebin,
+              GstPad *pad,
+              struct PipelineInfo *pipeline_info)
+{
+  SandboxStreamMessage stream;
+  SandboxStreamKind kind;
+  GstElement *queue, *convert, *sink;
+  GstPad *sinkpad;
+  gulong probe;
+  gint fds[2];
+
+  if (!get_stream_kind (pad, pipeline_info->demux_only, &kind)) {
+    discard_stream (pipeline_info->pipeline, pad);
+    return;
+  }
+
+  if (!sandbox_ipc_socketpair (fds)) {
+    fprintf (stderr, "Could not create a stream channel: %m\n");
+    discard_stream (pipeline_info->pipeline, pad);
+    return;
+  }
+
+  queue = gst_element_factory_make ("queue", NULL);
+  sink = gst_element_factory_make ("sandboxsink", NULL);
+  g_object_set (sink, "fd", fds[0], NULL);
+  if (kind == SANDBOX_STREAM_AUDIO)
+    g_object_set (sink, "audio-batch-duration",
+                  pipeline_info->audio_batch_duration, NULL);
+  g_object_set (sink,
+                "max-buffers-in-flight", pipeline_info->max_buffers_in_flight,
+                "max-bytes-in-flight", pipeline_info->max_bytes_in_flight,
+                "shm-huge-pages",
+                pipeline_info->huge_pages == SANDBOX_HUGE_PAGES_EXPLICIT,
+                "shm-transparent-huge-pages",
+                pipeline_info->huge_pages == SANDBOX_HUGE_PAGES_TRANSPARENT,
+                "shm-prefault", pipeline_info->prefault_shm, NULL);
+  /* with a credit, the decoder stops when the parent falls behind instead
+   * of filling the queue, so it doesn't need to hold more than that */
+  if (pipeline_info->max_buffers_in_flight
+      || pipeline_info->max_bytes_in_flight)
+    g_object_set (queue,
+                  "max-size-buffers", pipeline_info->max_buffers_in_flight,
+                  "max-size-bytes",
+                  (guint) MIN (pipeline_info->max_bytes_in_flight, G_MAXUINT),
+                  "max-size-time", (guint64) 0, NULL);
+  g_signal_connect (sink, "client-connected",
                     G_CALLBACK (on_client_connected), pipeline_info);
-  g_signal_connect (pipeline_info->audiosink, "client-disconnected",
+  g_signal_connect (sink, "client-disconnected",
                     G_CALLBACK (on_client_disconnected), pipeline_info);
+  /* after the queue, so that it doesn't hold up the decoder. Compressed
+   * streams go as they are. */
+  convert = pipeline_info->demux_only ? NULL : make_converter (kind, sink);
+
+  /* the sink dups its fd when it starts */
+  if (!plug_stream_end (pipeline_info->pipeline, pad, queue, convert, sink)) {
+    fprintf (stderr, "Could not plug a sink for %s:%s\n",
+             GST_DEBUG_PAD_NAME (pad));
+    close (fds[0]);
+    close (fds[1]);
+    return;
+  }
+  close (fds[0]);
+
+  sinkpad = gst_element_get_static_pad (sink, "sink");
+  probe = gst_pad_add_buffer_probe (sinkpad, G_CALLBACK (on_first_buffer),
+                                    pipeline_info);
+  g_object_set_data (G_OBJECT (sinkpad), "first-buffer-probe",
+                     GUINT_TO_POINTER (probe));
+  gst_object_unref (sinkpad);
+
+  stream.kind = kind;
+  g_mutex_lock (&pipeline_info->sinks_lock);
+  stream.id = pipeline_info->sinks->len;
+  g_ptr_array_add (pipeline_info->sinks, gst_object_ref (sink));
+  g_mutex_unlock (&pipeline_info->sinks_lock);
+  if (!sandbox_channel_send (pipeline_info->control,
+                             SANDBOX_MESSAGE_STREAM_ADDED,
+                             &stream, sizeof (stream), &fds[1], 1))
+    fprintf (stderr, "Could not announce a stream to the parent\n");
+  close (fds[1]);
 }
 
-static gboolean
+static void
+on_no_more_pads (GstElement *decodebin, struct PipelineInfo *pipeline_info)
+{
+  sandbox_channel_send (pipeline_info->control,
+                        SANDBOX_MESSAGE_NO_MORE_STREAMS, NULL, 0, NULL, 0);
+}
+
+static void
 init_pipeline (struct PipelineInfo *pipeline_info)
 {
   GError *error = NULL;
+  GstElement *pipeline;
   gchar *pipeline_desc;
-
-  fprintf (stderr, "Loading all plugins\n");
-  load_all_plugins ();
+  GstElement *decodebin;
+  GstBus *bus;
 
   fprintf (stderr, "Creating pipeline\n");
-  pipeline_desc = g_strdup_printf ("fdsrc ! decodebin2 name=decoder "
-      "decoder. ! video/x-raw-yuv;video/x-raw-rgb ! gdppay ! queue ! shmsink name=videosink socket-path=%s shm-size=%d "
-      "decoder. ! audio/x-raw-int;audio/x-raw-float ! gdppay ! queue ! shmsink name=audiosink socket-path=%s shm-size=%d",
-      pipeline_info->video_shm, SHM_SIZE,
-      pipeline_info->audio_shm, SHM_SIZE);
+  pipeline_desc = g_strdup_printf ("sandboxinputsrc fd=%d ! decodebin2 name=decoder",
+                                   pipeline_info->input_fd);
 
   pipeline = gst_parse_launch (pipeline_desc, &error);
   g_free (pipeline_desc);
@@ -126,27 +843,38 @@ init_pipeline (struct PipelineInfo *pipeline_info)
     fprintf (stderr, "Problem creating pipeline: %s\n", error->message);
     exit(EXIT_FAILURE);
   }
+  pipeline_info->pipeline = pipeline;
+  mark_phase (&pipeline_info->startup_profile,
+              SANDBOX_PHASE_PIPELINE_CREATED);
 
-  pipeline_info->videosink = gst_bin_get_by_name (GST_BIN (pipeline), "videosink");
-  pipeline_info->audiosink = gst_bin_get_by_name (GST_BIN (pipeline), "audiosink");
-
-  monitor_shmsink_connections (pipeline_info);
+  decodebin = gst_bin_get_by_name (GST_BIN (pipeline), "decoder");
+  g_signal_connect (decodebin, "pad-added",
+                    G_CALLBACK (on_pad_added), pipeline_info);
+  g_signal_connect (decodebin, "no-more-pads",
+                    G_CALLBACK (on_no_more_pads), pipeline_info);
+  g_signal_connect (decodebin, "element-added",
+                    G_CALLBACK (on_element_added), pipeline_info);
+  g_signal_connect (decodebin, "autoplug-select",
+                    G_CALLBACK (on_autoplug_select), pipeline_info);
+  gst_object_unref (decodebin);
 
   fprintf (stderr, "Setting up bus watch\n");
   bus = gst_pipeline_get_bus (GST_PIPELINE (pipeline));
 
-  gst_bus_add_watch (bus, on_message, NULL);
+  pipeline_info->bus_watch = gst_bus_add_watch (bus, (GstBusFunc) on_message,
+                                                pipeline_info);
+  /* the preamble's thread settings are known by the time threads start */
+  gst_bus_set_sync_handler (bus, (GstBusSyncHandler) on_sync_message,
+                            pipeline_info);
+  gst_object_unref (bus);
 
   fprintf (stderr, "Going to READY\n");
   gst_element_set_state (pipeline, GST_STATE_READY);
-
-  return FALSE;
 }
 
 static void
-on_pipeline_ready (void)
+go_silent (void)
 {
-  fprintf (stderr, "pipeline is READY\n");
   if (NULL == g_getenv("GST_DECODER_DEBUG")) {
     /* Unless we're in debug mode, close stdout and stderr which are likely
      * to be fds on a tty, which is a potential "escape" risk, and make them
@@ -160,10 +888,57 @@ on_pipeline_ready (void)
     /* make stderr point to /dev/null */
     g_assert (-1 != dup2 (devnul, 2));
   }
-  chrootme ();
+}
+
+/* The parent has seen the start of the stream and sent the preamble */
+static gboolean
+on_preamble (GIOChannel *source,
+             GIOCondition condition,
+             struct PipelineInfo *pipeline_info)
+{
+  pipeline_info->preamble_watch = 0;
+
+  if (!load_required_plugins (pipeline_info)) {
+    fprintf (stderr, "Could not read the list of plugins to load\n");
+    quit_soon (pipeline_info);
+    return FALSE;
+  }
+
+  /* the zygote went silent and chrooted before forking us */
+  if (!pipeline_info->sandboxed) {
+    go_silent ();
+    enter_sandbox ();
+    confine_signals ();
+    mark_phase (&pipeline_info->startup_profile, SANDBOX_PHASE_SANDBOXED);
+  }
 
   fprintf (stderr, "going to PLAYING\n");
-  gst_element_set_state (pipeline, GST_STATE_PLAYING);
+  gst_element_set_state (pipeline_info->pipeline, GST_STATE_PLAYING);
+
+  return FALSE;
+}
+
+static void
+on_pipeline_ready (struct PipelineInfo *pipeline_info)
+{
+  GIOChannel *io_channel;
+
+  fprintf (stderr, "pipeline is READY\n");
+  mark_phase (&pipeline_info->startup_profile, SANDBOX_PHASE_PIPELINE_READY);
+  if (!sandbox_channel_send (pipeline_info->control, SANDBOX_MESSAGE_READY,
+                             NULL, 0, NULL, 0)) {
+    fprintf (stderr, "Could not tell the parent we are ready\n");
+    quit_soon (pipeline_info);
+    return;
+  }
+
+  /* the parent typefinds before sending the preamble, which may take a
+   * while, and the other sessions we host must go on meanwhile */
+  io_channel = g_io_channel_unix_new (pipeline_info->input_fd);
+  pipeline_info->preamble_watch =
+      g_io_add_watch (io_channel, G_IO_IN | G_IO_HUP | G_IO_ERR,
+                      (GIOFunc) on_preamble, pipeline_info);
+  g_io_channel_unref (io_channel);
 }
 
 /* signal handler */
@@ -171,15 +946,173 @@ static gboolean
 shut_down (gpointer data)
 {
   fprintf (stderr, "Decoder: Received a signal telling us to shut down.\n");
-  if (pipeline) {
-    gst_element_set_state (pipeline, GST_STATE_NULL);
+  if (session_link) {
+    g_source_remove (session_link_watch);
+    sandbox_channel_unref (session_link);
+    session_link = NULL;
   }
+  while (pipelines)
+    end_pipeline (pipelines->data);
 
   g_main_loop_quit (loop);
 
   return TRUE;
 }
 
+static gboolean
+register_elements (GstPlugin *plugin)
+{
+  return gst_element_register (plugin, "sandboxsink", GST_RANK_NONE,
+                               GST_SANDBOX_SINK_TYPE)
+      && gst_element_register (plugin, "sandboxinputsrc", GST_RANK_NONE,
+                               GST_SANDBOX_INPUT_SRC_TYPE);
+}
+
+/* Runs a query from downstream of the parent upstream of the sink of its
+ * stream, and sends the answer back */
+static void
+answer_query (struct PipelineInfo *pipeline_info, SandboxMessage *message)
+{
+  const SandboxQueryMessage *header;
+  SandboxQueryMessage result;
+  GstElement *sink = NULL;
+  GstQuery *query;
+  GstPad *sinkpad;
+
+  header = sandbox_message_get_query_header (message);
+  query = sandbox_message_parse_query (message);
+  if (!query) {
+    fprintf (stderr, "Invalid query from the parent\n");
+    return;
+  }
+
+  result = *header;
+  result.answered = FALSE;
+  g_mutex_lock (&pipeline_info->sinks_lock);
+  if (header->stream < pipeline_info->sinks->len)
+    sink = gst_object_ref (g_ptr_array_index (pipeline_info->sinks,
+                                              header->stream));
+  g_mutex_unlock (&pipeline_info->sinks_lock);
+
+  if (sink) {
+    sinkpad = gst_element_get_static_pad (sink, "sink");
+    result.answered = gst_pad_peer_query (sinkpad, query);
+    gst_object_unref (sinkpad);
+    gst_object_unref (sink);
+  }
+
+  sandbox_channel_send_query (pipeline_info->control,
+                              SANDBOX_MESSAGE_QUERY_RESULT, query, &result);
+  gst_query_unref (query);
+}
+
+/* Besides it going away, the parent only sends queries on the control
+ * channel */
+static gboolean
+on_control_event (GIOChannel *source,
+                  GIOCondition condition,
+                  struct PipelineInfo *pipeline_info)
+{
+  SandboxMessage *message;
+  SandboxChannelResult result;
+
+  if (condition & (G_IO_HUP | G_IO_ERR)) {
+    end_pipeline (pipeline_info);
+    return FALSE;
+  }
+
+  message = g_new (SandboxMessage, 1);
+  result = sandbox_channel_receive (pipeline_info->control, message);
+  if (result == SANDBOX_CHANNEL_OK) {
+    if (message->type == SANDBOX_MESSAGE_QUERY)
+      answer_query (pipeline_info, message);
+    sandbox_message_close_fds (message);
+  }
+  g_free (message);
+
+  if (result != SANDBOX_CHANNEL_OK) {
+    end_pipeline (pipeline_info);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+static guint
+watch_channel (SandboxChannel *channel, GIOFunc func, gpointer data)
+{
+  GIOChannel *io_channel;
+  guint id;
+
+  io_channel = g_io_channel_unix_new (sandbox_channel_get_fd (channel));
+  id = g_io_add_watch (io_channel, G_IO_IN | G_IO_HUP | G_IO_ERR, func, data);
+  g_io_channel_unref (io_channel);
+
+  return id;
+}
+
+/* Starts a session, it goes on once its pipeline is READY */
+static void
+add_pipeline (gint control_fd, gint input_fd, gboolean sandboxed)
+{
+  struct PipelineInfo *pipeline_info;
+
+  pipeline_info = g_slice_new0 (struct PipelineInfo);
+  pipeline_info->control = sandbox_channel_new (control_fd);
+  pipeline_info->input_fd = input_fd;
+  pipeline_info->sandboxed = sandboxed;
+  g_mutex_init (&pipeline_info->sinks_lock);
+  pipeline_info->sinks = g_ptr_array_new_with_free_func (gst_object_unref);
+  if (sandboxed) {
+    /* the startup of sessions we got from the zygote begins now */
+    mark_phase (&pipeline_info->startup_profile, SANDBOX_PHASE_STARTED);
+  } else {
+    pipeline_info->startup_profile = process_profile;
+  }
+  pipelines = g_list_append (pipelines, pipeline_info);
+
+  pipeline_info->control_watch =
+      watch_channel (pipeline_info->control, (GIOFunc) on_control_event,
+                     pipeline_info);
+  init_pipeline (pipeline_info);
+}
+
+/* The zygote hands us another session, or lets us know we had them all */
+static gboolean
+on_session_link_event (GIOChannel *source,
+                       GIOCondition condition,
+                       gpointer data)
+{
+  SandboxMessage *message;
+  SandboxChannelResult result = SANDBOX_CHANNEL_CLOSED;
+
+  message = g_new (SandboxMessage, 1);
+  if (!(condition & (G_IO_HUP | G_IO_ERR)))
+    result = sandbox_channel_receive (session_link, message);
+  if (result == SANDBOX_CHANNEL_OK) {
+    if (message->type == SANDBOX_MESSAGE_SPAWN && message->n_fds == 2) {
+      gint control_fd = sandbox_message_steal_fd (message);
+      gint input_fd = sandbox_message_steal_fd (message);
+
+      add_pipeline (control_fd, input_fd, TRUE);
+    } else {
+      fprintf (stderr, "Invalid session from the zygote\n");
+    }
+    sandbox_message_close_fds (message);
+  }
+  g_free (message);
+
+  if (result == SANDBOX_CHANNEL_OK)
+    return TRUE;
+
+  sandbox_channel_unref (session_link);
+  session_link = NULL;
+  if (!pipelines)
+    g_main_loop_quit (loop);
+
+  return FALSE;
+}
+
 static void
 set_up_signals (void)
 {
@@ -191,24 +1124,79 @@ set_up_signals (void)
 int
 main (int argc, char **argv)
 {
-  struct PipelineInfo pipeline_info;
+  GOptionContext *context;
+  GError *error = NULL;
+  gboolean zygote = FALSE;
+  gint control_fd = -1;
+  gint input_fd = 0;
+  gint link_fd = -1;
+  gint pool_size = 0;
+  gint prewarm = 1;
+  gint sessions = 1;
+  GOptionEntry entries[] = {
+    { "zygote", 0, 0, G_OPTION_ARG_NONE, &zygote,
+      "Load the plugins, enter the sandbox and fork decoders on demand", NULL },
+    { "control-fd", 0, 0, G_OPTION_ARG_INT, &control_fd,
+      "File descriptor of the channel to the parent", "FD" },
+    { "pool-size", 0, 0, G_OPTION_ARG_INT, &pool_size,
+      "Maximum number of decoders alive at the same time, 0 for no limit",
+      "N" },
+    { "prewarm", 0, 0, G_OPTION_ARG_INT, &prewarm,
+      "Number of decoders to fork in advance", "N" },
+    { "sessions", 0, 0, G_OPTION_ARG_INT, &sessions,
+      "Number of sessions each decoder forked by the zygote hosts", "N" },
+    { "sandbox", 0, 0, G_OPTION_ARG_CALLBACK, parse_sandbox_option,
+      "How to confine ourselves: setuid (we were started by sandboxme, "
+      "the default) or namespaces", "BACKEND" },
+    { NULL }
+  };
 
-  gst_init (&argc, &argv);
+  mark_phase (&process_profile, SANDBOX_PHASE_STARTED);
 
-  if (argc != 3) {
-    fprintf (stderr, "Syntax: %s <output shm video socket> <output shm audio socket>\n", argv[0]);
+  context = g_option_context_new (NULL);
+  g_option_context_add_main_entries (context, entries, NULL);
+  g_option_context_add_group (context, gst_init_get_option_group ());
+  if (!g_option_context_parse (context, &argc, &argv, &error)) {
+    fprintf (stderr, "%s\n", error->message);
     return EXIT_FAILURE;
   }
+  g_option_context_free (context);
+  mark_phase (&process_profile, SANDBOX_PHASE_GST_INITIALIZED);
 
-  pipeline_info.video_shm = argv[1];
-  pipeline_info.audio_shm = argv[2];
-  pipeline_info.connections = 0;
+  gst_plugin_register_static (GST_VERSION_MAJOR, GST_VERSION_MINOR,
+                              "sandboxdecoder",
+                              "Elements of the sandboxed decoder",
+                              register_elements, VERSION, "LGPL",
+                              PACKAGE, PACKAGE_NAME, "http://www.igalia.com/");
+
+  if (control_fd < 0 || pool_size < 0 || prewarm < 0 || sessions < 1) {
+    fprintf (stderr, "Syntax: %s --control-fd=<fd> [--sandbox=setuid|namespaces] [--zygote [--pool-size=<n>] [--prewarm=<n>] [--sessions=<n>]]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  if (zygote) {
+    /* everything the children share is done once and for all here */
+    load_all_plugins ();
+    go_silent ();
+    enter_sandbox ();
+
+    if (!decoder_zygote_run (control_fd, pool_size, prewarm, sessions,
+                             &control_fd, &input_fd, &link_fd))
+      return EXIT_SUCCESS;
+
+    /* from here on, we are a decoder forked by the zygote */
+    confine_signals ();
+  }
 
   loop = g_main_loop_new (g_main_context_default (), FALSE);
 
   set_up_signals ();
-
-  g_idle_add ((GSourceFunc)init_pipeline, &pipeline_info);
+  add_pipeline (control_fd, input_fd, zygote);
+  if (link_fd != -1) {
+    session_link = sandbox_channel_new (link_fd);
+    session_link_watch = watch_channel (session_link, on_session_link_event,
+                                        NULL);
+  }
 
   g_main_loop_run (loop);
 
@@ -0,0 +1,490 @@
+/*
+ * Copyright (C) 2012 Igalia S.L.
+*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/**
+ * SECTION:element-sandboxinputsrc
+ *
+ * Used inside the decoder subprocess to read the input from the
+ * sandboxinputsink of the parent. Every read is a request for a range of
+ * bytes, which the parent serves from upstream in pull mode when it can, so
+ * demuxers can jump to their index and seek without the stream being sent
+ * again from the start. When the parent can only serve the input in order,
+ * we are not seekable and basesrc reads it sequentially.
+ *
+ * Queries for the duration or position in other formats than bytes, and
+ * conversions we can't do, are run by the parent upstream of its input.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "gstsandboxinputsrc.h"
+#include "sandboxipc.h"
+
+GST_DEBUG_CATEGORY_STATIC (gst_debug_sandbox_input_src);
+#define GST_CAT_DEFAULT gst_debug_sandbox_input_src
+
+G_DEFINE_TYPE (GstSandboxInputSrc, gst_sandbox_input_src, GST_TYPE_BASE_SRC);
+
+#define GST_SANDBOX_INPUT_SRC_GET_PRIVATE(o)\
+    (G_TYPE_INSTANCE_GET_PRIVATE ((o), GST_SANDBOX_INPUT_SRC_TYPE, GstSandboxInputSrcPrivate))
+
+enum {
+  PROP_0,
+  PROP_FD
+};
+
+static GstStaticPadTemplate src_template = GST_STATIC_PAD_TEMPLATE ("src",
+    GST_PAD_SRC,
+    GST_PAD_ALWAYS,
+    GST_STATIC_CAPS_ANY);
+
+struct _GstSandboxInputSrcPrivate {
+  gint fd;
+
+  /* a read or a query at a time on the channel */
+  GMutex lock;
+  SandboxChannel *channel;
+  GstPoll *poll;
+  GstPollFD pollfd;
+  SandboxMessage *message;
+
+  guint64 size;
+  gboolean seekable;
+  /* of the last read, answers to earlier ones are stale */
+  guint32 seqnum;
+  /* of the last query, likewise */
+  guint32 query_id;
+};
+
+/* internal helpers */
+
+/* Waits for the next message from the parent */
+static GstFlowReturn
+receive_message (GstSandboxInputSrc *self)
+{
+  GstSandboxInputSrcPrivate *priv = self->priv;
+
+  for (;;) {
+    if (gst_poll_wait (priv->poll, GST_CLOCK_TIME_NONE) < 0) {
+      if (errno == EBUSY)
+        return GST_FLOW_WRONG_STATE;
+      if (errno == EINTR || errno == EAGAIN)
+        continue;
+      GST_ELEMENT_ERROR (self, RESOURCE, READ, (NULL),
+                         ("poll failed: %s", g_strerror (errno)));
+      return GST_FLOW_ERROR;
+    }
+    break;
+  }
+
+  switch (sandbox_channel_receive (priv->channel, priv->message)) {
+  case SANDBOX_CHANNEL_OK:
+    /* nothing we expect comes with fds */
+    sandbox_message_close_fds (priv->message);
+    return GST_FLOW_OK;
+  case SANDBOX_CHANNEL_CLOSED:
+    GST_DEBUG_OBJECT (self, "Parent went away");
+    return GST_FLOW_UNEXPECTED;
+  default:
+    GST_ELEMENT_ERROR (self, RESOURCE, READ, (NULL),
+                       ("Could not read from the parent: %s",
+                        g_strerror (errno)));
+    return GST_FLOW_ERROR;
+  }
+}
+
+static gboolean
+query_input_info (GstSandboxInputSrc *self)
+{
+  GstSandboxInputSrcPrivate *priv = self->priv;
+  const SandboxInputInfoMessage *info;
+
+  if (!sandbox_channel_send (priv->channel, SANDBOX_MESSAGE_QUERY_INPUT_INFO,
+                             NULL, 0, NULL, 0))
+    return FALSE;
+
+  do {
+    if (receive_message (self) != GST_FLOW_OK)
+      return FALSE;
+  } while (priv->message->type != SANDBOX_MESSAGE_INPUT_INFO);
+
+  info = sandbox_message_get_payload (priv->message, sizeof (*info));
+  if (!info)
+    return FALSE;
+
+  priv->size = info->size;
+  priv->seekable = info->seekable;
+  GST_DEBUG_OBJECT (self, "Input is %sseekable, size %" G_GUINT64_FORMAT,
+                    priv->seekable ? "" : "not ", priv->size);
+
+  return TRUE;
+}
+
+/* GstBaseSrc vmethod implementations */
+
+static gboolean gst_sandbox_input_src_stop (GstBaseSrc *base_src);
+
+static gboolean
+gst_sandbox_input_src_start (GstBaseSrc *base_src)
+{
+  GstSandboxInputSrc *self = GST_SANDBOX_INPUT_SRC (base_src);
+  GstSandboxInputSrcPrivate *priv = self->priv;
+  gint fd;
+
+  if (priv->fd == -1) {
+    GST_ELEMENT_ERROR (self, RESOURCE, NOT_FOUND, ("No fd set"), (NULL));
+    return FALSE;
+  }
+
+  fd = dup (priv->fd);
+  if (fd == -1) {
+    GST_ELEMENT_ERROR (self, RESOURCE, OPEN_READ, (NULL),
+                       ("Could not dup fd %d: %s", priv->fd,
+                        g_strerror (errno)));
+    return FALSE;
+  }
+
+  priv->channel = sandbox_channel_new (fd);
+  priv->message = g_new (SandboxMessage, 1);
+  priv->poll = gst_poll_new (TRUE);
+  gst_poll_fd_init (&priv->pollfd);
+  priv->pollfd.fd = fd;
+  gst_poll_add_fd (priv->poll, &priv->pollfd);
+  gst_poll_fd_ctl_read (priv->poll, &priv->pollfd, TRUE);
+  priv->seqnum = 0;
+  priv->query_id = 0;
+
+  if (!query_input_info (self)) {
+    GST_ELEMENT_ERROR (self, RESOURCE, OPEN_READ,
+                       ("Could not get the input from the parent"), (NULL));
+    gst_sandbox_input_src_stop (base_src);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+static gboolean
+gst_sandbox_input_src_stop (GstBaseSrc *base_src)
+{
+  GstSandboxInputSrcPrivate *priv = GST_SANDBOX_INPUT_SRC (base_src)->priv;
+
+  /* a query may still be waiting for the parent */
+  g_mutex_lock (&priv->lock);
+  if (priv->poll) {
+    gst_poll_free (priv->poll);
+    priv->poll = NULL;
+  }
+  g_free (priv->message);
+  priv->message = NULL;
+  if (priv->channel) {
+    sandbox_channel_unref (priv->channel);
+    priv->channel = NULL;
+  }
+  g_mutex_unlock (&priv->lock);
+
+  return TRUE;
+}
+
+static gboolean
+gst_sandbox_input_src_unlock (GstBaseSrc *base_src)
+{
+  gst_poll_set_flushing (GST_SANDBOX_INPUT_SRC (base_src)->priv->poll, TRUE);
+  return TRUE;
+}
+
+static gboolean
+gst_sandbox_input_src_unlock_stop (GstBaseSrc *base_src)
+{
+  gst_poll_set_flushing (GST_SANDBOX_INPUT_SRC (base_src)->priv->poll, FALSE);
+  return TRUE;
+}
+
+static gboolean
+gst_sandbox_input_src_is_seekable (GstBaseSrc *base_src)
+{
+  return GST_SANDBOX_INPUT_SRC (base_src)->priv->seekable;
+}
+
+static gboolean
+gst_sandbox_input_src_get_size (GstBaseSrc *base_src, guint64 *size)
+{
+  GstSandboxInputSrcPrivate *priv = GST_SANDBOX_INPUT_SRC (base_src)->priv;
+
+  if (priv->size == SANDBOX_INPUT_SIZE_UNKNOWN)
+    return FALSE;
+
+  *size = priv->size;
+  return TRUE;
+}
+
+static GstFlowReturn
+gst_sandbox_input_src_create (GstBaseSrc *base_src,
+                              guint64 offset,
+                              guint length,
+                              GstBuffer **buffer)
+{
+  GstSandboxInputSrc *self = GST_SANDBOX_INPUT_SRC (base_src);
+  GstSandboxInputSrcPrivate *priv = self->priv;
+  SandboxReadMessage request;
+  const SandboxDataMessage *data;
+  GstBuffer *buf;
+  GstFlowReturn ret;
+  guint filled = 0;
+
+  g_mutex_lock (&priv->lock);
+  request.offset = offset;
+  request.size = length;
+  request.seqnum = ++priv->seqnum;
+  if (!sandbox_channel_send (priv->channel, SANDBOX_MESSAGE_READ,
+                             &request, sizeof (request), NULL, 0)) {
+    g_mutex_unlock (&priv->lock);
+    GST_DEBUG_OBJECT (self, "Could not ask the parent for input: %m");
+    return GST_FLOW_UNEXPECTED;
+  }
+
+  buf = gst_buffer_new_and_alloc (length);
+  for (;;) {
+    gsize size;
+
+    ret = receive_message (self);
+    if (ret != GST_FLOW_OK)
+      goto failed;
+
+    if (priv->message->type != SANDBOX_MESSAGE_DATA
+        || priv->message->size < sizeof (SandboxDataMessage))
+      continue;
+
+    data = (const SandboxDataMessage *) priv->message->payload;
+    /* what is left of a read we were interrupted in */
+    if (data->seqnum != request.seqnum)
+      continue;
+
+    if (data->flags & SANDBOX_DATA_ERROR) {
+      GST_ELEMENT_ERROR (self, RESOURCE, READ, (NULL),
+                         ("Parent could not read %u bytes at %"
+                          G_GUINT64_FORMAT, length, offset));
+      ret = GST_FLOW_ERROR;
+      goto failed;
+    }
+
+    size = priv->message->size - sizeof (SandboxDataMessage);
+    if (size > length - filled) {
+      GST_ELEMENT_ERROR (self, RESOURCE, READ, (NULL),
+                         ("Parent sent more than we asked for"));
+      ret = GST_FLOW_ERROR;
+      goto failed;
+    }
+    memcpy (GST_BUFFER_DATA (buf) + filled,
+            priv->message->payload + sizeof (SandboxDataMessage), size);
+    filled += size;
+
+    if (data->flags & SANDBOX_DATA_LAST)
+      break;
+  }
+
+  if (filled == 0) {
+    GST_DEBUG_OBJECT (self, "End of input at %" G_GUINT64_FORMAT, offset);
+    ret = GST_FLOW_UNEXPECTED;
+    goto failed;
+  }
+
+  g_mutex_unlock (&priv->lock);
+
+  GST_BUFFER_SIZE (buf) = filled;
+  GST_BUFFER_OFFSET (buf) = offset;
+  GST_BUFFER_OFFSET_END (buf) = offset + filled;
+  *buffer = buf;
+
+  return GST_FLOW_OK;
+
+failed:
+  g_mutex_unlock (&priv->lock);
+  gst_buffer_unref (buf);
+  return ret;
+}
+
+/* Has the parent run the query upstream of its input */
+static gboolean
+forward_query (GstSandboxInputSrc *self, GstQuery *query)
+{
+  GstSandboxInputSrcPrivate *priv = self->priv;
+  SandboxQueryMessage header;
+  const SandboxQueryMessage *result;
+  gboolean answered = FALSE;
+
+  g_mutex_lock (&priv->lock);
+  if (!priv->channel)
+    goto done;
+
+  header.id = ++priv->query_id;
+  header.stream = 0;
+  header.answered = FALSE;
+  if (!sandbox_channel_send_query (priv->channel, SANDBOX_MESSAGE_QUERY,
+                                   query, &header))
+    goto done;
+
+  for (;;) {
+    if (receive_message (self) != GST_FLOW_OK)
+      goto done;
+
+    result = sandbox_message_get_query_header (priv->message);
+    if (priv->message->type == SANDBOX_MESSAGE_QUERY_RESULT && result
+        && result->id == header.id)
+      break;
+  }
+  answered = sandbox_message_parse_query_result (priv->message, query);
+  GST_DEBUG_OBJECT (self, "Parent %s the %s query",
+                    answered ? "answered" : "could not answer",
+                    GST_QUERY_TYPE_NAME (query));
+
+done:
+  g_mutex_unlock (&priv->lock);
+  return answered;
+}
+
+static gboolean
+gst_sandbox_input_src_query (GstBaseSrc *base_src, GstQuery *query)
+{
+  GstSandboxInputSrc *self = GST_SANDBOX_INPUT_SRC (base_src);
+  GstFormat format;
+
+  switch (GST_QUERY_TYPE (query)) {
+  case GST_QUERY_DURATION:
+    gst_query_parse_duration (query, &format, NULL);
+    break;
+  case GST_QUERY_POSITION:
+    gst_query_parse_position (query, &format, NULL);
+    break;
+  default:
+    format = GST_FORMAT_BYTES;
+    break;
+  }
+
+  /* basesrc only knows about bytes */
+  if (format != GST_FORMAT_BYTES && format != GST_FORMAT_PERCENT
+      && sandbox_query_is_forwarded (query) && forward_query (self, query))
+    return TRUE;
+
+  if (GST_BASE_SRC_CLASS (gst_sandbox_input_src_parent_class)->query (
+          base_src, query))
+    return TRUE;
+
+  return GST_QUERY_TYPE (query) == GST_QUERY_CONVERT
+      && forward_query (self, query);
+}
+
+/* GObject vmethod implementations */
+
+static void
+gst_sandbox_input_src_set_property (GObject *object,
+                                    guint prop_id,
+                                    const GValue *value,
+                                    GParamSpec *pspec)
+{
+  GstSandboxInputSrcPrivate *priv = GST_SANDBOX_INPUT_SRC (object)->priv;
+
+  switch (prop_id) {
+  case PROP_FD:
+    priv->fd = g_value_get_int (value);
+    break;
+  default:
+    G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+    break;
+  }
+}
+
+static void
+gst_sandbox_input_src_get_property (GObject *object,
+                                    guint prop_id,
+                                    GValue *value,
+                                    GParamSpec *pspec)
+{
+  GstSandboxInputSrcPrivate *priv = GST_SANDBOX_INPUT_SRC (object)->priv;
+
+  switch (prop_id) {
+  case PROP_FD:
+    g_value_set_int (value, priv->fd);
+    break;
+  default:
+    G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+    break;
+  }
+}
+
+static void
+gst_sandbox_input_src_finalize (GstSandboxInputSrc *self)
+{
+  g_mutex_clear (&self->priv->lock);
+
+  G_OBJECT_CLASS (gst_sandbox_input_src_parent_class)->finalize (G_OBJECT (self));
+}
+
+static void
+gst_sandbox_input_src_init (GstSandboxInputSrc *self)
+{
+  self->priv = GST_SANDBOX_INPUT_SRC_GET_PRIVATE (self);
+  self->priv->fd = -1;
+  self->priv->size = SANDBOX_INPUT_SIZE_UNKNOWN;
+  g_mutex_init (&self->priv->lock);
+}
+
+static void
+gst_sandbox_input_src_class_init (GstSandboxInputSrcClass *self_class)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (self_class);
+  GstElementClass *element_class = GST_ELEMENT_CLASS (self_class);
+  GstBaseSrcClass *base_src_class = GST_BASE_SRC_CLASS (self_class);
+
+  GST_DEBUG_CATEGORY_INIT (gst_debug_sandbox_input_src, "sandboxinputsrc", 0,
+      "input of the sandboxed decoder");
+
+  g_type_class_add_private (self_class, sizeof (GstSandboxInputSrcPrivate));
+  object_class->set_property = gst_sandbox_input_src_set_property;
+  object_class->get_property = gst_sandbox_input_src_get_property;
+  object_class->finalize = (void (*) (GObject *object)) gst_sandbox_input_src_finalize;
+
+  g_object_class_install_property (object_class, PROP_FD,
+      g_param_spec_int ("fd", "fd",
+                        "Socket connected to the parent's sandboxinputsink",
+                        -1, G_MAXINT, -1,
+                        G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  gst_element_class_add_pad_template (element_class,
+      gst_static_pad_template_get (&src_template));
+  gst_element_class_set_details_simple (element_class,
+      "Sandbox input source", "Source",
+      "Reads the input of the sandboxed decoder from the parent, at random",
+      "Guillaume Emont <guijemont@igalia.com>");
+
+  base_src_class->start = gst_sandbox_input_src_start;
+  base_src_class->stop = gst_sandbox_input_src_stop;
+  base_src_class->unlock = gst_sandbox_input_src_unlock;
+  base_src_class->unlock_stop = gst_sandbox_input_src_unlock_stop;
+  base_src_class->is_seekable = gst_sandbox_input_src_is_seekable;
+  base_src_class->get_size = gst_sandbox_input_src_get_size;
+  base_src_class->create = gst_sandbox_input_src_create;
+  base_src_class->query = gst_sandbox_input_src_query;
+}
@@ -0,0 +1,1479 @@
+/*
+ * Copyright (C) 2012 Igalia S.L.
+*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/**
+ * SECTION:element-sandboxsink
+ *
+ * Used inside the decoder subprocess to hand decoded buffers over to
+ * sandboxeddecodebin. Upstream elements allocate their buffers through us,
+ * which means decoders write straight into a shared memory area the parent
+ * has mapped. Only a small descriptor of each buffer (where it is in the
+ * area, timestamps, flags) goes through the socket, along with caps and
+ * serialised events. Buffers that weren't allocated by us are copied into the
+ * area once.
+ *
+ * The area is sized from the caps: shm-buffers frames of raw video, or
+ * shm-audio-duration worth of raw audio, shm-size bytes for anything else.
+ * When the caps change, a new area replaces it, the old one goes away once
+ * the parent has released all its buffers. All the sinks of the process
+ * share the limit set with gst_sandbox_sink_set_shm_limit(). Areas the
+ * parent is done with when they are replaced or their sink stops are kept
+ * as spares (still counted in the limit), and taken again by the next sink
+ * that needs one of about their size: a decoder hosting several sessions
+ * then doesn't pay for creating and faulting in areas for each. With
+ * shm-huge-pages, shm-transparent-huge-pages or shm-prefault, areas are
+ * created with the matching ShmAreaFlags, and the parent maps them alike.
+ *
+ * With audio-batch-duration set, raw audio buffers are copied one after the
+ * other into a block until it holds that much, and the whole block goes to
+ * the parent in a single message: decoders emit small audio buffers, and
+ * waking the parent up for each of them adds up. Serialised events and caps
+ * changes send what is pending first.
+ *
+ * With max-buffers-in-flight or max-bytes-in-flight set, these are the
+ * credits the parent granted: we don't send a block while the parent holds
+ * that many of ours, or that many bytes, and wait for its releases to give
+ * the credit back. A batch counts as one buffer.
+ *
+ * The parent tells us what its downstream accepts, which we pass on with
+ * the downstream-caps signal, from our reader thread. Whoever plugged us can
+ * then have upstream convert to it.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <gst/video/video.h>
+
+#include "gstsandboxsink.h"
+#include "sandboxipc.h"
+#include "shmarea.h"
+
+GST_DEBUG_CATEGORY_STATIC (gst_debug_sandbox_sink);
+#define GST_CAT_DEFAULT gst_debug_sandbox_sink
+
+G_DEFINE_TYPE (GstSandboxSink, gst_sandbox_sink, GST_TYPE_BASE_SINK);
+
+#define GST_SANDBOX_SINK_GET_PRIVATE(o)\
+    (G_TYPE_INSTANCE_GET_PRIVATE ((o), GST_SANDBOX_SINK_TYPE, GstSandboxSinkPrivate))
+
+#define DEFAULT_SHM_SIZE (4 * 1024 * 1024)
+#define DEFAULT_SHM_BUFFERS 8
+#define DEFAULT_SHM_AUDIO_DURATION (500 * GST_MSECOND)
+#define DEFAULT_SHM_HUGE_PAGES FALSE
+#define DEFAULT_SHM_TRANSPARENT_HUGE_PAGES FALSE
+#define DEFAULT_SHM_PREFAULT FALSE
+#define DEFAULT_AUDIO_BATCH_DURATION 0
+#define DEFAULT_MAX_BUFFERS_IN_FLIGHT 0
+#define DEFAULT_MAX_BYTES_IN_FLIGHT 0
+
+enum {
+  PROP_0,
+  PROP_FD,
+  PROP_SHM_SIZE,
+  PROP_SHM_BUFFERS,
+  PROP_SHM_AUDIO_DURATION,
+  PROP_SHM_HUGE_PAGES,
+  PROP_SHM_TRANSPARENT_HUGE_PAGES,
+  PROP_SHM_PREFAULT,
+  PROP_AUDIO_BATCH_DURATION,
+  PROP_MAX_BUFFERS_IN_FLIGHT,
+  PROP_MAX_BYTES_IN_FLIGHT
+};
+
+enum {
+  SIGNAL_CLIENT_CONNECTED,
+  SIGNAL_CLIENT_DISCONNECTED,
+  SIGNAL_DOWNSTREAM_CAPS,
+  LAST_SIGNAL
+};
+
+static guint signals[LAST_SIGNAL] = { 0 };
+
+static GstStaticPadTemplate sink_template = GST_STATIC_PAD_TEMPLATE ("sink",
+    GST_PAD_SINK,
+    GST_PAD_ALWAYS,
+    GST_STATIC_CAPS_ANY);
+
+/* the shared memory all the sinks of the process may use, 0 for no limit */
+G_LOCK_DEFINE_STATIC (shm_budget);
+static guint64 shm_limit = 0;
+static guint64 shm_allocated = 0;
+/* unused areas waiting for a sink, most recent first */
+static GQueue spare_areas = G_QUEUE_INIT;
+#define MAX_SPARE_AREAS 4
+
+struct _GstSandboxSinkPrivate {
+  gint fd;
+  guint shm_size;
+  guint shm_buffers;
+  guint64 shm_audio_duration;
+  ShmAreaFlags shm_flags;
+  guint64 audio_batch_duration;
+  guint max_buffers_in_flight;
+  guint64 max_bytes_in_flight;
+
+  /* the caps the area was sized for */
+  GstCaps *area_caps;
+  GstCaps *sent_caps;
+  guint32 next_area_id;
+
+  /* raw audio waiting to be sent, only used by the streaming thread */
+  ShmBlock *batch_block;
+  gsize batch_used;
+  guint64 batch_duration;
+  guint8 *batch_payload;
+
+  /* how long we waited for the parent to release memory */
+  guint64 shm_wait_time;
+
+  /* wakes up the reader thread when we stop */
+  GstPoll *poll;
+  GThread *reader;
+
+  /* protects the fields below */
+  GMutex lock;
+  GCond cond;
+  SandboxChannel *channel;
+  gboolean disconnected;
+  gboolean flushing;
+  /* the area new buffers go to */
+  ShmArea *area;
+  guint32 area_id;
+  /* id -> area, for all the areas the parent may still release blocks of */
+  GHashTable *areas;
+  /* block -> how many times the parent holds it, a buffer going through
+   * the zero-copy path may be sent again before it is released */
+  GHashTable *in_flight;
+  guint n_in_flight;
+  guint64 bytes_in_flight;
+};
+
+/* internal helpers */
+
+/* Reserves size bytes of the budget, or what is left of it if that is at
+ * least min_size. Returns the reserved size, 0 if nothing could be. */
+static gsize
+reserve_shm (gsize size, gsize min_size)
+{
+  G_LOCK (shm_budget);
+  if (shm_limit > 0) {
+    guint64 left = shm_limit > shm_allocated ? shm_limit - shm_allocated : 0;
+
+    if (left < min_size)
+      size = 0;
+    else
+      size = MIN (size, left);
+  }
+  shm_allocated += size;
+  G_UNLOCK (shm_budget);
+
+  return size;
+}
+
+static void
+return_shm (gsize size)
+{
+  G_LOCK (shm_budget);
+  shm_allocated -= size;
+  G_UNLOCK (shm_budget);
+}
+
+/* Frees the spare areas, to make room in the budget */
+static void
+drop_spare_areas (void)
+{
+  ShmArea *area;
+
+  G_LOCK (shm_budget);
+  while ((area = g_queue_pop_head (&spare_areas))) {
+    shm_allocated -= shm_area_get_size (area);
+    shm_area_unref (area);
+  }
+  G_UNLOCK (shm_budget);
+}
+
+/* Returns a spare area of between size and max_size bytes created with
+ * flags, which is already counted in the budget, or NULL. Whether it got the
+ * explicit huge pages it asked for doesn't matter. */
+static ShmArea *
+take_spare_area (gsize size, gsize max_size, ShmAreaFlags flags)
+{
+  ShmArea *area = NULL;
+  GList *elem;
+
+  G_LOCK (shm_budget);
+  for (elem = spare_areas.head; elem; elem = elem->next) {
+    ShmArea *candidate = elem->data;
+    gsize candidate_size = shm_area_get_size (candidate);
+
+    if (candidate_size >= size && candidate_size <= max_size
+        && (shm_area_get_flags (candidate) | SHM_AREA_HUGE_PAGES)
+           == (flags | SHM_AREA_HUGE_PAGES)) {
+      area = candidate;
+      g_queue_delete_link (&spare_areas, elem);
+      break;
+    }
+  }
+  G_UNLOCK (shm_budget);
+
+  return area;
+}
+
+static void
+retire_area (ShmArea *area)
+{
+  ShmArea *oldest = NULL;
+
+  shm_area_set_release_func (area, NULL, NULL);
+
+  /* buffers still around keep the area alive. Only the decoder allocates
+   * blocks, so one without any stays that way. */
+  if (shm_area_get_used (area) > 0) {
+    return_shm (shm_area_get_size (area));
+    shm_area_unref (area);
+    return;
+  }
+
+  G_LOCK (shm_budget);
+  g_queue_push_head (&spare_areas, area);
+  if (g_queue_get_length (&spare_areas) > MAX_SPARE_AREAS) {
+    oldest = g_queue_pop_tail (&spare_areas);
+    shm_allocated -= shm_area_get_size (oldest);
+  }
+  G_UNLOCK (shm_budget);
+
+  if (oldest)
+    shm_area_unref (oldest);
+}
+
+static gboolean
+is_unused_area (gpointer id, ShmArea *area, GstSandboxSink *self)
+{
+  return area != self->priv->area && shm_area_get_used (area) == 0;
+}
+
+/* Must be called with the lock held */
+static void
+drop_unused_areas_unlocked (GstSandboxSink *self)
+{
+  g_hash_table_foreach_remove (self->priv->areas, (GHRFunc) is_unused_area,
+                               self);
+}
+
+static void
+on_block_released (ShmArea *area, GstSandboxSink *self)
+{
+  g_mutex_lock (&self->priv->lock);
+  /* the areas are gone once we stopped */
+  if (self->priv->areas && area != self->priv->area)
+    drop_unused_areas_unlocked (self);
+  g_cond_broadcast (&self->priv->cond);
+  g_mutex_unlock (&self->priv->lock);
+}
+
+/* Must be called with the lock held */
+static void
+add_in_flight_unlocked (GstSandboxSink *self, ShmBlock *block)
+{
+  GstSandboxSinkPrivate *priv = self->priv;
+  guint count;
+
+  count = GPOINTER_TO_UINT (g_hash_table_lookup (priv->in_flight, block));
+  g_hash_table_insert (priv->in_flight, block, GUINT_TO_POINTER (count + 1));
+  priv->n_in_flight++;
+  priv->bytes_in_flight += shm_block_get_size (block);
+}
+
+/* Returns whether the parent held block. Must be called with the lock
+ * held. */
+static gboolean
+remove_in_flight_unlocked (GstSandboxSink *self, ShmBlock *block)
+{
+  GstSandboxSinkPrivate *priv = self->priv;
+  guint count;
+
+  count = GPOINTER_TO_UINT (g_hash_table_lookup (priv->in_flight, block));
+  if (count == 0)
+    return FALSE;
+  if (count == 1)
+    g_hash_table_remove (priv->in_flight, block);
+  else
+    g_hash_table_insert (priv->in_flight, block, GUINT_TO_POINTER (count - 1));
+  priv->n_in_flight--;
+  priv->bytes_in_flight -= shm_block_get_size (block);
+
+  return TRUE;
+}
+
+static void
+handle_release (GstSandboxSink *self, SandboxMessage *message)
+{
+  GstSandboxSinkPrivate *priv = self->priv;
+  const SandboxReleaseMessage *release;
+  ShmArea *area;
+  ShmBlock *block = NULL;
+  gboolean held;
+
+  release = sandbox_message_get_payload (message, sizeof (*release));
+  if (!release) {
+    GST_WARNING_OBJECT (self, "Invalid release message");
+    return;
+  }
+
+  g_mutex_lock (&priv->lock);
+  area = g_hash_table_lookup (priv->areas, GUINT_TO_POINTER (release->area));
+  if (area)
+    block = shm_area_find_block (area, release->offset);
+  g_mutex_unlock (&priv->lock);
+
+  if (!block) {
+    GST_WARNING_OBJECT (self, "Parent released unknown offset %"
+                        G_GUINT64_FORMAT, release->offset);
+    return;
+  }
+
+  /* the credit comes back */
+  g_mutex_lock (&priv->lock);
+  held = remove_in_flight_unlocked (self, block);
+  g_cond_broadcast (&priv->cond);
+  g_mutex_unlock (&priv->lock);
+
+  /* one for the reference we just got, one for the parent's */
+  shm_block_unref (block);
+  if (held)
+    shm_block_unref (block);
+  else
+    GST_WARNING_OBJECT (self, "Parent released offset %" G_GUINT64_FORMAT
+                        " more times than it got it", release->offset);
+}
+
+/* The parent forwards the seeks and QoS events it gets, which we send
+ * upstream as if they came from downstream of us. With QoS, the decoder
+ * skips the frames that would arrive too late in the parent. */
+static void
+handle_event (GstSandboxSink *self, SandboxMessage *message)
+{
+  GstEvent *event, *flush_stop;
+  GstSeekFlags flags;
+
+  event = sandbox_message_parse_event (message);
+  if (event && GST_EVENT_TYPE (event) == GST_EVENT_QOS) {
+    GST_LOG_OBJECT (self, "Parent sends %" GST_PTR_FORMAT, event);
+    gst_pad_push_event (GST_BASE_SINK_PAD (self), event);
+    return;
+  }
+
+  if (!event || GST_EVENT_TYPE (event) != GST_EVENT_SEEK) {
+    if (event)
+      gst_event_unref (event);
+    GST_WARNING_OBJECT (self, "Invalid event from the parent");
+    return;
+  }
+
+  GST_DEBUG_OBJECT (self, "Parent seeks: %" GST_PTR_FORMAT, event);
+  gst_event_parse_seek (event, NULL, NULL, &flags, NULL, NULL, NULL, NULL);
+  if (gst_pad_push_event (GST_BASE_SINK_PAD (self), event)
+      || !(flags & GST_SEEK_FLAG_FLUSH))
+    return;
+
+  /* the parent drops everything until it sees a flush, give it one */
+  GST_DEBUG_OBJECT (self, "Seek failed upstream");
+  flush_stop = gst_event_new_flush_stop ();
+  sandbox_channel_send_event (self->priv->channel, flush_stop);
+  gst_event_unref (flush_stop);
+}
+
+static void
+handle_downstream_caps (GstSandboxSink *self, SandboxMessage *message)
+{
+  GstCaps *caps;
+
+  caps = sandbox_message_parse_caps (message);
+  if (!caps) {
+    GST_WARNING_OBJECT (self, "Invalid caps from the parent");
+    return;
+  }
+
+  GST_DEBUG_OBJECT (self, "Parent's downstream accepts %" GST_PTR_FORMAT,
+                    caps);
+  g_signal_emit (self, signals[SIGNAL_DOWNSTREAM_CAPS], 0, caps);
+  gst_caps_unref (caps);
+}
+
+/* Makes the channel available to the streaming thread. Takes ownership of
+ * fd. */
+static void
+set_up_channel (GstSandboxSink *self, gint fd)
+{
+  GstSandboxSinkPrivate *priv = self->priv;
+
+  g_mutex_lock (&priv->lock);
+  priv->channel = sandbox_channel_new (fd);
+  g_cond_broadcast (&priv->cond);
+  g_mutex_unlock (&priv->lock);
+}
+
+static gpointer
+reader_thread (GstSandboxSink *self)
+{
+  GstSandboxSinkPrivate *priv = self->priv;
+  SandboxMessage *message;
+  GstPollFD pollfd = GST_POLL_FD_INIT;
+  gint fd;
+
+  fd = sandbox_channel_get_fd (priv->channel);
+  g_signal_emit (self, signals[SIGNAL_CLIENT_CONNECTED], 0, fd);
+
+  pollfd.fd = fd;
+  gst_poll_add_fd (priv->poll, &pollfd);
+  gst_poll_fd_ctl_read (priv->poll, &pollfd, TRUE);
+
+  message = g_new (SandboxMessage, 1);
+  for (;;) {
+    if (gst_poll_wait (priv->poll, GST_CLOCK_TIME_NONE) < 0) {
+      if (errno == EINTR || errno == EAGAIN)
+        continue;
+      /* we are stopping */
+      break;
+    }
+
+    if (sandbox_channel_receive (priv->channel, message) != SANDBOX_CHANNEL_OK) {
+      GST_DEBUG_OBJECT (self, "Parent went away");
+      g_mutex_lock (&priv->lock);
+      priv->disconnected = TRUE;
+      g_cond_broadcast (&priv->cond);
+      g_mutex_unlock (&priv->lock);
+      g_signal_emit (self, signals[SIGNAL_CLIENT_DISCONNECTED], 0, fd);
+      break;
+    }
+
+    switch (message->type) {
+    case SANDBOX_MESSAGE_RELEASE:
+      handle_release (self, message);
+      break;
+    case SANDBOX_MESSAGE_EVENT:
+      handle_event (self, message);
+      break;
+    case SANDBOX_MESSAGE_CAPS:
+      handle_downstream_caps (self, message);
+      break;
+    default:
+      GST_WARNING_OBJECT (self, "Unexpected message type %u", message->type);
+      break;
+    }
+    sandbox_message_close_fds (message);
+  }
+  gst_poll_remove_fd (priv->poll, &pollfd);
+  g_free (message);
+
+  return NULL;
+}
+
+/* Waits until the parent is connected. Must be called with the lock held. */
+static GstFlowReturn
+wait_for_channel_unlocked (GstSandboxSink *self)
+{
+  GstSandboxSinkPrivate *priv = self->priv;
+
+  while (!priv->channel && !priv->flushing && !priv->disconnected)
+    g_cond_wait (&priv->cond, &priv->lock);
+
+  if (priv->flushing)
+    return GST_FLOW_WRONG_STATE;
+  if (priv->disconnected)
+    return GST_FLOW_UNEXPECTED;
+
+  return GST_FLOW_OK;
+}
+
+/* Accounts for the time since wait_start, spent waiting for the parent to
+ * release something. The parent keeps track of it for its stats. */
+static void
+report_wait (GstSandboxSink *self, gint64 wait_start)
+{
+  GstSandboxSinkPrivate *priv = self->priv;
+  SandboxShmWaitMessage message;
+
+  g_mutex_lock (&priv->lock);
+  priv->shm_wait_time += (g_get_monotonic_time () - wait_start) * GST_USECOND;
+  message.total_wait_time = priv->shm_wait_time;
+  g_mutex_unlock (&priv->lock);
+
+  if (!sandbox_channel_send (priv->channel, SANDBOX_MESSAGE_SHM_WAIT,
+                             &message, sizeof (message), NULL, 0))
+    GST_DEBUG_OBJECT (self, "Could not send wait time: %m");
+}
+
+/* Whether the parent granted us room for one more block of size bytes. With
+ * nothing in flight there always is, or a buffer bigger than the grant would
+ * never go. Must be called with the lock held. */
+static gboolean
+has_credit_unlocked (GstSandboxSink *self, gsize size)
+{
+  GstSandboxSinkPrivate *priv = self->priv;
+
+  if (priv->n_in_flight == 0)
+    return TRUE;
+  if (priv->max_buffers_in_flight > 0
+      && priv->n_in_flight >= priv->max_buffers_in_flight)
+    return FALSE;
+  if (priv->max_bytes_in_flight > 0
+      && priv->bytes_in_flight + size > priv->max_bytes_in_flight)
+    return FALSE;
+
+  return TRUE;
+}
+
+/* Waits for the credit to send block, then counts it as in flight. Has to be
+ * undone with return_credit() if it doesn't get sent after all. */
+static GstFlowReturn
+take_credit (GstSandboxSink *self, ShmBlock *block)
+{
+  GstSandboxSinkPrivate *priv = self->priv;
+  GstFlowReturn ret = GST_FLOW_OK;
+  gsize size = shm_block_get_size (block);
+  gint64 wait_start = 0;
+
+  g_mutex_lock (&priv->lock);
+  while (!has_credit_unlocked (self, size)) {
+    if (priv->flushing) {
+      ret = GST_FLOW_WRONG_STATE;
+      break;
+    }
+    if (priv->disconnected) {
+      ret = GST_FLOW_UNEXPECTED;
+      break;
+    }
+    GST_LOG_OBJECT (self, "Out of credit, waiting for the parent");
+    if (!wait_start)
+      wait_start = g_get_monotonic_time ();
+    g_cond_wait (&priv->cond, &priv->lock);
+  }
+  if (ret == GST_FLOW_OK)
+    add_in_flight_unlocked (self, block);
+  g_mutex_unlock (&priv->lock);
+
+  if (wait_start)
+    report_wait (self, wait_start);
+
+  return ret;
+}
+
+static void
+return_credit (GstSandboxSink *self, ShmBlock *block)
+{
+  GstSandboxSinkPrivate *priv = self->priv;
+
+  g_mutex_lock (&priv->lock);
+  remove_in_flight_unlocked (self, block);
+  g_cond_broadcast (&priv->cond);
+  g_mutex_unlock (&priv->lock);
+}
+
+/* Bytes per second of raw audio caps, 0 for anything else */
+static guint64
+get_audio_byte_rate (GstCaps *caps)
+{
+  GstStructure *structure;
+  gint rate, channels, sample_width;
+
+  if (!caps || !gst_caps_is_fixed (caps))
+    return 0;
+
+  structure = gst_caps_get_structure (caps, 0);
+  if (g_str_has_prefix (gst_structure_get_name (structure), "audio/x-raw-")
+      && gst_structure_get_int (structure, "rate", &rate)
+      && gst_structure_get_int (structure, "channels", &channels)
+      && gst_structure_get_int (structure, "width", &sample_width)
+      && rate > 0 && channels > 0 && sample_width > 0)
+    return (guint64) rate * channels * sample_width / 8;
+
+  return 0;
+}
+
+/* How big an area should be for buffers of caps */
+static gsize
+get_area_size_for_caps (GstSandboxSink *self, GstCaps *caps)
+{
+  GstSandboxSinkPrivate *priv = self->priv;
+  GstVideoFormat format;
+  gint width, height;
+  guint64 byte_rate;
+
+  if (!caps || !gst_caps_is_fixed (caps))
+    return priv->shm_size;
+
+  if (gst_video_format_parse_caps (caps, &format, &width, &height))
+    return (gsize) gst_video_format_get_size (format, width, height)
+        * priv->shm_buffers;
+
+  byte_rate = get_audio_byte_rate (caps);
+  if (byte_rate > 0)
+    return gst_util_uint64_scale (priv->shm_audio_duration, byte_rate,
+                                  GST_SECOND);
+
+  return priv->shm_size;
+}
+
+/* Creates a new area for the buffers to come, or takes a spare one, and
+ * tells the parent */
+static GstFlowReturn
+switch_area (GstSandboxSink *self, gsize size, gsize min_size)
+{
+  GstSandboxSinkPrivate *priv = self->priv;
+  SandboxAreaMessage area_message;
+  ShmArea *area;
+  gsize wanted;
+  gint area_fd;
+
+  /* like ensure_area(), which would replace one more than twice too big */
+  area = take_spare_area (size, size * 2, priv->shm_flags);
+  if (area) {
+    size = shm_area_get_size (area);
+    GST_DEBUG_OBJECT (self, "Reusing spare area of %" G_GSIZE_FORMAT " bytes",
+                      size);
+    goto send;
+  }
+
+  wanted = size;
+  size = reserve_shm (wanted, min_size);
+  if (size == 0) {
+    drop_spare_areas ();
+    size = reserve_shm (wanted, min_size);
+  }
+  if (size == 0) {
+    GST_ELEMENT_ERROR (self, RESOURCE, NO_SPACE_LEFT,
+                       ("Shared memory limit reached"),
+                       ("Could not get %" G_GSIZE_FORMAT " bytes", min_size));
+    return GST_FLOW_ERROR;
+  }
+
+  /* Sinks are plugged as decodebin2 exposes streams, once the decoder is
+   * chrooted: only memfd areas can be created by then, shm_open() needs
+   * /dev/shm */
+  area = shm_area_new (size, priv->shm_flags);
+  if (!area) {
+    GST_ELEMENT_ERROR (self, RESOURCE, OPEN_READ_WRITE,
+                       ("Could not create shm area of %" G_GSIZE_FORMAT
+                        " bytes", size),
+                       ("%s", g_strerror (errno)));
+    return_shm (size);
+    return GST_FLOW_ERROR;
+  }
+
+send:
+  area_message.size = size;
+  area_message.id = priv->next_area_id++;
+  area_message.flags = shm_area_get_flags (area);
+  area_fd = shm_area_get_fd (area);
+  if (!sandbox_channel_send (priv->channel, SANDBOX_MESSAGE_AREA,
+                             &area_message, sizeof (area_message),
+                             &area_fd, 1)) {
+    GST_DEBUG_OBJECT (self, "Could not send shm area to the parent: %m");
+    retire_area (area);
+    return GST_FLOW_UNEXPECTED;
+  }
+  GST_DEBUG_OBJECT (self, "Using shm area %u of %" G_GSIZE_FORMAT " bytes",
+                    area_message.id, size);
+  shm_area_set_release_func (area,
+                             (ShmAreaReleaseFunc) on_block_released, self);
+
+  g_mutex_lock (&priv->lock);
+  g_hash_table_insert (priv->areas, GUINT_TO_POINTER (area_message.id), area);
+  priv->area = area;
+  priv->area_id = area_message.id;
+  drop_unused_areas_unlocked (self);
+  g_mutex_unlock (&priv->lock);
+
+  return GST_FLOW_OK;
+}
+
+/* Returns a new block of at least size bytes, waiting for the parent to
+ * release some memory if the area is full. If the parent has nothing to
+ * release, the area is replaced. If we may not wait, block is set to NULL
+ * instead. */
+static GstFlowReturn
+alloc_block (GstSandboxSink *self, gsize size, gboolean wait, ShmBlock **block)
+{
+  GstSandboxSinkPrivate *priv = self->priv;
+  GstFlowReturn ret = GST_FLOW_OK;
+  gint64 wait_start = 0;
+  gsize area_size;
+
+  g_mutex_lock (&priv->lock);
+  while (!(*block = shm_area_alloc_block (priv->area, size))) {
+    if (priv->flushing) {
+      ret = GST_FLOW_WRONG_STATE;
+      break;
+    }
+    if (priv->disconnected) {
+      ret = GST_FLOW_UNEXPECTED;
+      break;
+    }
+    /* with nothing in flight, upstream holds all of it (reference frames)
+     * and the parent has nothing to release */
+    if (!wait || priv->n_in_flight == 0)
+      break;
+    GST_LOG_OBJECT (self, "shm area full, waiting for the parent");
+    if (!wait_start)
+      wait_start = g_get_monotonic_time ();
+    g_cond_wait (&priv->cond, &priv->lock);
+  }
+  area_size = shm_area_get_size (priv->area);
+  g_mutex_unlock (&priv->lock);
+
+  if (wait_start)
+    report_wait (self, wait_start);
+
+  if (*block || ret != GST_FLOW_OK || !wait)
+    return ret;
+
+  /* the old area lives on until upstream lets go of its blocks */
+  GST_DEBUG_OBJECT (self, "shm area held upstream, replacing it");
+  ret = switch_area (self, area_size, size);
+  if (ret != GST_FLOW_OK)
+    return ret;
+  g_mutex_lock (&priv->lock);
+  *block = shm_area_alloc_block (priv->area, size);
+  g_mutex_unlock (&priv->lock);
+  if (!*block) {
+    GST_ELEMENT_ERROR (self, RESOURCE, NO_SPACE_LEFT,
+                       ("Could not allocate %" G_GSIZE_FORMAT " bytes of "
+                        "shared memory", size), (NULL));
+    return GST_FLOW_ERROR;
+  }
+
+  return GST_FLOW_OK;
+}
+
+/* Makes sure the area suits caps and has room for a buffer of min_size
+ * bytes. The area is replaced if it has to grow, or if the caps need less
+ * than half of it. */
+static GstFlowReturn
+ensure_area (GstSandboxSink *self, GstCaps *caps, gsize min_size)
+{
+  GstSandboxSinkPrivate *priv = self->priv;
+  gsize size, wanted;
+
+  size = priv->area ? shm_area_get_size (priv->area) : 0;
+  if (priv->area && min_size <= size
+      && (!caps || (priv->area_caps && gst_caps_is_equal (caps,
+                                                          priv->area_caps))))
+    return GST_FLOW_OK;
+
+  wanted = get_area_size_for_caps (self, caps ? caps : priv->area_caps);
+  if (wanted < min_size)
+    /* buffers are bigger than the caps told, make room for a few */
+    wanted = min_size * priv->shm_buffers;
+
+  if (caps)
+    gst_caps_replace (&priv->area_caps, caps);
+
+  if (priv->area && min_size <= size && wanted <= size && wanted >= size / 2)
+    return GST_FLOW_OK;
+
+  return switch_area (self, wanted, min_size);
+}
+
+static gboolean
+send_caps_if_changed (GstSandboxSink *self, GstCaps *caps)
+{
+  GstSandboxSinkPrivate *priv = self->priv;
+
+  if (!caps || (priv->sent_caps && gst_caps_is_equal (caps, priv->sent_caps)))
+    return TRUE;
+
+  if (!sandbox_channel_send_caps (priv->channel, caps))
+    return FALSE;
+
+  gst_caps_replace (&priv->sent_caps, caps);
+  return TRUE;
+}
+
+/* Buffers of caps go through batch_buffer() */
+static gboolean
+is_batched (GstSandboxSink *self, GstCaps *caps)
+{
+  return self->priv->audio_batch_duration > 0
+      && get_audio_byte_rate (caps) > 0;
+}
+
+/* Sends the pending batch, if any. Our reference on its block becomes the
+ * parent's. When flushing while waiting for credit, the batch stays pending
+ * until the FLUSH_STOP discards it. */
+static GstFlowReturn
+send_batch (GstSandboxSink *self)
+{
+  GstSandboxSinkPrivate *priv = self->priv;
+  SandboxBatchMessage *header = (SandboxBatchMessage *) priv->batch_payload;
+  GstFlowReturn ret;
+
+  if (!priv->batch_block)
+    return GST_FLOW_OK;
+
+  ret = take_credit (self, priv->batch_block);
+  if (ret != GST_FLOW_OK)
+    return ret;
+
+  header->offset = shm_block_get_offset (priv->batch_block);
+  GST_LOG_OBJECT (self, "Sending batch of %u buffers, %" G_GSIZE_FORMAT
+                  " bytes", header->n_buffers, priv->batch_used);
+  if (!sandbox_channel_send (priv->channel, SANDBOX_MESSAGE_BUFFER_BATCH,
+                             priv->batch_payload,
+                             sizeof (SandboxBatchMessage)
+                             + header->n_buffers * sizeof (SandboxBufferMessage),
+                             NULL, 0)) {
+    GST_DEBUG_OBJECT (self, "Could not send to the parent: %m");
+    return_credit (self, priv->batch_block);
+    shm_block_unref (priv->batch_block);
+    ret = GST_FLOW_UNEXPECTED;
+  }
+  priv->batch_block = NULL;
+
+  return ret;
+}
+
+static void
+discard_batch (GstSandboxSink *self)
+{
+  if (self->priv->batch_block) {
+    shm_block_unref (self->priv->batch_block);
+    self->priv->batch_block = NULL;
+  }
+}
+
+/* Copies a raw audio buffer into the pending batch, which is sent once it
+ * holds audio-batch-duration of audio */
+static GstFlowReturn
+batch_buffer (GstSandboxSink *self, GstBuffer *buffer)
+{
+  GstSandboxSinkPrivate *priv = self->priv;
+  SandboxBatchMessage *header = (SandboxBatchMessage *) priv->batch_payload;
+  SandboxBufferMessage *entry;
+  GstCaps *caps = GST_BUFFER_CAPS (buffer);
+  guint64 byte_rate = get_audio_byte_rate (caps);
+  GstFlowReturn ret;
+
+  /* a batch only holds contiguous buffers with the same caps */
+  if (priv->batch_block
+      && (GST_BUFFER_IS_DISCONT (buffer)
+          || !priv->sent_caps || !gst_caps_is_equal (caps, priv->sent_caps)
+          || header->n_buffers == SANDBOX_BATCH_MAX_BUFFERS
+          || priv->batch_used + GST_BUFFER_SIZE (buffer)
+             > shm_block_get_size (priv->batch_block))) {
+    ret = send_batch (self);
+    if (ret != GST_FLOW_OK)
+      return ret;
+  }
+
+  if (!priv->batch_block) {
+    gsize size;
+
+    size = gst_util_uint64_scale (priv->audio_batch_duration, byte_rate,
+                                  GST_SECOND);
+    size = MAX (size, GST_BUFFER_SIZE (buffer));
+
+    ret = ensure_area (self, caps, size);
+    if (ret != GST_FLOW_OK)
+      return ret;
+    if (!send_caps_if_changed (self, caps))
+      goto send_failed;
+    ret = alloc_block (self, size, TRUE, &priv->batch_block);
+    if (ret != GST_FLOW_OK)
+      return ret;
+
+    priv->batch_used = 0;
+    priv->batch_duration = 0;
+    header->n_buffers = 0;
+  }
+
+  entry = (SandboxBufferMessage *) (priv->batch_payload
+                                 + sizeof (SandboxBatchMessage))
+      + header->n_buffers++;
+  memcpy (shm_block_get_data (priv->batch_block) + priv->batch_used,
+          GST_BUFFER_DATA (buffer), GST_BUFFER_SIZE (buffer));
+  entry->offset = priv->batch_used;
+  entry->size = GST_BUFFER_SIZE (buffer);
+  entry->timestamp = GST_BUFFER_TIMESTAMP (buffer);
+  entry->duration = GST_BUFFER_DURATION (buffer);
+  entry->buffer_offset = GST_BUFFER_OFFSET (buffer);
+  entry->buffer_offset_end = GST_BUFFER_OFFSET_END (buffer);
+  entry->render_time = g_get_monotonic_time () * GST_USECOND;
+  entry->flags = GST_BUFFER_FLAGS (buffer);
+  priv->batch_used += GST_BUFFER_SIZE (buffer);
+
+  if (GST_BUFFER_DURATION_IS_VALID (buffer))
+    priv->batch_duration += GST_BUFFER_DURATION (buffer);
+  else
+    priv->batch_duration += gst_util_uint64_scale (GST_BUFFER_SIZE (buffer),
+                                                   GST_SECOND, byte_rate);
+
+  if (priv->batch_duration >= priv->audio_batch_duration)
+    return send_batch (self);
+
+  return GST_FLOW_OK;
+
+send_failed:
+  GST_DEBUG_OBJECT (self, "Could not send to the parent: %m");
+  return GST_FLOW_UNEXPECTED;
+}
+
+/* Sets how much shared memory all the sandboxsinks of the process may use
+ * together, 0 for no limit. Areas already created are not affected. */
+void
+gst_sandbox_sink_set_shm_limit (guint64 limit)
+{
+  G_LOCK (shm_budget);
+  shm_limit = limit;
+  G_UNLOCK (shm_budget);
+}
+
+/* GstBaseSink vmethod implementations */
+
+static gboolean
+gst_sandbox_sink_start (GstBaseSink *sink)
+{
+  GstSandboxSink *self = GST_SANDBOX_SINK (sink);
+  GstSandboxSinkPrivate *priv = self->priv;
+  gint fd;
+
+  if (priv->fd == -1) {
+    GST_ELEMENT_ERROR (self, RESOURCE, NOT_FOUND, ("No fd set"), (NULL));
+    return FALSE;
+  }
+
+  fd = dup (priv->fd);
+  if (fd == -1) {
+    GST_ELEMENT_ERROR (self, RESOURCE, WRITE,
+                       ("Could not talk to the parent"),
+                       ("%s", g_strerror (errno)));
+    return FALSE;
+  }
+
+  /* the area comes with the caps, see ensure_area() */
+  priv->areas = g_hash_table_new_full (NULL, NULL, NULL,
+                                       (GDestroyNotify) retire_area);
+  priv->in_flight = g_hash_table_new (NULL, NULL);
+  priv->n_in_flight = 0;
+  priv->bytes_in_flight = 0;
+  priv->next_area_id = 0;
+  priv->shm_wait_time = 0;
+  priv->batch_payload = g_malloc0 (SANDBOX_IPC_MAX_PAYLOAD_SIZE);
+  set_up_channel (self, fd);
+
+  priv->flushing = FALSE;
+  priv->disconnected = FALSE;
+  priv->poll = gst_poll_new (TRUE);
+  priv->reader = g_thread_new ("sandboxsink-reader",
+                               (GThreadFunc) reader_thread, self);
+
+  return TRUE;
+}
+
+static gboolean
+gst_sandbox_sink_stop (GstBaseSink *sink)
+{
+  GstSandboxSink *self = GST_SANDBOX_SINK (sink);
+  GstSandboxSinkPrivate *priv = self->priv;
+  GHashTableIter iter;
+  gpointer block, count;
+
+  gst_poll_set_flushing (priv->poll, TRUE);
+  g_thread_join (priv->reader);
+  priv->reader = NULL;
+  gst_poll_free (priv->poll);
+  priv->poll = NULL;
+
+  discard_batch (self);
+  g_free (priv->batch_payload);
+  priv->batch_payload = NULL;
+
+  if (priv->channel) {
+    sandbox_channel_unref (priv->channel);
+    priv->channel = NULL;
+  }
+
+  /* the parent is gone and won't release the blocks it still had, drop its
+   * references, one per send, so the areas get reused. Nothing else touches
+   * the table now the reader is gone, and releasing a block takes the
+   * lock. */
+  g_hash_table_iter_init (&iter, priv->in_flight);
+  while (g_hash_table_iter_next (&iter, &block, &count)) {
+    guint i;
+
+    for (i = 0; i < GPOINTER_TO_UINT (count); i++)
+      shm_block_unref (block);
+  }
+
+  g_mutex_lock (&priv->lock);
+  priv->area = NULL;
+  g_hash_table_destroy (priv->in_flight);
+  priv->in_flight = NULL;
+  priv->n_in_flight = 0;
+  priv->bytes_in_flight = 0;
+  g_hash_table_destroy (priv->areas);
+  priv->areas = NULL;
+  g_mutex_unlock (&priv->lock);
+
+  gst_caps_replace (&priv->area_caps, NULL);
+  gst_caps_replace (&priv->sent_caps, NULL);
+
+  return TRUE;
+}
+
+static gboolean
+gst_sandbox_sink_unlock (GstBaseSink *sink)
+{
+  GstSandboxSinkPrivate *priv = GST_SANDBOX_SINK (sink)->priv;
+
+  g_mutex_lock (&priv->lock);
+  priv->flushing = TRUE;
+  g_cond_broadcast (&priv->cond);
+  g_mutex_unlock (&priv->lock);
+
+  return TRUE;
+}
+
+static gboolean
+gst_sandbox_sink_unlock_stop (GstBaseSink *sink)
+{
+  GstSandboxSinkPrivate *priv = GST_SANDBOX_SINK (sink)->priv;
+
+  g_mutex_lock (&priv->lock);
+  priv->flushing = FALSE;
+  g_mutex_unlock (&priv->lock);
+
+  return TRUE;
+}
+
+static GstFlowReturn
+gst_sandbox_sink_buffer_alloc (GstBaseSink *sink,
+                               guint64 offset,
+                               guint size,
+                               GstCaps *caps,
+                               GstBuffer **buf)
+{
+  GstSandboxSink *self = GST_SANDBOX_SINK (sink);
+  GstBuffer *buffer;
+  ShmBlock *block;
+  GstFlowReturn ret;
+
+  /* batched buffers are copied anyway, upstream can use normal memory */
+  if (is_batched (self, caps)) {
+    *buf = NULL;
+    return GST_FLOW_OK;
+  }
+
+  ret = ensure_area (self, caps, size);
+  if (ret != GST_FLOW_OK)
+    return ret;
+
+  /* the blocks upstream holds on to only come back when it lets go of them,
+   * which a decoder keeping reference frames may only do once it got more */
+  ret = alloc_block (self, size, FALSE, &block);
+  if (ret != GST_FLOW_OK)
+    return ret;
+  if (!block) {
+    GST_LOG_OBJECT (self, "shm area full, upstream gets normal memory");
+    *buf = NULL;
+    return GST_FLOW_OK;
+  }
+
+  buffer = gst_buffer_new ();
+  GST_BUFFER_DATA (buffer) = shm_block_get_data (block);
+  GST_BUFFER_SIZE (buffer) = size;
+  GST_BUFFER_MALLOCDATA (buffer) = (guint8 *) block;
+  GST_BUFFER_FREE_FUNC (buffer) = (GFreeFunc) shm_block_unref;
+  GST_BUFFER_OFFSET (buffer) = offset;
+  gst_buffer_set_caps (buffer, caps);
+
+  *buf = buffer;
+
+  return GST_FLOW_OK;
+}
+
+static GstFlowReturn
+gst_sandbox_sink_render (GstBaseSink *sink, GstBuffer *buffer)
+{
+  GstSandboxSink *self = GST_SANDBOX_SINK (sink);
+  GstSandboxSinkPrivate *priv = self->priv;
+  SandboxBufferMessage message;
+  ShmBlock *block = NULL;
+  guint8 *area_data;
+  GstFlowReturn ret;
+
+  g_mutex_lock (&priv->lock);
+  ret = wait_for_channel_unlocked (self);
+  g_mutex_unlock (&priv->lock);
+  if (ret != GST_FLOW_OK)
+    return ret;
+
+  if (is_batched (self, GST_BUFFER_CAPS (buffer)))
+    return batch_buffer (self, buffer);
+
+  ret = send_batch (self);
+  if (ret != GST_FLOW_OK)
+    return ret;
+
+  ret = ensure_area (self, GST_BUFFER_CAPS (buffer), GST_BUFFER_SIZE (buffer));
+  if (ret != GST_FLOW_OK)
+    return ret;
+
+  if (!send_caps_if_changed (self, GST_BUFFER_CAPS (buffer)))
+    goto send_failed;
+
+  area_data = shm_area_get_data (priv->area);
+  if (shm_area_contains (priv->area, GST_BUFFER_DATA (buffer),
+                         GST_BUFFER_SIZE (buffer)))
+    block = shm_area_find_block (priv->area,
+                                 GST_BUFFER_DATA (buffer) - area_data);
+
+  if (block) {
+    /* zero-copy path: upstream wrote into memory we gave it */
+    message.offset = GST_BUFFER_DATA (buffer) - area_data;
+  } else {
+    /* this includes buffers from an area we replaced since */
+    ret = alloc_block (self, GST_BUFFER_SIZE (buffer), TRUE, &block);
+    if (ret != GST_FLOW_OK)
+      return ret;
+    GST_LOG_OBJECT (self, "Copying buffer of %u bytes into the shm area",
+                    GST_BUFFER_SIZE (buffer));
+    memcpy (shm_block_get_data (block), GST_BUFFER_DATA (buffer),
+            GST_BUFFER_SIZE (buffer));
+    message.offset = shm_block_get_offset (block);
+  }
+
+  message.size = GST_BUFFER_SIZE (buffer);
+  message.timestamp = GST_BUFFER_TIMESTAMP (buffer);
+  message.duration = GST_BUFFER_DURATION (buffer);
+  message.buffer_offset = GST_BUFFER_OFFSET (buffer);
+  message.buffer_offset_end = GST_BUFFER_OFFSET_END (buffer);
+  message.render_time = g_get_monotonic_time () * GST_USECOND;
+  message.flags = GST_BUFFER_FLAGS (buffer);
+
+  ret = take_credit (self, block);
+  if (ret != GST_FLOW_OK) {
+    shm_block_unref (block);
+    return ret;
+  }
+
+  /* on success, our reference on the block is now the parent's */
+  if (!sandbox_channel_send (priv->channel, SANDBOX_MESSAGE_BUFFER,
+                             &message, sizeof (message), NULL, 0)) {
+    return_credit (self, block);
+    shm_block_unref (block);
+    goto send_failed;
+  }
+
+  return GST_FLOW_OK;
+
+send_failed:
+  GST_DEBUG_OBJECT (self, "Could not send to the parent: %m");
+  return GST_FLOW_UNEXPECTED;
+}
+
+static gboolean
+gst_sandbox_sink_event (GstBaseSink *sink, GstEvent *event)
+{
+  GstSandboxSink *self = GST_SANDBOX_SINK (sink);
+  GstSandboxSinkPrivate *priv = self->priv;
+  SandboxChannel *channel = NULL;
+
+  /* the parent would take the others for an attack */
+  if (!sandbox_event_is_forwarded (event)) {
+    GST_DEBUG_OBJECT (self, "Not forwarding %s event",
+                      GST_EVENT_TYPE_NAME (event));
+    return TRUE;
+  }
+
+  g_mutex_lock (&priv->lock);
+  if (GST_EVENT_IS_SERIALIZED (event)) {
+    /* these have to reach the parent before the next buffers */
+    if (wait_for_channel_unlocked (self) == GST_FLOW_OK)
+      channel = sandbox_channel_ref (priv->channel);
+  } else if (priv->channel) {
+    channel = sandbox_channel_ref (priv->channel);
+  }
+  g_mutex_unlock (&priv->lock);
+
+  /* serialised events come from the streaming thread, after the buffers
+   * of the pending batch */
+  if (GST_EVENT_TYPE (event) == GST_EVENT_FLUSH_STOP)
+    discard_batch (self);
+  else if (channel && GST_EVENT_IS_SERIALIZED (event)
+           && send_batch (self) != GST_FLOW_OK)
+    GST_DEBUG_OBJECT (self, "Could not send pending batch");
+
+  if (channel) {
+    GST_DEBUG_OBJECT (self, "Forwarding %s event", GST_EVENT_TYPE_NAME (event));
+    if (!sandbox_channel_send_event (channel, event))
+      GST_WARNING_OBJECT (self, "Could not forward %s event",
+                          GST_EVENT_TYPE_NAME (event));
+    sandbox_channel_unref (channel);
+  }
+
+  return TRUE;
+}
+
+static void
+set_shm_flag (GstSandboxSinkPrivate *priv, ShmAreaFlags flag, gboolean set)
+{
+  if (set)
+    priv->shm_flags |= flag;
+  else
+    priv->shm_flags &= ~flag;
+}
+
+/* GObject vmethod implementations */
+
+static void
+gst_sandbox_sink_set_property (GObject *object,
+                               guint prop_id,
+                               const GValue *value,
+                               GParamSpec *pspec)
+{
+  GstSandboxSinkPrivate *priv = GST_SANDBOX_SINK (object)->priv;
+
+  switch (prop_id) {
+  case PROP_FD:
+    priv->fd = g_value_get_int (value);
+    break;
+  case PROP_SHM_SIZE:
+    priv->shm_size = g_value_get_uint (value);
+    break;
+  case PROP_SHM_BUFFERS:
+    priv->shm_buffers = g_value_get_uint (value);
+    break;
+  case PROP_SHM_HUGE_PAGES:
+    set_shm_flag (priv, SHM_AREA_HUGE_PAGES, g_value_get_boolean (value));
+    break;
+  case PROP_SHM_TRANSPARENT_HUGE_PAGES:
+    set_shm_flag (priv, SHM_AREA_TRANSPARENT_HUGE_PAGES,
+                  g_value_get_boolean (value));
+    break;
+  case PROP_SHM_PREFAULT:
+    set_shm_flag (priv, SHM_AREA_PREFAULT, g_value_get_boolean (value));
+    break;
+  case PROP_SHM_AUDIO_DURATION:
+    priv->shm_audio_duration = g_value_get_uint64 (value);
+    break;
+  case PROP_AUDIO_BATCH_DURATION:
+    priv->audio_batch_duration = g_value_get_uint64 (value);
+    break;
+  case PROP_MAX_BUFFERS_IN_FLIGHT:
+    priv->max_buffers_in_flight = g_value_get_uint (value);
+    break;
+  case PROP_MAX_BYTES_IN_FLIGHT:
+    priv->max_bytes_in_flight = g_value_get_uint64 (value);
+    break;
+  default:
+    G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+    break;
+  }
+}
+
+static void
+gst_sandbox_sink_get_property (GObject *object,
+                               guint prop_id,
+                               GValue *value,
+                               GParamSpec *pspec)
+{
+  GstSandboxSinkPrivate *priv = GST_SANDBOX_SINK (object)->priv;
+
+  switch (prop_id) {
+  case PROP_FD:
+    g_value_set_int (value, priv->fd);
+    break;
+  case PROP_SHM_SIZE:
+    g_value_set_uint (value, priv->shm_size);
+    break;
+  case PROP_SHM_BUFFERS:
+    g_value_set_uint (value, priv->shm_buffers);
+    break;
+  case PROP_SHM_HUGE_PAGES:
+    g_value_set_boolean (value, !!(priv->shm_flags & SHM_AREA_HUGE_PAGES));
+    break;
+  case PROP_SHM_TRANSPARENT_HUGE_PAGES:
+    g_value_set_boolean (value, !!(priv->shm_flags
+                                   & SHM_AREA_TRANSPARENT_HUGE_PAGES));
+    break;
+  case PROP_SHM_PREFAULT:
+    g_value_set_boolean (value, !!(priv->shm_flags & SHM_AREA_PREFAULT));
+    break;
+  case PROP_SHM_AUDIO_DURATION:
+    g_value_set_uint64 (value, priv->shm_audio_duration);
+    break;
+  case PROP_AUDIO_BATCH_DURATION:
+    g_value_set_uint64 (value, priv->audio_batch_duration);
+    break;
+  case PROP_MAX_BUFFERS_IN_FLIGHT:
+    g_value_set_uint (value, priv->max_buffers_in_flight);
+    break;
+  case PROP_MAX_BYTES_IN_FLIGHT:
+    g_value_set_uint64 (value, priv->max_bytes_in_flight);
+    break;
+  default:
+    G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+    break;
+  }
+}
+
+static void
+gst_sandbox_sink_finalize (GstSandboxSink *self)
+{
+  g_mutex_clear (&self->priv->lock);
+  g_cond_clear (&self->priv->cond);
+
+  G_OBJECT_CLASS (gst_sandbox_sink_parent_class)->finalize (G_OBJECT (self));
+}
+
+static void
+gst_sandbox_sink_init (GstSandboxSink *self)
+{
+  GstSandboxSinkPrivate *priv;
+
+  self->priv = priv = GST_SANDBOX_SINK_GET_PRIVATE (self);
+
+  priv->shm_size = DEFAULT_SHM_SIZE;
+  priv->shm_buffers = DEFAULT_SHM_BUFFERS;
+  priv->shm_audio_duration = DEFAULT_SHM_AUDIO_DURATION;
+  priv->shm_flags = 0;
+  priv->audio_batch_duration = DEFAULT_AUDIO_BATCH_DURATION;
+  priv->max_buffers_in_flight = DEFAULT_MAX_BUFFERS_IN_FLIGHT;
+  priv->max_bytes_in_flight = DEFAULT_MAX_BYTES_IN_FLIGHT;
+  priv->fd = -1;
+  g_mutex_init (&priv->lock);
+  g_cond_init (&priv->cond);
+
+  /* the parent does the syncing */
+  gst_base_sink_set_sync (GST_BASE_SINK (self), FALSE);
+}
+
+static void
+gst_sandbox_sink_class_init (GstSandboxSinkClass *self_class)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (self_class);
+  GstElementClass *element_class = GST_ELEMENT_CLASS (self_class);
+  GstBaseSinkClass *base_sink_class = GST_BASE_SINK_CLASS (self_class);
+
+  GST_DEBUG_CATEGORY_INIT (gst_debug_sandbox_sink, "sandboxsink", 0,
+      "sink of the sandboxed decoder");
+
+  g_type_class_add_private (self_class, sizeof (GstSandboxSinkPrivate));
+  object_class->set_property = gst_sandbox_sink_set_property;
+  object_class->get_property = gst_sandbox_sink_get_property;
+  object_class->finalize = (void (*) (GObject *object)) gst_sandbox_sink_finalize;
+
+  g_object_class_install_property (object_class, PROP_FD,
+      g_param_spec_int ("fd", "fd",
+                        "Socket connected to the parent",
+                        -1, G_MAXINT, -1,
+                        G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (object_class, PROP_SHM_SIZE,
+      g_param_spec_uint ("shm-size", "shm size",
+                         "Size of the shared memory area in bytes, when "
+                         "the caps don't tell",
+                         1, G_MAXUINT, DEFAULT_SHM_SIZE,
+                         G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (object_class, PROP_SHM_BUFFERS,
+      g_param_spec_uint ("shm-buffers", "shm buffers",
+                         "Number of raw video frames the shared memory area "
+                         "can hold",
+                         1, G_MAXUINT, DEFAULT_SHM_BUFFERS,
+                         G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (object_class, PROP_SHM_AUDIO_DURATION,
+      g_param_spec_uint64 ("shm-audio-duration", "shm audio duration",
+                           "Duration of raw audio the shared memory area "
+                           "can hold, in ns",
+                           1, G_MAXUINT64, DEFAULT_SHM_AUDIO_DURATION,
+                           G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (object_class, PROP_SHM_HUGE_PAGES,
+      g_param_spec_boolean ("shm-huge-pages", "shm huge pages",
+                            "Back the shared memory areas with explicit huge "
+                            "pages, if enough are reserved",
+                            DEFAULT_SHM_HUGE_PAGES,
+                            G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (object_class,
+      PROP_SHM_TRANSPARENT_HUGE_PAGES,
+      g_param_spec_boolean ("shm-transparent-huge-pages",
+                            "shm transparent huge pages",
+                            "Ask for transparent huge pages for the shared "
+                            "memory areas",
+                            DEFAULT_SHM_TRANSPARENT_HUGE_PAGES,
+                            G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (object_class, PROP_SHM_PREFAULT,
+      g_param_spec_boolean ("shm-prefault", "shm prefault",
+                            "Fault the shared memory areas in as they are "
+                            "created rather than as buffers are written",
+                            DEFAULT_SHM_PREFAULT,
+                            G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (object_class, PROP_AUDIO_BATCH_DURATION,
+      g_param_spec_uint64 ("audio-batch-duration", "audio batch duration",
+                           "Raw audio is sent in batches of up to this "
+                           "duration, in ns, 0 to send each buffer",
+                           0, G_MAXUINT64, DEFAULT_AUDIO_BATCH_DURATION,
+                           G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (object_class, PROP_MAX_BUFFERS_IN_FLIGHT,
+      g_param_spec_uint ("max-buffers-in-flight", "max buffers in flight",
+                         "Number of buffers the parent may hold before we "
+                         "wait for it to release some, 0 for no limit",
+                         0, G_MAXUINT, DEFAULT_MAX_BUFFERS_IN_FLIGHT,
+                         G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (object_class, PROP_MAX_BYTES_IN_FLIGHT,
+      g_param_spec_uint64 ("max-bytes-in-flight", "max bytes in flight",
+                           "Bytes the parent may hold before we wait for it "
+                           "to release some, 0 for no limit",
+                           0, G_MAXUINT64, DEFAULT_MAX_BYTES_IN_FLIGHT,
+                           G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  signals[SIGNAL_CLIENT_CONNECTED] =
+      g_signal_new ("client-connected", G_TYPE_FROM_CLASS (self_class),
+                    G_SIGNAL_RUN_LAST, 0, NULL, NULL,
+                    g_cclosure_marshal_VOID__INT, G_TYPE_NONE, 1, G_TYPE_INT);
+  signals[SIGNAL_CLIENT_DISCONNECTED] =
+      g_signal_new ("client-disconnected", G_TYPE_FROM_CLASS (self_class),
+                    G_SIGNAL_RUN_LAST, 0, NULL, NULL,
+                    g_cclosure_marshal_VOID__INT, G_TYPE_NONE, 1, G_TYPE_INT);
+  signals[SIGNAL_DOWNSTREAM_CAPS] =
+      g_signal_new ("downstream-caps", G_TYPE_FROM_CLASS (self_class),
+                    G_SIGNAL_RUN_LAST, 0, NULL, NULL,
+                    g_cclosure_marshal_VOID__BOXED, G_TYPE_NONE, 1,
+                    GST_TYPE_CAPS);
+
+  gst_element_class_add_pad_template (element_class,
+      gst_static_pad_template_get (&sink_template));
+  gst_element_class_set_details_simple (element_class,
+      "Sandbox sink", "Sink",
+      "Hands buffers over to sandboxeddecodebin through shared memory",
+      "Guillaume Emont <guijemont@igalia.com>");
+
+  base_sink_class->start = gst_sandbox_sink_start;
+  base_sink_class->stop = gst_sandbox_sink_stop;
+  base_sink_class->unlock = gst_sandbox_sink_unlock;
+  base_sink_class->unlock_stop = gst_sandbox_sink_unlock_stop;
+  base_sink_class->buffer_alloc = gst_sandbox_sink_buffer_alloc;
+  base_sink_class->render = gst_sandbox_sink_render;
+  base_sink_class->event = gst_sandbox_sink_event;
+}
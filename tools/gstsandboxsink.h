@@ -0,0 +1,56 @@
+/*
+ * Copyright (C) 2012 Igalia S.L.
+*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __GST_SANDBOX_SINK_H__
+#define __GST_SANDBOX_SINK_H__
+
+#include <gst/gst.h>
+#include <gst/base/gstbasesink.h>
+
+G_BEGIN_DECLS
+
+#define GST_SANDBOX_SINK_TYPE (gst_sandbox_sink_get_type ())
+#define GST_SANDBOX_SINK(obj) (G_TYPE_CHECK_INSTANCE_CAST ((obj), GST_SANDBOX_SINK_TYPE, GstSandboxSink))
+#define GST_SANDBOX_SINK_CLASS(klass) (G_TYPE_CHECK_CLASS_CAST ((klass), GST_SANDBOX_SINK_TYPE, GstSandboxSinkClass))
+#define IS_GST_SANDBOX_SINK(obj) (G_TYPE_CHECK_INSTANCE_TYPE ((obj), GST_SANDBOX_SINK_TYPE))
+#define IS_GST_SANDBOX_SINK_CLASS(klass) (G_TYPE_CHECK_CLASS_TYPE ((klass), GST_SANDBOX_SINK_TYPE))
+#define GST_SANDBOX_SINK_GET_CLASS(obj) (G_TYPE_INSTANCE_GET_CLASS ((obj), GST_SANDBOX_SINK_TYPE, GstSandboxSinkClass))
+
+typedef struct _GstSandboxSink GstSandboxSink;
+typedef struct _GstSandboxSinkClass GstSandboxSinkClass;
+
+typedef struct _GstSandboxSinkPrivate GstSandboxSinkPrivate;
+
+struct _GstSandboxSink {
+  GstBaseSink parent;
+
+  GstSandboxSinkPrivate *priv;
+};
+
+struct _GstSandboxSinkClass {
+  GstBaseSinkClass parent;
+};
+
+GType gst_sandbox_sink_get_type (void);
+
+void gst_sandbox_sink_set_shm_limit (guint64 limit);
+
+G_END_DECLS
+
+#endif /* __GST_SANDBOX_SINK_H__ */
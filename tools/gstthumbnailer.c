@@ -0,0 +1,914 @@
+/*
+ * Copyright (C) 2012 Igalia S.L.
+*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * Grabs thumbnails of untrusted media files, decoding them in the sandbox.
+ *
+ * This program opens the files and writes the thumbnails, the decoding is
+ * done by a worker: this program again, started with --worker through
+ * sandboxme or with the namespaces backend. The worker loads all the plugins
+ * once, enters the sandbox and then gets the files one after the other as
+ * file descriptors on its channel, see SANDBOX_MESSAGE_THUMBNAIL_JOB. Each
+ * one is decoded in a child it forks, which never sees the channel or the
+ * other files, so a file that takes over its decoder can't get at the files
+ * after it or forge their thumbnails. For each timestamp asked for, it seeks to
+ * the closest keyframe and takes the frame the pipeline prerolls with, so
+ * that only keyframes are decoded. Frames come back in shm areas.
+ *
+ * A child crashing on a file only costs that file. A worker running out of
+ * time on one is killed, the next file gets a new worker.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <glib/gstdio.h>
+#include <gst/gst.h>
+
+#include "libsandbox.h"
+#include "nssandbox.h"
+#include "sandboxipc.h"
+#include "shmarea.h"
+
+#define WORKER_PATH "gst-thumbnailer"
+
+/* how long we give a worker to get ready, in ms */
+#define WORKER_READY_TIMEOUT 10000
+
+/* how long past the job timeout we wait for a worker to give up on its
+ * own before we kill it, in s */
+#define WORKER_TIMEOUT_MARGIN 5
+
+/* Between the first video stream and the sink we take the frames from */
+#define RAW_CAPS "video/x-raw-rgb,bpp=24,depth=24,endianness=4321," \
+    "red_mask=16711680,green_mask=65280,blue_mask=255,pixel-aspect-ratio=1/1"
+
+static gboolean worker = FALSE;
+static gint control_fd = -1;
+static SandboxBackend sandbox_backend = SANDBOX_BACKEND_SETUID;
+static gchar *times_option = NULL;
+static gint count = 0;
+static gint width = 160;
+static gint height = 0;
+static gchar *format_option = NULL;
+static gchar *output_dir = NULL;
+static gint timeout = 30;
+
+static gboolean
+parse_sandbox_option (const gchar *name,
+                      const gchar *value,
+                      gpointer data,
+                      GError **error)
+{
+  if (!strcmp (value, "setuid")) {
+    sandbox_backend = SANDBOX_BACKEND_SETUID;
+  } else if (!strcmp (value, "namespaces")) {
+    /* like gst-decoder, while we are the only thread: --worker comes first
+     * and gst_init() runs once all options are parsed */
+    if (worker && !ns_sandbox_enter_namespaces ()) {
+      g_set_error (error, G_OPTION_ERROR, G_OPTION_ERROR_FAILED,
+                   "Could not enter new namespaces");
+      return FALSE;
+    }
+    sandbox_backend = SANDBOX_BACKEND_NAMESPACES;
+  } else {
+    g_set_error (error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+                 "Unknown sandbox %s", value);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+static GOptionEntry entries[] = {
+  { "times", 't', 0, G_OPTION_ARG_STRING, &times_option,
+    "Comma separated timestamps to grab, in seconds", "T1,T2,..." },
+  { "count", 'n', 0, G_OPTION_ARG_INT, &count,
+    "Number of evenly spaced thumbnails to grab without --times "
+    "(default: 1)", "N" },
+  { "width", 'w', 0, G_OPTION_ARG_INT, &width,
+    "Width of the thumbnails, 0 to follow the height (default: 160)", "W" },
+  { "height", 'h', 0, G_OPTION_ARG_INT, &height,
+    "Height of the thumbnails, 0 to follow the width (default: 0)", "H" },
+  { "format", 'f', 0, G_OPTION_ARG_STRING, &format_option,
+    "png or raw, packed RGB (default: png)", "FORMAT" },
+  { "output-dir", 'o', 0, G_OPTION_ARG_FILENAME, &output_dir,
+    "Where to write the thumbnails (default: .)", "DIR" },
+  { "timeout", 0, 0, G_OPTION_ARG_INT, &timeout,
+    "Seconds the worker may spend on a file, 0 for no limit (default: 30)",
+    "S" },
+  { "sandbox", 0, 0, G_OPTION_ARG_CALLBACK, parse_sandbox_option,
+    "How the worker confines itself: setuid (started by sandboxme, the "
+    "default) or namespaces", "BACKEND" },
+  { "worker", 0, G_OPTION_FLAG_HIDDEN, G_OPTION_ARG_NONE, &worker,
+    NULL, NULL },
+  { "control-fd", 0, G_OPTION_FLAG_HIDDEN, G_OPTION_ARG_INT, &control_fd,
+    NULL, NULL },
+  { NULL }
+};
+
+/* worker */
+
+/* The pipeline of the file the worker is on */
+typedef struct {
+  GstElement *pipeline;
+  /* the end of the first video stream, holding the last frame */
+  GstElement *sink;
+  const SandboxThumbnailJobMessage *job;
+} Grabber;
+
+static void
+load_all_plugins (void)
+{
+  GList *plugin_list, *elem;
+
+  /* we keep the references, the plugins stay loaded */
+  plugin_list = gst_registry_get_plugin_list (gst_registry_get_default ());
+  for (elem = plugin_list; elem; elem = elem->next) {
+    GstPlugin *plugin = GST_PLUGIN (elem->data);
+
+    if (!gst_plugin_is_loaded (plugin))
+      gst_plugin_load (plugin);
+  }
+  g_list_free (plugin_list);
+}
+
+/* Nothing can be loaded or opened from here on */
+static gboolean
+enter_sandbox (void)
+{
+  if (sandbox_backend == SANDBOX_BACKEND_NAMESPACES)
+    return ns_sandbox_lock_down ();
+
+  return chrootme () != -1;
+}
+
+/* Audio is never decoded, its pads are exposed compressed and left
+ * unlinked */
+static gboolean
+on_autoplug_continue (GstElement *decodebin,
+                      GstPad *pad,
+                      GstCaps *caps,
+                      Grabber *grabber)
+{
+  const gchar *name;
+
+  if (gst_caps_is_empty (caps) || gst_caps_is_any (caps))
+    return TRUE;
+  name = gst_structure_get_name (gst_caps_get_structure (caps, 0));
+
+  return !g_str_has_prefix (name, "audio/");
+}
+
+static gchar *
+get_branch_description (const SandboxThumbnailJobMessage *job)
+{
+  GString *desc;
+
+  desc = g_string_new ("ffmpegcolorspace ! videoscale ! capsfilter caps=\""
+                       RAW_CAPS);
+  if (job->width)
+    g_string_append_printf (desc, ",width=%u", job->width);
+  if (job->height)
+    g_string_append_printf (desc, ",height=%u", job->height);
+  g_string_append (desc, "\" ! ");
+  /* pngenc sends EOS after its first frame in snapshot mode */
+  if (job->format == SANDBOX_THUMBNAIL_PNG)
+    g_string_append (desc, "pngenc snapshot=false ! ");
+  g_string_append (desc, "fakesink name=sink sync=false");
+
+  return g_string_free (desc, FALSE);
+}
+
+/* Converts, scales and encodes the first video stream into a fakesink */
+static void
+on_pad_added (GstElement *decodebin, GstPad *pad, Grabber *grabber)
+{
+  GstElement *branch;
+  GstCaps *caps;
+  GstPad *sinkpad;
+  GError *error = NULL;
+  gchar *desc;
+  gboolean video;
+
+  if (grabber->sink)
+    return;
+
+  caps = gst_pad_get_caps_reffed (pad);
+  video = !gst_caps_is_empty (caps) && !gst_caps_is_any (caps)
+      && g_str_has_prefix (gst_structure_get_name (
+             gst_caps_get_structure (caps, 0)), "video/x-raw-");
+  gst_caps_unref (caps);
+  if (!video)
+    return;
+
+  desc = get_branch_description (grabber->job);
+  branch = gst_parse_bin_from_description (desc, TRUE, &error);
+  g_free (desc);
+  if (error) {
+    fprintf (stderr, "Could not create the video branch: %s\n",
+             error->message);
+    g_error_free (error);
+    if (branch)
+      gst_object_unref (branch);
+    return;
+  }
+
+  gst_bin_add (GST_BIN (grabber->pipeline), branch);
+  sinkpad = gst_element_get_static_pad (branch, "sink");
+  if (GST_PAD_LINK_SUCCESSFUL (gst_pad_link (pad, sinkpad))) {
+    grabber->sink = gst_bin_get_by_name (GST_BIN (branch), "sink");
+    gst_element_sync_state_with_parent (branch);
+  } else {
+    fprintf (stderr, "Could not link the video stream\n");
+    gst_bin_remove (GST_BIN (grabber->pipeline), branch);
+  }
+  gst_object_unref (sinkpad);
+}
+
+/* Waits for the pipeline to preroll, after going to PAUSED or a seek.
+ * Errors and EOS mean there is no frame to take. */
+static gboolean
+wait_for_preroll (GstElement *pipeline)
+{
+  GstBus *bus;
+  GstMessage *message;
+  gboolean ret;
+
+  bus = gst_element_get_bus (pipeline);
+  message = gst_bus_timed_pop_filtered (bus, GST_CLOCK_TIME_NONE,
+                                        GST_MESSAGE_ASYNC_DONE
+                                        | GST_MESSAGE_ERROR
+                                        | GST_MESSAGE_EOS);
+  gst_object_unref (bus);
+
+  ret = GST_MESSAGE_TYPE (message) == GST_MESSAGE_ASYNC_DONE;
+  if (GST_MESSAGE_TYPE (message) == GST_MESSAGE_ERROR) {
+    GError *error;
+
+    gst_message_parse_error (message, &error, NULL);
+    fprintf (stderr, "Decoding failed: %s\n", error->message);
+    g_error_free (error);
+  }
+  gst_message_unref (message);
+
+  return ret;
+}
+
+static gboolean
+send_thumbnail (SandboxChannel *channel,
+                const SandboxThumbnailJobMessage *job,
+                guint index,
+                GstBuffer *buffer)
+{
+  SandboxThumbnailMessage message;
+  GstStructure *structure;
+  ShmArea *area;
+  gint fd, frame_width = 0, frame_height = 0;
+  gboolean ret;
+
+  structure = gst_caps_get_structure (GST_BUFFER_CAPS (buffer), 0);
+  gst_structure_get_int (structure, "width", &frame_width);
+  gst_structure_get_int (structure, "height", &frame_height);
+
+  area = shm_area_new (GST_BUFFER_SIZE (buffer), 0);
+  if (!area) {
+    fprintf (stderr, "Could not create shm area: %m\n");
+    return FALSE;
+  }
+  memcpy (shm_area_get_data (area), GST_BUFFER_DATA (buffer),
+          GST_BUFFER_SIZE (buffer));
+
+  message.timestamp = GST_BUFFER_TIMESTAMP (buffer);
+  message.size = GST_BUFFER_SIZE (buffer);
+  message.job = job->id;
+  message.index = index;
+  message.width = frame_width;
+  message.height = frame_height;
+  /* ffmpegcolorspace pads RGB rows to 4 bytes */
+  message.stride = job->format == SANDBOX_THUMBNAIL_RAW
+      ? GST_ROUND_UP_4 (frame_width * 3) : 0;
+  message.padding = 0;
+  fd = shm_area_get_fd (area);
+  ret = sandbox_channel_send (channel, SANDBOX_MESSAGE_THUMBNAIL,
+                              &message, sizeof (message), &fd, 1);
+  shm_area_unref (area);
+
+  return ret;
+}
+
+/* Seeks to the keyframe closest to each of the times and sends the frame
+ * the pipeline prerolls with */
+static gboolean
+grab_thumbnails (SandboxChannel *channel,
+                 Grabber *grabber,
+                 const guint64 *times)
+{
+  const SandboxThumbnailJobMessage *job = grabber->job;
+  GstFormat format = GST_FORMAT_TIME;
+  gint64 duration = -1;
+  guint n_times, i;
+  gboolean ret = TRUE;
+
+  n_times = job->n_times ? job->n_times : MAX (job->count, 1);
+  if (!job->n_times)
+    gst_element_query_duration (grabber->pipeline, &format, &duration);
+
+  for (i = 0; i < n_times && ret; i++) {
+    GstBuffer *buffer = NULL;
+    GstClockTime time;
+
+    if (job->n_times)
+      time = times[i];
+    else if (duration > 0)
+      time = gst_util_uint64_scale (duration, i + 1, n_times + 1);
+    else if (i == 0)
+      /* the frame we prerolled with */
+      time = GST_CLOCK_TIME_NONE;
+    else
+      break;
+
+    if (GST_CLOCK_TIME_IS_VALID (time)
+        && (!gst_element_seek_simple (grabber->pipeline, GST_FORMAT_TIME,
+                                      GST_SEEK_FLAG_FLUSH
+                                      | GST_SEEK_FLAG_KEY_UNIT, time)
+            || !wait_for_preroll (grabber->pipeline))) {
+      fprintf (stderr, "No frame at %" GST_TIME_FORMAT "\n",
+               GST_TIME_ARGS (time));
+      continue;
+    }
+
+    g_object_get (grabber->sink, "last-buffer", &buffer, NULL);
+    if (!buffer || !GST_BUFFER_CAPS (buffer)) {
+      fprintf (stderr, "No frame at %" GST_TIME_FORMAT "\n",
+               GST_TIME_ARGS (time));
+    } else {
+      ret = send_thumbnail (channel, job, i, buffer);
+    }
+    if (buffer)
+      gst_buffer_unref (buffer);
+  }
+
+  return ret;
+}
+
+static gboolean
+handle_job (SandboxChannel *channel, SandboxMessage *message)
+{
+  SandboxThumbnailJobDoneMessage done;
+  const SandboxThumbnailJobMessage *job;
+  Grabber grabber = { NULL, NULL, NULL };
+  GstStateChangeReturn state_ret;
+  GstElement *decodebin;
+  GError *error = NULL;
+  gchar *desc;
+  gint fd;
+
+  /* the times follow, so the payload is bigger than the header */
+  job = message->size >= sizeof (*job)
+      ? (const SandboxThumbnailJobMessage *) message->payload : NULL;
+  fd = sandbox_message_steal_fd (message);
+  if (!job || fd == -1 || job->n_times > SANDBOX_THUMBNAIL_MAX_TIMES
+      || message->size < sizeof (*job) + job->n_times * sizeof (guint64)) {
+    fprintf (stderr, "Invalid job\n");
+    if (fd != -1)
+      close (fd);
+    return FALSE;
+  }
+
+  done.job = job->id;
+  done.success = FALSE;
+  grabber.job = job;
+
+  /* SIGALRM kills us, our parent starts another worker for the next file */
+  alarm (job->timeout);
+
+  desc = g_strdup_printf ("fdsrc fd=%d ! decodebin2 name=decoder", fd);
+  grabber.pipeline = gst_parse_launch (desc, &error);
+  g_free (desc);
+  if (!grabber.pipeline) {
+    fprintf (stderr, "Could not create pipeline: %s\n", error->message);
+    g_error_free (error);
+    goto done;
+  }
+
+  decodebin = gst_bin_get_by_name (GST_BIN (grabber.pipeline), "decoder");
+  g_signal_connect (decodebin, "autoplug-continue",
+                    G_CALLBACK (on_autoplug_continue), &grabber);
+  g_signal_connect (decodebin, "pad-added",
+                    G_CALLBACK (on_pad_added), &grabber);
+  gst_object_unref (decodebin);
+
+  state_ret = gst_element_set_state (grabber.pipeline, GST_STATE_PAUSED);
+  if (state_ret == GST_STATE_CHANGE_FAILURE
+      || (state_ret == GST_STATE_CHANGE_ASYNC
+          && !wait_for_preroll (grabber.pipeline)))
+    goto done;
+  if (!grabber.sink) {
+    fprintf (stderr, "No video stream\n");
+    goto done;
+  }
+
+  done.success = grab_thumbnails (channel, &grabber,
+      (const guint64 *) (message->payload + sizeof (*job)));
+
+done:
+  if (grabber.pipeline) {
+    gst_element_set_state (grabber.pipeline, GST_STATE_NULL);
+    gst_object_unref (grabber.pipeline);
+  }
+  if (grabber.sink)
+    gst_object_unref (grabber.sink);
+  close (fd);
+  alarm (0);
+
+  return sandbox_channel_send (channel, SANDBOX_MESSAGE_THUMBNAIL_JOB_DONE,
+                               &done, sizeof (done), NULL, 0);
+}
+
+/* Has a child of ours handle the job, on a channel of its own. We pass on
+ * what it sends, and answer for it if it dies before it is done. */
+static gboolean
+run_job (SandboxChannel *channel, SandboxMessage *message)
+{
+  SandboxThumbnailJobDoneMessage done = { 0, FALSE };
+  SandboxChannel *job_channel;
+  SandboxMessage *reply;
+  gboolean finished = FALSE, sent = TRUE;
+  gint link[2];
+  pid_t pid;
+
+  /* the child checks the rest */
+  if (message->size >= sizeof (SandboxThumbnailJobMessage))
+    done.job = ((const SandboxThumbnailJobMessage *) message->payload)->id;
+
+  if (!sandbox_ipc_socketpair (link)) {
+    fprintf (stderr, "Could not create the job channel: %m\n");
+    return FALSE;
+  }
+
+  pid = fork ();
+  if (pid == -1) {
+    fprintf (stderr, "Could not fork: %m\n");
+    close (link[0]);
+    close (link[1]);
+    return FALSE;
+  }
+  if (pid == 0) {
+    /* only our own file and channel from here on */
+    close (sandbox_channel_get_fd (channel));
+    close (link[0]);
+    if (sandbox_backend == SANDBOX_BACKEND_NAMESPACES
+        && !ns_sandbox_confine_signals ())
+      _exit (EXIT_FAILURE);
+    job_channel = sandbox_channel_new (link[1]);
+    _exit (handle_job (job_channel, message) ? EXIT_SUCCESS : EXIT_FAILURE);
+  }
+
+  close (link[1]);
+  job_channel = sandbox_channel_new (link[0]);
+  reply = g_new (SandboxMessage, 1);
+  while (!finished && sent
+         && sandbox_channel_receive (job_channel, reply)
+            == SANDBOX_CHANNEL_OK) {
+    finished = reply->type == SANDBOX_MESSAGE_THUMBNAIL_JOB_DONE;
+    if (finished || reply->type == SANDBOX_MESSAGE_THUMBNAIL)
+      sent = sandbox_channel_send (channel, reply->type, reply->payload,
+                                   reply->size, reply->fds, reply->n_fds);
+    sandbox_message_close_fds (reply);
+  }
+  g_free (reply);
+  sandbox_channel_unref (job_channel);
+  while (waitpid (pid, NULL, 0) == -1 && errno == EINTR);
+
+  if (sent && !finished)
+    sent = sandbox_channel_send (channel, SANDBOX_MESSAGE_THUMBNAIL_JOB_DONE,
+                                 &done, sizeof (done), NULL, 0);
+
+  return sent;
+}
+
+static gint
+run_worker (void)
+{
+  SandboxChannel *channel;
+  SandboxMessage *message;
+
+  if (control_fd < 0) {
+    fprintf (stderr, "The worker needs --control-fd\n");
+    return EXIT_FAILURE;
+  }
+  channel = sandbox_channel_new (control_fd);
+
+  load_all_plugins ();
+  if (!enter_sandbox ()) {
+    fprintf (stderr, "Could not enter the sandbox\n");
+    return EXIT_FAILURE;
+  }
+
+  if (!sandbox_channel_send (channel, SANDBOX_MESSAGE_READY,
+                             NULL, 0, NULL, 0))
+    return EXIT_FAILURE;
+
+  /* until our parent is done with us */
+  message = g_new (SandboxMessage, 1);
+  while (sandbox_channel_receive (channel, message) == SANDBOX_CHANNEL_OK) {
+    gboolean handled = FALSE;
+
+    if (message->type == SANDBOX_MESSAGE_THUMBNAIL_JOB)
+      handled = run_job (channel, message);
+    else
+      fprintf (stderr, "Unexpected message %u\n", message->type);
+    sandbox_message_close_fds (message);
+    if (!handled)
+      break;
+  }
+  g_free (message);
+  sandbox_channel_unref (channel);
+
+  return EXIT_SUCCESS;
+}
+
+/* front end */
+
+typedef enum {
+  FILE_DONE,
+  FILE_FAILED,
+  WORKER_GONE
+} FileStatus;
+
+/* Receives a message from the worker, waiting at most timeout ms for it, -1
+ * for no limit */
+static SandboxChannelResult
+receive_from_worker (SandboxChannel *channel,
+                     gint timeout_ms,
+                     SandboxMessage *message)
+{
+  GPollFD pollfd;
+  gint ret;
+
+  pollfd.fd = sandbox_channel_get_fd (channel);
+  pollfd.events = G_IO_IN;
+  do {
+    ret = g_poll (&pollfd, 1, timeout_ms);
+  } while (ret == -1 && errno == EINTR);
+  if (ret <= 0)
+    return SANDBOX_CHANNEL_ERROR;
+
+  return sandbox_channel_receive (channel, message);
+}
+
+/* Drops the channel of a worker and reaps it, killing it first if it is
+ * stuck */
+static void
+stop_worker (SandboxChannel *channel, GPid pid, gboolean force)
+{
+  if (force)
+    kill (pid, SIGKILL);
+  /* the worker quits when its channel goes away */
+  sandbox_channel_unref (channel);
+  while (waitpid (pid, NULL, 0) == -1 && errno == EINTR);
+  g_spawn_close_pid (pid);
+}
+
+/* Starts a worker in the sandbox and waits for it to be ready. Returns its
+ * channel and sets pid, or returns NULL. */
+static SandboxChannel *
+spawn_worker (GPid *pid)
+{
+  SandboxChannel *channel;
+  SandboxMessage *message;
+  GError *error = NULL;
+  gint control[2];
+  gboolean ready;
+  char *setuid_args[] = {
+    SANDBOXME_PATH,
+    "-P",
+    "-u1",
+    "--",
+    WORKER_PATH,
+    "--worker",
+    "--control-fd=" G_STRINGIFY (SANDBOX_IPC_CONTROL_FD),
+    NULL
+  };
+  char *namespaces_args[] = {
+    WORKER_PATH,
+    "--worker",
+    "--sandbox=namespaces",
+    "--control-fd=" G_STRINGIFY (SANDBOX_IPC_CONTROL_FD),
+    NULL
+  };
+
+  if (!sandbox_ipc_socketpair (control)) {
+    fprintf (stderr, "Could not create the worker channel: %m\n");
+    return NULL;
+  }
+
+  if (!g_spawn_async (NULL, /* working_directory */
+                      sandbox_backend == SANDBOX_BACKEND_NAMESPACES
+                      ? namespaces_args : setuid_args,
+                      NULL, /* envp */
+                      G_SPAWN_SEARCH_PATH | G_SPAWN_DO_NOT_REAP_CHILD,
+                      sandbox_ipc_setup_control_fd,
+                      GINT_TO_POINTER (control[1]),
+                      pid,
+                      &error)) {
+    fprintf (stderr, "Could not start a worker: %s\n", error->message);
+    g_error_free (error);
+    close (control[0]);
+    close (control[1]);
+    return NULL;
+  }
+  close (control[1]);
+  channel = sandbox_channel_new (control[0]);
+
+  message = g_new (SandboxMessage, 1);
+  ready = receive_from_worker (channel, WORKER_READY_TIMEOUT, message)
+      == SANDBOX_CHANNEL_OK && message->type == SANDBOX_MESSAGE_READY;
+  if (ready)
+    sandbox_message_close_fds (message);
+  g_free (message);
+
+  if (!ready) {
+    fprintf (stderr, "The worker did not get ready\n");
+    stop_worker (channel, *pid, TRUE);
+    return NULL;
+  }
+
+  return channel;
+}
+
+/* Writes a thumbnail the worker sent next to the others of its file.
+ * Everything in it comes from the worker, which may be compromised. */
+static gboolean
+write_thumbnail (const gchar *path, guint job, SandboxMessage *message)
+{
+  const SandboxThumbnailMessage *thumbnail;
+  ShmArea *area;
+  GError *error = NULL;
+  gchar *base, *dot, *name, *output;
+  gboolean raw, ret = FALSE;
+  gint fd;
+
+  thumbnail = sandbox_message_get_payload (message, sizeof (*thumbnail));
+  fd = sandbox_message_steal_fd (message);
+  if (!thumbnail || fd == -1 || thumbnail->job != job
+      || thumbnail->size > G_MAXSIZE) {
+    fprintf (stderr, "Invalid thumbnail from the worker\n");
+    if (fd != -1)
+      close (fd);
+    return FALSE;
+  }
+
+  raw = thumbnail->stride > 0;
+  if (raw && (thumbnail->width == 0 || thumbnail->height == 0
+              || thumbnail->stride < (guint64) thumbnail->width * 3
+              || (guint64) thumbnail->stride * thumbnail->height
+                 > thumbnail->size)) {
+    fprintf (stderr, "Invalid raw thumbnail from the worker\n");
+    close (fd);
+    return FALSE;
+  }
+
+  area = shm_area_new_from_fd (fd, thumbnail->size, 0);
+  if (!area) {
+    fprintf (stderr, "Could not map the thumbnail: %m\n");
+    return FALSE;
+  }
+
+  base = g_path_get_basename (path);
+  dot = strrchr (base, '.');
+  if (dot && dot != base)
+    *dot = '\0';
+  name = g_strdup_printf ("%s-%02u.%s", base, thumbnail->index,
+                          raw ? "rgb" : "png");
+  output = g_build_filename (output_dir, name, NULL);
+
+  if (raw) {
+    GString *rows = g_string_sized_new (thumbnail->width * 3
+                                        * thumbnail->height);
+    guint y;
+
+    /* without the padding of the rows */
+    for (y = 0; y < thumbnail->height; y++)
+      g_string_append_len (rows, (const gchar *) shm_area_get_data (area)
+                           + (gsize) y * thumbnail->stride,
+                           thumbnail->width * 3);
+    ret = g_file_set_contents (output, rows->str, rows->len, &error);
+    g_string_free (rows, TRUE);
+  } else {
+    ret = g_file_set_contents (output,
+                               (const gchar *) shm_area_get_data (area),
+                               thumbnail->size, &error);
+  }
+
+  if (ret) {
+    printf ("%s %" GST_TIME_FORMAT " %ux%u\n", output,
+            GST_TIME_ARGS (thumbnail->timestamp), thumbnail->width,
+            thumbnail->height);
+  } else {
+    fprintf (stderr, "%s\n", error->message);
+    g_error_free (error);
+  }
+
+  g_free (output);
+  g_free (name);
+  g_free (base);
+  shm_area_unref (area);
+
+  return ret;
+}
+
+/* Has the worker grab the thumbnails of the file at path */
+static FileStatus
+thumbnail_file (SandboxChannel *channel,
+                const gchar *path,
+                guint job,
+                SandboxThumbnailFormat format,
+                GArray *times)
+{
+  SandboxThumbnailJobMessage *header;
+  SandboxMessage *message;
+  FileStatus status = WORKER_GONE;
+  gint64 deadline = 0;
+  gsize size;
+  gboolean sent;
+  gint fd;
+
+  fd = g_open (path, O_RDONLY | O_CLOEXEC, 0);
+  if (fd == -1) {
+    fprintf (stderr, "Could not open %s: %m\n", path);
+    return FILE_FAILED;
+  }
+
+  size = sizeof (*header) + times->len * sizeof (guint64);
+  header = g_malloc0 (size);
+  header->id = job;
+  header->format = format;
+  header->width = width;
+  header->height = height;
+  header->count = count;
+  header->timeout = timeout;
+  header->n_times = times->len;
+  memcpy (header + 1, times->data, times->len * sizeof (guint64));
+  sent = sandbox_channel_send (channel, SANDBOX_MESSAGE_THUMBNAIL_JOB,
+                               header, size, &fd, 1);
+  g_free (header);
+  close (fd);
+  if (!sent)
+    return WORKER_GONE;
+
+  /* the worker enforces the timeout, and dies trying; one that does not
+   * manage to is killed by our caller once we give up on it */
+  if (timeout)
+    deadline = g_get_monotonic_time ()
+        + (gint64) (timeout + WORKER_TIMEOUT_MARGIN) * G_USEC_PER_SEC;
+  message = g_new (SandboxMessage, 1);
+  for (;;) {
+    const SandboxThumbnailJobDoneMessage *done;
+    gint timeout_ms = -1;
+
+    if (deadline) {
+      timeout_ms = MAX (deadline - g_get_monotonic_time (), 0) / 1000;
+      if (timeout_ms == 0) {
+        fprintf (stderr, "The worker timed out on %s\n", path);
+        break;
+      }
+    }
+    if (receive_from_worker (channel, timeout_ms, message)
+        != SANDBOX_CHANNEL_OK)
+      break;
+
+    if (message->type == SANDBOX_MESSAGE_THUMBNAIL) {
+      write_thumbnail (path, job, message);
+    } else if (message->type == SANDBOX_MESSAGE_THUMBNAIL_JOB_DONE) {
+      done = sandbox_message_get_payload (message, sizeof (*done));
+      status = done && done->job == job && done->success
+          ? FILE_DONE : FILE_FAILED;
+      sandbox_message_close_fds (message);
+      break;
+    }
+    sandbox_message_close_fds (message);
+  }
+  g_free (message);
+
+  return status;
+}
+
+static gboolean
+parse_times (const gchar *option, GArray *times)
+{
+  gchar **values, **value;
+  gboolean ret = TRUE;
+
+  values = g_strsplit (option, ",", -1);
+  for (value = values; *value && ret; value++) {
+    gchar *end;
+    gdouble seconds = g_ascii_strtod (*value, &end);
+    guint64 time;
+
+    ret = end != *value && *end == '\0' && seconds >= 0;
+    time = seconds * GST_SECOND;
+    g_array_append_val (times, time);
+  }
+  g_strfreev (values);
+
+  return ret && times->len <= SANDBOX_THUMBNAIL_MAX_TIMES;
+}
+
+int
+main (int argc, char **argv)
+{
+  GOptionContext *context;
+  GError *error = NULL;
+  SandboxChannel *channel = NULL;
+  GPid worker_pid = 0;
+  SandboxThumbnailFormat format = SANDBOX_THUMBNAIL_PNG;
+  GArray *times;
+  gint i, failures = 0;
+
+  context = g_option_context_new ("FILE...");
+  g_option_context_set_summary (context,
+      "Grabs thumbnails of media files, decoding them in the sandbox. For "
+      "each one, prints where it went, its timestamp and size.");
+  g_option_context_add_main_entries (context, entries, NULL);
+  g_option_context_add_group (context, gst_init_get_option_group ());
+  if (!g_option_context_parse (context, &argc, &argv, &error)) {
+    fprintf (stderr, "%s\n", error->message);
+    return EXIT_FAILURE;
+  }
+  g_option_context_free (context);
+
+  if (worker)
+    return run_worker ();
+
+  times = g_array_new (FALSE, FALSE, sizeof (guint64));
+  if (times_option && !parse_times (times_option, times)) {
+    fprintf (stderr, "Invalid --times %s\n", times_option);
+    return EXIT_FAILURE;
+  }
+  if (format_option && !strcmp (format_option, "raw")) {
+    format = SANDBOX_THUMBNAIL_RAW;
+  } else if (format_option && strcmp (format_option, "png")) {
+    fprintf (stderr, "Unknown format %s\n", format_option);
+    return EXIT_FAILURE;
+  }
+  if (argc < 2 || count < 0 || width < 0 || height < 0 || timeout < 0) {
+    fprintf (stderr, "Syntax: %s [--times=T1,T2,...|--count=N] [--width=W] [--height=H] [--format=png|raw] [--output-dir=DIR] [--timeout=S] [--sandbox=setuid|namespaces] FILE...\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  if (!output_dir)
+    output_dir = g_strdup (".");
+
+  /* all the files go through the same worker while it lasts */
+  for (i = 1; i < argc; i++) {
+    FileStatus status;
+
+    if (!channel)
+      channel = spawn_worker (&worker_pid);
+    if (!channel) {
+      failures += argc - i;
+      break;
+    }
+
+    status = thumbnail_file (channel, argv[i], i, format, times);
+    if (status == WORKER_GONE) {
+      fprintf (stderr, "The worker died on %s\n", argv[i]);
+      stop_worker (channel, worker_pid, TRUE);
+      channel = NULL;
+    }
+    if (status != FILE_DONE)
+      failures++;
+  }
+
+  if (channel)
+    stop_worker (channel, worker_pid, FALSE);
+  g_array_free (times, TRUE);
+
+  return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,423 @@
+/*
+ * Copyright (C) 2012 Igalia S.L.
+*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/* The sandbox of the namespaces backend, which needs no setuid helper: the
+ * decoder confines itself.
+ *
+ * First thing in main(), while we are the only thread (unshare() refuses
+ * CLONE_NEWUSER otherwise), we move to new user, mount, network and IPC
+ * namespaces, keeping our uid and gid. Once the plugins are loaded, instead
+ * of asking sandboxme to chroot us, we chroot into an empty read-only tmpfs
+ * that only exists in our mount namespace, forbid gaining privileges and
+ * install a seccomp filter that refuses the system calls a decoder has no use
+ * for: opening sockets, executing programs, tracing, signalling or otherwise
+ * reaching into other processes, mounting, loading modules, and leaving or
+ * creating namespaces.
+ *
+ * We stay in the PID namespace of the player, whose processes we could see
+ * and signal as they have our uid: the filter only lets the calls taking a pid
+ * act on ourselves. */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/audit.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+#include <sys/mount.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include "nssandbox.h"
+
+/* only exists in our mount namespace, it doesn't hide the real one */
+#define EMPTY_ROOT "/tmp"
+
+#define NAMESPACE_FLAGS \
+    (CLONE_NEWUSER | CLONE_NEWNS | CLONE_NEWNET | CLONE_NEWIPC \
+     | CLONE_NEWUTS | CLONE_NEWPID)
+
+#if defined(__x86_64__)
+#define SECCOMP_ARCH AUDIT_ARCH_X86_64
+#elif defined(__i386__)
+#define SECCOMP_ARCH AUDIT_ARCH_I386
+#elif defined(__aarch64__)
+#define SECCOMP_ARCH AUDIT_ARCH_AARCH64
+#elif defined(__arm__)
+#define SECCOMP_ARCH AUDIT_ARCH_ARM
+#endif
+
+/* the new mount API and pidfds, in case our headers predate them; they have
+ * the same numbers on all the architectures above */
+#ifndef __NR_open_tree
+#define __NR_open_tree 428
+#endif
+#ifndef __NR_move_mount
+#define __NR_move_mount 429
+#endif
+#ifndef __NR_fsopen
+#define __NR_fsopen 430
+#endif
+#ifndef __NR_fsconfig
+#define __NR_fsconfig 431
+#endif
+#ifndef __NR_fsmount
+#define __NR_fsmount 432
+#endif
+#ifndef __NR_mount_setattr
+#define __NR_mount_setattr 442
+#endif
+#ifndef __NR_pidfd_send_signal
+#define __NR_pidfd_send_signal 424
+#endif
+#ifndef __NR_pidfd_open
+#define __NR_pidfd_open 434
+#endif
+#ifndef __NR_pidfd_getfd
+#define __NR_pidfd_getfd 438
+#endif
+#ifndef __NR_process_madvise
+#define __NR_process_madvise 440
+#endif
+
+#ifndef SECCOMP_SET_MODE_FILTER
+#define SECCOMP_SET_MODE_FILTER 1
+#endif
+#ifndef SECCOMP_FILTER_FLAG_TSYNC
+#define SECCOMP_FILTER_FLAG_TSYNC 1
+#endif
+
+static gboolean
+write_file (const gchar *path, const gchar *contents)
+{
+  gssize len = strlen (contents);
+  gboolean ret;
+  gint fd;
+
+  fd = open (path, O_WRONLY | O_CLOEXEC);
+  if (fd == -1)
+    return FALSE;
+  ret = write (fd, contents, len) == len;
+  close (fd);
+
+  return ret;
+}
+
+gboolean
+ns_sandbox_enter_namespaces (void)
+{
+  uid_t uid = getuid ();
+  gid_t gid = getgid ();
+  gchar map[64];
+
+  if (unshare (CLONE_NEWUSER | CLONE_NEWNS | CLONE_NEWNET | CLONE_NEWIPC
+               | CLONE_NEWUTS) == -1) {
+    fprintf (stderr, "Could not create namespaces: %m\n");
+    return FALSE;
+  }
+
+  /* unprivileged, we can only map ourselves, and only once setgroups() is
+   * denied */
+  if (!write_file ("/proc/self/setgroups", "deny")) {
+    fprintf (stderr, "Could not deny setgroups: %m\n");
+    return FALSE;
+  }
+  g_snprintf (map, sizeof (map), "%u %u 1", uid, uid);
+  if (!write_file ("/proc/self/uid_map", map)) {
+    fprintf (stderr, "Could not map our uid: %m\n");
+    return FALSE;
+  }
+  g_snprintf (map, sizeof (map), "%u %u 1", gid, gid);
+  if (!write_file ("/proc/self/gid_map", map)) {
+    fprintf (stderr, "Could not map our gid: %m\n");
+    return FALSE;
+  }
+
+  /* don't let our mounts propagate back */
+  if (mount (NULL, "/", NULL, MS_REC | MS_PRIVATE, NULL) == -1) {
+    fprintf (stderr, "Could not make our mounts private: %m\n");
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+#ifdef SECCOMP_ARCH
+
+#define DENY_SYSCALL(name) \
+    BPF_JUMP (BPF_JMP | BPF_JEQ | BPF_K, __NR_##name, 0, 1), \
+    BPF_STMT (BPF_RET | BPF_K, SECCOMP_RET_ERRNO | EPERM)
+
+/* for the calls taking the pid to act on first */
+#define ALLOW_SYSCALL_ON_PID(name, pid) \
+    BPF_JUMP (BPF_JMP | BPF_JEQ | BPF_K, __NR_##name, 0, 4), \
+    BPF_STMT (BPF_LD | BPF_W | BPF_ABS, \
+              offsetof (struct seccomp_data, args[0])), \
+    BPF_JUMP (BPF_JMP | BPF_JEQ | BPF_K, pid, 1, 0), \
+    BPF_STMT (BPF_RET | BPF_K, SECCOMP_RET_ERRNO | EPERM), \
+    BPF_STMT (BPF_RET | BPF_K, SECCOMP_RET_ALLOW)
+
+#define ALLOW_SYSCALL_ON_SELF(name) ALLOW_SYSCALL_ON_PID (name, pid)
+
+/* pid 0 is the calling thread, the same in all our processes */
+#define ALLOW_SYSCALL_ON_CALLER(name) ALLOW_SYSCALL_ON_PID (name, 0)
+
+/* system calls of another architecture have other numbers */
+#define CHECK_ARCH \
+    BPF_STMT (BPF_LD | BPF_W | BPF_ABS, offsetof (struct seccomp_data, arch)), \
+    BPF_JUMP (BPF_JMP | BPF_JEQ | BPF_K, SECCOMP_ARCH, 1, 0), \
+    BPF_STMT (BPF_RET | BPF_K, SECCOMP_RET_KILL)
+
+#ifdef __x86_64__
+#ifndef __X32_SYSCALL_BIT
+#define __X32_SYSCALL_BIT 0x40000000
+#endif
+/* x32 calls share the x86-64 arch with their own numbers, which none of our
+ * checks would match */
+#define LOAD_SYSCALL_NR \
+    BPF_STMT (BPF_LD | BPF_W | BPF_ABS, offsetof (struct seccomp_data, nr)), \
+    BPF_JUMP (BPF_JMP | BPF_JGE | BPF_K, __X32_SYSCALL_BIT, 0, 1), \
+    BPF_STMT (BPF_RET | BPF_K, SECCOMP_RET_KILL)
+#else
+#define LOAD_SYSCALL_NR \
+    BPF_STMT (BPF_LD | BPF_W | BPF_ABS, offsetof (struct seccomp_data, nr))
+#endif
+
+/* The threads already running get the filter too. Without seccomp() and
+ * TSYNC (Linux 3.17) they would stay unfiltered, so we don't fall back to
+ * prctl(). */
+static gboolean
+load_filter (struct sock_filter *filter, gushort len)
+{
+#ifdef __NR_seccomp
+  struct sock_fprog program = {
+    .len = len,
+    .filter = filter
+  };
+
+  if (syscall (__NR_seccomp, SECCOMP_SET_MODE_FILTER,
+               SECCOMP_FILTER_FLAG_TSYNC, &program) == -1) {
+    fprintf (stderr, "Could not install the seccomp filter: %m\n");
+    return FALSE;
+  }
+
+  return TRUE;
+#else
+  fprintf (stderr, "No seccomp() to filter all our threads\n");
+  return FALSE;
+#endif
+}
+
+static gboolean
+install_filter (void)
+{
+  struct sock_filter filter[] = {
+    CHECK_ARCH,
+    LOAD_SYSCALL_NR,
+
+    /* threads are fine, new namespaces are not */
+    BPF_JUMP (BPF_JMP | BPF_JEQ | BPF_K, __NR_clone, 0, 4),
+    BPF_STMT (BPF_LD | BPF_W | BPF_ABS,
+              offsetof (struct seccomp_data, args[0])),
+    BPF_JUMP (BPF_JMP | BPF_JSET | BPF_K, NAMESPACE_FLAGS, 0, 1),
+    BPF_STMT (BPF_RET | BPF_K, SECCOMP_RET_ERRNO | EPERM),
+    BPF_STMT (BPF_RET | BPF_K, SECCOMP_RET_ALLOW),
+#ifdef __NR_clone3
+    /* we cannot look into its arguments, libc falls back to clone */
+    BPF_JUMP (BPF_JMP | BPF_JEQ | BPF_K, __NR_clone3, 0, 1),
+    BPF_STMT (BPF_RET | BPF_K, SECCOMP_RET_ERRNO | ENOSYS),
+#endif
+
+    /* socketpair() stays, we make a channel for each stream. Where
+     * everything goes through socketcall(), sockets cannot be told apart. */
+#ifdef __NR_socket
+    DENY_SYSCALL (socket),
+#endif
+#ifdef __NR_connect
+    DENY_SYSCALL (connect),
+#endif
+#ifdef __NR_bind
+    DENY_SYSCALL (bind),
+#endif
+    DENY_SYSCALL (execve),
+#ifdef __NR_execveat
+    DENY_SYSCALL (execveat),
+#endif
+    DENY_SYSCALL (ptrace),
+    DENY_SYSCALL (process_vm_readv),
+    DENY_SYSCALL (process_vm_writev),
+    DENY_SYSCALL (process_madvise),
+    DENY_SYSCALL (pidfd_open),
+    DENY_SYSCALL (pidfd_getfd),
+#ifdef __NR_kcmp
+    DENY_SYSCALL (kcmp),
+#endif
+#ifdef __NR_migrate_pages
+    DENY_SYSCALL (migrate_pages),
+#endif
+#ifdef __NR_move_pages
+    DENY_SYSCALL (move_pages),
+#endif
+
+    /* the decoding threads set their own scheduling */
+    ALLOW_SYSCALL_ON_CALLER (sched_setaffinity),
+    ALLOW_SYSCALL_ON_CALLER (sched_setscheduler),
+    ALLOW_SYSCALL_ON_CALLER (sched_setparam),
+#ifdef __NR_sched_setattr
+    ALLOW_SYSCALL_ON_CALLER (sched_setattr),
+#endif
+#ifdef __NR_prlimit64
+    ALLOW_SYSCALL_ON_CALLER (prlimit64),
+#endif
+    /* only setpriority (PRIO_PROCESS, 0, ...) */
+    BPF_JUMP (BPF_JMP | BPF_JEQ | BPF_K, __NR_setpriority, 0, 6),
+    BPF_STMT (BPF_LD | BPF_W | BPF_ABS,
+              offsetof (struct seccomp_data, args[0])),
+    BPF_JUMP (BPF_JMP | BPF_JEQ | BPF_K, PRIO_PROCESS, 0, 3),
+    BPF_STMT (BPF_LD | BPF_W | BPF_ABS,
+              offsetof (struct seccomp_data, args[1])),
+    BPF_JUMP (BPF_JMP | BPF_JEQ | BPF_K, 0, 1, 0),
+    BPF_STMT (BPF_RET | BPF_K, SECCOMP_RET_ERRNO | EPERM),
+    BPF_STMT (BPF_RET | BPF_K, SECCOMP_RET_ALLOW),
+    DENY_SYSCALL (unshare),
+    DENY_SYSCALL (setns),
+    DENY_SYSCALL (mount),
+    DENY_SYSCALL (umount2),
+    DENY_SYSCALL (pivot_root),
+    DENY_SYSCALL (open_tree),
+    DENY_SYSCALL (move_mount),
+    DENY_SYSCALL (fsopen),
+    DENY_SYSCALL (fsconfig),
+    DENY_SYSCALL (fsmount),
+    DENY_SYSCALL (mount_setattr),
+    DENY_SYSCALL (chroot),
+    DENY_SYSCALL (init_module),
+#ifdef __NR_finit_module
+    DENY_SYSCALL (finit_module),
+#endif
+    DENY_SYSCALL (delete_module),
+    DENY_SYSCALL (kexec_load),
+    DENY_SYSCALL (reboot),
+    DENY_SYSCALL (swapon),
+    DENY_SYSCALL (swapoff),
+    DENY_SYSCALL (acct),
+    DENY_SYSCALL (keyctl),
+    DENY_SYSCALL (add_key),
+    DENY_SYSCALL (request_key),
+    DENY_SYSCALL (personality),
+#ifdef __NR_perf_event_open
+    DENY_SYSCALL (perf_event_open),
+#endif
+#ifdef __NR_bpf
+    DENY_SYSCALL (bpf),
+#endif
+#ifdef __NR_userfaultfd
+    DENY_SYSCALL (userfaultfd),
+#endif
+#ifdef __NR_open_by_handle_at
+    DENY_SYSCALL (open_by_handle_at),
+#endif
+
+    BPF_STMT (BPF_RET | BPF_K, SECCOMP_RET_ALLOW)
+  };
+
+  return load_filter (filter, G_N_ELEMENTS (filter));
+}
+
+/* Stacks on top of the other one: filters are inherited and can't be
+ * removed, so a process forking decoders can't have it itself. */
+static gboolean
+install_signal_filter (void)
+{
+  /* the same for all our threads; 0 and -1 would reach the player */
+  guint32 pid = getpid ();
+  struct sock_filter filter[] = {
+    CHECK_ARCH,
+    LOAD_SYSCALL_NR,
+
+    /* abort() and pthread_kill() signal our own threads */
+    ALLOW_SYSCALL_ON_SELF (kill),
+    ALLOW_SYSCALL_ON_SELF (tkill),
+    ALLOW_SYSCALL_ON_SELF (tgkill),
+    ALLOW_SYSCALL_ON_SELF (rt_sigqueueinfo),
+    ALLOW_SYSCALL_ON_SELF (rt_tgsigqueueinfo),
+    DENY_SYSCALL (pidfd_send_signal),
+
+    BPF_STMT (BPF_RET | BPF_K, SECCOMP_RET_ALLOW)
+  };
+
+  return load_filter (filter, G_N_ELEMENTS (filter));
+}
+
+#else
+
+static gboolean
+install_filter (void)
+{
+  fprintf (stderr, "No seccomp filter for this architecture\n");
+  return FALSE;
+}
+
+static gboolean
+install_signal_filter (void)
+{
+  return install_filter ();
+}
+
+#endif
+
+/* Called where the setuid backend calls chrootme(), possibly with other
+ * threads around: chroot() applies to all of them, and so does the filter. */
+gboolean
+ns_sandbox_lock_down (void)
+{
+  if (mount ("none", EMPTY_ROOT, "tmpfs",
+             MS_RDONLY | MS_NOSUID | MS_NODEV | MS_NOEXEC, "size=0") == -1) {
+    fprintf (stderr, "Could not mount an empty root: %m\n");
+    return FALSE;
+  }
+  if (chroot (EMPTY_ROOT) == -1 || chdir ("/") == -1) {
+    fprintf (stderr, "Could not chroot: %m\n");
+    return FALSE;
+  }
+
+  if (prctl (PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) == -1) {
+    fprintf (stderr, "Could not forbid new privileges: %m\n");
+    return FALSE;
+  }
+
+  return install_filter ();
+}
+
+/* Called after ns_sandbox_lock_down() by the process that decodes, which for
+ * a zygote is each of its children: only lets us signal ourselves. */
+gboolean
+ns_sandbox_confine_signals (void)
+{
+  return install_signal_filter ();
+}
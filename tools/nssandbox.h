@@ -0,0 +1,33 @@
+/*
+ * Copyright (C) 2012 Igalia S.L.
+*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __NS_SANDBOX_H__
+#define __NS_SANDBOX_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+gboolean ns_sandbox_enter_namespaces (void);
+gboolean ns_sandbox_lock_down (void);
+gboolean ns_sandbox_confine_signals (void);
+
+G_END_DECLS
+
+#endif /* __NS_SANDBOX_H__ */